@@ -0,0 +1,267 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      admin.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Loopback admin interface for the chat server. One admin connection is
+ *    served at a time by a single thread.
+ * 
+ *  -- See admin.h for function header blocks
+ *
+ ************************************************************/
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "admin.h"
+
+#define ADMIN_MAX_COMMANDS 32
+#define ADMIN_MAX_ARGS 16
+#define ADMIN_LINE_SIZE 512
+
+typedef struct
+{
+    const char * name;
+    const char * usage;
+    admin_handler_t handler;
+    void * userData;
+} admin_command_t;
+
+static admin_command_t commands[ADMIN_MAX_COMMANDS];
+static int commandCount = 0;
+
+static int adminListenFd = -1;
+// Admin connection being served, so Stop_Admin can kick it
+static int adminClientFd = -1;
+static bool adminStopping = false;
+static bool adminRunning = false;
+static pthread_t adminThread;
+static pthread_mutex_t adminLock = PTHREAD_MUTEX_INITIALIZER;
+
+//********************************************
+int Register_Admin_Command(const char * name, const char * usage,
+                           admin_handler_t handler, void * userData)
+{
+    if (commandCount >= ADMIN_MAX_COMMANDS)
+    {
+        return ADMIN_TOO_MANY_COMMANDS;
+    }
+    commands[commandCount].name = name;
+    commands[commandCount].usage = usage;
+    commands[commandCount].handler = handler;
+    commands[commandCount].userData = userData;
+    ++commandCount;
+    return 0;
+}
+
+//********************************************
+// Split line into words in place and run the matching command.
+// Returns false if the admin asked to disconnect.
+static bool Run_Admin_Line(char * line, FILE * out)
+{
+    char * argv[ADMIN_MAX_ARGS];
+    int argc = 0;
+    char * savePtr = NULL;
+    char * word;
+    int index;
+    
+    for (word = strtok_r(line, " \t\r\n", &savePtr);
+         word != NULL && argc < ADMIN_MAX_ARGS;
+         word = strtok_r(NULL, " \t\r\n", &savePtr))
+    {
+        argv[argc++] = word;
+    }
+    if (0 == argc)
+    {
+        return true;
+    }
+    
+    if (0 == strcmp(argv[0], "quit"))
+    {
+        return false;
+    }
+    if (0 == strcmp(argv[0], "help"))
+    {
+        fprintf(out, "help\nquit\n");
+        for (index = 0; index < commandCount; ++index)
+        {
+            fprintf(out, "%s%s%s\n", commands[index].name,
+                    commands[index].usage[0] ? " " : "",
+                    commands[index].usage);
+        }
+        return true;
+    }
+    
+    for (index = 0; index < commandCount; ++index)
+    {
+        if (0 == strcmp(argv[0], commands[index].name))
+        {
+            if (0 != commands[index].handler(argc, argv, out,
+                                             commands[index].userData))
+            {
+                fprintf(out, "usage: %s %s\n", commands[index].name,
+                        commands[index].usage);
+            }
+            return true;
+        }
+    }
+    fprintf(out, "unknown command '%s', try help\n", argv[0]);
+    return true;
+}
+
+//********************************************
+// Serve one admin connection until it quits or hangs up
+static void Serve_Admin_Client(int clientFd)
+{
+    char line[ADMIN_LINE_SIZE];
+    int outFd = dup(clientFd);
+    FILE * in = fdopen(clientFd, "r");
+    FILE * out = (-1 == outFd) ? NULL : fdopen(outFd, "w");
+    
+    if (NULL == in || NULL == out)
+    {
+        if (in)
+        {
+            fclose(in);
+        }
+        else
+        {
+            close(clientFd);
+        }
+        if (out)
+        {
+            fclose(out);
+        }
+        else if (-1 != outFd)
+        {
+            close(outFd);
+        }
+        return;
+    }
+    
+    while (NULL != fgets(line, sizeof(line), in))
+    {
+        if (!Run_Admin_Line(line, out))
+        {
+            break;
+        }
+        fprintf(out, "ok\n");
+        fflush(out);
+    }
+    
+    fclose(out);
+    fclose(in);
+}
+
+//********************************************
+static void * ThreadAdmin(void * arg)
+{
+    int clientFd;
+    
+    while (-1 != (clientFd = accept(adminListenFd, NULL, NULL)))
+    {
+        pthread_mutex_lock(&adminLock);
+        if (adminStopping)
+        {
+            pthread_mutex_unlock(&adminLock);
+            close(clientFd);
+            break;
+        }
+        adminClientFd = clientFd;
+        pthread_mutex_unlock(&adminLock);
+        
+        Serve_Admin_Client(clientFd);
+        
+        pthread_mutex_lock(&adminLock);
+        adminClientFd = -1;
+        pthread_mutex_unlock(&adminLock);
+    }
+    return NULL;
+}
+
+//********************************************
+int Start_Admin(const char * port)
+{
+    struct addrinfo hints;
+    struct addrinfo * results;
+    struct addrinfo * current;
+    int yes = 1;
+    
+    memset(&hints, 0, sizeof(hints));
+    // IPv4 only: "localhost" doesn't resolve to ::1 everywhere, but it always
+    // resolves to 127.0.0.1
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    // No AI_PASSIVE and no node: getaddrinfo gives the loopback address, so
+    // the admin port is never reachable from off the box
+    if (0 != getaddrinfo(NULL, port, &hints, &results))
+    {
+        return ADMIN_SOCKET_ERROR;
+    }
+    
+    for (current = results; NULL != current; current = current->ai_next)
+    {
+        adminListenFd = socket(current->ai_family, current->ai_socktype,
+                               current->ai_protocol);
+        if (-1 == adminListenFd)
+        {
+            continue;
+        }
+        setsockopt(adminListenFd, SOL_SOCKET, SO_REUSEADDR, (void *)&yes,
+                   sizeof(yes));
+        if (0 == bind(adminListenFd, current->ai_addr, current->ai_addrlen) &&
+            0 == listen(adminListenFd, 4))
+        {
+            break;
+        }
+        close(adminListenFd);
+        adminListenFd = -1;
+    }
+    freeaddrinfo(results);
+    
+    if (-1 == adminListenFd)
+    {
+        return ADMIN_SOCKET_ERROR;
+    }
+    
+    if (0 != pthread_create(&adminThread, NULL, ThreadAdmin, NULL))
+    {
+        close(adminListenFd);
+        adminListenFd = -1;
+        return ADMIN_SOCKET_ERROR;
+    }
+    adminRunning = true;
+    return 0;
+}
+
+//********************************************
+void Stop_Admin(void)
+{
+    if (!adminRunning)
+    {
+        return;
+    }
+    
+    pthread_mutex_lock(&adminLock);
+    adminStopping = true;
+    // Wake the thread out of accept() and out of reading a client
+    shutdown(adminListenFd, SHUT_RD);
+    if (-1 != adminClientFd)
+    {
+        shutdown(adminClientFd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&adminLock);
+    
+    pthread_join(adminThread, NULL);
+    close(adminListenFd);
+    adminListenFd = -1;
+    adminRunning = false;
+}
@@ -0,0 +1,50 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      admin.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Admin interface for the chat server. Listens on a loopback-only port and
+ *    runs one line-oriented command per line, e.g. "stats" or
+ *    "limit conn bytes 4096". Commands are registered by the rest of the
+ *    server; "help" and "quit" are built in.
+ *
+ ************************************************************/
+#include <stdio.h>
+
+// Error returns
+#define ADMIN_TOO_MANY_COMMANDS 1
+#define ADMIN_SOCKET_ERROR 2
+
+// Function run for an admin command
+// Return zero on success. On failure, usage is printed after any output.
+// Params:
+//    argc: number of words on the command line, including the command name
+//    argv: the words
+//    out: where to write the command's output
+//    userData: pointer given when the command was registered
+typedef int (*admin_handler_t)(int argc, char ** argv, FILE * out,
+                               void * userData);
+
+// Add a command. Call before Start_Admin.
+// Return zero on success
+// Params:
+//    name: the first word of the command line
+//    usage: one line describing the arguments, shown by help
+//    handler: function to run
+//    userData: passed to handler
+int Register_Admin_Command(const char * name, const char * usage,
+                           admin_handler_t handler, void * userData);
+
+// Start listening for admin connections on the loopback interface
+// Return zero on success
+// Params:
+//    port: port number or service name to listen on
+int Start_Admin(const char * port);
+
+// Stop the admin listener and wait for its thread. Safe to call if
+// Start_Admin was never called or failed.
+void Stop_Admin(void);
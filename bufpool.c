@@ -0,0 +1,191 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      bufpool.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Free list of fixed size buffers. A free buffer holds the pointer to the
+ *    next free one in its first bytes, so the free list costs no memory of
+ *    its own.
+ * 
+ *  -- See bufpool.h for function header blocks
+ *
+ ************************************************************/
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "bufpool.h"
+
+//********************************************
+// A chunk of buffers allocated together, kept so they can be freed. Linked
+// both ways so a one buffer slab can be freed on its own.
+typedef struct slab_s
+{
+    struct slab_s * next;
+    struct slab_s * previous;
+} slab_t;
+
+//********************************************
+typedef struct free_buffer_s
+{
+    struct free_buffer_s * next;
+} free_buffer_t;
+
+//********************************************
+typedef struct
+{
+    pthread_mutex_t lock;
+    size_t bufferSize;
+    int buffersPerSlab;
+    // -1 for no limit
+    int maxFree;
+    slab_t * slabs;
+    free_buffer_t * free;
+    int total;
+    int inUse;
+} pool_t;
+
+//********************************************
+buffer_pool_t Init_Buffer_Pool(size_t bufferSize, int buffersPerSlab,
+                               int maxFree)
+{
+    pool_t * pool = (pool_t *)malloc(sizeof(pool_t));
+    if (NULL == pool)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_init(&(pool->lock), NULL);
+    // Each buffer has to be able to hold the free list link, and stay
+    // pointer aligned
+    if (bufferSize < sizeof(free_buffer_t))
+    {
+        bufferSize = sizeof(free_buffer_t);
+    }
+    pool->bufferSize = (bufferSize + sizeof(void *) - 1) &
+        ~(sizeof(void *) - 1);
+    pool->buffersPerSlab = buffersPerSlab > 0 ? buffersPerSlab : 1;
+    pool->maxFree = 1 == pool->buffersPerSlab ? maxFree : -1;
+    pool->slabs = NULL;
+    pool->free = NULL;
+    pool->total = 0;
+    pool->inUse = 0;
+
+    return (buffer_pool_t)pool;
+}
+
+//********************************************
+void Delete_Buffer_Pool(buffer_pool_t p)
+{
+    pool_t * pool = (pool_t *)p;
+    slab_t * slab;
+
+    while (NULL != pool->slabs)
+    {
+        slab = pool->slabs;
+        pool->slabs = slab->next;
+        free(slab);
+    }
+    pthread_mutex_destroy(&(pool->lock));
+    free(pool);
+}
+
+//********************************************
+// Add a slab's worth of buffers to the free list. Caller holds the lock.
+static int Grow_Prelocked(pool_t * pool)
+{
+    // Buffers start after the slab header, which keeps them pointer aligned
+    slab_t * slab = (slab_t *)malloc(sizeof(slab_t) +
+        pool->bufferSize * pool->buffersPerSlab);
+    char * buffer;
+    int index;
+
+    if (NULL == slab)
+    {
+        return 1;
+    }
+    slab->next = pool->slabs;
+    slab->previous = NULL;
+    if (pool->slabs)
+    {
+        pool->slabs->previous = slab;
+    }
+    pool->slabs = slab;
+
+    buffer = (char *)(slab + 1);
+    for (index = 0; index < pool->buffersPerSlab; ++index)
+    {
+        ((free_buffer_t *)buffer)->next = pool->free;
+        pool->free = (free_buffer_t *)buffer;
+        buffer += pool->bufferSize;
+    }
+    pool->total += pool->buffersPerSlab;
+    return 0;
+}
+
+//********************************************
+char * Acquire_Buffer(buffer_pool_t p)
+{
+    pool_t * pool = (pool_t *)p;
+    free_buffer_t * buffer;
+
+    pthread_mutex_lock(&(pool->lock));
+    if (NULL == pool->free && 0 != Grow_Prelocked(pool))
+    {
+        pthread_mutex_unlock(&(pool->lock));
+        return NULL;
+    }
+    buffer = pool->free;
+    pool->free = buffer->next;
+    ++(pool->inUse);
+    pthread_mutex_unlock(&(pool->lock));
+
+    return (char *)buffer;
+}
+
+//********************************************
+void Release_Buffer(buffer_pool_t p, char * buffer)
+{
+    pool_t * pool = (pool_t *)p;
+    // Only meaningful for one buffer slabs
+    slab_t * slab = (slab_t *)buffer - 1;
+
+    pthread_mutex_lock(&(pool->lock));
+    --(pool->inUse);
+    if (-1 != pool->maxFree && pool->total - pool->inUse > pool->maxFree)
+    {
+        // Enough kept already: the slab goes back to the system
+        if (slab->previous)
+        {
+            slab->previous->next = slab->next;
+        }
+        else
+        {
+            pool->slabs = slab->next;
+        }
+        if (slab->next)
+        {
+            slab->next->previous = slab->previous;
+        }
+        --(pool->total);
+        pthread_mutex_unlock(&(pool->lock));
+        free(slab);
+        return;
+    }
+    ((free_buffer_t *)buffer)->next = pool->free;
+    pool->free = (free_buffer_t *)buffer;
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+//********************************************
+void Get_Buffer_Pool_Counts(buffer_pool_t p, int * total, int * inUse)
+{
+    pool_t * pool = (pool_t *)p;
+
+    pthread_mutex_lock(&(pool->lock));
+    *total = pool->total;
+    *inUse = pool->inUse;
+    pthread_mutex_unlock(&(pool->lock));
+}
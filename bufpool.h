@@ -0,0 +1,58 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      bufpool.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Pool of fixed size buffers shared by all connections. A connection
+ *    takes a buffer only while it has data to handle and gives it back
+ *    straight after, so memory scales with the number of busy connections
+ *    rather than the number of open ones.
+ *
+ *    Buffers are carved out of slabs that are never returned to the system,
+ *    so the pool grows to the peak number in use at once and stays there.
+ *    The exception is a pool of big buffers allocated one per slab, which
+ *    can be told to keep only so many free and free the rest.
+ *
+ ************************************************************/
+#include <stddef.h>
+
+typedef void * buffer_pool_t;
+
+// Create an empty pool
+// Return pointer to the pool. Return NULL on failure.
+// Params:
+//    bufferSize: size of each buffer
+//    buffersPerSlab: how many buffers to allocate at a time when the pool
+//       runs dry
+//    maxFree: most free buffers to keep when buffersPerSlab is 1; a buffer
+//       given back past that is freed. -1 keeps them all, as does any pool
+//       with bigger slabs, since their buffers can't be freed one by one.
+buffer_pool_t Init_Buffer_Pool(size_t bufferSize, int buffersPerSlab,
+                               int maxFree);
+
+// Free a pool and all its buffers. None may be in use.
+// Params:
+//    pool: pool to delete
+void Delete_Buffer_Pool(buffer_pool_t pool);
+
+// Take a buffer from the pool
+// Return the buffer. Return NULL if the pool was empty and couldn't grow.
+// Params:
+//    pool: pool to take from
+char * Acquire_Buffer(buffer_pool_t pool);
+
+// Give a buffer back to the pool
+// Params:
+//    pool: pool it came from
+//    buffer: buffer from Acquire_Buffer
+void Release_Buffer(buffer_pool_t pool, char * buffer);
+
+// Get how many buffers the pool holds and how many of those are in use
+// Params:
+//    pool: pool to look at
+//    total, inUse: where to store the counts
+void Get_Buffer_Pool_Counts(buffer_pool_t pool, int * total, int * inUse);
@@ -0,0 +1,363 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      capture.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Capture queue, writer thread and reader.
+ *
+ *    Events go through a lock-free queue (see mpscq.h) with the capture
+ *    thread as its only consumer.
+ *
+ *    Producers never make a syscall. When the queue is empty the capture
+ *    thread flushes the file and sleeps for CAPTURE_IDLE_NS; nothing waits
+ *    on the file, so the latency doesn't matter.
+ *
+ *  -- See capture.h for function header blocks
+ *
+ ************************************************************/
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+#include "mpscq.h"
+
+#define NS_PER_SEC 1000000000ULL
+// How long the capture thread sleeps when it runs out of events
+#define CAPTURE_IDLE_NS (10 * 1000 * 1000)
+// Stream buffer for the capture file
+#define CAPTURE_FILE_BUFFER (1024 * 1024)
+// Longest message a reader accepts, to catch corrupt lengths
+#define CAPTURE_MAX_MESSAGE (16 * 1024 * 1024)
+// Most bytes in a 64 bit varint
+#define VARINT_MAX_BYTES 10
+
+typedef struct capture_node_s
+{
+    mpsc_link_t link;
+    int type;
+    uint32_t flags;
+    uint64_t id;
+    uint64_t timeNs;
+    int length;
+    char data[];
+} capture_node_t;
+
+static bool captureRunning = false;
+static bool captureStopping = false;
+static pthread_t captureThread;
+static FILE * captureFile = NULL;
+
+static mpsc_queue_t queue;
+static int queued = 0;
+
+// Time of the last record written, in microseconds. Only touched by the
+// capture thread once started.
+static uint64_t lastUs = 0;
+
+static uint64_t recordCount = 0;
+static uint64_t droppedCount = 0;
+
+//********************************************
+static uint64_t Now_Ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+//********************************************
+// Append a varint to buffer, returning the bytes used
+static int Encode_Varint(uint64_t value, unsigned char * buffer)
+{
+    int used = 0;
+
+    while (value >= 0x80)
+    {
+        buffer[used++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buffer[used++] = (unsigned char)value;
+    return used;
+}
+
+//********************************************
+// Return 0 with *value set, or -1 at the end of the file or on a bad varint
+static int Decode_Varint(FILE * file, uint64_t * value)
+{
+    int shift;
+    int byte;
+
+    *value = 0;
+    for (shift = 0; shift < 7 * VARINT_MAX_BYTES; shift += 7)
+    {
+        if (EOF == (byte = getc(file)))
+        {
+            return -1;
+        }
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (0 == (byte & 0x80))
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+//********************************************
+static void Write_Record(const capture_node_t * node)
+{
+    unsigned char header[1 + 4 * VARINT_MAX_BYTES];
+    uint64_t us = node->timeNs / 1000;
+    int used = 0;
+
+    // Connection threads append in roughly time order, but not exactly, so
+    // keep deltas from going negative
+    if (us < lastUs)
+    {
+        us = lastUs;
+    }
+    header[used++] = (unsigned char)node->type;
+    used += Encode_Varint(us - lastUs, header + used);
+    used += Encode_Varint(node->id, header + used);
+    if (CAPTURE_CONNECT == node->type || CAPTURE_HELLO == node->type)
+    {
+        used += Encode_Varint(node->flags, header + used);
+    }
+    if (CAPTURE_MESSAGE == node->type || CAPTURE_HELLO == node->type)
+    {
+        used += Encode_Varint(node->length, header + used);
+    }
+    lastUs = us;
+    fwrite(header, 1, used, captureFile);
+    if (node->length > 0)
+    {
+        fwrite(node->data, 1, node->length, captureFile);
+    }
+    __atomic_add_fetch(&recordCount, 1, __ATOMIC_RELAXED);
+}
+
+//********************************************
+static void * Capture_Thread(void * arg)
+{
+    mpsc_link_t * link;
+    capture_node_t * node;
+    struct timespec idle;
+
+    (void)arg;
+    idle.tv_sec = 0;
+    idle.tv_nsec = CAPTURE_IDLE_NS;
+    while (true)
+    {
+        if (NULL != (link = Mpsc_Pop(&queue)))
+        {
+            node = MPSC_ENTRY(link, capture_node_t, link);
+            Write_Record(node);
+            free(node);
+            __atomic_sub_fetch(&queued, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        // Stop_Capture is only called once every producer is done, so an
+        // empty queue now stays empty
+        if (__atomic_load_n(&captureStopping, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+        fflush(captureFile);
+        nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+//********************************************
+// Queue one event. message may be NULL when length is 0.
+static void Capture_Event(int type, uint64_t id, uint32_t flags,
+                          const char * message, int length)
+{
+    capture_node_t * node;
+
+    if (!__atomic_load_n(&captureRunning, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    if (__atomic_add_fetch(&queued, 1, __ATOMIC_RELAXED) > CAPTURE_MAX_QUEUED
+        || NULL == (node = malloc(sizeof(capture_node_t) + length)))
+    {
+        __atomic_sub_fetch(&queued, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&droppedCount, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    node->type = type;
+    node->flags = flags;
+    node->id = id;
+    node->timeNs = Now_Ns();
+    node->length = length;
+    if (length > 0)
+    {
+        memcpy(node->data, message, length);
+    }
+    Mpsc_Push(&queue, &(node->link));
+}
+
+//********************************************
+int Start_Capture(const char * path)
+{
+    unsigned char start[VARINT_MAX_BYTES];
+    struct timespec wallClock;
+
+    if (NULL == (captureFile = fopen(path, "wb")))
+    {
+        return 1;
+    }
+    setvbuf(captureFile, NULL, _IOFBF, CAPTURE_FILE_BUFFER);
+    clock_gettime(CLOCK_REALTIME, &wallClock);
+    fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LENGTH, captureFile);
+    fwrite(start, 1, Encode_Varint((uint64_t)wallClock.tv_sec * 1000000 +
+                                   wallClock.tv_nsec / 1000, start),
+           captureFile);
+    lastUs = Now_Ns() / 1000;
+    Init_Mpsc_Queue(&queue);
+    if (0 != pthread_create(&captureThread, NULL, Capture_Thread, NULL))
+    {
+        fclose(captureFile);
+        captureFile = NULL;
+        return 1;
+    }
+    __atomic_store_n(&captureRunning, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+//********************************************
+void Stop_Capture(void)
+{
+    if (!captureRunning)
+    {
+        return;
+    }
+    __atomic_store_n(&captureRunning, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&captureStopping, true, __ATOMIC_RELEASE);
+    pthread_join(captureThread, NULL);
+    if (0 != fclose(captureFile))
+    {
+        perror("Trouble writing the capture file");
+    }
+    captureFile = NULL;
+}
+
+//********************************************
+void Capture_Connect(uint64_t id, uint32_t flags)
+{
+    Capture_Event(CAPTURE_CONNECT, id, flags, NULL, 0);
+}
+
+//********************************************
+void Capture_Hello(uint64_t id, uint32_t flags, const char * filter)
+{
+    Capture_Event(CAPTURE_HELLO, id, flags, filter,
+                  filter ? (int)strlen(filter) : 0);
+}
+
+//********************************************
+void Capture_Disconnect(uint64_t id)
+{
+    Capture_Event(CAPTURE_DISCONNECT, id, 0, NULL, 0);
+}
+
+//********************************************
+void Capture_Message(uint64_t id, const char * message, int length)
+{
+    Capture_Event(CAPTURE_MESSAGE, id, 0, message, length);
+}
+
+//********************************************
+void Get_Capture_Stats(capture_stats_t * stats)
+{
+    stats->records = __atomic_load_n(&recordCount, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&droppedCount, __ATOMIC_RELAXED);
+}
+
+//********************************************
+FILE * Open_Capture(const char * path, capture_record_t * record)
+{
+    char magic[CAPTURE_MAGIC_LENGTH];
+    uint64_t startUs;
+    FILE * file = fopen(path, "rb");
+
+    if (NULL == file)
+    {
+        perror("Couldn't open the capture file");
+        return NULL;
+    }
+    if (CAPTURE_MAGIC_LENGTH != fread(magic, 1, CAPTURE_MAGIC_LENGTH, file) ||
+        0 != memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH) ||
+        0 != Decode_Varint(file, &startUs))
+    {
+        fprintf(stderr, "%s is not a capture file.\n", path);
+        fclose(file);
+        return NULL;
+    }
+    memset(record, 0, sizeof(*record));
+    return file;
+}
+
+//********************************************
+int Read_Capture_Record(FILE * file, capture_record_t * record)
+{
+    uint64_t delta;
+    uint64_t value;
+    int type = getc(file);
+
+    if (EOF == type)
+    {
+        return 0;
+    }
+    if (0 != Decode_Varint(file, &delta) ||
+        0 != Decode_Varint(file, &(record->connectionId)))
+    {
+        return -1;
+    }
+    record->type = type;
+    record->timeUs += delta;
+    record->flags = 0;
+    record->length = 0;
+    if (CAPTURE_CONNECT == type || CAPTURE_HELLO == type)
+    {
+        if (0 != Decode_Varint(file, &value))
+        {
+            return -1;
+        }
+        record->flags = (uint32_t)value;
+    }
+    if (CAPTURE_MESSAGE == type || CAPTURE_HELLO == type)
+    {
+        if (0 != Decode_Varint(file, &value) || value > CAPTURE_MAX_MESSAGE)
+        {
+            return -1;
+        }
+        if ((int)value > record->capacity)
+        {
+            char * grown = realloc(record->data, value);
+            if (NULL == grown)
+            {
+                return -1;
+            }
+            record->data = grown;
+            record->capacity = (int)value;
+        }
+        record->length = (int)value;
+        if (value != fread(record->data, 1, value, file))
+        {
+            return -1;
+        }
+    }
+    else if (CAPTURE_DISCONNECT != type && CAPTURE_CONNECT != type)
+    {
+        return -1;
+    }
+    return 1;
+}
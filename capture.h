@@ -0,0 +1,120 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      capture.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Traffic capture, for replaying real load against a server later.
+ *
+ *    Connection threads hand each event to a capture thread through a
+ *    lock-free queue and carry on; only the capture thread formats and
+ *    writes. If the file can't keep up, events are dropped and counted
+ *    rather than letting the queue grow without bound.
+ *
+ *    File format: CAPTURE_MAGIC, then a varint start time in microseconds
+ *    since the epoch, then records. A record is a type byte, a varint of
+ *    microseconds since the previous record and a varint connection id.
+ *    CAPTURE_CONNECT adds a varint of connection flags, CAPTURE_MESSAGE a
+ *    varint length and that many bytes. CAPTURE_HELLO adds a varint of the
+ *    flags the HELLO left the connection with, then a varint length and the
+ *    filter it set up, if any. Varints are 7 bits per byte, low bits first,
+ *    high bit set on all but the last byte.
+ *
+ ************************************************************/
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAPTURE_MAGIC "CHATCAP1"
+#define CAPTURE_MAGIC_LENGTH 8
+
+// Record types
+#define CAPTURE_CONNECT 1
+#define CAPTURE_DISCONNECT 2
+#define CAPTURE_MESSAGE 3
+// The connection sent a HELLO, which may come after chat to it
+#define CAPTURE_HELLO 4
+
+// Events waiting for the capture thread beyond which new ones are dropped
+#define CAPTURE_MAX_QUEUED 65536
+
+// Open a capture file and start the capture thread
+// Return zero on success
+// Params:
+//    path: file to write, replaced if it exists
+int Start_Capture(const char * path);
+
+// Write everything already captured and stop. No Capture_ calls may be in
+// progress or made after this starts.
+void Stop_Capture(void);
+
+// Record a connection joining. Does nothing unless capture is started.
+// Params:
+//    id: connection id
+//    flags: connection flags (see connection.h)
+void Capture_Connect(uint64_t id, uint32_t flags);
+
+// Record a connection's HELLO being taken, with the options it set up, so
+// replay can ask for the same. Does nothing unless capture is started.
+// Params:
+//    id: connection id
+//    flags: connection flags once the HELLO's options are set up
+//    filter: the filter's patterns as the client sent them, or NULL
+void Capture_Hello(uint64_t id, uint32_t flags, const char * filter);
+
+// Record a connection leaving. Does nothing unless capture is started.
+// Params:
+//    id: connection id
+void Capture_Disconnect(uint64_t id);
+
+// Record chat a connection sent. Does nothing unless capture is started.
+// Copies the message.
+// Params:
+//    id: connection id
+//    message, length: the chat
+void Capture_Message(uint64_t id, const char * message, int length);
+
+// Statistics for the admin interface
+typedef struct
+{
+    uint64_t records;
+    uint64_t dropped;
+} capture_stats_t;
+
+// Get capture statistics
+// Params:
+//    stats: where to store them
+void Get_Capture_Stats(capture_stats_t * stats);
+
+// One record read back from a capture file
+typedef struct
+{
+    int type;
+    // Since the capture started
+    uint64_t timeUs;
+    uint64_t connectionId;
+    uint32_t flags;
+    // For CAPTURE_MESSAGE, and the filter for CAPTURE_HELLO. data is owned
+    // by the record and reused by each read; free() it when done.
+    int length;
+    char * data;
+    int capacity;
+} capture_record_t;
+
+// Open a capture file for reading
+// Return the file positioned at the first record, or NULL with an error
+// written to stderr
+// Params:
+//    path: file to read
+//    record: initialized for Read_Capture_Record
+FILE * Open_Capture(const char * path, capture_record_t * record);
+
+// Read the next record
+// Return 1 for a record, 0 at the end of the file, -1 if the file is corrupt
+// or truncated mid-record
+// Params:
+//    file: from Open_Capture
+//    record: where to store it
+int Read_Capture_Record(FILE * file, capture_record_t * record);
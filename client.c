@@ -3,6 +3,11 @@
  * Filename:      client.c
  * Date Created:  2016-03-??
  * Modifications: 2016-05-17 by Erik Andersen <erik.andersen@oit.edu>
+ *   2026-10-18: -u to connect over a Unix domain socket, -m to receive
+ *   through shared memory. Answers server pings. -f for server side
+ *   filtering. Connection setup moved to netconnect.c for the replay tool.
+ *   -d to chat by datagram with a server listening with -U. -z to take large
+ *   messages compressed.
  **************************************************************
  *
  * Lab/Assignment: CST340 L3
@@ -15,6 +20,13 @@
  * Input:
  *    Command line arguments -i or -s set the hostname of the server to connect
  *    to. -p sets the port to connect to. -n sets the username to use.
+ *    Instead of -i/-s and -p, -u connects to a server on this host through
+ *    its Unix domain socket; adding -m asks for broadcasts to be delivered
+ *    through shared memory. -f only shows chat matching a filter, such as
+ *    -f error,^alice: (contains "error" or starts with "alice:"). -d sends
+ *    and receives chat as datagrams, to a server's -U port; chat may then be
+ *    lost or arrive out of order, which is counted and reported on exit.
+ *    -z asks the server to send large messages compressed.
  *    Input typed on the console will be sent to the server as a chat message,
  *    prepended with the username. To exit, a SIGINT must be recieved, followed
  *    by a newline on the stdin.
@@ -39,8 +51,26 @@
 #include <netinet/tcp.h>
 #include <signal.h>
 #include <pthread.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/param.h>
+#include <sys/un.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "netconnect.h"
+#include "protocol.h"
+#include "shmring.h"
 
 #define BUFFER_SIZE 1024
+// Biggest compressed frame we accept, either side of decompressing
+#define MAX_FRAME_BYTES (16 * 1024 * 1024)
+// Datagrams we send getting subscribed before giving up, and how long we
+// wait for an answer to each in ms
+#define SUBSCRIBE_TRIES 10
+#define SUBSCRIBE_WAIT_MS 1000
+// How long the server may go quiet before answering our HELLO, in ms
+#define HELLO_WAIT_MS 2000
 
 // Contains an easy to use representation of the command line args
 typedef struct
@@ -48,6 +78,14 @@ typedef struct
     char * port;
     char * address;
     char * clientName;
+    char * unixPath;
+    bool useShm;
+    // Patterns for the server to filter on, or NULL
+    char * filter;
+    // Chat by datagram instead of over a stream
+    bool useUdp;
+    // Ask for large messages compressed
+    bool useDeflate;
 } program_options;
 
 /****************************************************************
@@ -67,12 +105,19 @@ void Init_program_options(program_options * options)
     options->port = NULL;
     options->address = NULL;
     options->clientName = NULL;
+    options->unixPath = NULL;
+    options->useShm = false;
+    options->filter = NULL;
+    options->useUdp = false;
+    options->useDeflate = false;
 }
 
 typedef struct
 {
     int socketFd;
     program_options * options;
+    // Ring broadcasts arrive on, if the server gave us one
+    shm_ring_t * ring;
 } io_thread_data;
 
 /****************************************************************
@@ -89,7 +134,7 @@ void parseOptions(int argc, char ** argv, program_options * options)
 {
     int portNum = 0;
     int arg;
-    while (-1 != (arg = getopt(argc, argv, "s:n:i:p:")))
+    while (-1 != (arg = getopt(argc, argv, "s:n:i:p:u:mf:dz")))
     {
         if ('p' == arg)
         {
@@ -110,14 +155,46 @@ void parseOptions(int argc, char ** argv, program_options * options)
         {
             options->clientName = optarg;
         }
+        else if ('u' == arg)
+        {
+            options->unixPath = optarg;
+        }
+        else if ('m' == arg)
+        {
+            options->useShm = true;
+        }
+        else if ('f' == arg)
+        {
+            options->filter = optarg;
+        }
+        else if ('d' == arg)
+        {
+            options->useUdp = true;
+        }
+        else if ('z' == arg)
+        {
+            options->useDeflate = true;
+        }
     }
-    if (NULL == (options->address))
+    if (NULL == (options->address) && NULL == (options->unixPath))
     {
         fprintf(stderr, "You must set either a hostname or address with -s or"
-        " -i.\n");
+        " -i, or a Unix socket path with -u.\n");
         exit(2);
     }
-    if (NULL == (options->port))
+    if (options->useShm && NULL == (options->unixPath))
+    {
+        fprintf(stderr, "Shared memory (-m) needs a Unix socket (-u).\n");
+        exit(6);
+    }
+    if (options->useUdp && (NULL != (options->unixPath) ||
+        NULL != (options->filter) || options->useDeflate))
+    {
+        fprintf(stderr, "Datagrams (-d) go to a host and port, without a"
+        " filter or compression.\n");
+        exit(7);
+    }
+    if (NULL == (options->port) && NULL == (options->unixPath))
     {
         fprintf(stderr, "You must set a port number with the -p option.\n");
         exit(4);
@@ -137,6 +214,25 @@ void parseOptions(int argc, char ** argv, program_options * options)
 
 bool continueLoop = true;
 int sockfd = -1;
+// sockfd is a datagram socket (-d). Set before the signal handler is.
+bool useUdp = false;
+// Held for each write to sockfd, since both the input thread (chat) and the
+// output thread (pong replies, keepalives) send on it
+pthread_mutex_t sendLock = PTHREAD_MUTEX_INITIALIZER;
+// Number for the next datagram we send, and when we last sent one in ms,
+// guarded by sendLock
+uint32_t sendSequence = 0;
+uint64_t lastSentMs = 0;
+// Datagrams from the server that never came, or came after a later one.
+// Only touched by the output thread until it's joined.
+unsigned long lostDatagrams = 0;
+unsigned long lateDatagrams = 0;
+// Compressed frame being read, set up by its header line. Only touched by
+// the output thread.
+char * frame = NULL;
+int frameLength = 0;
+int frameUsed = 0;
+int framePlainLength = 0;
 
 /****************************************************************
  * Do our best to cause all the threads to cleanly exit. Note that the user
@@ -153,7 +249,39 @@ void clientSIGINT(int signal)
 {
     write(1, "Got SIGINT -- press enter to exit.\n", 36);
     continueLoop = false;
-    shutdown(sockfd, SHUT_RDWR);
+    // A datagram socket stays open for sending the server our BYE
+    shutdown(sockfd, useUdp ? SHUT_RD : SHUT_RDWR);
+}
+
+/****************************************************************
+ * Time since an arbitrary point, in ms
+ ****************************************************************/
+uint64_t monotonicMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/****************************************************************
+ * Send one datagram to the server (see protocol.h)
+ * 
+ * Preconditions: sockfd is a connected datagram socket, sendLock held.
+ *  length is at most PROTO_UDP_MAX_PAYLOAD.
+ *
+ * Postcondition:
+ *      datagram sent, returns 0 on success, -1 otherwise
+ ****************************************************************/
+int sendDatagram(const char * payload, int length)
+{
+    char datagram[PROTO_UDP_HEADER + PROTO_UDP_MAX_PAYLOAD];
+    uint32_t sequence = htonl(sendSequence++);
+    
+    memcpy(datagram, &sequence, PROTO_UDP_HEADER);
+    memcpy(datagram + PROTO_UDP_HEADER, payload, length);
+    lastSentMs = monotonicMs();
+    return (PROTO_UDP_HEADER + length ==
+            send(sockfd, datagram, PROTO_UDP_HEADER + length, 0)) ? 0 : -1;
 }
 
 /****************************************************************
@@ -183,18 +311,21 @@ void * inputLoop(void * userdata)
         -usernameSize, stdin))
     {
         int sendBufUsed = strlen(sendBuffer);
-        int sendBufWritten = 0;
-        int writtenThisRound = 0;
-        while (sendBufWritten < sendBufUsed && 0 < (writtenThisRound = write(
-            sockfd, sendBuffer, sendBufUsed-sendBufWritten))
-        )
+        char * control;
+        // Chat must never contain the control line marker
+        while (NULL != (control = memchr(sendBuffer, PROTO_CONTROL,
+            sendBufUsed)))
         {
-            sendBufWritten += writtenThisRound;
+            *control = '?';
         }
-        if (writtenThisRound <= 0)
+        pthread_mutex_lock(&sendLock);
+        // A line fits in one datagram: BUFFER_SIZE < PROTO_UDP_MAX_PAYLOAD
+        if (0 != (useUdp ? sendDatagram(sendBuffer, sendBufUsed) :
+                           Write_All(sockfd, sendBuffer, sendBufUsed)))
         {
             fprintf(stderr, "Error writing to fd %d.\n", sockfd);
         }
+        pthread_mutex_unlock(&sendLock);
         if (usernameSize + 1 < BUFFER_SIZE)
         {
             strcpy(sendBuffer, options->clientName);
@@ -205,6 +336,147 @@ void * inputLoop(void * userdata)
     return NULL;
 }
 
+/****************************************************************
+ * Act on a complete control line from the server
+ * 
+ * Preconditions: line is nul terminated, without the trailing newline
+ *
+ * Postcondition:
+ *      pings answered; a compressed frame's header sets up reading the
+ *      frame; other control lines ignored
+ ****************************************************************/
+void handleControlLine(const char * line)
+{
+    static const char pong[] = PROTO_PONG "\n";
+    
+    if (0 == strcmp(line, PROTO_PING))
+    {
+        pthread_mutex_lock(&sendLock);
+        Write_All(sockfd, pong, sizeof(pong) - 1);
+        pthread_mutex_unlock(&sendLock);
+    }
+    else if (0 == strncmp(line, PROTO_COMPRESSED " ",
+                          strlen(PROTO_COMPRESSED " ")))
+    {
+        if (2 != sscanf(line + strlen(PROTO_COMPRESSED), "%d %d",
+                        &frameLength, &framePlainLength) ||
+            frameLength <= 0 || frameLength > MAX_FRAME_BYTES ||
+            framePlainLength <= 0 || framePlainLength > MAX_FRAME_BYTES ||
+            NULL == (frame = malloc(frameLength)))
+        {
+            // Can't tell where the frame ends, so everything after it would
+            // be garbage too
+            fprintf(stderr, "Bad compressed frame from the server.\n");
+            continueLoop = false;
+            frameLength = 0;
+            return;
+        }
+        frameUsed = 0;
+    }
+}
+
+/****************************************************************
+ * Take bytes of the compressed frame being read, and once it's all here
+ * write it to stdout decompressed
+ * 
+ * Preconditions: a frame header set up frame, and length is no more than
+ *  the rest of it
+ *
+ * Postcondition:
+ *      bytes added to the frame, the frame written out and freed if that
+ *      completes it. returns 0 on success, -1 if stdout failed
+ ****************************************************************/
+int takeFrameBytes(const char * buffer, int length)
+{
+    uLongf plainLength = framePlainLength;
+    char * plain;
+    int result = 0;
+    
+    memcpy(frame + frameUsed, buffer, length);
+    frameUsed += length;
+    if (frameUsed < frameLength)
+    {
+        return 0;
+    }
+    if (NULL == (plain = malloc(framePlainLength)) ||
+        Z_OK != uncompress((Bytef *)plain, &plainLength, (Bytef *)frame,
+                           frameLength))
+    {
+        fprintf(stderr, "Couldn't decompress a message from the server.\n");
+    }
+    else
+    {
+        result = Write_All(1, plain, plainLength);
+    }
+    free(plain);
+    free(frame);
+    frame = NULL;
+    frameLength = 0;
+    return result;
+}
+
+/****************************************************************
+ * Write bytes from the server to stdout, taking out control lines (which may
+ * be split across calls) and handling them, and decompressing frames
+ * 
+ * Preconditions: only ever called from the output thread
+ *
+ * Postcondition:
+ *      chat written to stdout. returns 0 on success, -1 if stdout failed
+ ****************************************************************/
+int showServerOutput(const char * buffer, int length)
+{
+    static char controlLine[PROTO_MAX_LINE];
+    static int controlUsed = 0;
+    static bool inControlLine = false;
+    int chatStart = 0;
+    int index;
+    int taken;
+    
+    for (index = 0; index < length; ++index)
+    {
+        if (frameLength > 0)
+        {
+            taken = MIN(length - index, frameLength - frameUsed);
+            if (0 != takeFrameBytes(buffer + index, taken))
+            {
+                return -1;
+            }
+            index += taken - 1;
+            chatStart = index + 1;
+        }
+        else if (inControlLine)
+        {
+            if ('\n' == buffer[index])
+            {
+                controlLine[controlUsed] = '\0';
+                handleControlLine(controlLine);
+                inControlLine = false;
+                chatStart = index + 1;
+            }
+            else if (controlUsed < PROTO_MAX_LINE - 1)
+            {
+                controlLine[controlUsed++] = buffer[index];
+            }
+        }
+        else if (PROTO_CONTROL == buffer[index])
+        {
+            if (0 != Write_All(1, buffer + chatStart, index - chatStart))
+            {
+                return -1;
+            }
+            inControlLine = true;
+            controlLine[0] = PROTO_CONTROL;
+            controlUsed = 1;
+        }
+    }
+    if (!inControlLine)
+    {
+        return Write_All(1, buffer + chatStart, length - chatStart);
+    }
+    return 0;
+}
+
 /****************************************************************
  * Output from the server socket to stdout
  * 
@@ -224,15 +496,7 @@ void * outputLoop(void * userdata)
     while (continueLoop &&
         0 != (recvBufUsed = read(socketfd, recvBuffer, BUFFER_SIZE)))
     {
-        int recvBufWritten = 0;
-        int writtenThisRound = 0;
-        while (recvBufWritten < recvBufUsed && 0 < (writtenThisRound =
-            write(1, recvBuffer, recvBufUsed-recvBufWritten))
-        )
-        {
-            recvBufWritten += writtenThisRound;
-        }
-        if (writtenThisRound <=0)
+        if (0 != showServerOutput(recvBuffer, recvBufUsed))
         {
             fprintf(stderr, "Error writing to stdout.\n");
             continueLoop = 0;
@@ -242,55 +506,360 @@ void * outputLoop(void * userdata)
     return NULL;
 }
 
-int main(int argc, char ** argv)
+/****************************************************************
+ * Output broadcasts from the shared memory ring to stdout. The socket is
+ * still watched, for the server's goodbye and for hangups.
+ * 
+ * Preconditions: ring attached, socketfd open and accepting reads
+ *
+ * Postcondition:
+ *      Information from the ring and socketfd written to stdout
+ * 
+ ****************************************************************/
+void * shmOutputLoop(void * userdata)
 {
-    // Program options
-    program_options options;
-    Init_program_options(&options);
-    parseOptions(argc, argv, &options);
+    char recvBuffer[BUFFER_SIZE];
+    int socketfd = ((io_thread_data *)(userdata))->socketFd;
+    shm_ring_t * ring = ((io_thread_data *)(userdata))->ring;
+    size_t recvBufUsed;
+    ssize_t socketBufUsed;
+    int waitResult = 1;
     
-    // For critera for lookup
-    struct addrinfo hints;
-    struct addrinfo * destInfoResults;
+    while (continueLoop && -1 != waitResult)
+    {
+        // Drain the ring first: anything in it was sent before whatever is
+        // waiting on the socket
+        while (0 < (recvBufUsed = Shm_Ring_Read(ring, recvBuffer, BUFFER_SIZE)))
+        {
+            if (0 != showServerOutput(recvBuffer, recvBufUsed))
+            {
+                fprintf(stderr, "Error writing to stdout.\n");
+                continueLoop = 0;
+            }
+        }
+        if (0 == waitResult)
+        {
+            socketBufUsed = read(socketfd, recvBuffer, BUFFER_SIZE);
+            if (socketBufUsed <= 0)
+            {
+                break;
+            }
+            showServerOutput(recvBuffer, socketBufUsed);
+        }
+        waitResult = Shm_Ring_Wait(ring, socketfd);
+    }
+    return NULL;
+}
+
+/****************************************************************
+ * Output datagrams from the server to stdout, counting any that are missing
+ * or out of order by their sequence numbers, and keep our subscription
+ * alive while we have nothing to say, however much we are receiving
+ * 
+ * Preconditions: socketfd is a connected datagram socket subscribed with
+ *  subscribeDatagrams
+ *
+ * Postcondition:
+ *      Chat from the datagrams written to stdout. lostDatagrams and
+ *      lateDatagrams count what didn't arrive in order.
+ ****************************************************************/
+void * datagramOutputLoop(void * userdata)
+{
+    char datagram[PROTO_UDP_HEADER + PROTO_UDP_MAX_PAYLOAD];
+    int socketfd = ((io_thread_data *)(userdata))->socketFd;
+    struct pollfd waitFor;
+    bool first = true;
+    uint32_t expected = 0;
+    uint32_t sequence;
+    int32_t ahead;
+    ssize_t received;
+    uint64_t quietMs;
+    int ready;
+    
+    waitFor.fd = socketfd;
+    waitFor.events = POLLIN;
+    while (continueLoop)
+    {
+        // The server only hears from us when we send, so the keepalive
+        // goes by what we sent, not by what we received
+        pthread_mutex_lock(&sendLock);
+        quietMs = monotonicMs() - lastSentMs;
+        if (quietMs >= PROTO_UDP_KEEPALIVE_MS)
+        {
+            sendDatagram("", 0);
+            quietMs = 0;
+        }
+        pthread_mutex_unlock(&sendLock);
+        if (0 == (ready = poll(&waitFor, 1,
+                               PROTO_UDP_KEEPALIVE_MS - (int)quietMs)))
+        {
+            continue;
+        }
+        if (-1 == ready || -1 == (received = recv(socketfd, datagram,
+                                                  sizeof(datagram), 0)))
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            if (ECONNREFUSED == errno)
+            {
+                fprintf(stderr, "Server isn't taking datagrams on that port."
+                "\n");
+            }
+            break;
+        }
+        if (0 == received)
+        {
+            // Shut down by SIGINT
+            break;
+        }
+        if (received < PROTO_UDP_HEADER ||
+            (received > PROTO_UDP_HEADER &&
+             PROTO_CONTROL == datagram[PROTO_UDP_HEADER]))
+        {
+            // Nothing to show, such as a repeat of the server saying we're
+            // subscribed
+            continue;
+        }
+        memcpy(&sequence, datagram, PROTO_UDP_HEADER);
+        sequence = ntohl(sequence);
+        // We may have subscribed part way through the server's numbering
+        ahead = first ? 0 : (int32_t)(sequence - expected);
+        first = false;
+        if (ahead < 0)
+        {
+            ++lateDatagrams;
+        }
+        else
+        {
+            lostDatagrams += ahead;
+            expected = sequence + 1;
+        }
+        if (0 != showServerOutput(datagram + PROTO_UDP_HEADER,
+                                  received - PROTO_UDP_HEADER))
+        {
+            fprintf(stderr, "Error writing to stdout.\n");
+            continueLoop = 0;
+        }
+    }
+    return NULL;
+}
+
+/****************************************************************
+ * Send a HELLO asking for the options we want and read the server's WELCOME.
+ * The server doesn't hold chat back for the WELCOME, so anything ahead of it
+ * is shown like any other output. Called before the io threads start, so
+ * nothing else touches the socket or stdout.
+ * 
+ * Preconditions: sockfd connected, nothing sent on it yet
+ *
+ * Postcondition:
+ *      returns the ring the server attached to its WELCOME, or NULL if it
+ *      didn't give us one
+ ****************************************************************/
+shm_ring_t * negotiateHello(int socketfd, program_options * options)
+{
+    char line[PROTO_MAX_LINE];
+    int lineUsed = 0;
+    char chat[BUFFER_SIZE];
+    int chatUsed = 0;
+    shm_ring_t * ring = NULL;
+    struct pollfd waitFor;
+    char byte;
     
-    // Initialize the struct
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC; // Use IPv4 or IPv6, we don't care
-    hints.ai_socktype = SOCK_STREAM; // Use tcp
+    snprintf(line, sizeof(line), "%s%s%s%s%s%s\n", PROTO_HELLO,
+             options->useShm ? " " : "", options->useShm ? PROTO_OPT_SHM : "",
+             options->useDeflate ? " " PROTO_OPT_DEFLATE : "",
+             options->filter ? " " PROTO_OPT_FILTER : "",
+             options->filter ? options->filter : "");
+    if (0 != Write_All(socketfd, line, strlen(line)))
+    {
+        fprintf(stderr, "Trouble sending HELLO to the server.\n");
+        return NULL;
+    }
     
-    // Do the lookup
-    int returnStatus = -1;
-    if (0 != (returnStatus = getaddrinfo(options.address, options.port, &hints,
-        &destInfoResults)) )
+    // One byte at a time so we never read past the WELCOME into chat that
+    // may be compressed. The fds, if any, come with its first byte.
+    waitFor.fd = socketfd;
+    waitFor.events = POLLIN;
+    while (1 == poll(&waitFor, 1, HELLO_WAIT_MS) &&
+           1 == Receive_Shm_Ring_Fds(socketfd, &byte, 1, &ring))
     {
-        fprintf(stderr, "Couldn't get address lookup info: %s\n",
-                gai_strerror(returnStatus));
-        exit(8);
+        if (0 == lineUsed && PROTO_CONTROL != byte)
+        {
+            chat[chatUsed++] = byte;
+            if ('\n' == byte || BUFFER_SIZE == chatUsed)
+            {
+                showServerOutput(chat, chatUsed);
+                chatUsed = 0;
+            }
+            continue;
+        }
+        if (chatUsed > 0)
+        {
+            // A line cut short by a control line
+            showServerOutput(chat, chatUsed);
+            chatUsed = 0;
+        }
+        if (lineUsed < PROTO_MAX_LINE - 1)
+        {
+            line[lineUsed++] = byte;
+        }
+        if ('\n' != byte)
+        {
+            continue;
+        }
+        line[lineUsed] = '\0';
+        if (0 == strncmp(line, PROTO_WELCOME, strlen(PROTO_WELCOME)))
+        {
+            break;
+        }
+        // Some other control line; let it be handled as usual
+        showServerOutput(line, lineUsed);
+        lineUsed = 0;
+    }
+    if (chatUsed > 0)
+    {
+        showServerOutput(chat, chatUsed);
+    }
+    line[lineUsed] = '\0';
+    if (0 != strncmp(line, PROTO_WELCOME, strlen(PROTO_WELCOME)))
+    {
+        fprintf(stderr, "Server didn't answer our HELLO.\n");
     }
+    else
+    {
+        if (options->useShm && NULL == ring)
+        {
+            fprintf(stderr, "Server didn't give us shared memory, using the"
+            " socket.\n");
+        }
+        if (options->useDeflate && NULL == strstr(line, " " PROTO_OPT_DEFLATE))
+        {
+            fprintf(stderr, "Server won't compress chat for us.\n");
+        }
+        if (options->filter && NULL == strstr(line, " " PROTO_OPT_FILTER))
+        {
+            fprintf(stderr, "Server didn't accept the filter, showing all"
+            " chat.\n");
+        }
+    }
+    return ring;
+}
+
+/****************************************************************
+ * Get subscribed to the server's datagrams: ask for a cookie, send it back
+ * and wait for the server to say we're subscribed (see protocol.h). Called
+ * before the io threads start, so nothing else touches the socket.
+ * 
+ * Preconditions: socketfd is a connected datagram socket
+ *
+ * Postcondition:
+ *      returns 0 once subscribed, -1 with an error written to stderr if
+ *      the server never took us
+ ****************************************************************/
+int subscribeDatagrams(int socketfd)
+{
+    char datagram[PROTO_UDP_HEADER + PROTO_UDP_MAX_PAYLOAD];
+    char line[PROTO_MAX_LINE];
+    int lineLength = strlen(PROTO_UDP_COOKIE) + PROTO_UDP_COOKIE_DIGITS;
+    struct pollfd waitFor;
+    ssize_t received;
+    int tries = 0;
+    int ready;
     
-    // Loop through results until one works
-    bool connectSuccess = false;
-    struct addrinfo * p = destInfoResults;
-    for (; (!connectSuccess) && NULL != p; p = p->ai_next)
+    snprintf(line, sizeof(line), "%s%0*d", PROTO_UDP_COOKIE,
+             PROTO_UDP_COOKIE_DIGITS, 0);
+    waitFor.fd = socketfd;
+    waitFor.events = POLLIN;
+    while (tries++ < SUBSCRIBE_TRIES)
     {
-        if (-1 != (sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)))
+        if (0 != sendDatagram(line, lineLength))
+        {
+            break;
+        }
+        if (0 == (ready = poll(&waitFor, 1, SUBSCRIBE_WAIT_MS)))
         {
-            if (-1 != connect(sockfd, p->ai_addr, p->ai_addrlen))
+            // The server may have lost it or our cookie. Start over.
+            snprintf(line, sizeof(line), "%s%0*d", PROTO_UDP_COOKIE,
+                     PROTO_UDP_COOKIE_DIGITS, 0);
+            continue;
+        }
+        if (-1 == ready ||
+            -1 == (received = recv(socketfd, datagram, sizeof(datagram), 0)))
+        {
+            if (EINTR == errno)
             {
-                connectSuccess = true;
+                continue;
             }
-            else
+            if (ECONNREFUSED == errno)
             {
-                close(sockfd);
-                perror("Trouble connecting: ");
+                fprintf(stderr, "Server isn't taking datagrams on that port."
+                "\n");
+                return -1;
             }
+            break;
         }
-        else
+        if (PROTO_UDP_HEADER + lineLength != received ||
+            0 != memcmp(datagram + PROTO_UDP_HEADER, PROTO_UDP_COOKIE,
+                        strlen(PROTO_UDP_COOKIE)))
+        {
+            continue;
+        }
+        if (0 == memcmp(datagram + PROTO_UDP_HEADER, line, lineLength))
+        {
+            // Our own line back: we're subscribed
+            return 0;
+        }
+        // A cookie to send back
+        memcpy(line, datagram + PROTO_UDP_HEADER, lineLength);
+    }
+    fprintf(stderr, "Server didn't subscribe us to its datagrams.\n");
+    return -1;
+}
+
+int main(int argc, char ** argv)
+{
+    // Program options
+    program_options options;
+    Init_program_options(&options);
+    parseOptions(argc, argv, &options);
+    shm_ring_t * ring = NULL;
+    useUdp = options.useUdp;
+    
+    if (useUdp)
+    {
+        if (-1 == (sockfd = Connect_Udp(options.address, options.port)))
         {
-            perror("Trouble getting a socket: ");
+            exit(8);
         }
     }
-    freeaddrinfo(destInfoResults);
+    else if (options.unixPath)
+    {
+        if (-1 == (sockfd = Connect_Unix(options.unixPath)))
+        {
+            exit(8);
+        }
+    }
+    else if (-1 == (sockfd = Connect_Tcp(options.address, options.port)))
+    {
+        exit(8);
+    }
+    
+    if (useUdp)
+    {
+        if (0 != subscribeDatagrams(sockfd))
+        {
+            exit(8);
+        }
+    }
+    else
+    {
+        // Always say HELLO, even with no options, so the server knows we
+        // handle control lines such as pings
+        ring = negotiateHello(sockfd, &options);
+    }
     
     signal(SIGINT, clientSIGINT);
     
@@ -300,16 +869,34 @@ int main(int argc, char ** argv)
     
     inThreadData.socketFd = sockfd;
     inThreadData.options = &options;
+    inThreadData.ring = NULL;
     outThreadData.socketFd = sockfd;
     outThreadData.options = &options;
+    outThreadData.ring = ring;
     
     pthread_create(&inThread, NULL, inputLoop, &inThreadData);
-    pthread_create(&outThread, NULL, outputLoop, &outThreadData);
+    pthread_create(&outThread, NULL, useUdp ? datagramOutputLoop :
+                   (ring ? shmOutputLoop : outputLoop), &outThreadData);
     
     pthread_join(outThread, NULL);
     pthread_join(inThread, NULL);
     
+    if (useUdp)
+    {
+        // Otherwise the server keeps sending until we time out
+        sendDatagram(PROTO_UDP_BYE, strlen(PROTO_UDP_BYE));
+        if (lostDatagrams || lateDatagrams)
+        {
+            fprintf(stderr, "%lu datagrams from the server were lost, %lu"
+            " arrived out of order.\n", lostDatagrams, lateDatagrams);
+        }
+    }
+    
     close(sockfd);
+    if (ring)
+    {
+        Delete_Shm_Ring(ring);
+    }
     
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,164 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      compress.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Pool of zlib compressors and the frame encoder.
+ *
+ *    The header's length depends on the compressed size, so the message is
+ *    compressed to just past the longest header there could be, and moved
+ *    down next to the header once that is written.
+ * 
+ *  -- See compress.h for function header blocks
+ *
+ ************************************************************/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "protocol.h"
+
+#define NS_PER_SEC 1000000000ULL
+// Longest frame header: the marker, two ints and the separators
+#define COMPRESS_HEADER_MAX (sizeof(PROTO_COMPRESSED) + 2 * 12)
+
+typedef struct compressor_s
+{
+    // Next idle compressor
+    struct compressor_s * next;
+    z_stream stream;
+    int level;
+} compressor_t;
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static compressor_t * idle = NULL;
+
+static compress_stats_t stats;
+
+//********************************************
+static uint64_t Now_Ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+//********************************************
+// Take an idle compressor set to level, or make one. Return NULL if out of
+// memory.
+static compressor_t * Acquire_Compressor(int level)
+{
+    compressor_t * compressor;
+
+    pthread_mutex_lock(&poolLock);
+    if (NULL != (compressor = idle))
+    {
+        idle = compressor->next;
+    }
+    pthread_mutex_unlock(&poolLock);
+
+    if (NULL == compressor)
+    {
+        if (NULL == (compressor = calloc(1, sizeof(compressor_t))))
+        {
+            return NULL;
+        }
+        if (Z_OK != deflateInit(&(compressor->stream), level))
+        {
+            free(compressor);
+            return NULL;
+        }
+        compressor->level = level;
+    }
+    else
+    {
+        deflateReset(&(compressor->stream));
+        // The level changed through the admin port since this one was used
+        if (compressor->level != level &&
+            Z_OK == deflateParams(&(compressor->stream), level,
+                                  Z_DEFAULT_STRATEGY))
+        {
+            compressor->level = level;
+        }
+    }
+    return compressor;
+}
+
+//********************************************
+static void Release_Compressor(compressor_t * compressor)
+{
+    pthread_mutex_lock(&poolLock);
+    compressor->next = idle;
+    idle = compressor;
+    pthread_mutex_unlock(&poolLock);
+}
+
+//********************************************
+int Compress_Frame(const char * message, int length, int level, char ** frame)
+{
+    compressor_t * compressor;
+    uint64_t start = Now_Ns();
+    char header[COMPRESS_HEADER_MAX];
+    char * out;
+    int headerLength;
+    int compressedLength;
+
+    if (NULL == (compressor = Acquire_Compressor(level)))
+    {
+        return 0;
+    }
+    if (NULL == (out = malloc(COMPRESS_HEADER_MAX +
+                              deflateBound(&(compressor->stream), length))))
+    {
+        Release_Compressor(compressor);
+        return 0;
+    }
+    compressor->stream.next_in = (Bytef *)message;
+    compressor->stream.avail_in = length;
+    compressor->stream.next_out = (Bytef *)(out + COMPRESS_HEADER_MAX);
+    compressor->stream.avail_out = deflateBound(&(compressor->stream), length);
+    // deflateBound makes room for everything, so one call finishes
+    if (Z_STREAM_END != deflate(&(compressor->stream), Z_FINISH))
+    {
+        Release_Compressor(compressor);
+        free(out);
+        return 0;
+    }
+    compressedLength = (int)compressor->stream.total_out;
+    Release_Compressor(compressor);
+
+    headerLength = snprintf(header, sizeof(header), "%s %d %d\n",
+                            PROTO_COMPRESSED, compressedLength, length);
+    __atomic_add_fetch(&(stats.messages), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(stats.ns), Now_Ns() - start, __ATOMIC_RELAXED);
+    if (headerLength + compressedLength >= length)
+    {
+        __atomic_add_fetch(&(stats.notSmaller), 1, __ATOMIC_RELAXED);
+        free(out);
+        return 0;
+    }
+    memcpy(out, header, headerLength);
+    memmove(out + headerLength, out + COMPRESS_HEADER_MAX, compressedLength);
+    __atomic_add_fetch(&(stats.plainBytes), length, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(stats.frameBytes), headerLength + compressedLength,
+                       __ATOMIC_RELAXED);
+    *frame = out;
+    return headerLength + compressedLength;
+}
+
+//********************************************
+void Get_Compress_Stats(compress_stats_t * out)
+{
+    out->messages = __atomic_load_n(&(stats.messages), __ATOMIC_RELAXED);
+    out->notSmaller = __atomic_load_n(&(stats.notSmaller), __ATOMIC_RELAXED);
+    out->plainBytes = __atomic_load_n(&(stats.plainBytes), __ATOMIC_RELAXED);
+    out->frameBytes = __atomic_load_n(&(stats.frameBytes), __ATOMIC_RELAXED);
+    out->ns = __atomic_load_n(&(stats.ns), __ATOMIC_RELAXED);
+}
@@ -0,0 +1,52 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      compress.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Compressed chat frames (see protocol.h), made once per message by the
+ *    thread that read it and then sent as is to every recipient that asked
+ *    for them.
+ *
+ *    zlib's compressor state is a few hundred KB, too much to keep one per
+ *    connection thread, so threads share a pool of them and only hold one
+ *    while compressing. The pool grows to the most messages ever being
+ *    compressed at once.
+ *
+ ************************************************************/
+#include <stdint.h>
+
+// Levels, as zlib's: 1 is fastest, 9 smallest
+#define COMPRESS_MIN_LEVEL 1
+#define COMPRESS_MAX_LEVEL 9
+
+// Compress a message into a frame: its header line, then the message in
+// zlib format
+// Return the frame's length with *frame set to it, to free() when done, or 0
+// if the frame wouldn't be smaller than the message or we ran out of memory
+// Params:
+//    message, length: chat to compress
+//    level: COMPRESS_MIN_LEVEL to COMPRESS_MAX_LEVEL
+//    frame: where to store the frame
+int Compress_Frame(const char * message, int length, int level,
+                   char ** frame);
+
+// Statistics for the admin interface
+typedef struct
+{
+    // Messages compressed, and of those, ones that didn't get smaller
+    uint64_t messages;
+    uint64_t notSmaller;
+    // Of messages that made frames
+    uint64_t plainBytes;
+    uint64_t frameBytes;
+    uint64_t ns;
+} compress_stats_t;
+
+// Get compression statistics
+// Params:
+//    stats: where to store them
+void Get_Compress_Stats(compress_stats_t * stats);
@@ -0,0 +1,93 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      connection.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Allocation of per-connection state for the chat server.
+ * 
+ *  -- See connection.h for function header blocks
+ *
+ ************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "transport.h"
+
+// Handed out to each new connection so log messages and counters can name a
+// connection even after its fd number has been reused
+static uint64_t nextConnectionId = 1;
+
+//********************************************
+connection_t * Init_Connection(int fd)
+{
+    void * memory = NULL;
+    
+    // Cache line aligned so the hot fields never straddle two lines
+    if (0 != posix_memalign(&memory, CONNECTION_CACHE_LINE,
+        sizeof(connection_t)))
+    {
+        return NULL;
+    }
+    
+    connection_t * connection = (connection_t *)memory;
+    memset(connection, 0, sizeof(connection_t));
+    connection->fd = fd;
+    pthread_mutex_init(&(connection->writeLock), NULL);
+    pthread_mutex_init(&(connection->inFlightLock), NULL);
+    pthread_cond_init(&(connection->inFlightCond), NULL);
+    connection->shardSlot = -1;
+    connection->weight = 1;
+    connection->refCount = 1;
+    Init_Rate_State(&(connection->rate));
+    connection->id = __atomic_fetch_add(&nextConnectionId, 1, __ATOMIC_RELAXED);
+    
+    return connection;
+}
+
+//********************************************
+void Retain_Connection(connection_t * connection)
+{
+    __atomic_add_fetch(&(connection->refCount), 1, __ATOMIC_RELAXED);
+}
+
+//********************************************
+void Release_Connection(connection_t * connection)
+{
+    if (0 != __atomic_sub_fetch(&(connection->refCount), 1, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+    
+    Transport_Close(connection->fd);
+    if (connection->ring)
+    {
+        Delete_Shm_Ring(connection->ring);
+    }
+    // Only now, when no writer can be delivering to it any more, are its
+    // keywords safe to hand to another filter
+    if (connection->filter)
+    {
+        Delete_Filter(connection->filter);
+    }
+    pthread_mutex_destroy(&(connection->writeLock));
+    pthread_mutex_destroy(&(connection->inFlightLock));
+    pthread_cond_destroy(&(connection->inFlightCond));
+    free(connection);
+}
+
+//********************************************
+void Retain_Connection_Link(list_link_t * link)
+{
+    Retain_Connection(CONNECTION_FROM_LINK(link));
+}
+
+//********************************************
+void Release_Connection_Link(list_link_t * link)
+{
+    Release_Connection(CONNECTION_FROM_LINK(link));
+}
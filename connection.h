@@ -0,0 +1,133 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      connection.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Per-connection state for the chat server. Each connection object carries
+ *    its own list link, so the connections list points straight at the state
+ *    a broadcast needs instead of at an fd that has to be looked up elsewhere.
+ *
+ ************************************************************/
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "filter.h"
+#include "list.h"
+#include "ratelimit.h"
+#include "shmring.h"
+#include "timerwheel.h"
+
+// Size of a cache line on the machines we run on
+#define CONNECTION_CACHE_LINE 64
+
+// Values for connection_t.flags
+// Accepted on the Unix domain socket, so the client is on this host
+#define CONNECTION_LOCAL 0x1
+// Broadcasts go through connection_t.ring instead of the socket
+#define CONNECTION_SHM 0x2
+// Client sent a HELLO, so it understands control lines such as pings
+#define CONNECTION_HELLO 0x4
+// Not a client connection: stands in for every client sending datagrams
+#define CONNECTION_UDP 0x8
+// Client takes compressed frames (see protocol.h)
+#define CONNECTION_DEFLATE 0x10
+
+typedef struct connection_s
+{
+    // Hot fields: read for every recipient of every broadcast. Kept together
+    // at the front so a broadcast touches one cache line per recipient.
+    int fd;
+    uint32_t flags;
+    // Held while writing one message, so concurrent broadcasts don't
+    // interleave partial writes
+    pthread_mutex_t writeLock;
+    // Content filter from the client's HELLO, or NULL for everything. Set
+    // when the HELLO is taken, which may be after the connection joined the
+    // fan-out (see filter.h); freed with the connection.
+    filter_t * filter;
+    
+    // Cold fields
+    list_link_t link;
+    // References from the serving thread and from list snapshots. The fd is
+    // closed when the last one is dropped, so it can't be reused under a
+    // broadcast still holding an old snapshot.
+    int refCount;
+    // Shared memory ring for CONNECTION_SHM connections, otherwise NULL
+    shm_ring_t * ring;
+    // Heartbeat state, see heartbeat.c. lastActivity is stored by the
+    // reader; the rest belongs to the heartbeat thread.
+    wheel_timer_t idleTimer;
+    uint64_t lastActivity;
+    uint64_t lastPing;
+    int heartbeatState;
+    struct connection_s * heartbeatNext;
+    // Fan-out state, see fanout.c. shard and leaving are guarded by the
+    // fan-out membership lock; shardSlot belongs to the owning writer.
+    int shard;
+    int shardSlot;
+    bool leaving;
+    // Messages from this connection not yet delivered everywhere. The reader
+    // waits on inFlightCond when there are too many.
+    int inFlight;
+    int inFlightWaiting;
+    pthread_mutex_t inFlightLock;
+    pthread_cond_t inFlightCond;
+    // This connection's messages waiting for the fan-out sequencer to publish
+    // them, and its place in the sequencer's round robin. Only touched by
+    // the sequencer thread.
+    struct fanout_node_s * sequencedHead;
+    struct fanout_node_s * sequencedTail;
+    struct connection_s * sequencedNext;
+    int sequencedDeficit;
+    // Size of this connection's turns as a sender, in FANOUT_QUANTUMs. 1
+    // unless changed with Fanout_Set_Weight.
+    int weight;
+    // Broadcasts this connection's filter kept from it. Only touched by the
+    // writer owning its shard.
+    uint64_t filteredOut;
+    // Only touched by the thread serving this connection
+    uint64_t id;
+    uint64_t bytesRead;
+    uint64_t messagesRead;
+    uint64_t reads;
+    // Size class of the buffer the reader uses, see server.c. Grows when a
+    // read fills the buffer; shrinks after smallPasses passes in a row that
+    // would have fit the next size down, or when the connection goes idle.
+    int readSizeClass;
+    int smallPasses;
+    rate_state_t rate;
+    // Inside a control line from the client, which isn't broadcast
+    bool inControlLine;
+} __attribute__((aligned(CONNECTION_CACHE_LINE))) connection_t;
+
+// Create a connection object for an accepted socket, holding one reference
+// Return pointer to the connection. Return NULL on failure.
+// Params:
+//    fd: the accepted socket
+connection_t * Init_Connection(int fd);
+
+// Take a reference on a connection
+// Params:
+//    connection: connection to keep alive
+void Retain_Connection(connection_t * connection);
+
+// Drop a reference on a connection. The last reference closes the fd and frees
+// the connection, which must not be on any list by then.
+// Params:
+//    connection: connection to release
+void Release_Connection(connection_t * connection);
+
+// Retain_Connection and Release_Connection taking the connection's list link,
+// for use with Set_Snapshot_Refcounting
+void Retain_Connection_Link(list_link_t * link);
+void Release_Connection_Link(list_link_t * link);
+
+// Get the connection a list link is embedded in
+// Params:
+//    link: a link from a list of connections
+#define CONNECTION_FROM_LINK(l) LIST_ENTRY((l), connection_t, link)
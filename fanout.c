@@ -0,0 +1,1379 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      fanout.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Sharded broadcast over a shared log.
+ *
+ *    The log is a singly linked list. Producers append with one atomic
+ *    exchange of the tail pointer and then link the previous tail to the new
+ *    node. Every writer keeps its own cursor into the list. A writer can't
+ *    move past a node whose next pointer is still NULL, so the tail node is
+ *    never freed under a producer that is about to link onto it. Each node
+ *    starts with one reference per writer and is freed by the last writer to
+ *    move past it. That waits for the next node to arrive, so each node also
+ *    counts the writers still to process it, and the last of those finishes
+ *    the entry: latency stats and dropping the connection references.
+ *
+ *    A writer that runs out of log sleeps on its eventfd after setting a
+ *    flag; producers only make the syscall to wake it when the flag is set.
+ *
+ *    Writers may finish log entries out of order (see fanout.h), so each
+ *    node has a bit per writer saying it's done, and a writer's cursor only
+ *    moves past entries with its bit set. Everything between the cursor and
+ *    the entry it delivers stays allocated because its reference is still
+ *    held.
+ *
+ *    Each writer's control lane is a lock-free stack that producers push
+ *    onto and the writer empties all at once, reversing it into order.
+ *
+ *    Sequenced mode puts one thread between the producers and the log.
+ *    Producers push onto its ingest queue (see mpscq.h) instead of appending.
+ *    The sequencer keeps each sender's messages in a queue of their own,
+ *    linked through the nodes' next pointers until they are published, and
+ *    picks between senders by deficit round robin. It appends what it picks
+ *    as one chain, so a batch costs one exchange and one round of wakeups.
+ *    It publishes no more than FANOUT_SEQUENCER_WINDOW messages ahead of the
+ *    writer furthest along; the rest wait with it, where a quiet sender can
+ *    still go ahead of them. A writer behind the others doesn't hold back
+ *    the window, so a slow shard doesn't stall the rest; its backlog waits
+ *    in the log, bounded by FANOUT_MAX_IN_FLIGHT per sender. Joins, leaves,
+ *    moves, drains and the server's own messages are barriers: everything
+ *    taken in before one is published ahead of it. Writers then go strictly
+ *    in log order, so every recipient sees the same order.
+ *
+ *  -- See fanout.h for function header blocks
+ *
+ ************************************************************/
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fanout.h"
+#include "mpscq.h"
+
+#define NS_PER_SEC 1000000000ULL
+// Trace events each writer keeps: a sampled message costs two per recipient
+#define FANOUT_TRACE_EVENTS 16384
+
+// Kinds of log entries
+#define FANOUT_MESSAGE 0
+#define FANOUT_JOIN 1
+#define FANOUT_LEAVE 2
+// Move one connection from shard to toShard. The from shard picks which.
+#define FANOUT_REBALANCE 3
+// The initial node every cursor starts on. Never freed.
+#define FANOUT_STUB 4
+// Marks how far Fanout_Drain has to wait for
+#define FANOUT_DRAIN 5
+
+typedef struct fanout_node_s
+{
+    // Next in the log. Before the sequencer publishes a message, next in its
+    // sender's queue.
+    struct fanout_node_s * next;
+    // On the sequencer's ingest queue
+    mpsc_link_t ingest;
+    // Writers that haven't moved past this node, for freeing it
+    int refCount;
+    // Writers that haven't processed this node yet, for finishing it
+    int pending;
+    int type;
+    // Sender of a message, or the connection joining, leaving or moving
+    connection_t * connection;
+    int shard;
+    int toShard;
+    // Set by the from shard once it has chosen the connection to move
+    int decided;
+    uint64_t submitNs;
+    // For FANOUT_DRAIN, which drain this is
+    uint64_t drainTicket;
+    // Bit per writer that has processed this node
+    uint64_t doneBy;
+    // For FANOUT_MESSAGE, 0 unless it is being traced
+    uint32_t traceId;
+    // Points into data, ahead of the message, or NULL
+    filter_hits_t * hits;
+    int length;
+    // Follows the message in data, if there is one
+    int compressedLength;
+    char data[] __attribute__((aligned(8)));
+} fanout_node_t;
+
+// A frame on a writer's control lane
+typedef struct fanout_control_s
+{
+    struct fanout_control_s * next;
+    uint64_t submitNs;
+    int length;
+    char data[];
+} fanout_control_t;
+
+// One sender's place in a writer's round robin
+typedef struct
+{
+    connection_t * sender;
+    // Bytes it may still have delivered this turn
+    int deficit;
+} fanout_flow_t;
+
+typedef struct
+{
+    pthread_t thread;
+    int index;
+    // Only touched by this writer
+    fanout_node_t * cursor;
+    connection_t ** members;
+    int memberCount;
+    int memberCapacity;
+    // Senders with messages in the lookahead, in round robin order, and
+    // whose turn it is
+    fanout_flow_t flows[FANOUT_LOOKAHEAD];
+    int flowCount;
+    int currentFlow;
+    // Control lane, newest first. Pushed by producers, emptied by the writer.
+    fanout_control_t * control;
+    // Messages delivered, for the sequencer's window. Only written by this
+    // writer.
+    uint64_t delivered;
+    // Sleep/wake handshake with producers
+    int sleeping;
+    int eventFd;
+} fanout_writer_t;
+
+typedef struct
+{
+    pthread_t thread;
+    mpsc_queue_t ingest;
+    // Senders with messages waiting, in round robin order, linked through
+    // connection->sequencedNext. The head has the turn. Only touched by the
+    // sequencer thread, like held and barrier.
+    connection_t * roundHead;
+    connection_t * roundTail;
+    // Messages waiting in senders' queues
+    int held;
+    // Taken off the ingest queue but waiting for held messages to go first
+    fanout_node_t * barrier;
+    // Messages published. Only written by the sequencer.
+    uint64_t published;
+    bool stopping;
+    // Sleep/wake handshake. Producers wake the sequencer when it is
+    // sleeping; writers delivering messages only when it is also waiting for
+    // room in the window.
+    int sleeping;
+    int waitingForRoom;
+    int eventFd;
+} fanout_sequencer_t;
+
+static fanout_writer_t writers[FANOUT_MAX_WRITERS];
+static int writerCount = 0;
+static fanout_deliver_t deliverFunction = NULL;
+static bool fanoutStopping = false;
+static bool sequenced = false;
+static fanout_sequencer_t sequencer;
+
+static fanout_node_t stub;
+// Most recently appended node
+static fanout_node_t * logTail = &stub;
+
+// Guards shard assignment (assigned[], connection->shard and
+// connection->leaving). Only taken on joins, leaves and moves.
+static pthread_mutex_t membershipLock = PTHREAD_MUTEX_INITIALIZER;
+static int assigned[FANOUT_MAX_WRITERS];
+
+// Fanout_Drain callers wait for drainsDone to reach their ticket
+static pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drainCond;
+static uint64_t drainsIssued = 0;
+static uint64_t drainsDone = 0;
+
+static uint64_t messageCount = 0;
+static uint64_t rebalanceCount = 0;
+static uint64_t lastRecipientNsTotal = 0;
+static uint64_t lastRecipientNsMax = 0;
+static uint64_t laneQueued[FANOUT_LANES];
+static uint64_t laneQueuedNsTotal[FANOUT_LANES];
+static uint64_t laneQueuedNsMax[FANOUT_LANES];
+static uint64_t batchCount = 0;
+static uint64_t batchedCount = 0;
+static uint64_t windowWaits = 0;
+
+//********************************************
+static uint64_t Now_Ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+//********************************************
+// Make a node with one reference per writer
+static fanout_node_t * New_Node(int type, int length)
+{
+    fanout_node_t * node =
+        (fanout_node_t *)malloc(sizeof(fanout_node_t) + length);
+    if (NULL == node)
+    {
+        return NULL;
+    }
+    node->next = NULL;
+    node->refCount = writerCount;
+    node->pending = writerCount;
+    node->type = type;
+    node->connection = NULL;
+    node->shard = -1;
+    node->toShard = -1;
+    node->decided = 0;
+    node->doneBy = 0;
+    node->submitNs = 0;
+    node->traceId = 0;
+    node->hits = NULL;
+    node->length = length;
+    node->compressedLength = 0;
+    return node;
+}
+
+//********************************************
+// Wake a writer or the sequencer if it ran out of work
+static void Wake_Thread(int * sleeping, int eventFd)
+{
+    uint64_t one = 1;
+
+    if (__atomic_load_n(sleeping, __ATOMIC_SEQ_CST) &&
+        sizeof(one) != write(eventFd, &one, sizeof(one)))
+    {
+        // Counter is saturated, so it is already signalled
+    }
+}
+
+//********************************************
+static void Wake_Writer(fanout_writer_t * writer)
+{
+    Wake_Thread(&(writer->sleeping), writer->eventFd);
+}
+
+//********************************************
+// Add a chain of nodes, first to last, to the log and wake any writer that
+// ran out of work
+static void Append_Nodes(fanout_node_t * first, fanout_node_t * last)
+{
+    fanout_node_t * previous;
+    int index;
+
+    previous = __atomic_exchange_n(&logTail, last, __ATOMIC_SEQ_CST);
+    // Between the exchange and this store, writers just see the log end at
+    // previous and wait
+    __atomic_store_n(&(previous->next), first, __ATOMIC_SEQ_CST);
+
+    for (index = 0; index < writerCount; ++index)
+    {
+        Wake_Writer(&(writers[index]));
+    }
+}
+
+//********************************************
+// Hand a node from a producer to the sequencer, or straight to the log
+static void Ingest_Node(fanout_node_t * node)
+{
+    if (sequenced)
+    {
+        Mpsc_Push(&(sequencer.ingest), &(node->ingest));
+        Wake_Thread(&(sequencer.sleeping), sequencer.eventFd);
+    }
+    else
+    {
+        Append_Nodes(node, node);
+    }
+}
+
+//********************************************
+// Add to a lane's queueing latency stats
+static void Record_Queued(int lane, uint64_t submitNs)
+{
+    uint64_t latency = Now_Ns() - submitNs;
+    uint64_t worst = __atomic_load_n(&(laneQueuedNsMax[lane]),
+                                     __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&(laneQueued[lane]), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(laneQueuedNsTotal[lane]), latency, __ATOMIC_RELAXED);
+    while (latency > worst && !__atomic_compare_exchange_n(
+        &(laneQueuedNsMax[lane]), &worst, latency, false, __ATOMIC_RELAXED,
+        __ATOMIC_RELAXED))
+    {
+    }
+}
+
+//********************************************
+// Deliver everything on a writer's control lane to its shard
+static void Run_Control(fanout_writer_t * writer)
+{
+    fanout_control_t * frames = __atomic_exchange_n(&(writer->control), NULL,
+                                                    __ATOMIC_ACQUIRE);
+    fanout_control_t * ordered = NULL;
+    fanout_control_t * frame;
+    int index;
+
+    // Pushed newest first
+    while (NULL != frames)
+    {
+        frame = frames;
+        frames = frame->next;
+        frame->next = ordered;
+        ordered = frame;
+    }
+    while (NULL != ordered)
+    {
+        frame = ordered;
+        ordered = frame->next;
+        Record_Queued(FANOUT_LANE_CONTROL, frame->submitNs);
+        for (index = 0; index < writer->memberCount; ++index)
+        {
+            deliverFunction(writer->members[index], frame->data,
+                            frame->length, NULL, 0, NULL, 0);
+        }
+        free(frame);
+    }
+}
+
+//********************************************
+// Let a sender waiting on FANOUT_MAX_IN_FLIGHT continue. Same limit as
+// Fanout_Submit waits on, so one message done is enough.
+static void Message_Done(connection_t * sender)
+{
+    if (__atomic_sub_fetch(&(sender->inFlight), 1, __ATOMIC_SEQ_CST) <=
+        FANOUT_MAX_IN_FLIGHT &&
+        __atomic_load_n(&(sender->inFlightWaiting), __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&(sender->inFlightLock));
+        pthread_cond_signal(&(sender->inFlightCond));
+        pthread_mutex_unlock(&(sender->inFlightLock));
+    }
+}
+
+//********************************************
+// Drop one writer's reference to a node it has moved past
+static void Release_Node(fanout_node_t * node)
+{
+    if (FANOUT_STUB != node->type &&
+        0 == __atomic_sub_fetch(&(node->refCount), 1, __ATOMIC_ACQ_REL))
+    {
+        free(node);
+    }
+}
+
+//********************************************
+// Note that one writer has processed a node. The last one to do so drops
+// the references the entry holds; nothing reads node->connection after that.
+static void Finish_Node(fanout_node_t * node)
+{
+    uint64_t latency;
+    uint64_t worst;
+
+    if (0 != __atomic_sub_fetch(&(node->pending), 1, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+
+    if (FANOUT_MESSAGE == node->type)
+    {
+        // Last shard is done with it: that's the last recipient's latency
+        latency = Now_Ns() - node->submitNs;
+        __atomic_add_fetch(&lastRecipientNsTotal, latency, __ATOMIC_RELAXED);
+        worst = __atomic_load_n(&lastRecipientNsMax, __ATOMIC_RELAXED);
+        while (latency > worst && !__atomic_compare_exchange_n(
+            &lastRecipientNsMax, &worst, latency, false, __ATOMIC_RELAXED,
+            __ATOMIC_RELAXED))
+        {
+        }
+        __atomic_add_fetch(&messageCount, 1, __ATOMIC_RELAXED);
+        if (node->traceId)
+        {
+            uint64_t now = Trace_Now();
+            Trace_Event(TRACE_MESSAGE_END, node->traceId, now, now, 0);
+        }
+        if (NULL != node->connection)
+        {
+            Message_Done(node->connection);
+            Release_Connection(node->connection);
+        }
+    }
+    else if (FANOUT_DRAIN == node->type)
+    {
+        // Every writer got here, so everything before it is delivered
+        pthread_mutex_lock(&drainLock);
+        if (node->drainTicket > drainsDone)
+        {
+            drainsDone = node->drainTicket;
+        }
+        pthread_cond_broadcast(&drainCond);
+        pthread_mutex_unlock(&drainLock);
+    }
+    else if (FANOUT_LEAVE == node->type)
+    {
+        Release_Connection(node->connection);
+    }
+}
+
+//********************************************
+// Add a connection to a writer's shard
+static void Add_Member(fanout_writer_t * writer, connection_t * connection)
+{
+    if (writer->memberCount == writer->memberCapacity)
+    {
+        int capacity = writer->memberCapacity ? writer->memberCapacity * 2 : 64;
+        connection_t ** members = (connection_t **)realloc(writer->members,
+            sizeof(connection_t *) * capacity);
+        if (NULL == members)
+        {
+            // Nothing sensible to do but stop delivering to it
+            return;
+        }
+        writer->members = members;
+        writer->memberCapacity = capacity;
+    }
+    connection->shardSlot = writer->memberCount;
+    writer->members[writer->memberCount++] = connection;
+}
+
+//********************************************
+// Take a connection out of a writer's shard. O(1): the last member fills the
+// hole.
+static void Remove_Member(fanout_writer_t * writer, connection_t * connection)
+{
+    int slot = connection->shardSlot;
+
+    if (slot < 0 || slot >= writer->memberCount ||
+        writer->members[slot] != connection)
+    {
+        return;
+    }
+    writer->members[slot] = writer->members[--(writer->memberCount)];
+    writer->members[slot]->shardSlot = slot;
+    connection->shardSlot = -1;
+}
+
+//********************************************
+// Act on one log entry
+static void Process_Node(fanout_writer_t * writer, fanout_node_t * node)
+{
+    connection_t * connection;
+    const char * message;
+    uint64_t shardStart = 0;
+    int index;
+
+    // Control frames queued before a membership change or drain go out
+    // first: the writer may have last looked at its lane before the entry
+    // was appended, and a leaving connection must still get them
+    if (FANOUT_MESSAGE != node->type)
+    {
+        Run_Control(writer);
+    }
+
+    switch (node->type)
+    {
+    case FANOUT_MESSAGE:
+        if (node->traceId)
+        {
+            shardStart = Trace_Now();
+            Trace_Event(TRACE_QUEUE, node->traceId, node->submitNs, shardStart,
+                        writer->index);
+        }
+        // The message follows the hits, if there are any
+        message = node->data + (node->hits ? sizeof(filter_hits_t) : 0);
+        for (index = 0; index < writer->memberCount; ++index)
+        {
+            // Control frames don't wait for the rest of the shard
+            if (NULL != __atomic_load_n(&(writer->control), __ATOMIC_RELAXED))
+            {
+                Run_Control(writer);
+            }
+            deliverFunction(writer->members[index], message, node->length,
+                            node->compressedLength ? message + node->length :
+                            NULL, node->compressedLength, node->hits,
+                            node->traceId);
+        }
+        if (node->traceId)
+        {
+            Trace_Event(TRACE_SHARD, node->traceId, shardStart, Trace_Now(),
+                        writer->index);
+        }
+        break;
+    case FANOUT_JOIN:
+        if (node->shard == writer->index)
+        {
+            Add_Member(writer, node->connection);
+        }
+        break;
+    case FANOUT_LEAVE:
+        // A move in flight only switches connection->shard between its from
+        // and to shards, and both are past the move if they got here, so
+        // only the owner finds its own index
+        if (__atomic_load_n(&(node->connection->shard), __ATOMIC_RELAXED) ==
+            writer->index)
+        {
+            Remove_Member(writer, node->connection);
+            Release_Connection(node->connection);
+        }
+        break;
+    case FANOUT_REBALANCE:
+        if (node->shard == writer->index)
+        {
+            // Pick the newest member that isn't on its way out
+            pthread_mutex_lock(&membershipLock);
+            for (index = writer->memberCount - 1; index >= 0; --index)
+            {
+                connection = writer->members[index];
+                if (!connection->leaving)
+                {
+                    Remove_Member(writer, connection);
+                    __atomic_store_n(&(connection->shard), node->toShard,
+                                     __ATOMIC_RELAXED);
+                    node->connection = connection;
+                    break;
+                }
+            }
+            if (NULL == node->connection)
+            {
+                // Nothing to move; undo the accounting done at submit
+                ++assigned[node->shard];
+                --assigned[node->toShard];
+            }
+            pthread_mutex_unlock(&membershipLock);
+            __atomic_store_n(&(node->decided), 1, __ATOMIC_RELEASE);
+        }
+        else if (node->toShard == writer->index)
+        {
+            // The target must not write to the moved connection before the
+            // from shard is done with the messages ahead of this entry. Moves
+            // are rare, so just poll. Other shards don't care which
+            // connection moves, so they go straight on.
+            struct timespec pause = { 0, 50000 };
+            while (!__atomic_load_n(&(node->decided), __ATOMIC_ACQUIRE))
+            {
+                nanosleep(&pause, NULL);
+            }
+            if (NULL != node->connection)
+            {
+                Add_Member(writer, node->connection);
+            }
+        }
+        break;
+    }
+}
+
+//********************************************
+// Process a node and mark it done for this writer
+static void Run_Node(fanout_writer_t * writer, fanout_node_t * node)
+{
+    if (FANOUT_MESSAGE == node->type)
+    {
+        Record_Queued(FANOUT_LANE_BULK, node->submitNs);
+    }
+    Process_Node(writer, node);
+    __atomic_fetch_or(&(node->doneBy), 1ULL << writer->index,
+                      __ATOMIC_RELAXED);
+    if (sequenced && FANOUT_MESSAGE == node->type)
+    {
+        // May be room for the sequencer to publish another
+        __atomic_add_fetch(&(writer->delivered), 1, __ATOMIC_SEQ_CST);
+        Wake_Thread(&(sequencer.waitingForRoom), sequencer.eventFd);
+    }
+    Finish_Node(node);
+}
+
+//********************************************
+// Bytes a sender's turn adds to its deficit
+static int Quantum(connection_t * sender)
+{
+    return FANOUT_QUANTUM * __atomic_load_n(&(sender->weight),
+                                            __ATOMIC_RELAXED);
+}
+
+//********************************************
+// Pick the next node to deliver, starting from first, the oldest this
+// writer hasn't done. Anything but a message goes in log order, and so does
+// everything when the sequencer has already ordered the log. Otherwise each
+// sender's oldest message in the lookahead is a candidate, and deficit round
+// robin picks between them.
+static fanout_node_t * Choose_Node(fanout_writer_t * writer,
+                                   fanout_node_t * first)
+{
+    uint64_t myBit = 1ULL << writer->index;
+    fanout_node_t * heads[FANOUT_LOOKAHEAD];
+    fanout_node_t * node;
+    fanout_flow_t * flow;
+    bool currentKept = false;
+    int current = -1;
+    int headCount = 0;
+    int scanned = 0;
+    int kept = 0;
+    int index;
+    int head;
+
+    if (sequenced || FANOUT_MESSAGE != first->type)
+    {
+        return first;
+    }
+    // Messages can't be delivered ahead of a join, leave or drain, so the
+    // lookahead stops at the first one
+    for (node = first; NULL != node && scanned < FANOUT_LOOKAHEAD;
+         node = __atomic_load_n(&(node->next), __ATOMIC_ACQUIRE), ++scanned)
+    {
+        if (__atomic_load_n(&(node->doneBy), __ATOMIC_RELAXED) & myBit)
+        {
+            continue;
+        }
+        if (FANOUT_MESSAGE != node->type)
+        {
+            break;
+        }
+        for (head = 0; head < headCount &&
+             heads[head]->connection != node->connection; ++head)
+        {
+        }
+        if (head == headCount)
+        {
+            heads[headCount++] = node;
+        }
+    }
+    if (1 == headCount)
+    {
+        writer->flowCount = 0;
+        return first;
+    }
+
+    // Senders with nothing waiting drop out, and their deficits with them.
+    // The rest keep their places; new ones join the end of the round.
+    for (index = 0; index < writer->flowCount; ++index)
+    {
+        flow = &(writer->flows[index]);
+        for (head = 0; head < headCount &&
+             heads[head]->connection != flow->sender; ++head)
+        {
+        }
+        if (head == headCount)
+        {
+            continue;
+        }
+        // The turn stays with its sender, or passes to the next one left
+        if (index >= writer->currentFlow && -1 == current)
+        {
+            current = kept;
+            currentKept = (index == writer->currentFlow);
+        }
+        writer->flows[kept++] = *flow;
+    }
+    for (head = 0; head < headCount; ++head)
+    {
+        for (index = 0; index < kept &&
+             writer->flows[index].sender != heads[head]->connection; ++index)
+        {
+        }
+        if (index == kept)
+        {
+            writer->flows[kept].sender = heads[head]->connection;
+            writer->flows[kept++].deficit = 0;
+        }
+    }
+    writer->flowCount = kept;
+    writer->currentFlow = (-1 == current) ? 0 : current;
+    if (!currentKept)
+    {
+        writer->flows[writer->currentFlow].deficit +=
+            Quantum(writer->flows[writer->currentFlow].sender);
+    }
+
+    while (true)
+    {
+        flow = &(writer->flows[writer->currentFlow]);
+        for (head = 0; heads[head]->connection != flow->sender; ++head)
+        {
+        }
+        if (flow->deficit >= heads[head]->length)
+        {
+            flow->deficit -= heads[head]->length;
+            return heads[head];
+        }
+        writer->currentFlow = (writer->currentFlow + 1) % writer->flowCount;
+        writer->flows[writer->currentFlow].deficit +=
+            Quantum(writer->flows[writer->currentFlow].sender);
+    }
+}
+
+//********************************************
+// Queue a message behind the rest of its sender's. A sender with nothing
+// held joins the end of the round.
+static void Hold_Message(fanout_node_t * node)
+{
+    connection_t * sender = node->connection;
+
+    node->next = NULL;
+    if (NULL == sender->sequencedHead)
+    {
+        sender->sequencedHead = node;
+        sender->sequencedDeficit = Quantum(sender);
+        sender->sequencedNext = NULL;
+        if (NULL == sequencer.roundTail)
+        {
+            sequencer.roundHead = sender;
+        }
+        else
+        {
+            sequencer.roundTail->sequencedNext = sender;
+        }
+        sequencer.roundTail = sender;
+    }
+    else
+    {
+        sender->sequencedTail->next = node;
+    }
+    sender->sequencedTail = node;
+    ++sequencer.held;
+}
+
+//********************************************
+// Take the next held message by deficit round robin. There must be one.
+static fanout_node_t * Next_Held(void)
+{
+    connection_t * sender;
+    fanout_node_t * node;
+
+    while (true)
+    {
+        sender = sequencer.roundHead;
+        node = sender->sequencedHead;
+        if (sender->sequencedDeficit >= node->length)
+        {
+            break;
+        }
+        // Used up its turn: to the back of the round, with another quantum
+        // for next time
+        sender->sequencedDeficit += Quantum(sender);
+        if (sender != sequencer.roundTail)
+        {
+            sequencer.roundHead = sender->sequencedNext;
+            sender->sequencedNext = NULL;
+            sequencer.roundTail->sequencedNext = sender;
+            sequencer.roundTail = sender;
+        }
+    }
+
+    sender->sequencedDeficit -= node->length;
+    sender->sequencedHead = node->next;
+    node->next = NULL;
+    if (NULL == sender->sequencedHead)
+    {
+        // Nothing left, so it drops out of the round, deficit and all
+        sender->sequencedTail = NULL;
+        sequencer.roundHead = sender->sequencedNext;
+        if (NULL == sequencer.roundHead)
+        {
+            sequencer.roundTail = NULL;
+        }
+        sender->sequencedNext = NULL;
+    }
+    --sequencer.held;
+    return node;
+}
+
+//********************************************
+// Return how many published messages the writer furthest along has yet to
+// deliver
+static int Window_Used(void)
+{
+    uint64_t most = 0;
+    uint64_t delivered;
+    int index;
+
+    for (index = 0; index < writerCount; ++index)
+    {
+        delivered = __atomic_load_n(&(writers[index].delivered),
+                                    __ATOMIC_SEQ_CST);
+        if (delivered > most)
+        {
+            most = delivered;
+        }
+    }
+    return (int)(sequencer.published - most);
+}
+
+//********************************************
+// Publish as many held messages as the window has room for, then the
+// barrier if nothing is held any more, all as one chain
+// Return the number of nodes published
+static int Publish_Batch(void)
+{
+    fanout_node_t * first = NULL;
+    fanout_node_t * last = NULL;
+    fanout_node_t * node;
+    int room = FANOUT_SEQUENCER_WINDOW - Window_Used();
+    int messages = 0;
+    int count = 0;
+
+    while (messages < room && sequencer.held > 0)
+    {
+        node = Next_Held();
+        if (NULL == first)
+        {
+            first = node;
+        }
+        else
+        {
+            last->next = node;
+        }
+        last = node;
+        ++messages;
+    }
+    count = messages;
+    if (0 == sequencer.held && NULL != sequencer.barrier)
+    {
+        node = sequencer.barrier;
+        sequencer.barrier = NULL;
+        if (NULL == first)
+        {
+            first = node;
+        }
+        else
+        {
+            last->next = node;
+        }
+        last = node;
+        ++count;
+        if (FANOUT_MESSAGE == node->type)
+        {
+            ++messages;
+        }
+    }
+    if (0 == count)
+    {
+        return 0;
+    }
+
+    // Counted before the writers can deliver any of them
+    __atomic_store_n(&(sequencer.published), sequencer.published + messages,
+                     __ATOMIC_SEQ_CST);
+    Append_Nodes(first, last);
+    if (messages)
+    {
+        __atomic_add_fetch(&batchCount, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&batchedCount, messages, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+//********************************************
+static void * ThreadFanoutSequencer(void * arg)
+{
+    mpsc_link_t * link;
+    fanout_node_t * node;
+    struct pollfd waitFor;
+    uint64_t count;
+
+    (void)arg;
+    waitFor.fd = sequencer.eventFd;
+    waitFor.events = POLLIN;
+
+    while (true)
+    {
+        // Take in everything that has arrived, up to the first barrier
+        while (NULL == sequencer.barrier &&
+               NULL != (link = Mpsc_Pop(&(sequencer.ingest))))
+        {
+            node = MPSC_ENTRY(link, fanout_node_t, ingest);
+            if (FANOUT_MESSAGE == node->type && NULL != node->connection)
+            {
+                Hold_Message(node);
+            }
+            else
+            {
+                sequencer.barrier = node;
+            }
+        }
+        if (0 != Publish_Batch())
+        {
+            continue;
+        }
+
+        if (NULL == sequencer.barrier && 0 == sequencer.held &&
+            Mpsc_Empty(&(sequencer.ingest)) &&
+            __atomic_load_n(&(sequencer.stopping), __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+
+        // Out of work, or out of room. Announce we're going to sleep, then
+        // look again so a producer or writer in between is sure to see the
+        // flag.
+        __atomic_store_n(&(sequencer.waitingForRoom), sequencer.held > 0,
+                         __ATOMIC_SEQ_CST);
+        __atomic_store_n(&(sequencer.sleeping), 1, __ATOMIC_SEQ_CST);
+        if ((NULL != sequencer.barrier || Mpsc_Empty(&(sequencer.ingest))) &&
+            (0 == sequencer.held ||
+             Window_Used() >= FANOUT_SEQUENCER_WINDOW) &&
+            !__atomic_load_n(&(sequencer.stopping), __ATOMIC_SEQ_CST))
+        {
+            if (sequencer.held > 0)
+            {
+                __atomic_add_fetch(&windowWaits, 1, __ATOMIC_RELAXED);
+            }
+            if (-1 == poll(&waitFor, 1, -1) && EINTR != errno)
+            {
+                break;
+            }
+            if (sizeof(count) != read(sequencer.eventFd, &count, sizeof(count)))
+            {
+                // Spurious wakeup, nothing to reset
+            }
+        }
+        __atomic_store_n(&(sequencer.sleeping), 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&(sequencer.waitingForRoom), 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+//********************************************
+static void * ThreadFanoutWriter(void * arg)
+{
+    fanout_writer_t * writer = (fanout_writer_t *)arg;
+    fanout_node_t * next;
+    struct pollfd waitFor;
+    uint64_t count;
+    uint64_t myBit = 1ULL << writer->index;
+
+    waitFor.fd = writer->eventFd;
+    waitFor.events = POLLIN;
+    Trace_Reserve_Thread(FANOUT_TRACE_EVENTS);
+
+    while (true)
+    {
+        if (NULL != __atomic_load_n(&(writer->control), __ATOMIC_ACQUIRE))
+        {
+            Run_Control(writer);
+        }
+        // Move past everything already delivered out of order
+        while (NULL != (next = __atomic_load_n(&(writer->cursor->next),
+                                               __ATOMIC_ACQUIRE)) &&
+               (__atomic_load_n(&(next->doneBy), __ATOMIC_RELAXED) & myBit))
+        {
+            Release_Node(writer->cursor);
+            writer->cursor = next;
+        }
+        if (NULL != next)
+        {
+            Run_Node(writer, Choose_Node(writer, next));
+            continue;
+        }
+
+        if (__atomic_load_n(&fanoutStopping, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+
+        // Out of work. Announce we're going to sleep, then look again so a
+        // producer appending in between is sure to see the flag.
+        __atomic_store_n(&(writer->sleeping), 1, __ATOMIC_SEQ_CST);
+        if (NULL == __atomic_load_n(&(writer->cursor->next), __ATOMIC_SEQ_CST)
+            && NULL == __atomic_load_n(&(writer->control), __ATOMIC_SEQ_CST)
+            && !__atomic_load_n(&fanoutStopping, __ATOMIC_SEQ_CST))
+        {
+            if (-1 == poll(&waitFor, 1, -1) && EINTR != errno)
+            {
+                break;
+            }
+            if (sizeof(count) != read(writer->eventFd, &count, sizeof(count)))
+            {
+                // Spurious wakeup, nothing to reset
+            }
+        }
+        __atomic_store_n(&(writer->sleeping), 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+//********************************************
+int Start_Fanout(int count, bool sequence, fanout_deliver_t deliver)
+{
+    int index;
+    pthread_condattr_t condAttributes;
+
+    if (count < 1 || count > FANOUT_MAX_WRITERS)
+    {
+        return 1;
+    }
+
+    deliverFunction = deliver;
+    writerCount = count;
+    sequenced = sequence;
+    fanoutStopping = false;
+    stub.next = NULL;
+    stub.type = FANOUT_STUB;
+    logTail = &stub;
+
+    // Monotonic, so a clock change can't stretch a drain's timeout
+    pthread_condattr_init(&condAttributes);
+    pthread_condattr_setclock(&condAttributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&drainCond, &condAttributes);
+    pthread_condattr_destroy(&condAttributes);
+
+    for (index = 0; index < writerCount; ++index)
+    {
+        writers[index].index = index;
+        writers[index].cursor = &stub;
+        writers[index].members = NULL;
+        writers[index].memberCount = 0;
+        writers[index].memberCapacity = 0;
+        writers[index].flowCount = 0;
+        writers[index].currentFlow = 0;
+        writers[index].control = NULL;
+        writers[index].delivered = 0;
+        writers[index].sleeping = 0;
+        writers[index].eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        assigned[index] = 0;
+        if (-1 == writers[index].eventFd)
+        {
+            return 1;
+        }
+    }
+    for (index = 0; index < writerCount; ++index)
+    {
+        if (0 != pthread_create(&(writers[index].thread), NULL,
+                                ThreadFanoutWriter, &(writers[index])))
+        {
+            return 1;
+        }
+    }
+
+    if (sequenced)
+    {
+        Init_Mpsc_Queue(&(sequencer.ingest));
+        sequencer.roundHead = NULL;
+        sequencer.roundTail = NULL;
+        sequencer.held = 0;
+        sequencer.barrier = NULL;
+        sequencer.published = 0;
+        sequencer.stopping = false;
+        sequencer.sleeping = 0;
+        sequencer.waitingForRoom = 0;
+        sequencer.eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (-1 == sequencer.eventFd ||
+            0 != pthread_create(&(sequencer.thread), NULL,
+                                ThreadFanoutSequencer, NULL))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//********************************************
+void Stop_Fanout(void)
+{
+    int index;
+    uint64_t one = 1;
+
+    // The sequencer publishes everything it has first, which may mean
+    // waiting for the writers to make room
+    if (sequenced)
+    {
+        __atomic_store_n(&(sequencer.stopping), true, __ATOMIC_SEQ_CST);
+        if (sizeof(one) != write(sequencer.eventFd, &one, sizeof(one)))
+        {
+            // Already signalled
+        }
+        pthread_join(sequencer.thread, NULL);
+        close(sequencer.eventFd);
+    }
+    __atomic_store_n(&fanoutStopping, true, __ATOMIC_SEQ_CST);
+    for (index = 0; index < writerCount; ++index)
+    {
+        if (sizeof(one) != write(writers[index].eventFd, &one, sizeof(one)))
+        {
+            // Already signalled
+        }
+    }
+    for (index = 0; index < writerCount; ++index)
+    {
+        pthread_join(writers[index].thread, NULL);
+    }
+    // Each writer stopped on the last node without releasing it
+    for (index = 0; index < writerCount; ++index)
+    {
+        Release_Node(writers[index].cursor);
+        // Frames that came in after the writer's last look
+        Run_Control(&(writers[index]));
+        close(writers[index].eventFd);
+        free(writers[index].members);
+    }
+    writerCount = 0;
+}
+
+//********************************************
+int Fanout_Join(connection_t * connection)
+{
+    fanout_node_t * node = New_Node(FANOUT_JOIN, 0);
+    int index;
+    int smallest = 0;
+
+    if (NULL == node)
+    {
+        return 1;
+    }
+
+    pthread_mutex_lock(&membershipLock);
+    for (index = 1; index < writerCount; ++index)
+    {
+        if (assigned[index] < assigned[smallest])
+        {
+            smallest = index;
+        }
+    }
+    ++assigned[smallest];
+    connection->shard = smallest;
+    connection->shardSlot = -1;
+    connection->leaving = false;
+    pthread_mutex_unlock(&membershipLock);
+
+    // The shard's reference
+    Retain_Connection(connection);
+    node->connection = connection;
+    node->shard = smallest;
+    Ingest_Node(node);
+    return 0;
+}
+
+//********************************************
+int Fanout_Leave(connection_t * connection)
+{
+    fanout_node_t * node = New_Node(FANOUT_LEAVE, 0);
+    fanout_node_t * rebalance = New_Node(FANOUT_REBALANCE, 0);
+    int index;
+    int largest = 0;
+    int smallest = 0;
+
+    if (NULL == node)
+    {
+        free(rebalance);
+        return 1;
+    }
+
+    pthread_mutex_lock(&membershipLock);
+    --assigned[connection->shard];
+    connection->leaving = true;
+
+    // Even the shards out if this leave made them lopsided: more than one
+    // apart, and more than an eighth of the biggest
+    for (index = 1; index < writerCount; ++index)
+    {
+        if (assigned[index] > assigned[largest])
+        {
+            largest = index;
+        }
+        if (assigned[index] < assigned[smallest])
+        {
+            smallest = index;
+        }
+    }
+    if (NULL != rebalance && assigned[largest] - assigned[smallest] > 1 &&
+        assigned[largest] - assigned[smallest] > assigned[largest] / 8)
+    {
+        --assigned[largest];
+        ++assigned[smallest];
+        rebalance->shard = largest;
+        rebalance->toShard = smallest;
+    }
+    pthread_mutex_unlock(&membershipLock);
+
+    // Keeps the connection readable by every writer until all of them are
+    // past this entry
+    Retain_Connection(connection);
+    node->connection = connection;
+    Ingest_Node(node);
+
+    if (NULL != rebalance && -1 != rebalance->shard)
+    {
+        __atomic_add_fetch(&rebalanceCount, 1, __ATOMIC_RELAXED);
+        Ingest_Node(rebalance);
+    }
+    else
+    {
+        free(rebalance);
+    }
+    return 0;
+}
+
+//********************************************
+int Fanout_Submit(connection_t * sender, const char * message, int length,
+                  const char * compressed, int compressedLength,
+                  const filter_hits_t * hits, uint32_t traceId)
+{
+    int hitsSize = hits ? sizeof(filter_hits_t) : 0;
+    fanout_node_t * node;
+
+    // Too much of this sender's output still queued: wait for some of it to
+    // go out, which pushes back on the client through TCP
+    if (NULL != sender &&
+        __atomic_add_fetch(&(sender->inFlight), 1, __ATOMIC_SEQ_CST) >
+        FANOUT_MAX_IN_FLIGHT)
+    {
+        pthread_mutex_lock(&(sender->inFlightLock));
+        __atomic_store_n(&(sender->inFlightWaiting), 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&(sender->inFlight), __ATOMIC_SEQ_CST) >
+            FANOUT_MAX_IN_FLIGHT)
+        {
+            pthread_cond_wait(&(sender->inFlightCond),
+                              &(sender->inFlightLock));
+        }
+        __atomic_store_n(&(sender->inFlightWaiting), 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&(sender->inFlightLock));
+    }
+
+    node = New_Node(FANOUT_MESSAGE, hitsSize + length + compressedLength);
+    if (NULL == node)
+    {
+        if (NULL != sender)
+        {
+            __atomic_sub_fetch(&(sender->inFlight), 1, __ATOMIC_SEQ_CST);
+        }
+        return 1;
+    }
+    if (NULL != sender)
+    {
+        Retain_Connection(sender);
+    }
+    node->connection = sender;
+    node->submitNs = Now_Ns();
+    node->traceId = traceId;
+    node->length = length;
+    if (hits)
+    {
+        node->hits = (filter_hits_t *)node->data;
+        memcpy(node->hits, hits, hitsSize);
+    }
+    memcpy(node->data + hitsSize, message, length);
+    node->compressedLength = compressedLength;
+    if (compressedLength)
+    {
+        memcpy(node->data + hitsSize + length, compressed, compressedLength);
+    }
+    Ingest_Node(node);
+    return 0;
+}
+
+//********************************************
+int Fanout_Set_Weight(connection_t * connection, int weight)
+{
+    if (weight < 1 || weight > FANOUT_MAX_WEIGHT)
+    {
+        return 1;
+    }
+    __atomic_store_n(&(connection->weight), weight, __ATOMIC_RELAXED);
+    return 0;
+}
+
+//********************************************
+int Fanout_Control(const char * message, int length)
+{
+    fanout_control_t * frame;
+    int index;
+    int result = 0;
+
+    for (index = 0; index < writerCount; ++index)
+    {
+        frame = malloc(sizeof(fanout_control_t) + length);
+        if (NULL == frame)
+        {
+            result = 1;
+            continue;
+        }
+        frame->submitNs = Now_Ns();
+        frame->length = length;
+        memcpy(frame->data, message, length);
+        frame->next = __atomic_load_n(&(writers[index].control),
+                                      __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&(writers[index].control),
+                                            &(frame->next), frame, true,
+                                            __ATOMIC_SEQ_CST,
+                                            __ATOMIC_RELAXED))
+        {
+        }
+        Wake_Writer(&(writers[index]));
+    }
+    return result;
+}
+
+//********************************************
+int Fanout_Drain(int timeoutMs)
+{
+    fanout_node_t * node = New_Node(FANOUT_DRAIN, 0);
+    struct timespec deadline;
+    uint64_t ticket;
+    int result = 0;
+
+    if (NULL == node)
+    {
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+    if (deadline.tv_nsec >= (long)NS_PER_SEC)
+    {
+        deadline.tv_nsec -= NS_PER_SEC;
+        ++deadline.tv_sec;
+    }
+
+    // Tickets are appended in order under the lock, so they finish in order
+    pthread_mutex_lock(&drainLock);
+    ticket = ++drainsIssued;
+    node->drainTicket = ticket;
+    Ingest_Node(node);
+    while (drainsDone < ticket && ETIMEDOUT != result)
+    {
+        result = pthread_cond_timedwait(&drainCond, &drainLock, &deadline);
+    }
+    result = (drainsDone < ticket) ? 1 : 0;
+    pthread_mutex_unlock(&drainLock);
+    return result;
+}
+
+//********************************************
+void Get_Fanout_Stats(fanout_stats_t * stats)
+{
+    int index;
+
+    stats->writerCount = writerCount;
+    pthread_mutex_lock(&membershipLock);
+    for (index = 0; index < writerCount; ++index)
+    {
+        stats->members[index] = assigned[index];
+    }
+    pthread_mutex_unlock(&membershipLock);
+    stats->messages = __atomic_load_n(&messageCount, __ATOMIC_RELAXED);
+    stats->rebalances = __atomic_load_n(&rebalanceCount, __ATOMIC_RELAXED);
+    stats->sequenced = sequenced;
+    stats->batches = __atomic_load_n(&batchCount, __ATOMIC_RELAXED);
+    stats->batched = __atomic_load_n(&batchedCount, __ATOMIC_RELAXED);
+    stats->windowWaits = __atomic_load_n(&windowWaits, __ATOMIC_RELAXED);
+    stats->lastRecipientNsTotal =
+        __atomic_load_n(&lastRecipientNsTotal, __ATOMIC_RELAXED);
+    stats->lastRecipientNsMax =
+        __atomic_load_n(&lastRecipientNsMax, __ATOMIC_RELAXED);
+    for (index = 0; index < FANOUT_LANES; ++index)
+    {
+        stats->laneQueued[index] =
+            __atomic_load_n(&(laneQueued[index]), __ATOMIC_RELAXED);
+        stats->laneQueuedNsTotal[index] =
+            __atomic_load_n(&(laneQueuedNsTotal[index]), __ATOMIC_RELAXED);
+        stats->laneQueuedNsMax[index] =
+            __atomic_load_n(&(laneQueuedNsMax[index]), __ATOMIC_RELAXED);
+    }
+}
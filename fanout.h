@@ -0,0 +1,171 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      fanout.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Parallel broadcast. Recipients are split into shards, each owned by one
+ *    writer thread. A message is handed off by appending it to a single
+ *    lock-free log that every writer walks; each writer delivers it to the
+ *    recipients in its shard. Joins, leaves and moves between shards are
+ *    entries in the same log, so every writer sees them at the same point
+ *    relative to the messages and shard membership needs no locking.
+ *
+ *    Each writer has two lanes. The control lane carries the server's own
+ *    frames, such as the shutdown goodbye, and is checked between every
+ *    delivery, so a control frame never waits behind queued chat. The bulk
+ *    lane is the log.
+ *
+ *    By default a single sequencer thread stands between the senders and
+ *    the log. Senders hand it their messages through a lock-free queue, and
+ *    it publishes them to the log in batches, taking turns between senders
+ *    by deficit round robin so one heavy talker can't keep everyone else's
+ *    chat waiting behind its own. A sender's weight sets how big its turns
+ *    are, so some can be given a bigger share than others. Writers deliver
+ *    in log order, so every recipient gets the same messages in the same
+ *    order.
+ *
+ *    Without the sequencer, senders append to the log themselves and each
+ *    writer takes turns between senders over the next stretch of the log.
+ *    Each sender's messages still go out in order, and nothing moves past a
+ *    join, leave or drain, but recipients in different shards may see two
+ *    senders' messages in different orders.
+ *
+ ************************************************************/
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "connection.h"
+#include "filter.h"
+#include "trace.h"
+
+// Most writer threads Start_Fanout will run
+#define FANOUT_MAX_WRITERS 64
+// Messages a sender may have waiting for delivery before its reader has to
+// wait. Bounds the memory one fast sender can tie up.
+#define FANOUT_MAX_IN_FLIGHT 32
+// Log entries a writer looks over when choosing whose message goes next
+#define FANOUT_LOOKAHEAD 64
+// Bytes a sender's turn adds to what it may have delivered, at weight 1
+#define FANOUT_QUANTUM 4096
+// Largest weight Fanout_Set_Weight takes
+#define FANOUT_MAX_WEIGHT 64
+// Messages the sequencer publishes ahead of the writer furthest along. The
+// rest wait with the sequencer, where it can still pick who goes next.
+// Writers behind that one don't hold it back.
+#define FANOUT_SEQUENCER_WINDOW 32
+
+// Lanes, for queueing latency stats
+#define FANOUT_LANE_CONTROL 0
+#define FANOUT_LANE_BULK 1
+#define FANOUT_LANES 2
+
+// Called by a writer thread to deliver a message to one recipient.
+// compressed, hits and traceId are what the message was submitted with.
+typedef void (*fanout_deliver_t)(connection_t * recipient,
+                                 const char * message, int length,
+                                 const char * compressed,
+                                 int compressedLength,
+                                 const filter_hits_t * hits,
+                                 uint32_t traceId);
+
+// Start the writer threads, and the sequencer if asked for
+// Return zero on success
+// Params:
+//    writerCount: number of shards / writer threads, 1 to FANOUT_MAX_WRITERS
+//    sequence: true to order messages through the sequencer, false for
+//       senders to append to the log themselves
+//    deliver: function writers use to send to one recipient
+int Start_Fanout(int writerCount, bool sequence, fanout_deliver_t deliver);
+
+// Deliver everything already submitted, then stop the writer threads. Every
+// joined connection must have left first.
+void Stop_Fanout(void);
+
+// Add a connection to the least loaded shard. It receives every message
+// submitted after this call. Takes a reference on it.
+// Return zero on success
+// Params:
+//    connection: connection to add
+int Fanout_Join(connection_t * connection);
+
+// Remove a connection. Its shard drops the reference once every message
+// submitted before this call has been delivered to it. May move another
+// connection to even out the shards.
+// Return zero on success
+// Params:
+//    connection: connection added with Fanout_Join
+int Fanout_Leave(connection_t * connection);
+
+// Broadcast a message to every joined connection. Copies the message, so
+// the caller may reuse its buffer as soon as this returns. Waits first if the
+// sender already has FANOUT_MAX_IN_FLIGHT messages waiting.
+// Return zero on success
+// Params:
+//    sender: connection the message came from, or NULL for one from the
+//       server itself, which never waits
+//    message, length: the message
+//    compressed, compressedLength: the message as a compressed frame for
+//       recipients that take them (see protocol.h), copied along with it.
+//       NULL and 0 if it wasn't compressed.
+//    hits: filter keywords the message matched (see filter.h), copied along
+//       with it for the deliver function. NULL if it wasn't matched.
+//    traceId: from Trace_Sample, 0 if the message isn't traced. Writers
+//       record its queueing and delivery under it (see trace.h).
+int Fanout_Submit(connection_t * sender, const char * message, int length,
+                  const char * compressed, int compressedLength,
+                  const filter_hits_t * hits, uint32_t traceId);
+
+// Set a sender's weight. Each of its turns is weight times FANOUT_QUANTUM
+// bytes, so while it and a weight 1 sender (the default) both have messages
+// waiting, it gets weight times the share. Takes effect from its next turn.
+// Return zero on success, non-zero if weight is out of range
+// Params:
+//    connection: the sender
+//    weight: 1 to FANOUT_MAX_WEIGHT
+int Fanout_Set_Weight(connection_t * connection, int weight);
+
+// Send a frame from the server to every joined connection, ahead of any
+// chat still queued for them. Each writer delivers it between two of its
+// deliveries.
+// Return zero on success
+// Params:
+//    message, length: the frame, copied
+int Fanout_Control(const char * message, int length);
+
+// Wait until everything submitted so far has been delivered
+// Return zero once it has, non-zero if timeoutMs passed first
+// Params:
+//    timeoutMs: longest to wait
+int Fanout_Drain(int timeoutMs);
+
+// Statistics for the admin interface
+typedef struct
+{
+    int writerCount;
+    int members[FANOUT_MAX_WRITERS];
+    uint64_t messages;
+    uint64_t rebalances;
+    // Whether the sequencer is running, the batches it published, the
+    // messages in them, and how often it waited for room in the window
+    bool sequenced;
+    uint64_t batches;
+    uint64_t batched;
+    uint64_t windowWaits;
+    // Time from submit until the last shard finished, summed and worst case
+    uint64_t lastRecipientNsTotal;
+    uint64_t lastRecipientNsMax;
+    // Per lane, time from submit until a writer started delivering it,
+    // counted once per writer: how many, summed and worst case
+    uint64_t laneQueued[FANOUT_LANES];
+    uint64_t laneQueuedNsTotal[FANOUT_LANES];
+    uint64_t laneQueuedNsMax[FANOUT_LANES];
+} fanout_stats_t;
+
+// Get fan-out statistics
+// Params:
+//    stats: where to store them
+void Get_Fanout_Stats(fanout_stats_t * stats);
@@ -0,0 +1,434 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      fanoutbench.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Compares the two ways into the fan-out: through the sequencer, and
+ *    senders appending to the log themselves. Sender threads submit
+ *    numbered messages as fast as the fan-out takes them, to recipients that
+ *    only record what they got, so the numbers are the hand-off and ordering
+ *    cost, not socket writes.
+ *
+ *    Each recipient folds the messages it gets, in order, into a hash, and
+ *    checks each sender's numbers come in order. Recipients that end up with
+ *    different hashes saw messages in different orders.
+ *
+ * Input:
+ *    -w writer threads (default 1,4,8, comma separated), -s senders
+ *    (default 8), -r recipients (default 256), -m messages per sender
+ *    (default 20000), -l message length (default 64), -d ns of busy work per
+ *    delivery (default 0), standing in for a write, -W weight for sender 0
+ *    (default 1, see Fanout_Set_Weight).
+ *
+ * Output:
+ *    One line per writer count and mode: messages delivered per second,
+ *    average time in Fanout_Submit, time from submit to delivery, how many
+ *    different orders the recipients saw, messages out of their sender's
+ *    order, and the sequencer's batches. With -W, sender 0's share of the
+ *    first half of what the first recipient got.
+ ************************************************************/
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fanout.h"
+
+#define NS_PER_SEC 1000000000ULL
+#define MAX_RUNS 16
+#define MAX_SENDERS 256
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+typedef struct
+{
+    int writerCounts[MAX_RUNS];
+    int runCount;
+    int senderCount;
+    int recipientCount;
+    int messageCount;
+    int messageLength;
+    int workNs;
+    int firstWeight;
+} bench_options;
+
+// What one recipient got. Each is only touched by the writer owning it.
+typedef struct
+{
+    uint64_t orderHash;
+    uint64_t received;
+    uint64_t outOfOrder;
+    uint64_t latencyNsTotal;
+    uint64_t latencyNsMax;
+    // Messages from sender 0 among the first half received
+    uint64_t firstHalfFromFirst;
+    uint32_t nextNumber[MAX_SENDERS];
+} __attribute__((aligned(64))) recipient_t;
+
+typedef struct
+{
+    pthread_t thread;
+    int index;
+    connection_t * connection;
+    uint64_t submitNs;
+} sender_t;
+
+// Starts every message
+typedef struct
+{
+    uint32_t sender;
+    uint32_t number;
+    uint64_t sentNs;
+} message_header_t;
+
+static bench_options options;
+static recipient_t * recipients;
+static sender_t senders[MAX_SENDERS];
+// Senders wait on this so they all start at once
+static pthread_barrier_t startLine;
+
+/****************************************************************
+ * Read the command line
+ *
+ * Preconditions: argc/argv from main
+ *
+ * Postcondition:
+ *  options filled in, defaults for anything not given; exits if any are out
+ *  of range
+ ****************************************************************/
+void parseOptions(int argc, char ** argv)
+{
+    char * count;
+    int arg;
+
+    options.writerCounts[0] = 1;
+    options.writerCounts[1] = 4;
+    options.writerCounts[2] = 8;
+    options.runCount = 3;
+    options.senderCount = 8;
+    options.recipientCount = 256;
+    options.messageCount = 20000;
+    options.messageLength = 64;
+    options.workNs = 0;
+    options.firstWeight = 1;
+    while (-1 != (arg = getopt(argc, argv, "w:s:r:m:l:d:W:")))
+    {
+        if ('w' == arg)
+        {
+            options.runCount = 0;
+            for (count = strtok(optarg, ","); NULL != count &&
+                 options.runCount < MAX_RUNS; count = strtok(NULL, ","))
+            {
+                options.writerCounts[options.runCount++] = atoi(count);
+            }
+        }
+        else if ('s' == arg)
+        {
+            options.senderCount = atoi(optarg);
+        }
+        else if ('r' == arg)
+        {
+            options.recipientCount = atoi(optarg);
+        }
+        else if ('m' == arg)
+        {
+            options.messageCount = atoi(optarg);
+        }
+        else if ('l' == arg)
+        {
+            options.messageLength = atoi(optarg);
+        }
+        else if ('d' == arg)
+        {
+            options.workNs = atoi(optarg);
+        }
+        else if ('W' == arg)
+        {
+            options.firstWeight = atoi(optarg);
+        }
+    }
+    if (options.senderCount < 1 || options.senderCount > MAX_SENDERS ||
+        options.recipientCount < 1 || options.messageCount < 1 ||
+        options.messageLength < (int)sizeof(message_header_t) ||
+        options.workNs < 0 || options.firstWeight < 1 ||
+        options.firstWeight > FANOUT_MAX_WEIGHT)
+    {
+        fprintf(stderr, "-s must be 1 to %d, -r and -m at least 1, -l at"
+                " least %d, -W 1 to %d.\n", MAX_SENDERS,
+                (int)sizeof(message_header_t), FANOUT_MAX_WEIGHT);
+        exit(1);
+    }
+    for (arg = 0; arg < options.runCount; ++arg)
+    {
+        if (options.writerCounts[arg] < 1 ||
+            options.writerCounts[arg] > FANOUT_MAX_WRITERS)
+        {
+            fprintf(stderr, "-w must be 1 to %d.\n", FANOUT_MAX_WRITERS);
+            exit(1);
+        }
+    }
+}
+
+/****************************************************************
+ * Time since an arbitrary point, in ns
+ ****************************************************************/
+uint64_t nowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+/****************************************************************
+ * Deliver function for the fan-out: record the message for the recipient
+ *
+ * Preconditions: called by the writer owning recipient. message starts with
+ *  a message_header_t.
+ *
+ * Postcondition:
+ *  recipient's hash, counts and latency updated
+ ****************************************************************/
+void recordMessage(connection_t * recipient, const char * message,
+                   int length, const char * compressed,
+                   int compressedLength, const filter_hits_t * hits,
+                   uint32_t traceId)
+{
+    recipient_t * state = &(recipients[recipient->id]);
+    message_header_t header;
+    uint64_t now = nowNs();
+    uint64_t until;
+
+    (void)length;
+    (void)compressed;
+    (void)compressedLength;
+    (void)hits;
+    (void)traceId;
+    memcpy(&header, message, sizeof(header));
+    state->orderHash = (state->orderHash ^
+        (((uint64_t)header.sender << 32) | header.number)) * FNV_PRIME;
+    ++(state->received);
+    if (0 == header.sender && state->received * 2 <=
+        (uint64_t)options.senderCount * options.messageCount)
+    {
+        ++(state->firstHalfFromFirst);
+    }
+    if (header.number != state->nextNumber[header.sender])
+    {
+        ++(state->outOfOrder);
+    }
+    state->nextNumber[header.sender] = header.number + 1;
+    state->latencyNsTotal += now - header.sentNs;
+    if (now - header.sentNs > state->latencyNsMax)
+    {
+        state->latencyNsMax = now - header.sentNs;
+    }
+    if (options.workNs)
+    {
+        until = now + options.workNs;
+        while (nowNs() < until)
+        {
+        }
+    }
+}
+
+/****************************************************************
+ * Sender thread: submit messageCount numbered messages
+ *
+ * Preconditions: arg is this thread's sender_t; fan-out started
+ *
+ * Postcondition:
+ *  every message submitted; sender->submitNs is the time spent submitting
+ ****************************************************************/
+void * sendMessages(void * arg)
+{
+    sender_t * sender = (sender_t *)arg;
+    char * message = malloc(options.messageLength);
+    message_header_t header;
+    uint64_t start;
+    int number;
+
+    if (NULL == message)
+    {
+        return NULL;
+    }
+    memset(message, 'x', options.messageLength);
+    header.sender = sender->index;
+    pthread_barrier_wait(&startLine);
+    start = nowNs();
+    for (number = 0; number < options.messageCount; ++number)
+    {
+        header.number = number;
+        header.sentNs = nowNs();
+        memcpy(message, &header, sizeof(header));
+        Fanout_Submit(sender->connection, message, options.messageLength,
+                      NULL, 0, NULL, 0);
+    }
+    sender->submitNs = nowNs() - start;
+    free(message);
+    return NULL;
+}
+
+/****************************************************************
+ * Run one benchmark and print its line
+ *
+ * Preconditions: fan-out not running
+ *
+ * Postcondition:
+ *  fan-out started, run and stopped again
+ ****************************************************************/
+void runBench(int writerCount, bool sequence)
+{
+    connection_t ** members =
+        malloc(sizeof(connection_t *) * options.recipientCount);
+    fanout_stats_t before;
+    fanout_stats_t after;
+    uint64_t submitNs = 0;
+    uint64_t outOfOrder = 0;
+    uint64_t delivered = 0;
+    uint64_t latencyNsTotal = 0;
+    uint64_t latencyNsMax = 0;
+    uint64_t elapsed;
+    uint64_t messages;
+    uint64_t batches;
+    int orders = 0;
+    int index;
+    int other;
+
+    if (NULL == members ||
+        0 != Start_Fanout(writerCount, sequence, recordMessage))
+    {
+        fprintf(stderr, "Couldn't start the fan-out.\n");
+        exit(2);
+    }
+    memset(recipients, 0, sizeof(recipient_t) * options.recipientCount);
+    for (index = 0; index < options.recipientCount; ++index)
+    {
+        recipients[index].orderHash = FNV_OFFSET;
+        members[index] = Init_Connection(-1);
+        if (NULL == members[index])
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(2);
+        }
+        // Which recipient_t is this connection's
+        members[index]->id = index;
+        if (0 != Fanout_Join(members[index]))
+        {
+            fprintf(stderr, "Couldn't add a recipient to the fan-out.\n");
+            exit(2);
+        }
+    }
+    Fanout_Drain(60 * 1000);
+    Get_Fanout_Stats(&before);
+
+    pthread_barrier_init(&startLine, NULL, options.senderCount + 1);
+    for (index = 0; index < options.senderCount; ++index)
+    {
+        senders[index].index = index;
+        senders[index].connection = Init_Connection(-1);
+        if (NULL == senders[index].connection ||
+            (0 == index && 0 != Fanout_Set_Weight(senders[index].connection,
+                                                  options.firstWeight)) ||
+            0 != pthread_create(&(senders[index].thread), NULL, sendMessages,
+                                &(senders[index])))
+        {
+            fprintf(stderr, "Couldn't start the senders.\n");
+            exit(2);
+        }
+    }
+    pthread_barrier_wait(&startLine);
+    elapsed = nowNs();
+    for (index = 0; index < options.senderCount; ++index)
+    {
+        pthread_join(senders[index].thread, NULL);
+        submitNs += senders[index].submitNs;
+        Release_Connection(senders[index].connection);
+    }
+    Fanout_Drain(60 * 1000);
+    elapsed = nowNs() - elapsed;
+    pthread_barrier_destroy(&startLine);
+    Get_Fanout_Stats(&after);
+
+    for (index = 0; index < options.recipientCount; ++index)
+    {
+        delivered += recipients[index].received;
+        outOfOrder += recipients[index].outOfOrder;
+        latencyNsTotal += recipients[index].latencyNsTotal;
+        if (recipients[index].latencyNsMax > latencyNsMax)
+        {
+            latencyNsMax = recipients[index].latencyNsMax;
+        }
+        for (other = 0; other < index &&
+             recipients[other].orderHash != recipients[index].orderHash;
+             ++other)
+        {
+        }
+        if (other == index)
+        {
+            ++orders;
+        }
+        Fanout_Leave(members[index]);
+        Release_Connection(members[index]);
+    }
+    Stop_Fanout();
+    free(members);
+
+    messages = (uint64_t)options.senderCount * options.messageCount;
+    batches = after.batches - before.batches;
+    printf("%2d writers  %-9s  %9.0f msg/s  submit %6.0f ns"
+           "  latency avg %6.0f us max %6lu us  %4d order%s"
+           "  %lu out of sender order", writerCount,
+           sequence ? "sequenced" : "direct",
+           (double)messages * NS_PER_SEC / elapsed,
+           (double)submitNs / messages,
+           delivered ? (double)latencyNsTotal / delivered / 1000 : 0.0,
+           (unsigned long)(latencyNsMax / 1000), orders,
+           1 == orders ? " " : "s", (unsigned long)outOfOrder);
+    if (sequence)
+    {
+        printf("  %.1f per batch", batches ?
+               (double)(after.batched - before.batched) / batches : 0.0);
+    }
+    if (options.firstWeight > 1)
+    {
+        printf("  sender 0 weight %d got %.1f%% of the first half",
+               options.firstWeight, 200.0 * recipients[0].firstHalfFromFirst /
+               messages);
+    }
+    printf("\n");
+    if (delivered != messages * options.recipientCount)
+    {
+        printf("  delivered %lu of %lu\n", (unsigned long)delivered,
+               (unsigned long)(messages * options.recipientCount));
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    int run;
+
+    parseOptions(argc, argv);
+    recipients = malloc(sizeof(recipient_t) * options.recipientCount);
+    if (NULL == recipients)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return 2;
+    }
+    printf("%d senders, %d messages each of %d bytes, %d recipients, %d ns"
+           " per delivery\n", options.senderCount, options.messageCount,
+           options.messageLength, options.recipientCount, options.workNs);
+    for (run = 0; run < options.runCount; ++run)
+    {
+        runBench(options.writerCounts[run], true);
+        runBench(options.writerCounts[run], false);
+    }
+    free(recipients);
+    return 0;
+}
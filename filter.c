@@ -0,0 +1,510 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      filter.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Shared keyword table and the matcher run over it.
+ *
+ *    The table itself changes under registryLock. Each change publishes a
+ *    new immutable, refcounted compiled copy, which Match_Filters works from
+ *    without holding the lock.
+ *
+ *    Matching a message first notes which pairs of adjacent bytes it
+ *    contains (hashed into a small bitset), so a keyword whose first or last
+ *    pair doesn't occur is skipped without a scan. In chat text that rules
+ *    out nearly every keyword. The scan compares the keyword's first and
+ *    last bytes against 16 positions at a time with SSE2 and only runs
+ *    memcmp where both agree.
+ *
+ *  -- See filter.h for function header blocks
+ *
+ ************************************************************/
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "filter.h"
+
+// Size of the hashed set of byte pairs a message contains
+#define FILTER_PAIR_BITS 12
+#define FILTER_PAIR_SET_WORDS ((1 << FILTER_PAIR_BITS) / 64)
+
+// Hash two adjacent bytes into the pair set
+#define FILTER_PAIR(a, b) \
+    ((((unsigned)(a) << 5) ^ (unsigned)(b)) & ((1 << FILTER_PAIR_BITS) - 1))
+
+//********************************************
+// A keyword as the matcher sees it
+typedef struct
+{
+    int id;
+    int length;
+    bool anchored;
+    unsigned char first;
+    unsigned char last;
+    // Hashes of the first two and last two bytes
+    unsigned int firstPair;
+    unsigned int lastPair;
+    char text[FILTER_MAX_LENGTH];
+} compiled_keyword_t;
+
+//********************************************
+// Immutable copy of the keyword table
+typedef struct
+{
+    int refCount;
+    int count;
+    uint64_t generation;
+    compiled_keyword_t keywords[];
+} matcher_t;
+
+//********************************************
+// Entry in the keyword table. Free when refCount is 0.
+typedef struct
+{
+    int refCount;
+    int length;
+    bool anchored;
+    char text[FILTER_MAX_LENGTH];
+} keyword_t;
+
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static keyword_t keywords[FILTER_MAX_KEYWORDS];
+// Number of keywords in use, readable without the lock
+static int keywordCount = 0;
+// Latest compiled table, holding a reference of its own. Swapped under
+// registryLock.
+static matcher_t * currentMatcher = NULL;
+// Bumped under registryLock on every change to the keyword table, whether or
+// not a new compiled table could be published for it
+static uint64_t tableGeneration = 0;
+
+#ifdef __SSE2__
+static bool useVectorized = true;
+#else
+static bool useVectorized = false;
+#endif
+
+//********************************************
+static void Release_Matcher(matcher_t * matcher)
+{
+    if (NULL != matcher &&
+        0 == __atomic_sub_fetch(&(matcher->refCount), 1, __ATOMIC_ACQ_REL))
+    {
+        free(matcher);
+    }
+}
+
+//********************************************
+// Publish a new compiled table after the keyword table changed. Caller holds
+// registryLock.
+static void Rebuild_Prelocked(void)
+{
+    matcher_t * matcher;
+    matcher_t * stale;
+    compiled_keyword_t * compiled;
+    int id;
+
+    ++tableGeneration;
+    matcher = (matcher_t *)malloc(sizeof(matcher_t) +
+        sizeof(compiled_keyword_t) * keywordCount);
+    if (NULL == matcher)
+    {
+        // Keep the old one. Worst case a new filter turns down messages
+        // until a later rebuild works, as the old table's hits are too old.
+        return;
+    }
+    matcher->refCount = 1;
+    matcher->count = 0;
+    matcher->generation = tableGeneration;
+    for (id = 0; id < FILTER_MAX_KEYWORDS; ++id)
+    {
+        if (0 == keywords[id].refCount)
+        {
+            continue;
+        }
+        compiled = &(matcher->keywords[matcher->count++]);
+        compiled->id = id;
+        compiled->length = keywords[id].length;
+        compiled->anchored = keywords[id].anchored;
+        memcpy(compiled->text, keywords[id].text, keywords[id].length);
+        compiled->first = (unsigned char)compiled->text[0];
+        compiled->last = (unsigned char)compiled->text[compiled->length - 1];
+        if (compiled->length > 1)
+        {
+            compiled->firstPair = FILTER_PAIR(compiled->first,
+                (unsigned char)compiled->text[1]);
+            compiled->lastPair = FILTER_PAIR(
+                (unsigned char)compiled->text[compiled->length - 2],
+                compiled->last);
+        }
+    }
+
+    stale = currentMatcher;
+    currentMatcher = matcher;
+    Release_Matcher(stale);
+}
+
+//********************************************
+// Find or add a keyword and take a reference on it. Caller holds
+// registryLock.
+// Return its id, or -1 if the table is full
+static int Intern_Prelocked(const char * text, int length, bool anchored)
+{
+    int id;
+    int freeId = -1;
+
+    for (id = 0; id < FILTER_MAX_KEYWORDS; ++id)
+    {
+        if (0 == keywords[id].refCount)
+        {
+            if (-1 == freeId)
+            {
+                freeId = id;
+            }
+        }
+        else if (keywords[id].length == length &&
+                 keywords[id].anchored == anchored &&
+                 0 == memcmp(keywords[id].text, text, length))
+        {
+            ++(keywords[id].refCount);
+            return id;
+        }
+    }
+    if (-1 != freeId)
+    {
+        keywords[freeId].refCount = 1;
+        keywords[freeId].length = length;
+        keywords[freeId].anchored = anchored;
+        memcpy(keywords[freeId].text, text, length);
+        __atomic_add_fetch(&keywordCount, 1, __ATOMIC_RELAXED);
+    }
+    return freeId;
+}
+
+//********************************************
+// Drop a reference on a keyword. Caller holds registryLock.
+static void Unintern_Prelocked(int id)
+{
+    if (0 == --(keywords[id].refCount))
+    {
+        __atomic_sub_fetch(&keywordCount, 1, __ATOMIC_RELAXED);
+    }
+}
+
+//********************************************
+filter_t * Create_Filter(const char * spec)
+{
+    filter_t * filter = (filter_t *)malloc(sizeof(filter_t));
+    const char * start = spec;
+    const char * end;
+    bool anchored;
+    int length;
+    int id;
+    int index;
+
+    if (NULL == filter)
+    {
+        return NULL;
+    }
+    filter->count = 0;
+
+    pthread_mutex_lock(&registryLock);
+    while ('\0' != *start)
+    {
+        end = strchr(start, FILTER_SEPARATOR);
+        if (NULL == end)
+        {
+            end = start + strlen(start);
+        }
+        anchored = (FILTER_PREFIX_MARK == *start);
+        length = end - start - (anchored ? 1 : 0);
+        if (length > 0)
+        {
+            if (length > FILTER_MAX_LENGTH ||
+                FILTER_MAX_PATTERNS == filter->count ||
+                -1 == (id = Intern_Prelocked(start + (anchored ? 1 : 0),
+                                             length, anchored)))
+            {
+                // Undo what we took so far
+                for (index = 0; index < filter->count; ++index)
+                {
+                    Unintern_Prelocked(filter->ids[index]);
+                }
+                filter->count = 0;
+                break;
+            }
+            filter->ids[filter->count++] = id;
+        }
+        start = ('\0' == *end) ? end : end + 1;
+    }
+    if (filter->count > 0)
+    {
+        Rebuild_Prelocked();
+        filter->generation = tableGeneration;
+    }
+    pthread_mutex_unlock(&registryLock);
+
+    if (0 == filter->count)
+    {
+        free(filter);
+        return NULL;
+    }
+    return filter;
+}
+
+//********************************************
+void Delete_Filter(filter_t * filter)
+{
+    int index;
+
+    pthread_mutex_lock(&registryLock);
+    for (index = 0; index < filter->count; ++index)
+    {
+        Unintern_Prelocked(filter->ids[index]);
+    }
+    Rebuild_Prelocked();
+    pthread_mutex_unlock(&registryLock);
+    free(filter);
+}
+
+//********************************************
+// Plain C search for an unanchored keyword of length 2 or more
+static bool Find_Scalar(const unsigned char * message, int length,
+                        const compiled_keyword_t * keyword)
+{
+    int position;
+    int lastStart = length - keyword->length;
+
+    for (position = 0; position <= lastStart; ++position)
+    {
+        if (message[position] == keyword->first &&
+            message[position + keyword->length - 1] == keyword->last &&
+            0 == memcmp(message + position + 1, keyword->text + 1,
+                        keyword->length - 2))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef __SSE2__
+//********************************************
+// SSE2 search for an unanchored keyword of length 2 or more. Each round
+// compares the first byte at 16 candidate starts and the last byte at the
+// matching 16 ends; only starts where both agree get a memcmp.
+static bool Find_Sse2(const unsigned char * message, int length,
+                      const compiled_keyword_t * keyword)
+{
+    const __m128i first = _mm_set1_epi8((char)keyword->first);
+    const __m128i last = _mm_set1_epi8((char)keyword->last);
+    int offset = keyword->length - 1;
+    int position;
+    unsigned int mask;
+    int bit;
+
+    // Both loads must stay inside the message
+    for (position = 0; position + offset + 16 <= length; position += 16)
+    {
+        __m128i starts =
+            _mm_loadu_si128((const __m128i *)(message + position));
+        __m128i ends =
+            _mm_loadu_si128((const __m128i *)(message + position + offset));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(starts, first),
+                                               _mm_cmpeq_epi8(ends, last)));
+        while (0 != mask)
+        {
+            bit = __builtin_ctz(mask);
+            if (0 == memcmp(message + position + bit + 1, keyword->text + 1,
+                            keyword->length - 2))
+            {
+                return true;
+            }
+            mask &= mask - 1;
+        }
+    }
+    // Fewer than 16 starts left
+    return Find_Scalar(message + position, length - position, keyword);
+}
+#endif
+
+//********************************************
+// Does the message contain this keyword?
+static bool Find_Keyword(const unsigned char * message, int length,
+                         const compiled_keyword_t * keyword)
+{
+    if (keyword->length > length)
+    {
+        return false;
+    }
+    if (keyword->anchored)
+    {
+        return 0 == memcmp(message, keyword->text, keyword->length);
+    }
+    if (1 == keyword->length)
+    {
+        return NULL != memchr(message, keyword->first, length);
+    }
+#ifdef __SSE2__
+    if (useVectorized)
+    {
+        return Find_Sse2(message, length, keyword);
+    }
+#endif
+    return Find_Scalar(message, length, keyword);
+}
+
+//********************************************
+// Take a reference on the current matcher, or return NULL if nobody filters
+static matcher_t * Acquire_Matcher(void)
+{
+    matcher_t * matcher;
+
+    // Nobody filters: skip the lock entirely
+    if (0 == __atomic_load_n(&keywordCount, __ATOMIC_RELAXED))
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&registryLock);
+    matcher = currentMatcher;
+    if (NULL != matcher)
+    {
+        __atomic_add_fetch(&(matcher->refCount), 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&registryLock);
+    return matcher;
+}
+
+//********************************************
+// Set hits to the keywords a message contains
+static void Match_Message(const matcher_t * matcher, const char * message,
+                          int length, filter_hits_t * hits)
+{
+    const unsigned char * bytes = (const unsigned char *)message;
+    uint64_t pairs[FILTER_PAIR_SET_WORDS];
+    const compiled_keyword_t * keyword;
+    unsigned int pair;
+    int index;
+
+    memset(hits, 0, sizeof(filter_hits_t));
+    hits->generation = matcher->generation;
+    memset(pairs, 0, sizeof(pairs));
+    for (index = 1; index < length; ++index)
+    {
+        pair = FILTER_PAIR(bytes[index - 1], bytes[index]);
+        pairs[pair >> 6] |= 1ULL << (pair & 63);
+    }
+
+    for (index = 0; index < matcher->count; ++index)
+    {
+        keyword = &(matcher->keywords[index]);
+        // Anchored and one byte keywords are as cheap to check directly
+        if (!keyword->anchored && keyword->length > 1 &&
+            (!(pairs[keyword->firstPair >> 6] &
+               (1ULL << (keyword->firstPair & 63))) ||
+             !(pairs[keyword->lastPair >> 6] &
+               (1ULL << (keyword->lastPair & 63)))))
+        {
+            continue;
+        }
+        if (Find_Keyword(bytes, length, keyword))
+        {
+            hits->bits[keyword->id >> 6] |= 1ULL << (keyword->id & 63);
+        }
+    }
+}
+
+//********************************************
+bool Match_Filters(const char * message, int length, filter_hits_t * hits)
+{
+    matcher_t * matcher = Acquire_Matcher();
+
+    if (NULL == matcher)
+    {
+        return false;
+    }
+    Match_Message(matcher, message, length, hits);
+    Release_Matcher(matcher);
+    return true;
+}
+
+//********************************************
+int Match_Filter_Run(const char * chat, int length, filter_hits_t * hits,
+                     bool * matched)
+{
+    matcher_t * matcher = Acquire_Matcher();
+    filter_hits_t lineHits;
+    const char * newline;
+    int lineLength;
+    int used = 0;
+
+    *matched = (NULL != matcher);
+    if (NULL == matcher)
+    {
+        return length;
+    }
+    while (used < length)
+    {
+        // The newline isn't part of what is matched, so an anchored pattern
+        // can't match across it
+        newline = memchr(chat + used, '\n', length - used);
+        lineLength = newline ? (int)(newline - chat) - used : length - used;
+        Match_Message(matcher, chat + used, lineLength,
+                      used ? &lineHits : hits);
+        if (used && 0 != memcmp(&lineHits, hits, sizeof(lineHits)))
+        {
+            break;
+        }
+        used += lineLength + (newline ? 1 : 0);
+    }
+    Release_Matcher(matcher);
+    return used;
+}
+
+//********************************************
+bool Filter_Accepts(const filter_t * filter, const filter_hits_t * hits)
+{
+    int index;
+    int id;
+
+    if (NULL == filter)
+    {
+        return true;
+    }
+    // Matched before this filter existed: its ids may not mean ours
+    if (NULL == hits || hits->generation < filter->generation)
+    {
+        return false;
+    }
+    for (index = 0; index < filter->count; ++index)
+    {
+        id = filter->ids[index];
+        if (hits->bits[id >> 6] & (1ULL << (id & 63)))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//********************************************
+void Set_Filter_Vectorized(bool vectorized)
+{
+#ifdef __SSE2__
+    useVectorized = vectorized;
+#endif
+}
+
+//********************************************
+int Get_Filter_Keyword_Count(void)
+{
+    return __atomic_load_n(&keywordCount, __ATOMIC_RELAXED);
+}
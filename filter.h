@@ -0,0 +1,108 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      filter.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Content filters for subscribers that only want some of the chat.
+ *
+ *    Every pattern any subscriber uses is entered once in a shared keyword
+ *    table. A message is matched against the table once, no matter how many
+ *    subscribers there are, giving a bitset of the keywords it contains.
+ *    Deciding whether one subscriber wants the message is then just a few
+ *    bit tests.
+ *
+ *    Keyword ids are reused once no subscriber holds them, while messages
+ *    matched against the old table may still be queued. So each change to
+ *    the table starts a new generation, hits say which generation they came
+ *    from, and a filter turns down messages matched before it was created:
+ *    their ids may have meant other keywords then, so there's no telling
+ *    whether they match. Filters can therefore be created at any time,
+ *    including after their connection joined the fan-out; a filter must
+ *    only be deleted once nothing can check it again.
+ *
+ ************************************************************/
+#include <stdbool.h>
+#include <stdint.h>
+
+// Most distinct patterns across all subscribers
+#define FILTER_MAX_KEYWORDS 1024
+// Most patterns in one subscriber's filter
+#define FILTER_MAX_PATTERNS 8
+// Longest pattern
+#define FILTER_MAX_LENGTH 32
+// Starts a pattern that must be at the start of the message
+#define FILTER_PREFIX_MARK '^'
+// Separates patterns in a filter spec
+#define FILTER_SEPARATOR ','
+
+// Which keywords a message contains
+typedef struct
+{
+    uint64_t bits[FILTER_MAX_KEYWORDS / 64];
+    // Generation of the keyword table the message was matched against
+    uint64_t generation;
+} filter_hits_t;
+
+// One subscriber's filter: it wants a message containing any of these
+typedef struct
+{
+    int count;
+    int ids[FILTER_MAX_PATTERNS];
+    // Generation of the keyword table once these ids were added
+    uint64_t generation;
+} filter_t;
+
+// Create a filter from a spec like "error,^deploy": the message contains
+// "error" or starts with "deploy"
+// Return the filter. Return NULL if the spec is empty, has too many or too
+// long patterns, or the keyword table is full.
+// Params:
+//    spec: comma separated patterns
+filter_t * Create_Filter(const char * spec);
+
+// Free a filter and give up its keywords
+// Params:
+//    filter: filter from Create_Filter
+void Delete_Filter(filter_t * filter);
+
+// Match a message against every keyword in use
+// Return false, leaving hits alone, if no filters exist; then every
+// subscriber should get the message. Otherwise return true with hits set.
+// Params:
+//    message, length: the message
+//    hits: where to store which keywords it contains
+bool Match_Filters(const char * message, int length, filter_hits_t * hits);
+
+// Match chat line by line, so anchored patterns go by the start of each line
+// and each line only goes to the subscribers that want it. Takes the lines
+// at the start of chat that contain the same keywords.
+// Return how many bytes of chat those lines take up, newlines included. All
+// of chat, with *matched false and hits left alone, if no filters exist.
+// Params:
+//    chat, length: one or more lines; the last may have no newline
+//    hits: where to store which keywords the lines contain
+//    matched: where to store whether hits was set
+int Match_Filter_Run(const char * chat, int length, filter_hits_t * hits,
+                     bool * matched);
+
+// Decide whether a subscriber wants a message
+// Return true if filter is NULL (no filter) or the message contains one of
+// the filter's patterns. Return false if hits is NULL (nothing was matched
+// against, so the filter didn't exist yet) or older than the filter.
+// Params:
+//    filter: the subscriber's filter
+//    hits: from Match_Filters
+bool Filter_Accepts(const filter_t * filter, const filter_hits_t * hits);
+
+// Choose the SIMD matcher (the default where the CPU has it) or the plain C
+// one, for comparing them
+// Params:
+//    vectorized: true for SIMD
+void Set_Filter_Vectorized(bool vectorized);
+
+// Get how many distinct keywords are in use
+int Get_Filter_Keyword_Count(void);
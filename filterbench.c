@@ -0,0 +1,352 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      filterbench.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Measures what server side filtering costs per message. Sets up a
+ *    number of subscribers, each with a few patterns drawn from a shared
+ *    vocabulary, then times deciding who gets each of a batch of chat-like
+ *    messages. It compares the shared SIMD matcher, the same matcher in
+ *    plain C, and the naive approach of running every subscriber's patterns
+ *    through strstr.
+ *
+ * Input:
+ *    -s subscribers (default 1000,5000,10000, comma separated), -k distinct
+ *    keywords in the vocabulary (default 500), -m messages (default 20000),
+ *    -l message length (default 120), -r random seed.
+ *
+ * Output:
+ *    One line per subscriber count and method: ns per message and the
+ *    fraction of subscribers that got each message on average.
+ ************************************************************/
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filter.h"
+
+#define NS_PER_SEC 1000000000ULL
+#define MAX_RUNS 16
+#define PATTERNS_PER_SUBSCRIBER 3
+
+typedef struct
+{
+    int subscriberCounts[MAX_RUNS];
+    int runCount;
+    int keywordCount;
+    int messageCount;
+    int messageLength;
+    unsigned int seed;
+} bench_options;
+
+// One subscriber as the naive method sees it
+typedef struct
+{
+    int count;
+    const char * patterns[PATTERNS_PER_SUBSCRIBER];
+    bool anchored[PATTERNS_PER_SUBSCRIBER];
+} naive_filter_t;
+
+/****************************************************************
+ * Read the command line
+ *
+ * Preconditions: argc/argv from main
+ *
+ * Postcondition:
+ *  options filled in, defaults for anything not given
+ ****************************************************************/
+void parseOptions(int argc, char ** argv, bench_options * options)
+{
+    char * count;
+    int arg;
+
+    options->subscriberCounts[0] = 1000;
+    options->subscriberCounts[1] = 5000;
+    options->subscriberCounts[2] = 10000;
+    options->runCount = 3;
+    options->keywordCount = 500;
+    options->messageCount = 20000;
+    options->messageLength = 120;
+    options->seed = 1;
+    while (-1 != (arg = getopt(argc, argv, "s:k:m:l:r:")))
+    {
+        if ('s' == arg)
+        {
+            options->runCount = 0;
+            for (count = strtok(optarg, ","); NULL != count &&
+                 options->runCount < MAX_RUNS; count = strtok(NULL, ","))
+            {
+                options->subscriberCounts[options->runCount++] = atoi(count);
+            }
+        }
+        else if ('k' == arg)
+        {
+            options->keywordCount = atoi(optarg);
+        }
+        else if ('m' == arg)
+        {
+            options->messageCount = atoi(optarg);
+        }
+        else if ('l' == arg)
+        {
+            options->messageLength = atoi(optarg);
+        }
+        else if ('r' == arg)
+        {
+            options->seed = atoi(optarg);
+        }
+    }
+    // Anchored and unanchored copies of each word must both fit the table
+    if (options->keywordCount < 1 ||
+        options->keywordCount * 2 > FILTER_MAX_KEYWORDS)
+    {
+        fprintf(stderr, "-k must be 1 to %d.\n", FILTER_MAX_KEYWORDS / 2);
+        exit(1);
+    }
+}
+
+/****************************************************************
+ * Make a random lower case word
+ *
+ * Preconditions: word holds at least maxLength + 1 bytes
+ *
+ * Postcondition:
+ *  word holds a word of 3 to maxLength letters
+ ****************************************************************/
+void randomWord(char * word, int maxLength)
+{
+    int length = 3 + rand() % (maxLength - 2);
+    int index;
+
+    for (index = 0; index < length; ++index)
+    {
+        word[index] = 'a' + rand() % 26;
+    }
+    word[length] = '\0';
+}
+
+/****************************************************************
+ * Time since an arbitrary point, in ns
+ ****************************************************************/
+uint64_t nowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+/****************************************************************
+ * Does one naive subscriber want a message?
+ *
+ * Preconditions: message is NUL terminated
+ *
+ * Postcondition:
+ *  returns true if any of its patterns matches
+ ****************************************************************/
+bool naiveAccepts(const naive_filter_t * filter, const char * message)
+{
+    int index;
+
+    for (index = 0; index < filter->count; ++index)
+    {
+        if (filter->anchored[index] ?
+            0 == strncmp(message, filter->patterns[index],
+                         strlen(filter->patterns[index])) :
+            NULL != strstr(message, filter->patterns[index]))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/****************************************************************
+ * Time the shared matcher over every message for one set of subscribers
+ *
+ * Preconditions: filters holds subscriberCount filters
+ *
+ * Postcondition:
+ *  returns ns per message. *deliveries is the total number of
+ *  (message, subscriber) pairs accepted.
+ ****************************************************************/
+double timeShared(filter_t ** filters, int subscriberCount, char ** messages,
+                  int messageCount, uint64_t * deliveries)
+{
+    filter_hits_t hits;
+    uint64_t start = nowNs();
+    bool matched;
+    int message;
+    int subscriber;
+
+    *deliveries = 0;
+    for (message = 0; message < messageCount; ++message)
+    {
+        matched = Match_Filters(messages[message], strlen(messages[message]),
+                                &hits);
+        for (subscriber = 0; subscriber < subscriberCount; ++subscriber)
+        {
+            if (Filter_Accepts(filters[subscriber], matched ? &hits : NULL))
+            {
+                ++(*deliveries);
+            }
+        }
+    }
+    return (double)(nowNs() - start) / messageCount;
+}
+
+/****************************************************************
+ * Time the naive method over every message for one set of subscribers
+ *
+ * Preconditions: filters holds subscriberCount filters
+ *
+ * Postcondition:
+ *  returns ns per message. *deliveries as for timeShared.
+ ****************************************************************/
+double timeNaive(naive_filter_t * filters, int subscriberCount,
+                 char ** messages, int messageCount, uint64_t * deliveries)
+{
+    uint64_t start = nowNs();
+    int message;
+    int subscriber;
+
+    *deliveries = 0;
+    for (message = 0; message < messageCount; ++message)
+    {
+        for (subscriber = 0; subscriber < subscriberCount; ++subscriber)
+        {
+            if (naiveAccepts(&(filters[subscriber]), messages[message]))
+            {
+                ++(*deliveries);
+            }
+        }
+    }
+    return (double)(nowNs() - start) / messageCount;
+}
+
+int main(int argc, char ** argv)
+{
+    bench_options options;
+    parseOptions(argc, argv, &options);
+    srand(options.seed);
+
+    // The vocabulary subscribers pick from
+    char (*vocabulary)[FILTER_MAX_LENGTH + 1] =
+        malloc(sizeof(*vocabulary) * options.keywordCount);
+    char ** messages = malloc(sizeof(char *) * options.messageCount);
+    if (NULL == vocabulary || NULL == messages)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return 2;
+    }
+    int index;
+    for (index = 0; index < options.keywordCount; ++index)
+    {
+        randomWord(vocabulary[index], 10);
+    }
+
+    // Chat-like messages: "name: words...", with the odd vocabulary word
+    for (index = 0; index < options.messageCount; ++index)
+    {
+        char word[FILTER_MAX_LENGTH + 1];
+        int used = 0;
+        messages[index] = malloc(options.messageLength + 1);
+        randomWord(word, 8);
+        used = snprintf(messages[index], options.messageLength + 1, "%s:",
+                        (0 == rand() % 4) ?
+                        vocabulary[rand() % options.keywordCount] : word);
+        while (used < options.messageLength)
+        {
+            if (0 == rand() % 20)
+            {
+                strcpy(word, vocabulary[rand() % options.keywordCount]);
+            }
+            else
+            {
+                randomWord(word, 9);
+            }
+            used += snprintf(messages[index] + used,
+                             options.messageLength + 1 - used, " %s", word);
+        }
+    }
+
+    printf("%d keywords, %d messages of %d bytes\n", options.keywordCount,
+           options.messageCount, options.messageLength);
+    int run;
+    for (run = 0; run < options.runCount; ++run)
+    {
+        int subscriberCount = options.subscriberCounts[run];
+        filter_t ** filters = malloc(sizeof(filter_t *) * subscriberCount);
+        naive_filter_t * naive =
+            malloc(sizeof(naive_filter_t) * subscriberCount);
+        if (NULL == filters || NULL == naive)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            return 2;
+        }
+
+        int subscriber;
+        for (subscriber = 0; subscriber < subscriberCount; ++subscriber)
+        {
+            char spec[(FILTER_MAX_LENGTH + 2) * PATTERNS_PER_SUBSCRIBER];
+            int used = 0;
+            naive[subscriber].count = 1 + rand() % PATTERNS_PER_SUBSCRIBER;
+            for (index = 0; index < naive[subscriber].count; ++index)
+            {
+                // One pattern in eight is a name prefix
+                naive[subscriber].anchored[index] = (0 == rand() % 8);
+                naive[subscriber].patterns[index] =
+                    vocabulary[rand() % options.keywordCount];
+                used += sprintf(spec + used, "%s%s%s", index ? "," : "",
+                                naive[subscriber].anchored[index] ? "^" : "",
+                                naive[subscriber].patterns[index]);
+            }
+            if (NULL == (filters[subscriber] = Create_Filter(spec)))
+            {
+                fprintf(stderr, "Couldn't create filter %s.\n", spec);
+                return 3;
+            }
+        }
+
+        uint64_t deliveries;
+        double ns;
+        Set_Filter_Vectorized(true);
+        ns = timeShared(filters, subscriberCount, messages,
+                        options.messageCount, &deliveries);
+        printf("%6d subscribers  shared SIMD    %10.0f ns/message  %5.2f%%"
+               " delivered\n", subscriberCount, ns, 100.0 * deliveries /
+               ((double)subscriberCount * options.messageCount));
+        Set_Filter_Vectorized(false);
+        ns = timeShared(filters, subscriberCount, messages,
+                        options.messageCount, &deliveries);
+        printf("%6d subscribers  shared scalar  %10.0f ns/message  %5.2f%%"
+               " delivered\n", subscriberCount, ns, 100.0 * deliveries /
+               ((double)subscriberCount * options.messageCount));
+        ns = timeNaive(naive, subscriberCount, messages,
+                       options.messageCount, &deliveries);
+        printf("%6d subscribers  per-subscriber %10.0f ns/message  %5.2f%%"
+               " delivered\n", subscriberCount, ns, 100.0 * deliveries /
+               ((double)subscriberCount * options.messageCount));
+
+        for (subscriber = 0; subscriber < subscriberCount; ++subscriber)
+        {
+            Delete_Filter(filters[subscriber]);
+        }
+        free(filters);
+        free(naive);
+    }
+
+    for (index = 0; index < options.messageCount; ++index)
+    {
+        free(messages[index]);
+    }
+    free(messages);
+    free(vocabulary);
+    return 0;
+}
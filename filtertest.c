@@ -0,0 +1,174 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      filtertest.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Checks that a read holding many lines is filtered line by line: the
+ *    server splits it with Match_Filter_Run, so each run of lines only goes
+ *    to the subscribers that want it, and a pattern anchored with ^ matches
+ *    at the start of any line rather than only at the start of the read.
+ *
+ *    Also checks that a filter created after a message was matched, reusing
+ *    a keyword id the message's hits have set, turns the message down.
+ *
+ * Input:
+ *    (none)
+ *
+ * Output:
+ *    What each subscriber would get from a multi-line burst, and any
+ *    mismatch with what it should get. Exits 1 if there was one.
+ ************************************************************/
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "filter.h"
+
+#define SUBSCRIBERS 3
+#define MAX_RECEIVED 256
+
+// One read from a client, as it reaches broadcastMessage
+static const char burst[] =
+    "bob: morning\n"
+    "alice: hello\n"
+    "alice: anyone here?\n"
+    "bob: an error in the build\n"
+    "carol: said alice: earlier\n"
+    "alice: partial line";
+
+static const char * specs[SUBSCRIBERS] = { "^alice:", "error", NULL };
+static const char * expected[SUBSCRIBERS] =
+{
+    "alice: hello\n"
+    "alice: anyone here?\n"
+    "alice: partial line",
+    "bob: an error in the build\n",
+    burst
+};
+
+/****************************************************************
+ * Split the burst the way the server does and check what each subscriber
+ * would be sent
+ *
+ * Preconditions: (none)
+ *
+ * Postcondition:
+ *  returns 0 if every subscriber gets exactly its lines, 1 otherwise
+ ****************************************************************/
+int main(void)
+{
+    filter_t * filters[SUBSCRIBERS];
+    filter_t * old;
+    filter_t * reused;
+    filter_hits_t oldHits;
+    filter_hits_t newHits;
+    int oldId;
+    char received[SUBSCRIBERS][MAX_RECEIVED];
+    int receivedLength[SUBSCRIBERS] = { 0 };
+    int length = sizeof(burst) - 1;
+    filter_hits_t hits;
+    bool matched;
+    int failures = 0;
+    int runs = 0;
+    int used;
+    int run;
+    int index;
+
+    for (index = 0; index < SUBSCRIBERS; ++index)
+    {
+        filters[index] = specs[index] ? Create_Filter(specs[index]) : NULL;
+        if (specs[index] && NULL == filters[index])
+        {
+            fprintf(stderr, "Couldn't create filter %s.\n", specs[index]);
+            return 1;
+        }
+    }
+
+    for (used = 0; used < length; used += run)
+    {
+        run = Match_Filter_Run(burst + used, length - used, &hits, &matched);
+        ++runs;
+        for (index = 0; index < SUBSCRIBERS; ++index)
+        {
+            if (Filter_Accepts(filters[index], matched ? &hits : NULL))
+            {
+                memcpy(received[index] + receivedLength[index],
+                       burst + used, run);
+                receivedLength[index] += run;
+            }
+        }
+    }
+
+    printf("burst split into %d messages\n", runs);
+    for (index = 0; index < SUBSCRIBERS; ++index)
+    {
+        received[index][receivedLength[index]] = '\0';
+        if (0 != strcmp(received[index], expected[index]))
+        {
+            printf("FAIL %s got:\n%s\n-- expected:\n%s\n--\n",
+                   specs[index] ? specs[index] : "(no filter)",
+                   received[index], expected[index]);
+            ++failures;
+        }
+        else
+        {
+            printf("ok   %s\n", specs[index] ? specs[index] : "(no filter)");
+        }
+    }
+
+    // With nobody filtering, the whole read stays one message
+    for (index = 0; index < SUBSCRIBERS; ++index)
+    {
+        if (filters[index])
+        {
+            Delete_Filter(filters[index]);
+        }
+    }
+    run = Match_Filter_Run(burst, length, &hits, &matched);
+    if (run != length || matched)
+    {
+        printf("FAIL unfiltered read split into %d of %d bytes\n", run,
+               length);
+        ++failures;
+    }
+    else
+    {
+        printf("ok   unfiltered read kept whole\n");
+    }
+
+    // A message matched while "alpha" held a keyword id, still queued when
+    // "beta" takes the id over
+    if (NULL == (old = Create_Filter("alpha")))
+    {
+        fprintf(stderr, "Couldn't create filter alpha.\n");
+        return 1;
+    }
+    oldId = old->ids[0];
+    Match_Filters("alpha only", strlen("alpha only"), &oldHits);
+    Delete_Filter(old);
+    if (NULL == (reused = Create_Filter("beta")))
+    {
+        fprintf(stderr, "Couldn't create filter beta.\n");
+        return 1;
+    }
+    Match_Filters("beta news", strlen("beta news"), &newHits);
+    if (reused->ids[0] != oldId)
+    {
+        printf("SKIP keyword id wasn't reused\n");
+    }
+    else if (Filter_Accepts(reused, &oldHits) ||
+             !Filter_Accepts(reused, &newHits))
+    {
+        printf("FAIL new filter went by a reused keyword id's old hits\n");
+        ++failures;
+    }
+    else
+    {
+        printf("ok   reused keyword id\n");
+    }
+    Delete_Filter(reused);
+    return failures ? 1 : 0;
+}
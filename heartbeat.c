@@ -0,0 +1,295 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      heartbeat.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Idle timeouts and pings, driven by a timer wheel on its own thread.
+ *
+ *    Each tracked connection has exactly one timer. When it fires, the
+ *    heartbeat thread compares the connection's last activity with the
+ *    timeouts, pings or disconnects it if needed, and re-arms the timer for
+ *    the next deadline. Timers also fire at least every
+ *    HEARTBEAT_RECHECK_TICKS so timeout changes reach every connection.
+ * 
+ *  -- See heartbeat.h for function header blocks
+ *
+ ************************************************************/
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "heartbeat.h"
+#include "shutdown.h"
+#include "timerwheel.h"
+#include "transport.h"
+
+#define HEARTBEAT_RECHECK_TICKS (10000 / HEARTBEAT_TICK_MS)
+
+// Values for connection_t.heartbeatState, guarded by wheelLock
+#define HEARTBEAT_UNTRACKED 0
+// Timer is in the wheel
+#define HEARTBEAT_ARMED 1
+// Timer fired and the heartbeat thread is checking the connection
+#define HEARTBEAT_FIRING 2
+// Removed while firing; the heartbeat thread drops the reference
+#define HEARTBEAT_REMOVED 3
+
+static timer_wheel_t wheel;
+static pthread_mutex_t wheelLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Tick the heartbeat thread last woke up on. Readers stamp activity with it
+// instead of reading the clock themselves.
+static uint64_t currentTick = 0;
+static uint64_t idleTicks = 0;
+static uint64_t pingTicks = 0;
+
+static heartbeat_ping_t pingFunction = NULL;
+static pthread_t heartbeatThread;
+static bool heartbeatRunning = false;
+static bool heartbeatStopping = false;
+
+static uint64_t pingCount = 0;
+static uint64_t timeoutCount = 0;
+
+//********************************************
+static uint64_t Clock_Tick(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000) /
+           HEARTBEAT_TICK_MS;
+}
+
+//********************************************
+// Tick on which a connection next needs looking at
+static uint64_t Next_Deadline(connection_t * connection, uint64_t now)
+{
+    uint64_t idle = __atomic_load_n(&idleTicks, __ATOMIC_RELAXED);
+    uint64_t ping = __atomic_load_n(&pingTicks, __ATOMIC_RELAXED);
+    uint64_t last = __atomic_load_n(&(connection->lastActivity),
+                                    __ATOMIC_RELAXED);
+    uint64_t deadline = now + HEARTBEAT_RECHECK_TICKS;
+    
+    if (ping && (connection->flags & CONNECTION_HELLO) &&
+        connection->lastPing <= last && last + ping < deadline)
+    {
+        deadline = last + ping;
+    }
+    if (idle && last + idle < deadline)
+    {
+        deadline = last + idle;
+    }
+    return deadline;
+}
+
+//********************************************
+// Timer wheel callback: chain fired connections up for checking outside the
+// wheel lock
+static void Collect_Expired(wheel_timer_t * timer, void * userData)
+{
+    connection_t ** due = (connection_t **)userData;
+    connection_t * connection = LIST_ENTRY(timer, connection_t, idleTimer);
+    
+    connection->heartbeatState = HEARTBEAT_FIRING;
+    connection->heartbeatNext = *due;
+    *due = connection;
+}
+
+//********************************************
+// Ping or drop a connection whose timer fired, if it has been quiet too long
+static void Check_Connection(connection_t * connection, uint64_t now)
+{
+    uint64_t idle = __atomic_load_n(&idleTicks, __ATOMIC_RELAXED);
+    uint64_t ping = __atomic_load_n(&pingTicks, __ATOMIC_RELAXED);
+    uint64_t last = __atomic_load_n(&(connection->lastActivity),
+                                    __ATOMIC_RELAXED);
+    
+    if (idle && now - last >= idle)
+    {
+        // Wakes the reader, which then tears the connection down as if the
+        // client had hung up
+        Transport_Shutdown(connection->fd, SHUT_RDWR);
+        __atomic_add_fetch(&timeoutCount, 1, __ATOMIC_RELAXED);
+    }
+    else if (ping && (connection->flags & CONNECTION_HELLO) &&
+        now - last >= ping && connection->lastPing <= last)
+    {
+        pingFunction(connection);
+        connection->lastPing = now;
+        __atomic_add_fetch(&pingCount, 1, __ATOMIC_RELAXED);
+    }
+}
+
+//********************************************
+static void * ThreadHeartbeat(void * arg)
+{
+    connection_t * due;
+    connection_t * released;
+    connection_t * connection;
+    uint64_t now;
+    
+    while (!__atomic_load_n(&heartbeatStopping, __ATOMIC_RELAXED))
+    {
+        // Everyone is leaving on shutdown, so there's nothing left to time
+        if (Shutdown_Sleep(HEARTBEAT_TICK_MS * 1000000ULL))
+        {
+            break;
+        }
+        now = Clock_Tick();
+        __atomic_store_n(&currentTick, now, __ATOMIC_RELAXED);
+        
+        due = NULL;
+        pthread_mutex_lock(&wheelLock);
+        Timer_Wheel_Advance(&wheel, now, Collect_Expired, &due);
+        pthread_mutex_unlock(&wheelLock);
+        
+        // The wheel's reference keeps each connection alive meanwhile
+        for (connection = due; NULL != connection;
+             connection = connection->heartbeatNext)
+        {
+            Check_Connection(connection, now);
+        }
+        
+        released = NULL;
+        pthread_mutex_lock(&wheelLock);
+        while (NULL != due)
+        {
+            connection = due;
+            due = due->heartbeatNext;
+            if (HEARTBEAT_REMOVED == connection->heartbeatState)
+            {
+                connection->heartbeatState = HEARTBEAT_UNTRACKED;
+                connection->heartbeatNext = released;
+                released = connection;
+            }
+            else
+            {
+                connection->heartbeatState = HEARTBEAT_ARMED;
+                Timer_Wheel_Add(&wheel, &(connection->idleTimer),
+                                Next_Deadline(connection, now));
+            }
+        }
+        pthread_mutex_unlock(&wheelLock);
+        
+        while (NULL != released)
+        {
+            connection = released;
+            released = released->heartbeatNext;
+            Release_Connection(connection);
+        }
+    }
+    return NULL;
+}
+
+//********************************************
+int Start_Heartbeat(heartbeat_ping_t sendPing)
+{
+    uint64_t now = Clock_Tick();
+    
+    pingFunction = sendPing;
+    __atomic_store_n(&currentTick, now, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&wheelLock);
+    Init_Timer_Wheel(&wheel, now);
+    pthread_mutex_unlock(&wheelLock);
+    
+    if (0 != pthread_create(&heartbeatThread, NULL, ThreadHeartbeat, NULL))
+    {
+        return 1;
+    }
+    heartbeatRunning = true;
+    return 0;
+}
+
+//********************************************
+void Stop_Heartbeat(void)
+{
+    if (!heartbeatRunning)
+    {
+        return;
+    }
+    __atomic_store_n(&heartbeatStopping, true, __ATOMIC_RELAXED);
+    pthread_join(heartbeatThread, NULL);
+    heartbeatRunning = false;
+}
+
+//********************************************
+void Set_Heartbeat_Timeouts(uint64_t idleMs, uint64_t pingMs)
+{
+    // Round up so a short timeout doesn't become "off"
+    __atomic_store_n(&idleTicks,
+                     (idleMs + HEARTBEAT_TICK_MS - 1) / HEARTBEAT_TICK_MS,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&pingTicks,
+                     (pingMs + HEARTBEAT_TICK_MS - 1) / HEARTBEAT_TICK_MS,
+                     __ATOMIC_RELAXED);
+}
+
+//********************************************
+void Get_Heartbeat_Timeouts(uint64_t * idleMs, uint64_t * pingMs)
+{
+    *idleMs = __atomic_load_n(&idleTicks, __ATOMIC_RELAXED) *
+              HEARTBEAT_TICK_MS;
+    *pingMs = __atomic_load_n(&pingTicks, __ATOMIC_RELAXED) *
+              HEARTBEAT_TICK_MS;
+}
+
+//********************************************
+void Heartbeat_Add(connection_t * connection)
+{
+    uint64_t now = __atomic_load_n(&currentTick, __ATOMIC_RELAXED);
+    
+    Retain_Connection(connection);
+    connection->lastActivity = now;
+    connection->lastPing = 0;
+    Init_Wheel_Timer(&(connection->idleTimer));
+    
+    pthread_mutex_lock(&wheelLock);
+    connection->heartbeatState = HEARTBEAT_ARMED;
+    Timer_Wheel_Add(&wheel, &(connection->idleTimer),
+                    Next_Deadline(connection, now));
+    pthread_mutex_unlock(&wheelLock);
+}
+
+//********************************************
+void Heartbeat_Remove(connection_t * connection)
+{
+    bool release = false;
+    
+    pthread_mutex_lock(&wheelLock);
+    if (HEARTBEAT_ARMED == connection->heartbeatState)
+    {
+        Timer_Wheel_Remove(&(connection->idleTimer));
+        connection->heartbeatState = HEARTBEAT_UNTRACKED;
+        release = true;
+    }
+    else if (HEARTBEAT_FIRING == connection->heartbeatState)
+    {
+        // The heartbeat thread is looking at it; let it drop the reference
+        connection->heartbeatState = HEARTBEAT_REMOVED;
+    }
+    pthread_mutex_unlock(&wheelLock);
+    
+    if (release)
+    {
+        Release_Connection(connection);
+    }
+}
+
+//********************************************
+void Heartbeat_Activity(connection_t * connection)
+{
+    __atomic_store_n(&(connection->lastActivity),
+                     __atomic_load_n(&currentTick, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+}
+
+//********************************************
+void Get_Heartbeat_Counts(uint64_t * pings, uint64_t * timeouts)
+{
+    *pings = __atomic_load_n(&pingCount, __ATOMIC_RELAXED);
+    *timeouts = __atomic_load_n(&timeoutCount, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,70 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      heartbeat.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Idle timeouts and application level pings for chat connections. A
+ *    single thread owns a timer wheel holding one timer per connection.
+ *    Readers only record the time of their last activity (a plain store of
+ *    a clock the heartbeat thread keeps up to date); the timer checks that
+ *    when it fires and re-arms itself if the connection was active, so
+ *    nothing is locked per message.
+ *
+ ************************************************************/
+#include <stdint.h>
+
+#include "connection.h"
+
+// Length of a timer wheel tick, in ms
+#define HEARTBEAT_TICK_MS 100
+
+// Called by the heartbeat thread to send a ping to a connection
+typedef void (*heartbeat_ping_t)(connection_t * connection);
+
+// Start the heartbeat thread
+// Return zero on success
+// Params:
+//    sendPing: function to send a ping frame to a connection
+int Start_Heartbeat(heartbeat_ping_t sendPing);
+
+// Stop the heartbeat thread. Connections still being tracked keep the
+// reference the heartbeat took until Heartbeat_Remove is called on them.
+void Stop_Heartbeat(void);
+
+// Change the timeouts. 0 turns the corresponding feature off.
+// Params:
+//    idleMs: disconnect a connection after this long without input
+//    pingMs: ping a connection (if it speaks the control protocol) after this
+//       long without input
+void Set_Heartbeat_Timeouts(uint64_t idleMs, uint64_t pingMs);
+
+// Get the current timeouts
+// Params:
+//    idleMs, pingMs: where to store them
+void Get_Heartbeat_Timeouts(uint64_t * idleMs, uint64_t * pingMs);
+
+// Start tracking a connection. Takes a reference on it.
+// Params:
+//    connection: connection to track
+void Heartbeat_Add(connection_t * connection);
+
+// Stop tracking a connection and drop the heartbeat's reference
+// Params:
+//    connection: connection added with Heartbeat_Add
+void Heartbeat_Remove(connection_t * connection);
+
+// Note that a connection just sent us something. Lock free; meant to be
+// called on every read.
+// Params:
+//    connection: connection that was active
+void Heartbeat_Activity(connection_t * connection);
+
+// Get counters since startup
+// Params:
+//    pings: where to store the number of pings sent
+//    timeouts: where to store the number of idle connections dropped
+void Get_Heartbeat_Counts(uint64_t * pings, uint64_t * timeouts);
@@ -6,6 +6,9 @@
  *  Last modified 2016-05-17 by Erik Andersen <erik.andersen@oit.edu>
  *   Fixed prev pointers in all functions. Re-wrote the DeleteItemsFilter
  *   function.
+ *  2026-10-18 by Erik Andersen: nodes are now built on an embedded
+ *   list_link_t, which is also exposed for intrusive use. Added versioned,
+ *   refcounted snapshots.
  **************************************************************
  * 
  * Overview:
@@ -21,24 +24,32 @@
 #include "list.h"
 
 //********************************************
-// typedef for an element of the list
+// typedef for an element of the list used by the int functions. The link is
+// first so an item_t * and its list_link_t * are interchangeable.
 typedef struct item_s
 {
+    list_link_t link;
     int data;
-    struct item_s *next;
-    struct item_s *prev;
 } item_t;
 
 //********************************************
 // typedef for the actual list
 typedef struct list_s
 {
-    item_t* head;
-    item_t* tail;
+    list_link_t* head;
+    list_link_t* tail;
     pthread_mutex_t lock;
+    // Bumped on every membership change of a link list
+    unsigned long version;
+    int count;
+    // Most recent snapshot, holding a reference of its own. NULL if none yet.
+    list_snapshot_t * snapshot;
+    void (*retain)(list_link_t * link);
+    void (*release)(list_link_t * link);
 } list_t;
 
 static int Remove_From_Beginning_Prelocked(linked_list_t l, int* data);
+static void Unlink_Prelocked(list_t * list, list_link_t * link);
 
 //********************************************
 linked_list_t* Init_List()
@@ -54,6 +65,11 @@ linked_list_t* Init_List()
     pthread_mutex_lock(&(list->lock));
     list->head = NULL;
     list->tail = NULL;
+    list->version = 0;
+    list->count = 0;
+    list->snapshot = NULL;
+    list->retain = NULL;
+    list->release = NULL;
     pthread_mutex_unlock(&(list->lock));
 
     return (linked_list_t *)list;
@@ -78,6 +94,10 @@ int Delete_List(linked_list_t l)
     pthread_mutex_unlock(&(list->lock));
     pthread_mutex_destroy(&(list->lock));
 
+    if (list->snapshot)
+    {
+        Release_Snapshot(list->snapshot);
+    }
     free(list);
     return 0;
 }
@@ -93,16 +113,8 @@ static int Remove_From_Beginning_Prelocked(linked_list_t l, int* data)
         return LL_LIST_EMPTY;
     }
     
-    item = list->head;
-    list->head = item->next;
-    if (list->head == NULL)
-    {
-        list->tail = NULL;
-    }
-    else
-    {
-        list->head->prev = NULL;
-    }
+    item = (item_t *)list->head;
+    Unlink_Prelocked(list, &(item->link));
     
     if (data != NULL)
     {
@@ -118,7 +130,6 @@ static int Remove_From_Beginning_Prelocked(linked_list_t l, int* data)
 int Insert_At_Beginning(linked_list_t l, int data)
 {
     item_t *item;
-    list_t *list = (list_t *)l;
     
     item = (item_t *)malloc(sizeof(item_t));
     if (item == NULL)
@@ -127,24 +138,10 @@ int Insert_At_Beginning(linked_list_t l, int data)
     }
 
     item->data = data;
-    item->prev = NULL;
-    pthread_mutex_lock(&(list->lock));
-    item->next = list->head;
-
-    if (item->next != NULL)
-    {
-        item->next->prev = item;
-    }
-    else
-    {
-        list->tail = item;
-    }
-
-    list->head = item;
-
-    pthread_mutex_unlock(&(list->lock));
+    item->link.next = NULL;
+    item->link.prev = NULL;
 
-    return 0;
+    return Insert_Link_At_Beginning(l, &(item->link));
 }
 
 //********************************************
@@ -159,16 +156,8 @@ int Remove_From_Beginning(linked_list_t l, int* data)
     }
 
     pthread_mutex_lock(&(list->lock));
-    item = list->head;
-    list->head = item->next;
-    if (list->head == NULL)
-    {
-        list->tail = NULL;
-    }
-    else
-    {
-        list->head->prev = NULL;
-    }
+    item = (item_t *)list->head;
+    Unlink_Prelocked(list, &(item->link));
 
     if (data != NULL)
     {
@@ -190,11 +179,11 @@ int Traverse(linked_list_t l, void (*action)(int value, void * userData),
     list_t *list = (list_t *)l;
 
     pthread_mutex_lock(&(list->lock));
-    item = list->head;
+    item = (item_t *)list->head;
     while (item != NULL)
     {
         action(item->data, userData);
-        item = item->next;
+        item = (item_t *)item->link.next;
     }
     pthread_mutex_unlock(&(list->lock));
 
@@ -211,7 +200,7 @@ int DeleteItemsFilter(linked_list_t l,
     list_t *list = (list_t *)l;
     
     pthread_mutex_lock(&(list->lock));
-    item = list->head;
+    item = (item_t *)list->head;
     while (item != NULL)
     {
         if (deleteTest(item->data, userData))
@@ -220,39 +209,237 @@ int DeleteItemsFilter(linked_list_t l,
             ++removedCount;
             item_t * toRemove = item;
             
-            // At the start or not
-            if (NULL == item->prev)
-            {
-                // At the start
-                // No node before us -- removed start of the list, update head
-                list->head = item->next;
-            }
-            else
-            {
-                // Not at the start
-                // Node before us is a real node, not head
-                item->prev->next = item->next;
-            }
-            
-            if (item->next)
-            {
-                item->next->prev = item->prev;
-            }
-            else
-            {
-                // At end of list
-                list->tail = item->prev;
-            }
-            
-            item = item->next;
+            item = (item_t *)item->link.next;
+            Unlink_Prelocked(list, &(toRemove->link));
             free(toRemove);
         }
         else
         {
-            item = item->next;
+            item = (item_t *)item->link.next;
         }
     }
     pthread_mutex_unlock(&(list->lock));
     
     return removedCount;
-}
\ No newline at end of file
+}
+
+//********************************************
+// Take a link out of the list, fixing up head/tail as needed. Caller holds
+// the list lock and has checked that link is on this list.
+static void Unlink_Prelocked(list_t * list, list_link_t * link)
+{
+    // At the start or not
+    if (NULL == link->prev)
+    {
+        // No node before us -- removed start of the list, update head
+        list->head = link->next;
+    }
+    else
+    {
+        link->prev->next = link->next;
+    }
+    
+    if (link->next)
+    {
+        link->next->prev = link->prev;
+    }
+    else
+    {
+        // At end of list
+        list->tail = link->prev;
+    }
+    
+    link->next = NULL;
+    link->prev = NULL;
+}
+
+//********************************************
+int Insert_Link_At_Beginning(linked_list_t l, list_link_t * link)
+{
+    list_t *list = (list_t *)l;
+
+    link->prev = NULL;
+    pthread_mutex_lock(&(list->lock));
+    link->next = list->head;
+
+    if (link->next != NULL)
+    {
+        link->next->prev = link;
+    }
+    else
+    {
+        list->tail = link;
+    }
+
+    list->head = link;
+    ++(list->version);
+    ++(list->count);
+
+    pthread_mutex_unlock(&(list->lock));
+
+    return 0;
+}
+
+//********************************************
+int Remove_Link(linked_list_t l, list_link_t * link)
+{
+    list_t *list = (list_t *)l;
+    list_snapshot_t * stale;
+
+    pthread_mutex_lock(&(list->lock));
+    // Only the head has no prev pointer, so anything else without one has
+    // already been removed (or was never inserted)
+    if (NULL == link->prev && list->head != link)
+    {
+        pthread_mutex_unlock(&(list->lock));
+        return LL_NOT_FOUND;
+    }
+    Unlink_Prelocked(list, link);
+    ++(list->version);
+    --(list->count);
+    // Drop the cached snapshot now rather than at the next acquire, so the
+    // removed object isn't kept alive by it while the list sits idle
+    stale = list->snapshot;
+    list->snapshot = NULL;
+    pthread_mutex_unlock(&(list->lock));
+
+    if (stale)
+    {
+        Release_Snapshot(stale);
+    }
+
+    return 0;
+}
+
+//********************************************
+int Traverse_Links(linked_list_t l,
+                   void (*action)(list_link_t * link, void * userData),
+                   void * userData)
+{
+    list_link_t *link;
+    list_t *list = (list_t *)l;
+
+    pthread_mutex_lock(&(list->lock));
+    link = list->head;
+    while (link != NULL)
+    {
+        action(link, userData);
+        link = link->next;
+    }
+    pthread_mutex_unlock(&(list->lock));
+
+    return 0;
+}
+
+//********************************************
+int Set_Snapshot_Refcounting(linked_list_t l,
+                             void (*retain)(list_link_t * link),
+                             void (*release)(list_link_t * link))
+{
+    list_t *list = (list_t *)l;
+
+    pthread_mutex_lock(&(list->lock));
+    list->retain = retain;
+    list->release = release;
+    pthread_mutex_unlock(&(list->lock));
+
+    return 0;
+}
+
+//********************************************
+list_snapshot_t * Acquire_Snapshot(linked_list_t l)
+{
+    list_t *list = (list_t *)l;
+    list_snapshot_t * snapshot;
+    list_snapshot_t * stale = NULL;
+    list_link_t * link;
+    int index = 0;
+
+    pthread_mutex_lock(&(list->lock));
+    snapshot = list->snapshot;
+    if (snapshot != NULL && snapshot->version == list->version)
+    {
+        // Nobody joined or left since the last one, share it
+        __atomic_add_fetch(&(snapshot->refCount), 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&(list->lock));
+        return snapshot;
+    }
+
+    snapshot = (list_snapshot_t *)malloc(sizeof(list_snapshot_t));
+    if (snapshot == NULL)
+    {
+        pthread_mutex_unlock(&(list->lock));
+        return NULL;
+    }
+    snapshot->links = (list_link_t **)malloc(
+        sizeof(list_link_t *) * (list->count > 0 ? list->count : 1));
+    if (snapshot->links == NULL)
+    {
+        pthread_mutex_unlock(&(list->lock));
+        free(snapshot);
+        return NULL;
+    }
+
+    for (link = list->head; link != NULL; link = link->next)
+    {
+        if (list->retain)
+        {
+            list->retain(link);
+        }
+        snapshot->links[index++] = link;
+    }
+    snapshot->count = index;
+    snapshot->version = list->version;
+    snapshot->release = list->release;
+    // One reference for the caller, one for the list's cache
+    snapshot->refCount = 2;
+
+    stale = list->snapshot;
+    list->snapshot = snapshot;
+    pthread_mutex_unlock(&(list->lock));
+
+    // Drop the cache's reference to the old one outside the lock, since it
+    // may run release on every link
+    if (stale)
+    {
+        Release_Snapshot(stale);
+    }
+
+    return snapshot;
+}
+
+//********************************************
+void Release_Snapshot(list_snapshot_t * snapshot)
+{
+    int index;
+
+    if (0 != __atomic_sub_fetch(&(snapshot->refCount), 1, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+
+    if (snapshot->release)
+    {
+        for (index = 0; index < snapshot->count; ++index)
+        {
+            snapshot->release(snapshot->links[index]);
+        }
+    }
+    free(snapshot->links);
+    free(snapshot);
+}
+
+//********************************************
+int Traverse_Snapshot(list_snapshot_t * snapshot,
+                      void (*action)(list_link_t * link, void * userData),
+                      void * userData)
+{
+    int index;
+
+    for (index = 0; index < snapshot->count; ++index)
+    {
+        action(snapshot->links[index], userData);
+    }
+
+    return 0;
+}
@@ -5,6 +5,9 @@
  * Date Created:  ?
  * Modifications: 2016-05-17 by Erik Andersen <erik.andersen@oit.edu>
  *   (added DeleteItemsFilter header)
+ *   2026-10-18 by Erik Andersen: added intrusive link API so list nodes can
+ *   live inside the objects they carry, and snapshots for traversing without
+ *   holding the list lock
  **************************************************************
  * 
  * Overview:
@@ -12,19 +15,55 @@
  *
  ************************************************************/
 
+#include <stddef.h>
+
 // Error returns
 #define LL_OUT_OF_MEMORY    1
 #define LL_LIST_EMPTY 3
+#define LL_NOT_FOUND 4
 
 // Opaque type for lists
 typedef void *linked_list_t;
 
+// Link to embed in a structure so it can be put on a list without a separate
+// node allocation. A list must be used either entirely through the int
+// functions or entirely through the *_Link functions, never both.
+typedef struct list_link_s
+{
+    struct list_link_s *next;
+    struct list_link_s *prev;
+} list_link_t;
+
+// Get a pointer to the structure a list_link_t is embedded in
+// Params:
+//    link: pointer to the embedded list_link_t
+//    type: type of the containing structure
+//    member: name of the list_link_t field in type
+#define LIST_ENTRY(link, type, member) \
+    ((type *)((char *)(link) - offsetof(type, member)))
+
+// Refcounted copy of the links on a list at one point in time. Snapshots are
+// shared: everyone acquiring between two membership changes gets the same one.
+// Treat as read only.
+typedef struct list_snapshot_s
+{
+    int refCount;
+    // Value of the list's version counter when this was taken
+    unsigned long version;
+    int count;
+    list_link_t ** links;
+    // Called on each link when the last reference is dropped
+    void (*release)(list_link_t * link);
+} list_snapshot_t;
+
 // Create and initialize a list. 
 // Return pointer to list. Return NULL on failure.
 linked_list_t* Init_List();
 
 // Delete a list are free all memory used by the list
 // It is erroneous to use the list pointer after caling this routine.
+// Lists used through the *_Link functions must be emptied by the caller first,
+// since their nodes belong to the caller.
 // Return zero on success
 int Delete_List(linked_list_t list);
 
@@ -67,3 +106,71 @@ int Traverse(linked_list_t list, void (*action)(int data, void * userData),
 int DeleteItemsFilter(linked_list_t list,
                       int (*deleteTest)(int data, void * userData),
                       void * userData);
+
+// Insert a caller owned link at the beginning of the list. The link must not
+// already be on a list, and must be zeroed (or previously removed) beforehand.
+// Return zero on success
+// Params:
+//    list: list to add the link to
+//    link: link embedded in the object being added
+int Insert_Link_At_Beginning(linked_list_t list, list_link_t * link);
+
+// Remove a link from the list. The memory of the link is not touched beyond
+// clearing its pointers; the caller still owns the containing object.
+// Return zero on success, LL_NOT_FOUND if the link is not on the list
+// Params:
+//    list: list to remove the link from
+//    link: link to remove
+int Remove_Link(linked_list_t list, list_link_t * link);
+
+// Iterate through the list. Call a function on each link.
+// Return zero on success
+// Params:
+//    list: list to traverse
+//    action: The function to call for each link
+//         link: The link being acted on. Use LIST_ENTRY to get the object.
+//         userData: opaque pointer for any data the user supplied function may
+//           need
+int Traverse_Links(linked_list_t list,
+                   void (*action)(list_link_t * link, void * userData),
+                   void * userData);
+
+// Set functions that keep the objects on a link list alive while they are in a
+// snapshot. retain is called (with the list locked) for each link captured
+// into a new snapshot, release for each link when that snapshot is freed.
+// Either may be NULL. Set before the list is shared between threads.
+// Return zero on success
+// Params:
+//    list: list to set the functions for
+//    retain: take a reference on the object holding link
+//    release: drop a reference on the object holding link
+int Set_Snapshot_Refcounting(linked_list_t list,
+                             void (*retain)(list_link_t * link),
+                             void (*release)(list_link_t * link));
+
+// Get a snapshot of the links currently on the list. Only copies the list if
+// its membership changed since the last snapshot, otherwise bumps a refcount.
+// Return the snapshot, or NULL on failure. Pass it to Release_Snapshot when
+// done.
+// Params:
+//    list: list to take a snapshot of
+list_snapshot_t * Acquire_Snapshot(linked_list_t list);
+
+// Drop a reference to a snapshot. Does not need the list lock.
+// Params:
+//    snapshot: snapshot from Acquire_Snapshot
+void Release_Snapshot(list_snapshot_t * snapshot);
+
+// Iterate through a snapshot. Call a function on each link. The list lock is
+// not held, so the list may change (and links may be removed from it) while
+// the action runs.
+// Return zero on success
+// Params:
+//    snapshot: snapshot to traverse
+//    action: The function to call for each link
+//         link: The link being acted on. Use LIST_ENTRY to get the object.
+//         userData: opaque pointer for any data the user supplied function may
+//           need
+int Traverse_Snapshot(list_snapshot_t * snapshot,
+                      void (*action)(list_link_t * link, void * userData),
+                      void * userData);
@@ -0,0 +1,84 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      mpscq.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Intrusive multi-producer single-consumer queue.
+ *
+ *    head is the oldest entry not yet popped. It stays on the list until the
+ *    entry after it is linked, because a producer may be about to link onto
+ *    it. When only one entry is left, the consumer pushes the stub behind it
+ *    so it can be handed out, and the stub becomes head again later.
+ *
+ *  -- See mpscq.h for function header blocks
+ *
+ ************************************************************/
+#include "mpscq.h"
+
+//********************************************
+void Init_Mpsc_Queue(mpsc_queue_t * queue)
+{
+    queue->stub.next = NULL;
+    queue->tail = &(queue->stub);
+    queue->head = &(queue->stub);
+}
+
+//********************************************
+void Mpsc_Push(mpsc_queue_t * queue, mpsc_link_t * link)
+{
+    mpsc_link_t * previous;
+
+    link->next = NULL;
+    previous = __atomic_exchange_n(&(queue->tail), link, __ATOMIC_SEQ_CST);
+    // Between the exchange and this store, the consumer just sees the queue
+    // end at previous and waits
+    __atomic_store_n(&(previous->next), link, __ATOMIC_RELEASE);
+}
+
+//********************************************
+mpsc_link_t * Mpsc_Pop(mpsc_queue_t * queue)
+{
+    mpsc_link_t * head = queue->head;
+    mpsc_link_t * next = __atomic_load_n(&(head->next), __ATOMIC_ACQUIRE);
+
+    if (&(queue->stub) == head)
+    {
+        if (NULL == next)
+        {
+            return NULL;
+        }
+        queue->head = next;
+        head = next;
+        next = __atomic_load_n(&(head->next), __ATOMIC_ACQUIRE);
+    }
+    if (NULL != next)
+    {
+        queue->head = next;
+        return head;
+    }
+    if (__atomic_load_n(&(queue->tail), __ATOMIC_ACQUIRE) != head)
+    {
+        // A producer is between its exchange and linking onto head
+        return NULL;
+    }
+    // head is the last entry. Put the stub behind it so it can go.
+    Mpsc_Push(queue, &(queue->stub));
+    next = __atomic_load_n(&(head->next), __ATOMIC_ACQUIRE);
+    if (NULL != next)
+    {
+        queue->head = next;
+        return head;
+    }
+    // A producer got in ahead of the stub and hasn't linked yet
+    return NULL;
+}
+
+//********************************************
+bool Mpsc_Empty(mpsc_queue_t * queue)
+{
+    return &(queue->stub) == queue->head &&
+           &(queue->stub) == __atomic_load_n(&(queue->tail), __ATOMIC_SEQ_CST);
+}
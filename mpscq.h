@@ -0,0 +1,74 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      mpscq.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Lock-free queue with any number of producers and a single consumer.
+ *    The link is embedded in the queued structure, so pushing never
+ *    allocates.
+ *
+ *    A push is one atomic exchange of the tail pointer followed by a store
+ *    linking the previous tail to the new entry, so producers never wait on
+ *    each other or on the consumer. Entries come out in the order their
+ *    exchanges happened. Between a producer's exchange and its store the
+ *    consumer sees the queue end early, and Mpsc_Pop returns NULL even though
+ *    Mpsc_Empty doesn't; it has the entry on a later try.
+ *
+ ************************************************************/
+#include <stdbool.h>
+#include <stddef.h>
+
+// Link to embed in a structure so it can be queued
+typedef struct mpsc_link_s
+{
+    struct mpsc_link_s * next;
+} mpsc_link_t;
+
+typedef struct
+{
+    // Most recently pushed. Producers only touch this and the link they
+    // exchanged out of it.
+    mpsc_link_t * tail;
+    // Next to pop, or the stub. Only touched by the consumer.
+    mpsc_link_t * head;
+    // Keeps the list non-empty, so producers never have to touch head
+    mpsc_link_t stub;
+} mpsc_queue_t;
+
+// Get a pointer to the structure an mpsc_link_t is embedded in
+// Params:
+//    link: pointer to the embedded mpsc_link_t
+//    type: type of the containing structure
+//    member: name of the mpsc_link_t field in type
+#define MPSC_ENTRY(link, type, member) \
+    ((type *)((char *)(link) - offsetof(type, member)))
+
+// Make a queue empty. Nothing may be using it.
+// Params:
+//    queue: queue to initialize
+void Init_Mpsc_Queue(mpsc_queue_t * queue);
+
+// Add an entry. Safe from any thread.
+// Params:
+//    queue: queue to add to
+//    link: link embedded in the entry, not on any queue
+void Mpsc_Push(mpsc_queue_t * queue, mpsc_link_t * link);
+
+// Take the oldest entry. Only the consumer thread may call this.
+// Return the entry's link, or NULL if there isn't one ready
+// Params:
+//    queue: queue to take from
+mpsc_link_t * Mpsc_Pop(mpsc_queue_t * queue);
+
+// Check for entries without taking one. Only the consumer thread may call
+// this. Sequentially consistent with Mpsc_Push, so a consumer that announces
+// it is going to sleep and then finds the queue empty can count on any later
+// producer seeing the announcement.
+// Return true if nothing has been pushed that wasn't popped
+// Params:
+//    queue: queue to check
+bool Mpsc_Empty(mpsc_queue_t * queue);
@@ -0,0 +1,130 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      netconnect.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Client side connection setup and writes, moved out of client.c.
+ * 
+ *  -- See netconnect.h for function header blocks
+ *
+ ************************************************************/
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "netconnect.h"
+
+//********************************************
+int Connect_Unix(const char * path)
+{
+    struct sockaddr_un address;
+    int fd;
+    
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Unix socket path is too long.\n");
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    
+    if (-1 == (fd = socket(AF_UNIX, SOCK_STREAM, 0)))
+    {
+        perror("Trouble getting a socket: ");
+        return -1;
+    }
+    if (-1 == connect(fd, (struct sockaddr *)&address, sizeof(address)))
+    {
+        perror("Trouble connecting: ");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//********************************************
+// Connect_Tcp and Connect_Udp, for a socket type
+static int Connect_Inet(const char * address, const char * port,
+                        int socketType)
+{
+    // For critera for lookup
+    struct addrinfo hints;
+    struct addrinfo * destInfoResults;
+    
+    // Initialize the struct
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC; // Use IPv4 or IPv6, we don't care
+    hints.ai_socktype = socketType;
+    
+    // Do the lookup
+    int returnStatus = -1;
+    if (0 != (returnStatus = getaddrinfo(address, port, &hints,
+        &destInfoResults)) )
+    {
+        fprintf(stderr, "Couldn't get address lookup info: %s\n",
+                gai_strerror(returnStatus));
+        return -1;
+    }
+    
+    // Loop through results until one works
+    bool connectSuccess = false;
+    int fd = -1;
+    struct addrinfo * p = destInfoResults;
+    for (; (!connectSuccess) && NULL != p; p = p->ai_next)
+    {
+        if (-1 != (fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)))
+        {
+            if (-1 != connect(fd, p->ai_addr, p->ai_addrlen))
+            {
+                connectSuccess = true;
+            }
+            else
+            {
+                close(fd);
+                perror("Trouble connecting: ");
+            }
+        }
+        else
+        {
+            perror("Trouble getting a socket: ");
+        }
+    }
+    freeaddrinfo(destInfoResults);
+    
+    return connectSuccess ? fd : -1;
+}
+
+//********************************************
+int Connect_Tcp(const char * address, const char * port)
+{
+    return Connect_Inet(address, port, SOCK_STREAM);
+}
+
+//********************************************
+int Connect_Udp(const char * address, const char * port)
+{
+    // Nothing goes over the wire yet; this only fixes the peer address
+    return Connect_Inet(address, port, SOCK_DGRAM);
+}
+
+//********************************************
+int Write_All(int fd, const char * buf, int length)
+{
+    int written = 0;
+    int writtenThisRound = 0;
+    while (written < length &&
+        0 < (writtenThisRound = write(fd, buf + written, length - written)))
+    {
+        written += writtenThisRound;
+    }
+    return (written == length) ? 0 : -1;
+}
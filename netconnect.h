@@ -0,0 +1,41 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      netconnect.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Connecting and writing to a chat server, shared by the client and the
+ *    tools that drive a server the way clients do.
+ *
+ ************************************************************/
+
+// Look up the server's address and connect to the first result that works
+// Return a connected socket, or -1 with an error written to stderr
+// Params:
+//    address: host name or address
+//    port: port number or service name
+int Connect_Tcp(const char * address, const char * port);
+
+// Look up the server's address and make a datagram socket that sends to and
+// only receives from the first result that works
+// Return the socket, or -1 with an error written to stderr
+// Params:
+//    address: host name or address
+//    port: port number or service name
+int Connect_Udp(const char * address, const char * port);
+
+// Connect to a server's Unix domain socket
+// Return a connected socket, or -1 with an error written to stderr
+// Params:
+//    path: path of the socket
+int Connect_Unix(const char * path);
+
+// Write a whole buffer to an fd, retrying partial writes
+// Return 0 if everything was written, -1 otherwise
+// Params:
+//    fd: open for writing
+//    buf, length: what to write
+int Write_All(int fd, const char * buf, int length);
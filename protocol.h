@@ -0,0 +1,84 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      protocol.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Wire constants shared by the chat client and server. The stream is plain
+ *    chat text, except for control lines, which start with PROTO_CONTROL and
+ *    end with a newline. Chat text typed into the client never contains
+ *    PROTO_CONTROL.
+ *
+ *    A client that wants options sends a HELLO line as the very first thing
+ *    after connecting:
+ *        \001HELLO <option> <option>...\n
+ *    and the server answers with the options it accepted:
+ *        \001WELCOME <option> <option>...\n
+ *    The server doesn't wait for a HELLO before sending chat, so plain chat
+ *    may come ahead of the WELCOME; the options apply to everything after
+ *    it. Chat the server read before setting up a filter and hasn't sent
+ *    yet can't be checked against it, so it is dropped rather than sent
+ *    unfiltered. Clients that don't send HELLO get plain chat, as before.
+ *
+ ************************************************************/
+
+#define PROTO_CONTROL '\001'
+#define PROTO_HELLO "\001HELLO"
+#define PROTO_WELCOME "\001WELCOME"
+
+// Longest control line either side will accept
+#define PROTO_MAX_LINE 256
+
+// Sent by the server to a quiet client that said HELLO. The client answers
+// with PROTO_PONG; any input at all counts as being alive, though.
+#define PROTO_PING "\001PING"
+#define PROTO_PONG "\001PONG"
+
+// Option: deliver broadcasts through a shared memory ring. Only honored on
+// the Unix domain socket. The WELCOME line carries the ring's fds.
+#define PROTO_OPT_SHM "shm"
+
+// Option: only send chat matching a filter, as filter=<pattern>,<pattern>...
+// A message matches if it contains any of the patterns; a pattern starting
+// with ^ must be at the start of the message instead. Patterns can't contain
+// spaces or commas. Filters apply to each message as the server read it.
+#define PROTO_OPT_FILTER "filter="
+
+// Datagrams, for a server listening with -U. Each datagram is a sequence
+// number, PROTO_UDP_HEADER bytes in network byte order, then the payload.
+// Each side numbers the datagrams it sends one up from the last, so the
+// other can spot what was lost or arrived out of order; the server numbers
+// broadcasts once for all subscribers. Payloads are chat, except that one
+// starting with PROTO_CONTROL is a control line without the newline, such
+// as PROTO_UDP_BYE to unsubscribe.
+//
+// A source address can be forged, so the server only subscribes an address
+// that proves it gets datagrams sent to it. The client sends
+//     \001COOKIE 0000000000000000
+// and the server answers with the same line holding a cookie of
+// PROTO_UDP_COOKIE_DIGITS hex digits in place of the zeros. The client
+// sends that line back, and the server subscribes it and sends the line
+// once more to say so. Until then the server drops anything else from the
+// address and answers nothing bigger than what it was sent. Control
+// datagrams to a client that isn't subscribed yet have sequence number 0.
+// A subscribed client sends an empty datagram every PROTO_UDP_KEEPALIVE_MS
+// while it has nothing to say.
+#define PROTO_UDP_HEADER 4
+// Biggest payload either side sends. Longer chat is split.
+#define PROTO_UDP_MAX_PAYLOAD 1400
+#define PROTO_UDP_KEEPALIVE_MS 10000
+#define PROTO_UDP_BYE "\001BYE"
+#define PROTO_UDP_COOKIE "\001COOKIE "
+#define PROTO_UDP_COOKIE_DIGITS 16
+
+// Option: the client can take compressed chat. The server may then send a
+// message as a frame instead:
+//     \001Z <compressed length> <plain length>\n
+// followed by the compressed length in bytes of the chat in zlib format
+// (RFC 1950). Only messages of at least the server's threshold are
+// compressed; the rest come as plain chat, as before.
+#define PROTO_OPT_DEFLATE "deflate"
+#define PROTO_COMPRESSED "\001Z"
@@ -0,0 +1,202 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      ratelimit.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Token bucket rate limiting for the read path.
+ * 
+ *  -- See ratelimit.h for function header blocks
+ *
+ ************************************************************/
+#include <pthread.h>
+#include <time.h>
+
+#include "ratelimit.h"
+#include "shutdown.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+// Current limits. Written under configLock; readers notice changes through
+// configVersion and copy the limits under the lock.
+static rate_limit_t limits[RATE_LIMIT_COUNT];
+static unsigned long configVersion = 1;
+static pthread_mutex_t configLock = PTHREAD_MUTEX_INITIALIZER;
+// Non-zero when either global limit is set, so readers can skip globalLock
+static int globalLimitsSet = 0;
+
+// Buckets shared by every connection, only locked when a global limit is set
+static token_bucket_t globalBytes;
+static token_bucket_t globalMessages;
+static pthread_mutex_t globalLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t totalThrottleCount = 0;
+static uint64_t totalThrottledNs = 0;
+
+//********************************************
+static uint64_t Now_Ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+//********************************************
+// Add tokens for the time since the last refill, take amount out, and return
+// how many ns until the bucket is back out of debt
+static uint64_t Charge_Bucket(token_bucket_t * bucket,
+                              const rate_limit_t * limit, double amount,
+                              uint64_t now)
+{
+    if (limit->rate <= 0)
+    {
+        return 0;
+    }
+    
+    if (0 == bucket->lastRefill)
+    {
+        // First use: start full
+        bucket->tokens = limit->burst;
+    }
+    else if (now > bucket->lastRefill)
+    {
+        bucket->tokens += limit->rate * (double)(now - bucket->lastRefill) /
+                          NS_PER_SEC;
+    }
+    if (bucket->tokens > limit->burst)
+    {
+        bucket->tokens = limit->burst;
+    }
+    bucket->lastRefill = now;
+    
+    bucket->tokens -= amount;
+    if (bucket->tokens >= 0)
+    {
+        return 0;
+    }
+    return (uint64_t)(-bucket->tokens / limit->rate * NS_PER_SEC);
+}
+
+//********************************************
+void Init_Rate_State(rate_state_t * state)
+{
+    state->bytes.tokens = 0;
+    state->bytes.lastRefill = 0;
+    state->messages.tokens = 0;
+    state->messages.lastRefill = 0;
+    state->limits[0].rate = 0;
+    state->limits[0].burst = 0;
+    state->limits[1].rate = 0;
+    state->limits[1].burst = 0;
+    // Force a copy of the limits on first use
+    state->configVersion = 0;
+    state->throttleCount = 0;
+    state->throttledNs = 0;
+}
+
+//********************************************
+int Set_Rate_Limit(rate_limit_kind kind, double rate, double burst)
+{
+    if (kind < 0 || kind >= RATE_LIMIT_COUNT || rate < 0 || burst < 0)
+    {
+        return 1;
+    }
+    if (0 == burst)
+    {
+        burst = rate;
+    }
+    
+    pthread_mutex_lock(&configLock);
+    limits[kind].rate = rate;
+    limits[kind].burst = burst;
+    __atomic_store_n(&globalLimitsSet, limits[RATE_GLOBAL_BYTES].rate > 0 ||
+                     limits[RATE_GLOBAL_MESSAGES].rate > 0, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&configVersion, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&configLock);
+    
+    return 0;
+}
+
+//********************************************
+void Get_Rate_Limit(rate_limit_kind kind, rate_limit_t * limit)
+{
+    pthread_mutex_lock(&configLock);
+    *limit = limits[kind];
+    pthread_mutex_unlock(&configLock);
+}
+
+//********************************************
+uint64_t Rate_Limit_Read(rate_state_t * state, size_t byteCount)
+{
+    uint64_t now = Now_Ns();
+    uint64_t wait = 0;
+    uint64_t otherWait = 0;
+    rate_limit_t globalLimits[2];
+    
+    // Pick up limit changes without taking a lock on every read
+    if (state->configVersion !=
+        __atomic_load_n(&configVersion, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_lock(&configLock);
+        state->limits[0] = limits[RATE_CONN_BYTES];
+        state->limits[1] = limits[RATE_CONN_MESSAGES];
+        state->configVersion = configVersion;
+        pthread_mutex_unlock(&configLock);
+    }
+    
+    wait = Charge_Bucket(&(state->bytes), &(state->limits[0]),
+                         (double)byteCount, now);
+    otherWait = Charge_Bucket(&(state->messages), &(state->limits[1]), 1,
+                              now);
+    if (otherWait > wait)
+    {
+        wait = otherWait;
+    }
+    
+    if (__atomic_load_n(&globalLimitsSet, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_lock(&configLock);
+        globalLimits[0] = limits[RATE_GLOBAL_BYTES];
+        globalLimits[1] = limits[RATE_GLOBAL_MESSAGES];
+        pthread_mutex_unlock(&configLock);
+        
+        pthread_mutex_lock(&globalLock);
+        otherWait = Charge_Bucket(&globalBytes, &(globalLimits[0]),
+                                  (double)byteCount, now);
+        if (otherWait > wait)
+        {
+            wait = otherWait;
+        }
+        otherWait = Charge_Bucket(&globalMessages, &(globalLimits[1]), 1, now);
+        if (otherWait > wait)
+        {
+            wait = otherWait;
+        }
+        pthread_mutex_unlock(&globalLock);
+    }
+    
+    if (0 == wait)
+    {
+        return 0;
+    }
+    
+    // Over the limit: don't read again until the debt is paid off
+    Shutdown_Sleep(wait);
+    uint64_t slept = Now_Ns() - now;
+    
+    ++(state->throttleCount);
+    state->throttledNs += slept;
+    __atomic_add_fetch(&totalThrottleCount, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totalThrottledNs, slept, __ATOMIC_RELAXED);
+    
+    return slept;
+}
+
+//********************************************
+void Get_Rate_Totals(uint64_t * throttleCount, uint64_t * throttledNs)
+{
+    *throttleCount = __atomic_load_n(&totalThrottleCount, __ATOMIC_RELAXED);
+    *throttledNs = __atomic_load_n(&totalThrottledNs, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,94 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      ratelimit.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Token bucket rate limiting for the chat server's read path. Each
+ *    connection has buckets for bytes and messages, and there is one global
+ *    pair shared by all connections. A reader that goes over its limits is
+ *    put to sleep before its next read, so the client is slowed down by TCP
+ *    flow control instead of having data dropped.
+ *
+ ************************************************************/
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Which limit to get or set
+typedef enum
+{
+    RATE_CONN_BYTES,
+    RATE_CONN_MESSAGES,
+    RATE_GLOBAL_BYTES,
+    RATE_GLOBAL_MESSAGES,
+    RATE_LIMIT_COUNT
+} rate_limit_kind;
+
+typedef struct
+{
+    // Tokens added per second. 0 means unlimited.
+    double rate;
+    // Most tokens the bucket can hold
+    double burst;
+} rate_limit_t;
+
+typedef struct
+{
+    // Can go negative: a read is charged after it happens, and the reader
+    // then waits out the debt
+    double tokens;
+    // CLOCK_MONOTONIC time of the last refill, in ns
+    uint64_t lastRefill;
+} token_bucket_t;
+
+// Per-connection limiter state. Only touched by the connection's reader,
+// except that the counters may be read (racily) for stats.
+typedef struct
+{
+    token_bucket_t bytes;
+    token_bucket_t messages;
+    // Copy of the per-connection limits, refreshed when the version changes
+    rate_limit_t limits[2];
+    unsigned long configVersion;
+    // Times this connection had to wait, and total time spent waiting
+    uint64_t throttleCount;
+    uint64_t throttledNs;
+} rate_state_t;
+
+// Initialize a connection's limiter state
+// Params:
+//    state: state to initialize
+void Init_Rate_State(rate_state_t * state);
+
+// Change a limit. Takes effect at each reader's next read.
+// Return zero on success, non-zero if the values are invalid
+// Params:
+//    kind: which limit to change
+//    rate: tokens per second, 0 for unlimited
+//    burst: bucket size, 0 for one second worth of rate
+int Set_Rate_Limit(rate_limit_kind kind, double rate, double burst);
+
+// Get the current value of a limit
+// Params:
+//    kind: which limit to get
+//    limit: where to store it
+void Get_Rate_Limit(rate_limit_kind kind, rate_limit_t * limit);
+
+// Charge a completed read against the connection's and the global buckets,
+// then sleep until both are within their limits again. Returns early if
+// server shutdown is requested (see shutdown.h).
+// Return the number of ns slept
+// Params:
+//    state: the reading connection's limiter state
+//    byteCount: bytes the read returned
+uint64_t Rate_Limit_Read(rate_state_t * state, size_t byteCount);
+
+// Get totals across all connections, past and present
+// Params:
+//    throttleCount: where to store the number of waits
+//    throttledNs: where to store the total time waited
+void Get_Rate_Totals(uint64_t * throttleCount, uint64_t * throttledNs);
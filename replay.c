@@ -0,0 +1,603 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      replay.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Plays a capture taken with the server's -c option back against a
+ *    server. Each captured connection gets its own connection, opened,
+ *    written to and closed on the captured schedule, so the server sees the
+ *    same shape of load it saw in production. Broadcasts coming back are
+ *    read and thrown away by a second thread, so the server never blocks
+ *    writing to us. Connections that sent a HELLO send it again with the
+ *    same options: filter, deflate, and shared memory, whose ring the
+ *    second thread empties like a socket.
+ *
+ *    A captured disconnect only shuts our side for writing. Closing outright
+ *    with broadcasts still unread would reset the connection, and the server
+ *    would lose whatever it hadn't read from us yet. The drain thread closes
+ *    the socket once the server hangs up too.
+ *
+ * Input:
+ *    -f capture file. -s or -i and -p for the server, or -u for its Unix
+ *    domain socket. -x speed: 1 (the default) for real time, 2 for twice as
+ *    fast and so on, 0 for as fast as possible.
+ *
+ * Output:
+ *    A summary: what was replayed, how long it took, how far behind the
+ *    captured schedule replay fell, and how much came back.
+ ************************************************************/
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "connection.h"
+#include "netconnect.h"
+#include "protocol.h"
+#include "shmring.h"
+
+#define NS_PER_SEC 1000000000ULL
+#define DRAIN_BUFFER_SIZE (64 * 1024)
+#define DRAIN_EVENTS 64
+// How often the drain thread checks whether replay is over, in ms
+#define DRAIN_POLL_MS 100
+// Longest to wait at the end for the server to finish with our connections
+#define LINGER_NS (2 * NS_PER_SEC)
+
+typedef struct replay_socket_s replay_socket_t;
+
+// Something the drain thread waits on for a replayed connection: its socket,
+// or the ring the server gave it
+typedef struct
+{
+    replay_socket_t * owner;
+    bool isRing;
+} replay_watch_t;
+
+// One replayed connection. Held by the main thread until the captured
+// disconnect and by the drain thread until the server hangs up; whichever
+// lets go last closes it.
+struct replay_socket_s
+{
+    int fd;
+    int refCount;
+    // The rest is only touched by the drain thread until the last release
+    shm_ring_t * ring;
+    bool hungUp;
+    replay_watch_t socketWatch;
+    replay_watch_t ringWatch;
+};
+
+typedef struct
+{
+    char * capturePath;
+    char * address;
+    char * port;
+    char * unixPath;
+    double speed;
+} replay_options;
+
+// Sockets for captured connections, indexed by connection id - baseId.
+// Only touched by the main thread.
+typedef struct
+{
+    uint64_t baseId;
+    replay_socket_t ** sockets;
+    int capacity;
+} socket_map_t;
+
+// Shared with the drain thread
+static int epollFd = -1;
+static bool replayDone = false;
+static uint64_t bytesReceived = 0;
+// Sockets not closed yet
+static int openSockets = 0;
+
+/****************************************************************
+ * Read the command line
+ *
+ * Preconditions: argc/argv from main
+ *
+ * Postcondition:
+ *  options filled in; exits if the capture file or server is missing
+ ****************************************************************/
+void parseOptions(int argc, char ** argv, replay_options * options)
+{
+    int arg;
+
+    options->capturePath = NULL;
+    options->address = NULL;
+    options->port = NULL;
+    options->unixPath = NULL;
+    options->speed = 1;
+    while (-1 != (arg = getopt(argc, argv, "f:s:i:p:u:x:")))
+    {
+        if ('f' == arg)
+        {
+            options->capturePath = optarg;
+        }
+        // Treat -s and -i the same since getaddrinfo can handle them both
+        else if ('s' == arg || 'i' == arg)
+        {
+            options->address = optarg;
+        }
+        else if ('p' == arg)
+        {
+            options->port = optarg;
+        }
+        else if ('u' == arg)
+        {
+            options->unixPath = optarg;
+        }
+        else if ('x' == arg)
+        {
+            options->speed = atof(optarg);
+        }
+    }
+    if (NULL == options->capturePath ||
+        (NULL == options->unixPath &&
+         (NULL == options->address || NULL == options->port)))
+    {
+        fprintf(stderr, "Usage: %s -f capture (-s server -p port | -u path)"
+                " [-x speed]\n", argv[0]);
+        exit(1);
+    }
+    if (options->speed < 0)
+    {
+        fprintf(stderr, "Speed can't be negative.\n");
+        exit(1);
+    }
+}
+
+/****************************************************************
+ * Time since an arbitrary point, in ns
+ ****************************************************************/
+uint64_t nowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+/****************************************************************
+ * Find the slot for a captured connection's socket, growing the map
+ *
+ * Preconditions: map is zeroed before first use
+ *
+ * Postcondition:
+ *  returns the slot, NULL in it if there's no socket. Returns NULL if the
+ *  id is before the first one seen or memory ran out.
+ ****************************************************************/
+replay_socket_t ** socketSlot(socket_map_t * map, uint64_t id)
+{
+    uint64_t index;
+    int newCapacity;
+    replay_socket_t ** grown;
+
+    if (NULL == map->sockets)
+    {
+        map->baseId = id;
+    }
+    if (id < map->baseId)
+    {
+        return NULL;
+    }
+    index = id - map->baseId;
+    if (index >= (uint64_t)map->capacity)
+    {
+        newCapacity = map->capacity ? map->capacity : 256;
+        while ((uint64_t)newCapacity <= index)
+        {
+            newCapacity *= 2;
+        }
+        if (NULL == (grown = realloc(map->sockets,
+                                     sizeof(replay_socket_t *) * newCapacity)))
+        {
+            return NULL;
+        }
+        for (; map->capacity < newCapacity; ++map->capacity)
+        {
+            grown[map->capacity] = NULL;
+        }
+        map->sockets = grown;
+    }
+    return &(map->sockets[index]);
+}
+
+/****************************************************************
+ * Let go of a replayed connection
+ *
+ * Preconditions: the caller holds a reference on replaySocket
+ *
+ * Postcondition:
+ *  closed and freed if that was the last reference
+ ****************************************************************/
+void releaseSocket(replay_socket_t * replaySocket)
+{
+    if (0 == __atomic_sub_fetch(&(replaySocket->refCount), 1,
+                                __ATOMIC_ACQ_REL))
+    {
+        if (replaySocket->ring)
+        {
+            Delete_Shm_Ring(replaySocket->ring);
+        }
+        close(replaySocket->fd);
+        free(replaySocket);
+        __atomic_sub_fetch(&openSockets, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/****************************************************************
+ * Stop sending on a replayed connection, as at a captured disconnect
+ *
+ * Preconditions: the main thread's reference on replaySocket
+ *
+ * Postcondition:
+ *  our side shut for writing, reference dropped
+ ****************************************************************/
+void disconnectSocket(replay_socket_t * replaySocket)
+{
+    shutdown(replaySocket->fd, SHUT_WR);
+    releaseSocket(replaySocket);
+}
+
+/****************************************************************
+ * Empty a replayed connection's ring and get woken when there's more
+ *
+ * Preconditions: called by the drain thread; replaySocket->ring attached
+ *
+ * Postcondition:
+ *  bytesReceived counts what was read; the ring is empty and armed
+ ****************************************************************/
+void drainRing(replay_socket_t * replaySocket, char * buffer)
+{
+    size_t got;
+
+    do
+    {
+        while (0 < (got = Shm_Ring_Read(replaySocket->ring, buffer,
+                                        DRAIN_BUFFER_SIZE)))
+        {
+            __atomic_add_fetch(&bytesReceived, got, __ATOMIC_RELAXED);
+        }
+    } while (Shm_Ring_Arm(replaySocket->ring));
+}
+
+/****************************************************************
+ * Start draining a ring the server just gave a replayed connection
+ *
+ * Preconditions: called by the drain thread; replaySocket->ring attached
+ *
+ * Postcondition:
+ *  the ring is watched, or the connection is shut so the server gives up
+ *  on it rather than waiting on a ring nobody reads
+ ****************************************************************/
+void watchRing(replay_socket_t * replaySocket, char * buffer)
+{
+    struct epoll_event event;
+
+    replaySocket->ringWatch.owner = replaySocket;
+    replaySocket->ringWatch.isRing = true;
+    event.events = EPOLLIN;
+    event.data.ptr = &(replaySocket->ringWatch);
+    if (0 != epoll_ctl(epollFd, EPOLL_CTL_ADD,
+                       replaySocket->ring->dataEventFd, &event))
+    {
+        shutdown(replaySocket->fd, SHUT_RDWR);
+        return;
+    }
+    drainRing(replaySocket, buffer);
+}
+
+/****************************************************************
+ * Read and discard everything the server sends, until replay is over
+ *
+ * Preconditions: epollFd is set up; sockets are added as they connect
+ *
+ * Postcondition:
+ *  bytesReceived counts what was read
+ ****************************************************************/
+void * drainThread(void * arg)
+{
+    struct epoll_event events[DRAIN_EVENTS];
+    replay_socket_t * hungUp[DRAIN_EVENTS];
+    char * buffer = malloc(DRAIN_BUFFER_SIZE);
+    replay_watch_t * watch;
+    replay_socket_t * replaySocket;
+    shm_ring_t * hadRing;
+    int hungUpCount;
+    int ready;
+    int index;
+    ssize_t got;
+
+    (void)arg;
+    while (NULL != buffer && !__atomic_load_n(&replayDone, __ATOMIC_ACQUIRE))
+    {
+        ready = epoll_wait(epollFd, events, DRAIN_EVENTS, DRAIN_POLL_MS);
+        hungUpCount = 0;
+        for (index = 0; index < ready; ++index)
+        {
+            watch = (replay_watch_t *)events[index].data.ptr;
+            replaySocket = watch->owner;
+            if (replaySocket->hungUp)
+            {
+                // Its other watch fired in the same batch
+                continue;
+            }
+            if (watch->isRing)
+            {
+                drainRing(replaySocket, buffer);
+                continue;
+            }
+            // The ring's fds, if we asked for one, come with its WELCOME
+            hadRing = replaySocket->ring;
+            got = Receive_Shm_Ring_Fds(replaySocket->fd, buffer,
+                                       DRAIN_BUFFER_SIZE,
+                                       &(replaySocket->ring));
+            if (got > 0)
+            {
+                __atomic_add_fetch(&bytesReceived, got, __ATOMIC_RELAXED);
+                if (NULL == hadRing && NULL != replaySocket->ring)
+                {
+                    watchRing(replaySocket, buffer);
+                }
+            }
+            else if (0 == got || EAGAIN != errno)
+            {
+                // The server hung up. Let go once the batch is done with it.
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, replaySocket->fd, NULL);
+                if (replaySocket->ring)
+                {
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL,
+                              replaySocket->ring->dataEventFd, NULL);
+                }
+                replaySocket->hungUp = true;
+                hungUp[hungUpCount++] = replaySocket;
+            }
+        }
+        for (index = 0; index < hungUpCount; ++index)
+        {
+            releaseSocket(hungUp[index]);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+/****************************************************************
+ * Open a connection for a captured one that joined
+ *
+ * Preconditions: record is a CAPTURE_CONNECT
+ *
+ * Postcondition:
+ *  returns the connection, watched by the drain thread, or NULL
+ ****************************************************************/
+replay_socket_t * replayConnect(const replay_options * options,
+                                const capture_record_t * record)
+{
+    static const char hello[] = PROTO_HELLO "\n";
+    replay_socket_t * replaySocket;
+    struct epoll_event event;
+    int fd = options->unixPath ? Connect_Unix(options->unixPath) :
+             Connect_Tcp(options->address, options->port);
+
+    if (-1 == fd)
+    {
+        return NULL;
+    }
+    // Captures from before CAPTURE_HELLO mark the HELLO on the connect
+    if (((record->flags & CONNECTION_HELLO) &&
+         0 != Write_All(fd, hello, sizeof(hello) - 1)) ||
+        NULL == (replaySocket = malloc(sizeof(replay_socket_t))))
+    {
+        close(fd);
+        return NULL;
+    }
+    replaySocket->fd = fd;
+    replaySocket->refCount = 2;
+    replaySocket->ring = NULL;
+    replaySocket->hungUp = false;
+    replaySocket->socketWatch.owner = replaySocket;
+    replaySocket->socketWatch.isRing = false;
+    __atomic_add_fetch(&openSockets, 1, __ATOMIC_RELAXED);
+    event.events = EPOLLIN;
+    event.data.ptr = &(replaySocket->socketWatch);
+    if (0 != epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event))
+    {
+        // The drain thread will never see it
+        releaseSocket(replaySocket);
+    }
+    return replaySocket;
+}
+
+/****************************************************************
+ * Ask for what a captured connection's HELLO set up
+ *
+ * Preconditions: record is a CAPTURE_HELLO for replaySocket's connection
+ *
+ * Postcondition:
+ *  returns 0 if the HELLO was sent. Clients that said HELLO get pings,
+ *  compressed or filtered chat, or a ring, so that part of the load is
+ *  kept. Shared memory is only granted if we replay over the Unix socket.
+ ****************************************************************/
+int replayHello(replay_socket_t * replaySocket,
+                const capture_record_t * record)
+{
+    char line[PROTO_MAX_LINE];
+    int length;
+
+    length = snprintf(line, sizeof(line), "%s%s%s%s%.*s\n", PROTO_HELLO,
+                      (record->flags & CONNECTION_SHM) ?
+                      " " PROTO_OPT_SHM : "",
+                      (record->flags & CONNECTION_DEFLATE) ?
+                      " " PROTO_OPT_DEFLATE : "",
+                      record->length ? " " PROTO_OPT_FILTER : "",
+                      record->length, record->length ? record->data : "");
+    if (length >= (int)sizeof(line))
+    {
+        return -1;
+    }
+    return Write_All(replaySocket->fd, line, length);
+}
+
+int main(int argc, char ** argv)
+{
+    replay_options options;
+    capture_record_t record;
+    socket_map_t sockets;
+    pthread_t drainer;
+    FILE * capture;
+    replay_socket_t ** slot;
+    int result;
+
+    parseOptions(argc, argv, &options);
+    if (NULL == (capture = Open_Capture(options.capturePath, &record)))
+    {
+        return 2;
+    }
+    if (-1 == (epollFd = epoll_create1(EPOLL_CLOEXEC)) ||
+        0 != pthread_create(&drainer, NULL, drainThread, NULL))
+    {
+        fprintf(stderr, "Couldn't start reading from the server.\n");
+        return 3;
+    }
+    // Writes to connections the server dropped should fail, not kill us
+    signal(SIGPIPE, SIG_IGN);
+    memset(&sockets, 0, sizeof(sockets));
+
+    uint64_t connects = 0;
+    uint64_t failedConnects = 0;
+    uint64_t messages = 0;
+    uint64_t bytesSent = 0;
+    uint64_t skipped = 0;
+    uint64_t maxLagNs = 0;
+    uint64_t start = nowNs();
+    while (1 == (result = Read_Capture_Record(capture, &record)))
+    {
+        // Wait for the record's time on the scaled schedule
+        if (options.speed > 0)
+        {
+            uint64_t due = start + (uint64_t)(record.timeUs * 1000.0 /
+                                              options.speed);
+            uint64_t now = nowNs();
+            if (now < due)
+            {
+                struct timespec wake;
+                wake.tv_sec = due / NS_PER_SEC;
+                wake.tv_nsec = due % NS_PER_SEC;
+                while (EINTR == clock_nanosleep(CLOCK_MONOTONIC,
+                                                TIMER_ABSTIME, &wake, NULL))
+                {
+                }
+            }
+            else if (now - due > maxLagNs)
+            {
+                maxLagNs = now - due;
+            }
+        }
+
+        if (NULL == (slot = socketSlot(&sockets, record.connectionId)))
+        {
+            ++skipped;
+            continue;
+        }
+        if (CAPTURE_CONNECT == record.type)
+        {
+            if (NULL != *slot)
+            {
+                disconnectSocket(*slot);
+            }
+            if (NULL == (*slot = replayConnect(&options, &record)))
+            {
+                ++failedConnects;
+            }
+            else
+            {
+                ++connects;
+            }
+        }
+        else if (CAPTURE_HELLO == record.type)
+        {
+            if (NULL == *slot || 0 != replayHello(*slot, &record))
+            {
+                ++skipped;
+            }
+        }
+        else if (CAPTURE_DISCONNECT == record.type && NULL != *slot)
+        {
+            disconnectSocket(*slot);
+            *slot = NULL;
+        }
+        else if (CAPTURE_MESSAGE == record.type)
+        {
+            if (NULL == *slot ||
+                0 != Write_All((*slot)->fd, record.data, record.length))
+            {
+                ++skipped;
+            }
+            else
+            {
+                ++messages;
+                bytesSent += record.length;
+            }
+        }
+    }
+    uint64_t elapsed = nowNs() - start;
+    if (-1 == result)
+    {
+        fprintf(stderr, "The capture file is corrupt or cut short. Stopped"
+                " there.\n");
+    }
+
+    // Connections still open when the capture ended
+    int index;
+    for (index = 0; index < sockets.capacity; ++index)
+    {
+        if (NULL != sockets.sockets[index])
+        {
+            disconnectSocket(sockets.sockets[index]);
+        }
+    }
+    // Give the server a chance to read everything we sent
+    struct timespec lingerStep = { 0, DRAIN_POLL_MS * 1000 * 1000 };
+    uint64_t lingerEnd = nowNs() + LINGER_NS;
+    while (__atomic_load_n(&openSockets, __ATOMIC_ACQUIRE) > 0 &&
+           nowNs() < lingerEnd)
+    {
+        nanosleep(&lingerStep, NULL);
+    }
+    __atomic_store_n(&replayDone, true, __ATOMIC_RELEASE);
+    pthread_join(drainer, NULL);
+
+    printf("Replayed %lu connections and %lu messages (%lu bytes) in"
+           " %.3f s, capture spans %.3f s.\n", (unsigned long)connects,
+           (unsigned long)messages, (unsigned long)bytesSent,
+           (double)elapsed / NS_PER_SEC, record.timeUs / 1e6);
+    if (options.speed > 0)
+    {
+        printf("Fell behind the schedule by up to %.3f ms.\n",
+               maxLagNs / 1e6);
+    }
+    printf("Received %lu bytes. %lu connections failed, %lu records"
+           " skipped.\n", (unsigned long)bytesReceived,
+           (unsigned long)failedConnects, (unsigned long)skipped);
+
+    free(sockets.sockets);
+    free(record.data);
+    fclose(capture);
+    close(epollFd);
+    return (-1 == result) ? 4 : 0;
+}
@@ -3,17 +3,48 @@
  * Filename:      server.c
  * Date Created:  2016-03-??
  * Modifications: 2016-05-17 by Erik Andersen <erik.andersen@oit.edu>
+ *   2026-10-18: connections list carries connection_t objects instead of fds.
+ *   Broadcasts write from a snapshot instead of holding the list lock.
+ *   Token bucket limits on reads, admin port (-a) to change them and read
+ *   counters. Unix domain socket listener (-u) with optional shared memory
+ *   delivery. Idle timeouts (-t) and pings (-k). Broadcasts are handed to a
+ *   pool of writer threads (-w) that each serve a shard of the connections.
+ *   Lean memory mode (-l) for large numbers of mostly idle connections.
+ *   Shutdown is driven by a signalfd and a shutdown eventfd, with goodbyes
+ *   sent through the writer threads under a deadline (-d). Clients can ask
+ *   for only the chat matching a filter. Traffic can be captured to a file
+ *   (-c) for replaying later. Sampled per-message tracing, dumped as Chrome
+ *   trace JSON through the admin port. Socket calls on client connections go
+ *   through a transport (see transport.h) so the simulator can stand in for
+ *   the network. Read buffers are sized per connection by how much it
+ *   sends, and each wakeup reads everything waiting and broadcasts it as one
+ *   message. The goodbye goes out on the fan-out's control lane, ahead of
+ *   queued chat, and writers take turns between senders. Optional datagram
+ *   listener (-U) with batched receives and sends, see udp.h. Large messages
+ *   are compressed once, by the reader, for clients that ask (-z, -Z).
+ *   Readers hand chat to a sequencer thread through a lock-free queue, so
+ *   every client gets the same order; -D goes back to readers appending to
+ *   the fan-out log themselves.
  **************************************************************
  *
  * Lab/Assignment: CST340 L3
  * 
  * Overview:
  *    This program is a chat serer. It listens on the port specified with
- *  -p.
+ *  -p, and also on a Unix domain socket if a path is given with -u.
  *
  * Input:
  *    All input comes through incoming connections. Input from those connections
  *    is broadcast to all connections, including the connection that sent it.
+ *    If -a is given, admin commands are accepted on that port on loopback.
+ *    -t drops connections that send nothing for that many seconds, and -k
+ *    pings connections that speak the control protocol after that many.
+ *    -c records connections and chat, with timestamps, to a file that the
+ *    replay tool can play back. -U also takes chat as datagrams on that port,
+ *    and sends all chat to the addresses that sent them. -z sets the smallest
+ *    message compressed for clients that take compressed chat, 0 for none,
+ *    and -Z how hard to compress, 1 to 9. -D skips the fan-out sequencer,
+ *    trading a single order across clients for one less hand-off.
  *
  * Output:
  *    Outputs version informantion and error messages to stdout. All other
@@ -22,32 +53,85 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <malloc.h>
+#include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <signal.h>
 #include <stdio.h>
 
 #include "list.h"
+#include "connection.h"
+#include "ratelimit.h"
+#include "admin.h"
+#include "protocol.h"
+#include "shmring.h"
+#include "heartbeat.h"
+#include "fanout.h"
+#include "bufpool.h"
+#include "shutdown.h"
+#include "filter.h"
+#include "capture.h"
+#include "trace.h"
+#include "transport.h"
+#include "udp.h"
+#include "compress.h"
 #define BUFFSIZE 256
+// Read buffers come in this many sizes, each four times the last, from
+// BUFFSIZE up to 64 KB
+#define READ_SIZE_CLASSES 5
+#define READ_BUFFER_SIZE(sizeClass) (BUFFSIZE << (2 * (sizeClass)))
+// Passes in a row that would have fit the next size down before a
+// connection's buffer shrinks
+#define READ_SHRINK_PASSES 16
+// A connection with a bigger than smallest buffer that sends nothing for
+// this long gives it back and starts small again, in ms
+#define READ_IDLE_MS 1000
+// Smallest read buffers allocated at a time when the pool runs out. Bigger
+// sizes allocate proportionally fewer.
+#define BUFFERS_PER_SLAB 64
+// Free buffers kept of each size allocated one at a time (16 KB and up).
+// More are freed as connections give them back.
+#define READ_FREE_LARGE 8
+// Smallest message compressed for clients that take compressed chat, and
+// how hard, unless set with -z and -Z
+#define DEFAULT_COMPRESS_THRESHOLD 4096
+#define DEFAULT_COMPRESS_LEVEL 1
+// Stack for connection threads in lean mode. They only ever run the read
+// loop, so this leaves plenty of headroom.
+#define LEAN_STACK_SIZE (64 * 1024)
 
 typedef struct 
 {
     linked_list_t connections;
-    int clientFd;
+    connection_t * connection;
 } thread_data_t;
 
+// What the weight admin command is looking for, and what it found
+typedef struct
+{
+    uint64_t id;
+    int weight;
+    bool found;
+    int result;
+} weight_search_t;
+
 typedef struct thisstruct
 {
     pthread_t threadId;
@@ -55,133 +139,1226 @@ typedef struct thisstruct
     int clientFd;
 } thread_list_node;
 
-// Only written by main thread, and only set by main thread independent of
-// previous value. Read by other threads: if they see it as true, they attempt
-// to shutdown at the next chance
+// Only used by main thread: set once it should stop accepting connections.
+// Other threads wait on the shutdown event instead (see shutdown.h), which
+// main fires once the goodbye is queued.
 bool serverShutdown;
-// Only used by main thread. Needs to be global so signal handler can tell it to
-// quit listening
+// Only used by main thread
 int sockfd = -1;
+int unixfd = -1;
+// Set up by main thread before any connection threads start, then only read.
+// In lean mode connection threads only hold a read buffer from the pool while
+// they have input to handle, instead of for their whole life.
+bool leanMode = false;
+// One pool per read buffer size class
+buffer_pool_t readBuffers[READ_SIZE_CLASSES];
+// Server wide ingest counters, for reads per message and bytes per fan-out
+uint64_t ingestReads = 0;
+uint64_t ingestMessages = 0;
+uint64_t ingestBytes = 0;
+// Compression settings, changed through the admin port. A threshold of 0
+// turns compression off.
+int compressThreshold = DEFAULT_COMPRESS_THRESHOLD;
+int compressLevel = DEFAULT_COMPRESS_LEVEL;
+// Joined connections that take compressed chat. Nothing is compressed
+// while there are none.
+int deflateConnections = 0;
+// Compressed frames written in place of the message
+uint64_t compressedDeliveries = 0;
+// Stands in as the sender of chat that arrives by datagram, or NULL without
+// -U. Set up by main thread before the datagram thread starts.
+connection_t * udpSender = NULL;
+// Resident memory just before the first connection, to work out what each
+// connection costs
+unsigned long baselineRss = 0;
+
+/****************************************************************
+ * Callback function to call on each connection in the shutdown snapshot
+ * once the shutdown deadline has passed
+ * 
+ * Preconditions: connection's fd is not closed yet (the caller's snapshot
+ *  holds a reference)
+ *
+ * Postcondition:
+ *      socket is shut both ways, so any write still blocked on it fails now.
+ *      *userdata counts the connections a write was still blocked on, not
+ *      those that were done or only waiting their turn behind one.
+ ****************************************************************/
+void shutConnection(list_link_t * link, void * userdata)
+{
+    connection_t * connection = CONNECTION_FROM_LINK(link);
+    // Held for the whole of each write, so taken means one is in progress
+    bool writing = 0 != pthread_mutex_trylock(&(connection->writeLock));
+    
+    if (!writing)
+    {
+        pthread_mutex_unlock(&(connection->writeLock));
+    }
+    Transport_Shutdown(connection->fd, SHUT_RDWR);
+    if (writing)
+    {
+        ++(*(int *)userdata);
+    }
+}
+
+// Contains an easy to use representation of the command line args. Strings
+// point into argv, so no destructor needed.
+typedef struct
+{
+    char * port;
+    char * adminPort;
+    char * unixPath;
+    // Heartbeat timeouts in seconds, 0 for off
+    double idleTimeout;
+    double pingInterval;
+    // Fan-out writer threads
+    int writers;
+    // Order chat through the fan-out sequencer
+    bool sequence;
+    bool lean;
+    // Longest to spend delivering goodbyes on shutdown, in seconds
+    double shutdownDeadline;
+    // File to capture traffic to, or NULL
+    char * capturePath;
+    // Datagram port, or NULL for none
+    char * udpPort;
+    int compressThreshold;
+    int compressLevel;
+} server_options;
+
+/****************************************************************
+ * Uses getopt style arguments to fill in the server options
+ * 
+ * Preconditions: argc is the count of elements in argv, and argv pointers are
+ *  valid. options points to a server_options.
+ *
+ * Postcondition:
+ *  options populated with settings from the command line; exits if the port
+ *  number is missing
+ ****************************************************************/
+void parseOptions(int argc, char ** argv, server_options * options)
+{
+    int arg;
+    options->port = NULL;
+    options->adminPort = NULL;
+    options->unixPath = NULL;
+    options->idleTimeout = 0;
+    options->pingInterval = 0;
+    options->lean = false;
+    options->sequence = true;
+    options->shutdownDeadline = 5;
+    options->capturePath = NULL;
+    options->udpPort = NULL;
+    options->compressThreshold = DEFAULT_COMPRESS_THRESHOLD;
+    options->compressLevel = DEFAULT_COMPRESS_LEVEL;
+    // One writer per CPU by default
+    options->writers = MAX(1, MIN(FANOUT_MAX_WRITERS,
+                                  sysconf(_SC_NPROCESSORS_ONLN)));
+    while (-1 != (arg = getopt(argc, argv, "p:a:u:t:k:w:ld:c:U:z:Z:D")))
+    {
+        if ('p' == arg)
+        {
+            options->port = optarg;
+        }
+        else if ('a' == arg)
+        {
+            options->adminPort = optarg;
+        }
+        else if ('u' == arg)
+        {
+            options->unixPath = optarg;
+        }
+        else if ('t' == arg)
+        {
+            options->idleTimeout = atof(optarg);
+        }
+        else if ('k' == arg)
+        {
+            options->pingInterval = atof(optarg);
+        }
+        else if ('w' == arg)
+        {
+            options->writers = atoi(optarg);
+        }
+        else if ('l' == arg)
+        {
+            options->lean = true;
+        }
+        else if ('d' == arg)
+        {
+            options->shutdownDeadline = atof(optarg);
+        }
+        else if ('c' == arg)
+        {
+            options->capturePath = optarg;
+        }
+        else if ('U' == arg)
+        {
+            options->udpPort = optarg;
+        }
+        else if ('z' == arg)
+        {
+            options->compressThreshold = atoi(optarg);
+        }
+        else if ('Z' == arg)
+        {
+            options->compressLevel = atoi(optarg);
+        }
+        else if ('D' == arg)
+        {
+            options->sequence = false;
+        }
+    }
+    if (NULL == options->port)
+    {
+        fprintf(stderr, "No port number or service name set. Please specify it"
+        " with -p <port_number>.\n");
+        exit(4);
+    }
+    if (options->writers < 1 || options->writers > FANOUT_MAX_WRITERS)
+    {
+        fprintf(stderr, "Writer count must be 1 to %d.\n", FANOUT_MAX_WRITERS);
+        exit(4);
+    }
+    if (options->compressThreshold < 0 ||
+        options->compressLevel < COMPRESS_MIN_LEVEL ||
+        options->compressLevel > COMPRESS_MAX_LEVEL)
+    {
+        fprintf(stderr, "Compression threshold can't be negative, and the"
+        " level must be %d to %d.\n", COMPRESS_MIN_LEVEL, COMPRESS_MAX_LEVEL);
+        exit(4);
+    }
+}
+
+/****************************************************************
+ * Get the resident memory of the whole process
+ * 
+ * Preconditions: (none)
+ *
+ * Postcondition:
+ *  returns resident bytes, or 0 if they couldn't be read
+ ****************************************************************/
+unsigned long currentRss(void)
+{
+    unsigned long pages = 0;
+    FILE * statm = fopen("/proc/self/statm", "r");
+    
+    if (NULL == statm)
+    {
+        return 0;
+    }
+    // Second field is resident pages
+    if (1 != fscanf(statm, "%*u %lu", &pages))
+    {
+        pages = 0;
+    }
+    fclose(statm);
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+/****************************************************************
+ * Print one connection's counters for the admin stats command
+ * 
+ * Preconditions: link is in a connection_t, userData is an open FILE *
+ *
+ * Postcondition:
+ *  one line of counters written to userData
+ ****************************************************************/
+void printConnectionStats(list_link_t * link, void * userData)
+{
+    connection_t * connection = CONNECTION_FROM_LINK(link);
+    fprintf((FILE *)userData, "conn id=%lu fd=%d bytes=%lu messages=%lu"
+            " reads=%lu read_buffer=%d throttled=%lu throttled_ms=%lu"
+            " filtered_out=%lu weight=%d\n",
+            (unsigned long)connection->id, connection->fd,
+            (unsigned long)connection->bytesRead,
+            (unsigned long)connection->messagesRead,
+            (unsigned long)connection->reads,
+            READ_BUFFER_SIZE(connection->readSizeClass),
+            (unsigned long)connection->rate.throttleCount,
+            (unsigned long)(connection->rate.throttledNs / 1000000),
+            (unsigned long)connection->filteredOut,
+            __atomic_load_n(&(connection->weight), __ATOMIC_RELAXED));
+}
+
+/****************************************************************
+ * Admin command: print server wide and per-connection counters
+ * 
+ * Preconditions: userData is the connections list
+ *
+ * Postcondition:
+ *  counters written to out, returns 0
+ ****************************************************************/
+int adminStats(int argc, char ** argv, FILE * out, void * userData)
+{
+    uint64_t throttleCount;
+    uint64_t throttledNs;
+    uint64_t pings;
+    uint64_t timeouts;
+    fanout_stats_t fanout;
+    capture_stats_t capture;
+    udp_stats_t udp;
+    compress_stats_t compress;
+    static const char * laneNames[FANOUT_LANES] = {"control", "bulk"};
+    int shard;
+    int lane;
+    int sizeClass;
+    int buffersTotal = 0;
+    int buffersInUse = 0;
+    int classTotal;
+    int classInUse;
+    uint64_t reads = __atomic_load_n(&ingestReads, __ATOMIC_RELAXED);
+    uint64_t messages = __atomic_load_n(&ingestMessages, __ATOMIC_RELAXED);
+    uint64_t bytes = __atomic_load_n(&ingestBytes, __ATOMIC_RELAXED);
+    unsigned long rss = currentRss();
+    list_snapshot_t * snapshot = Acquire_Snapshot((linked_list_t)userData);
+    
+    Get_Rate_Totals(&throttleCount, &throttledNs);
+    Get_Heartbeat_Counts(&pings, &timeouts);
+    fprintf(out, "connections %d\n", snapshot ? snapshot->count : -1);
+    fprintf(out, "rss_kb %lu\n", rss / 1024);
+    // Growth since startup spread over the connections open now. Only
+    // meaningful once there are enough of them to dwarf allocator noise.
+    fprintf(out, "bytes_per_connection %lu\n",
+            (snapshot && snapshot->count > 0 && rss > baselineRss) ?
+            (rss - baselineRss) / snapshot->count : 0);
+    fprintf(out, "read_buffers_in_use_by_size");
+    for (sizeClass = 0; sizeClass < READ_SIZE_CLASSES; ++sizeClass)
+    {
+        Get_Buffer_Pool_Counts(readBuffers[sizeClass], &classTotal,
+                               &classInUse);
+        buffersTotal += classTotal;
+        buffersInUse += classInUse;
+        fprintf(out, " %d:%d", READ_BUFFER_SIZE(sizeClass), classInUse);
+    }
+    fprintf(out, "\n");
+    fprintf(out, "read_buffers %d\n", buffersTotal);
+    fprintf(out, "read_buffers_in_use %d\n", buffersInUse);
+    fprintf(out, "ingest_reads %lu\n", (unsigned long)reads);
+    fprintf(out, "ingest_messages %lu\n", (unsigned long)messages);
+    fprintf(out, "reads_per_message %.2f\n",
+            messages ? (double)reads / messages : 0.0);
+    fprintf(out, "bytes_per_fanout %.1f\n",
+            messages ? (double)bytes / messages : 0.0);
+    fprintf(out, "throttled %lu\n", (unsigned long)throttleCount);
+    fprintf(out, "throttled_ms %lu\n", (unsigned long)(throttledNs / 1000000));
+    fprintf(out, "pings %lu\n", (unsigned long)pings);
+    fprintf(out, "idle_timeouts %lu\n", (unsigned long)timeouts);
+    Get_Capture_Stats(&capture);
+    fprintf(out, "capture_records %lu\n", (unsigned long)capture.records);
+    fprintf(out, "capture_dropped %lu\n", (unsigned long)capture.dropped);
+    Get_Fanout_Stats(&fanout);
+    fprintf(out, "filter_keywords %d\n", Get_Filter_Keyword_Count());
+    fprintf(out, "fanout_writers %d\n", fanout.writerCount);
+    fprintf(out, "fanout_shards");
+    for (shard = 0; shard < fanout.writerCount; ++shard)
+    {
+        fprintf(out, " %d", fanout.members[shard]);
+    }
+    fprintf(out, "\n");
+    fprintf(out, "fanout_messages %lu\n", (unsigned long)fanout.messages);
+    fprintf(out, "fanout_rebalances %lu\n", (unsigned long)fanout.rebalances);
+    fprintf(out, "fanout_sequenced %d\n", fanout.sequenced ? 1 : 0);
+    fprintf(out, "fanout_batches %lu\n", (unsigned long)fanout.batches);
+    fprintf(out, "fanout_messages_per_batch %.1f\n", fanout.batches ?
+            (double)fanout.batched / fanout.batches : 0.0);
+    fprintf(out, "fanout_window_waits %lu\n",
+            (unsigned long)fanout.windowWaits);
+    fprintf(out, "fanout_last_recipient_avg_us %lu\n", (unsigned long)
+            (fanout.messages ?
+             fanout.lastRecipientNsTotal / fanout.messages / 1000 : 0));
+    fprintf(out, "fanout_last_recipient_max_us %lu\n",
+            (unsigned long)(fanout.lastRecipientNsMax / 1000));
+    for (lane = 0; lane < FANOUT_LANES; ++lane)
+    {
+        fprintf(out, "fanout_%s_queued %lu\n", laneNames[lane],
+                (unsigned long)fanout.laneQueued[lane]);
+        fprintf(out, "fanout_%s_queued_avg_us %lu\n", laneNames[lane],
+                (unsigned long)(fanout.laneQueued[lane] ?
+                fanout.laneQueuedNsTotal[lane] / fanout.laneQueued[lane] /
+                1000 : 0));
+        fprintf(out, "fanout_%s_queued_max_us %lu\n", laneNames[lane],
+                (unsigned long)(fanout.laneQueuedNsMax[lane] / 1000));
+    }
+    Get_Compress_Stats(&compress);
+    fprintf(out, "deflate_connections %d\n",
+            __atomic_load_n(&deflateConnections, __ATOMIC_RELAXED));
+    fprintf(out, "compressed_messages %lu\n",
+            (unsigned long)(compress.messages - compress.notSmaller));
+    fprintf(out, "compress_not_smaller %lu\n",
+            (unsigned long)compress.notSmaller);
+    fprintf(out, "compress_ratio %.2f\n", compress.frameBytes ?
+            (double)compress.plainBytes / compress.frameBytes : 0.0);
+    fprintf(out, "compress_avg_us %lu\n", (unsigned long)(compress.messages ?
+            compress.ns / compress.messages / 1000 : 0));
+    fprintf(out, "compressed_deliveries %lu\n", (unsigned long)
+            __atomic_load_n(&compressedDeliveries, __ATOMIC_RELAXED));
+    Get_Udp_Stats(&udp);
+    fprintf(out, "udp_subscribers %d\n", udp.subscribers);
+    fprintf(out, "udp_datagrams_in %lu\n", (unsigned long)udp.datagramsIn);
+    fprintf(out, "udp_datagrams_per_receive %.1f\n", udp.receiveCalls ?
+            (double)udp.datagramsIn / udp.receiveCalls : 0.0);
+    fprintf(out, "udp_cookies_sent %lu\n", (unsigned long)udp.cookiesSent);
+    fprintf(out, "udp_not_subscribed %lu\n",
+            (unsigned long)udp.notSubscribed);
+    fprintf(out, "udp_lost_in %lu\n", (unsigned long)udp.lostIn);
+    fprintf(out, "udp_late_in %lu\n", (unsigned long)udp.lateIn);
+    fprintf(out, "udp_datagrams_out %lu\n", (unsigned long)udp.datagramsOut);
+    fprintf(out, "udp_datagrams_per_send %.1f\n", udp.sendCalls ?
+            (double)udp.datagramsOut / udp.sendCalls : 0.0);
+    fprintf(out, "udp_send_dropped %lu\n", (unsigned long)udp.sendDropped);
+    fprintf(out, "udp_queue_dropped %lu\n", (unsigned long)udp.queueDropped);
+    if (snapshot)
+    {
+        Traverse_Snapshot(snapshot, printConnectionStats, out);
+        Release_Snapshot(snapshot);
+    }
+    return 0;
+}
+
+/****************************************************************
+ * Admin command: show the current rate limits
+ * 
+ * Preconditions: (none)
+ *
+ * Postcondition:
+ *  limits written to out, returns 0
+ ****************************************************************/
+int adminLimits(int argc, char ** argv, FILE * out, void * userData)
+{
+    static const char * names[RATE_LIMIT_COUNT] =
+        { "conn bytes", "conn messages", "global bytes", "global messages" };
+    rate_limit_t limit;
+    int kind;
+    
+    for (kind = 0; kind < RATE_LIMIT_COUNT; ++kind)
+    {
+        Get_Rate_Limit((rate_limit_kind)kind, &limit);
+        fprintf(out, "%s rate=%g burst=%g\n", names[kind], limit.rate,
+                limit.burst);
+    }
+    return 0;
+}
+
+/****************************************************************
+ * Admin command: change a rate limit.
+ *  limit <conn|global> <bytes|messages> <per_second> [burst]
+ * 
+ * Preconditions: (none)
+ *
+ * Postcondition:
+ *  returns 0 and the limit is changed, or returns non-zero on bad arguments
+ ****************************************************************/
+int adminLimit(int argc, char ** argv, FILE * out, void * userData)
+{
+    rate_limit_kind kind;
+    bool conn;
+    double burst = 0;
+    
+    if (argc < 4 || argc > 5)
+    {
+        return 1;
+    }
+    if (0 == strcmp(argv[1], "conn"))
+    {
+        conn = true;
+    }
+    else if (0 == strcmp(argv[1], "global"))
+    {
+        conn = false;
+    }
+    else
+    {
+        return 1;
+    }
+    if (0 == strcmp(argv[2], "bytes"))
+    {
+        kind = conn ? RATE_CONN_BYTES : RATE_GLOBAL_BYTES;
+    }
+    else if (0 == strcmp(argv[2], "messages"))
+    {
+        kind = conn ? RATE_CONN_MESSAGES : RATE_GLOBAL_MESSAGES;
+    }
+    else
+    {
+        return 1;
+    }
+    if (5 == argc)
+    {
+        burst = atof(argv[4]);
+    }
+    return Set_Rate_Limit(kind, atof(argv[3]), burst);
+}
+
+/****************************************************************
+ * Set the weight of the connection a weight_search_t is looking for, if
+ * this is it
+ * 
+ * Preconditions: link is in a connection_t, userData is a weight_search_t
+ *
+ * Postcondition:
+ *  weight set and the search's result updated if the id matched
+ ****************************************************************/
+void setConnectionWeight(list_link_t * link, void * userData)
+{
+    connection_t * connection = CONNECTION_FROM_LINK(link);
+    weight_search_t * search = (weight_search_t *)userData;
+    
+    if (connection->id == search->id)
+    {
+        search->found = true;
+        search->result = Fanout_Set_Weight(connection, search->weight);
+    }
+}
+
+/****************************************************************
+ * Admin command: give a connection a bigger or smaller share of the
+ * fan-out's turns between senders (see fanout.h).
+ *  weight <connection_id> <weight>
+ * 
+ * Preconditions: userData is the connections list
+ *
+ * Postcondition:
+ *  returns 0 and the weight is changed, or returns non-zero on bad
+ *  arguments or an unknown connection
+ ****************************************************************/
+int adminWeight(int argc, char ** argv, FILE * out, void * userData)
+{
+    weight_search_t search;
+    list_snapshot_t * snapshot;
+    
+    if (3 != argc)
+    {
+        return 1;
+    }
+    search.id = strtoull(argv[1], NULL, 10);
+    search.weight = atoi(argv[2]);
+    search.found = false;
+    search.result = 1;
+    if (NULL == (snapshot = Acquire_Snapshot((linked_list_t)userData)))
+    {
+        return 1;
+    }
+    Traverse_Snapshot(snapshot, setConnectionWeight, &search);
+    Release_Snapshot(snapshot);
+    if (!search.found)
+    {
+        fprintf(out, "No connection %lu.\n", (unsigned long)search.id);
+    }
+    return search.result;
+}
+
+/****************************************************************
+ * Admin command: show or change the heartbeat timeouts.
+ *  heartbeat [idle_seconds ping_seconds]
+ * 
+ * Preconditions: (none)
+ *
+ * Postcondition:
+ *  returns 0 with the (new) timeouts written to out, or non-zero on bad
+ *  arguments
+ ****************************************************************/
+int adminHeartbeat(int argc, char ** argv, FILE * out, void * userData)
+{
+    uint64_t idleMs;
+    uint64_t pingMs;
+    
+    if (3 == argc)
+    {
+        if (atof(argv[1]) < 0 || atof(argv[2]) < 0)
+        {
+            return 1;
+        }
+        Set_Heartbeat_Timeouts(atof(argv[1]) * 1000, atof(argv[2]) * 1000);
+    }
+    else if (1 != argc)
+    {
+        return 1;
+    }
+    Get_Heartbeat_Timeouts(&idleMs, &pingMs);
+    fprintf(out, "idle %gs ping %gs\n", idleMs / 1000.0, pingMs / 1000.0);
+    return 0;
+}
+
+/****************************************************************
+ * Admin command: show or change compression for clients that take it.
+ *  compress [threshold_bytes level]
+ * 
+ * Preconditions: (none)
+ *
+ * Postcondition:
+ *  returns 0 with the (new) settings written to out, or non-zero on bad
+ *  arguments
+ ****************************************************************/
+int adminCompress(int argc, char ** argv, FILE * out, void * userData)
+{
+    if (3 == argc)
+    {
+        if (atoi(argv[1]) < 0 || atoi(argv[2]) < COMPRESS_MIN_LEVEL ||
+            atoi(argv[2]) > COMPRESS_MAX_LEVEL)
+        {
+            return 1;
+        }
+        __atomic_store_n(&compressThreshold, atoi(argv[1]), __ATOMIC_RELAXED);
+        __atomic_store_n(&compressLevel, atoi(argv[2]), __ATOMIC_RELAXED);
+    }
+    else if (1 != argc)
+    {
+        return 1;
+    }
+    fprintf(out, "threshold %d level %d\n",
+            __atomic_load_n(&compressThreshold, __ATOMIC_RELAXED),
+            __atomic_load_n(&compressLevel, __ATOMIC_RELAXED));
+    return 0;
+}
+
+/****************************************************************
+ * Decide whether a read or write on a connection that failed is worth
+ * trying again: it was interrupted, or the socket wasn't ready after all.
+ * Blocking sockets shouldn't do the latter, but the simulator does.
+ * 
+ * Preconditions: errno is from the failed call. events is POLLIN for a read,
+ *  POLLOUT for a write.
+ *
+ * Postcondition:
+ *  returns true, once the fd is ready again if that was the problem, or
+ *  false for a real error
+ ****************************************************************/
+bool retryable(int fd, short events)
+{
+    struct pollfd waitFor;
+    
+    if (EINTR == errno)
+    {
+        return true;
+    }
+    if (EAGAIN != errno && EWOULDBLOCK != errno)
+    {
+        return false;
+    }
+    waitFor.fd = fd;
+    waitFor.events = events;
+    return -1 != poll(&waitFor, 1, -1) || EINTR == errno;
+}
+
+/****************************************************************
+ * Write a whole buffer to a socket, retrying partial writes
+ * 
+ * Preconditions: fd is open for writing
+ *
+ * Postcondition:
+ *  returns 0 if everything was written, -1 otherwise
+ ****************************************************************/
+int writeAll(int fd, const char * buf, int length)
+{
+    int written = 0;
+    int writtenThisRound = 0;
+    while (written < length)
+    {
+        writtenThisRound = Transport_Write(fd, buf + written, length - written);
+        if (writtenThisRound > 0)
+        {
+            written += writtenThisRound;
+        }
+        else if (!(writtenThisRound < 0 && retryable(fd, POLLOUT)))
+        {
+            break;
+        }
+    }
+    return (written == length) ? 0 : -1;
+}
+
+/****************************************************************
+ * Read from a connection, retrying calls that didn't really fail
+ * 
+ * Preconditions: fd is open for reading
+ *
+ * Postcondition:
+ *  returns as read()
+ ****************************************************************/
+int readSome(int fd, char * buffer, int length)
+{
+    int got;
+    while (-1 == (got = Transport_Read(fd, buffer, length)) &&
+           retryable(fd, POLLIN))
+    {
+    }
+    return got;
+}
+
+/****************************************************************
+ * Admin command: show or change how often messages are traced.
+ *  trace [one_in_n]
+ * 
+ * Preconditions: (none)
+ *
+ * Postcondition:
+ *  returns 0 with the (new) sampling written to out, or non-zero on bad
+ *  arguments
+ ****************************************************************/
+int adminTrace(int argc, char ** argv, FILE * out, void * userData)
+{
+    uint32_t oneIn;
+    
+    if (2 == argc)
+    {
+        if (atoi(argv[1]) < 0)
+        {
+            return 1;
+        }
+        Set_Trace_Sampling(atoi(argv[1]));
+    }
+    else if (1 != argc)
+    {
+        return 1;
+    }
+    oneIn = Get_Trace_Sampling();
+    if (0 == oneIn)
+    {
+        fprintf(out, "tracing off\n");
+    }
+    else
+    {
+        fprintf(out, "tracing 1 in %u messages\n", oneIn);
+    }
+    return 0;
+}
+
+/****************************************************************
+ * Admin command: write the traced messages to a file as Chrome trace JSON,
+ * for chrome://tracing or Perfetto.
+ *  trace_dump <file>
+ * 
+ * Preconditions: (none)
+ *
+ * Postcondition:
+ *  returns 0 with the event count written to out, or non-zero if the file
+ *  couldn't be written
+ ****************************************************************/
+int adminTraceDump(int argc, char ** argv, FILE * out, void * userData)
+{
+    FILE * traceFile;
+    int events;
+    
+    if (2 != argc)
+    {
+        return 1;
+    }
+    if (NULL == (traceFile = fopen(argv[1], "w")))
+    {
+        fprintf(out, "couldn't open %s\n", argv[1]);
+        return 1;
+    }
+    events = Write_Trace(traceFile);
+    if (0 != fclose(traceFile))
+    {
+        fprintf(out, "couldn't write %s\n", argv[1]);
+        return 1;
+    }
+    fprintf(out, "wrote %d events to %s\n", events, argv[1]);
+    return 0;
+}
+
+/****************************************************************
+ * Write a message to a connection, unless its filter rejects it. Called by
+ * the fan-out writer that owns the connection's shard. Connections that take
+ * compressed chat get the compressed frame instead, if there is one.
+ * 
+ * Preconditions: connection's fd is open for writing. compressed is the
+ *  message as a frame, or NULL. hits is what the message matched, or NULL.
+ *  traceId is the message's, or 0.
+ *
+ * Postcondition:
+ *  message written to the connection's fd or ring, or counted as filtered
+ *  out, or error written to stderr. If the ring's reader is gone, the
+ *  socket is shut so the connection's reader tears it down.
+ ****************************************************************/
+void writeMessage(connection_t * connection, const char * messageBuf,
+                  int messageBufUsed, const char * compressed,
+                  int compressedLength, const filter_hits_t * hits,
+                  uint32_t traceId)
+{
+    int outFd = connection->fd;
+    int writeResult = 0;
+    uint64_t lockStart = 0;
+    uint64_t writeStart = 0;
+    filter_t * filter = __atomic_load_n(&(connection->filter),
+                                        __ATOMIC_ACQUIRE);
+    
+    if (!Filter_Accepts(filter, hits))
+    {
+        ++(connection->filteredOut);
+        return;
+    }
+    if (traceId)
+    {
+        lockStart = Trace_Now();
+    }
+    pthread_mutex_lock(&(connection->writeLock));
+    if (traceId)
+    {
+        writeStart = Trace_Now();
+        Trace_Event(TRACE_WRITE_LOCK, traceId, lockStart, writeStart,
+                    connection->id);
+    }
+    // A late HELLO sets its filter along with writing the WELCOME, so
+    // without one yet, look again: nothing unfiltered goes after it
+    if (NULL == filter && !Filter_Accepts(connection->filter, hits))
+    {
+        pthread_mutex_unlock(&(connection->writeLock));
+        ++(connection->filteredOut);
+        return;
+    }
+    // Checked under the lock too, so nothing compressed or in the ring comes
+    // before the WELCOME
+    if (compressed && (connection->flags & CONNECTION_DEFLATE))
+    {
+        messageBuf = compressed;
+        messageBufUsed = compressedLength;
+        __atomic_add_fetch(&compressedDeliveries, 1, __ATOMIC_RELAXED);
+    }
+    if (connection->flags & CONNECTION_SHM)
+    {
+        // Local client reading from shared memory: no syscall unless it is
+        // asleep or the ring is full
+        if (0 != (writeResult = Shm_Ring_Write(connection->ring, messageBuf,
+                                               messageBufUsed, outFd)))
+        {
+            // Its reader is gone, so there's no falling back to the socket.
+            // Wake our reader to close the connection, and make later
+            // writes give up at once.
+            Transport_Shutdown(outFd, SHUT_RDWR);
+        }
+    }
+    else
+    {
+        writeResult = writeAll(outFd, messageBuf, messageBufUsed);
+    }
+    pthread_mutex_unlock(&(connection->writeLock));
+    if (traceId)
+    {
+        Trace_Event(TRACE_WRITE, traceId, writeStart, Trace_Now(),
+                    connection->id);
+    }
+    if (0 != writeResult)
+    {
+        fprintf(stderr, "Error writing to fd %d.\n", outFd);
+    }
+}
 
 /****************************************************************
- * Handle a SIGINT for the server and trigger listener thread (and then other
- *  threads) to stop trying to read and to close down
+ * Send a ping to a connection on behalf of the heartbeat thread. Doesn't
+ * wait to start: a connection that is busy or backed up is evidently not a
+ * dead peer we need to detect, so it is just skipped. Only if the socket
+ * takes part of the ping does it wait to send the rest.
  * 
- * Preconditions: (none -- signal handler)
+ * Preconditions: connection is alive (the heartbeat holds a reference)
  *
  * Postcondition:
- *      socket that we accept() on closed. serverShutdown set to true to signal
- *      that we are shutting down
- * 
+ *  ping frame sent to the connection if that could be done without waiting
  ****************************************************************/
-void handleSIGINT(int sig)
+void sendPing(connection_t * connection)
 {
-    // Set the stop signal
-    serverShutdown = true;
-    // Close the accept socket
-    shutdown(sockfd, SHUT_RD);
+    static const char ping[] = PROTO_PING "\n";
+    ssize_t sent;
+    
+    if (0 != pthread_mutex_trylock(&(connection->writeLock)))
+    {
+        return;
+    }
+    if (connection->flags & CONNECTION_SHM)
+    {
+        Shm_Ring_Try_Write(connection->ring, ping, sizeof(ping) - 1);
+    }
+    else
+    {
+        sent = Transport_Send(connection->fd, ping, sizeof(ping) - 1,
+                              MSG_DONTWAIT | MSG_NOSIGNAL);
+        // Half a control line would swallow whatever is written next, so
+        // once any of it is out the rest has to follow, waiting if need be
+        if (sent > 0 && sent < (ssize_t)sizeof(ping) - 1)
+        {
+            writeAll(connection->fd, ping + sent, sizeof(ping) - 1 - sent);
+        }
+    }
+    pthread_mutex_unlock(&(connection->writeLock));
 }
 
 /****************************************************************
- * Callback function to call on each open connection in the list
+ * Set up whatever a client asks for in its HELLO line (see protocol.h) that
+ * we support, and answer with a WELCOME. The connection has already joined
+ * and may have been sent chat, so the options and the WELCOME are put in
+ * place under its write lock: every delivery is either before the WELCOME
+ * and plain, or after it with the options.
  * 
- * Preconditions: socket passed in FD is not already closed/shut
+ * Preconditions: buffer holds the first used bytes read from the
+ *  connection, which start with PROTO_CONTROL, and has room for bufferSize
  *
  * Postcondition:
- *      socket passed in fd is shut to further reads
- *      socket has goodbye written to it, if possible
- *      socket is shut to further writes
+ *  returns the number of chat bytes that were read along with the control
+ *  line, moved to the start of buffer, or -1 if the client hung up
  ****************************************************************/
-void shutConnection(int fd, void * userdata)
+int negotiateHello(connection_t * connection, char * buffer, int used,
+                   int bufferSize)
 {
-    shutdown(fd, SHUT_RD);
-    write(fd, "Chat server says goodbye.\n", 26);
-    shutdown(fd, SHUT_WR);
+    char * lineEnd = NULL;
+    char * word;
+    char * savePtr = NULL;
+    bool wantShm = false;
+    bool wantDeflate = false;
+    filter_t * filter = NULL;
+    shm_ring_t * ring = NULL;
+    char welcome[PROTO_MAX_LINE];
+    // Filter spec as accepted, echoed in the WELCOME
+    const char * filterSpec = NULL;
+    // Options accepted other than shm, each with a space in front. Sized to
+    // leave room for the rest of the WELCOME.
+    char accepted[PROTO_MAX_LINE - sizeof(PROTO_WELCOME " " PROTO_OPT_SHM
+                                          "\n")];
+    int readThisRound;
+    int leftover;
+    int result = 0;
+    
+    while (NULL == (lineEnd = memchr(buffer, '\n', used)) &&
+        used < bufferSize)
+    {
+        readThisRound = readSome(connection->fd, buffer + used,
+                                 bufferSize - used);
+        if (readThisRound <= 0)
+        {
+            return -1;
+        }
+        used += readThisRound;
+    }
+    if (NULL == lineEnd)
+    {
+        fprintf(stderr, "Dropping overlong control line from connection %lu.\n",
+                (unsigned long)connection->id);
+        // The rest of it is skipped like any other control line
+        connection->inControlLine = true;
+        return 0;
+    }
+    *lineEnd = '\0';
+    leftover = used - (lineEnd + 1 - buffer);
+    
+    if (0 == strncmp(buffer, PROTO_HELLO, strlen(PROTO_HELLO)))
+    {
+        for (word = strtok_r(buffer + strlen(PROTO_HELLO), " ", &savePtr);
+             NULL != word; word = strtok_r(NULL, " ", &savePtr))
+        {
+            if (0 == strcmp(word, PROTO_OPT_SHM) &&
+                (connection->flags & CONNECTION_LOCAL))
+            {
+                wantShm = true;
+            }
+            else if (0 == strncmp(word, PROTO_OPT_FILTER,
+                                  strlen(PROTO_OPT_FILTER)) &&
+                     NULL == filter &&
+                     NULL != (filter = Create_Filter(
+                        word + strlen(PROTO_OPT_FILTER))))
+            {
+                filterSpec = word;
+            }
+            else if (0 == strcmp(word, PROTO_OPT_DEFLATE))
+            {
+                wantDeflate = true;
+            }
+        }
+        snprintf(accepted, sizeof(accepted), "%s%s%s%s",
+                 wantDeflate ? " " : "", wantDeflate ? PROTO_OPT_DEFLATE : "",
+                 filterSpec ? " " : "", filterSpec ? filterSpec : "");
+        if (wantShm)
+        {
+            ring = Create_Shm_Ring(SHM_RING_DEFAULT_SIZE);
+        }
+        
+        pthread_mutex_lock(&(connection->writeLock));
+        if (ring)
+        {
+            snprintf(welcome, sizeof(welcome), "%s %s%s\n", PROTO_WELCOME,
+                     PROTO_OPT_SHM, accepted);
+            connection->ring = ring;
+            result = Send_Shm_Ring_Fds(connection->fd, ring, welcome,
+                                       strlen(welcome));
+        }
+        else
+        {
+            snprintf(welcome, sizeof(welcome), "%s%s\n", PROTO_WELCOME,
+                     accepted);
+            result = writeAll(connection->fd, welcome, strlen(welcome));
+        }
+        if (0 == result)
+        {
+            __atomic_store_n(&(connection->filter), filter, __ATOMIC_RELEASE);
+            __atomic_or_fetch(&(connection->flags), CONNECTION_HELLO |
+                              (wantDeflate ? CONNECTION_DEFLATE : 0) |
+                              (ring ? CONNECTION_SHM : 0), __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&(connection->writeLock));
+        if (0 != result)
+        {
+            // The ring, if any, goes with the connection
+            if (filter)
+            {
+                Delete_Filter(filter);
+            }
+            return -1;
+        }
+        if (wantDeflate)
+        {
+            __atomic_add_fetch(&deflateConnections, 1, __ATOMIC_RELAXED);
+        }
+        Capture_Hello(connection->id, connection->flags, filterSpec ?
+                      filterSpec + strlen(PROTO_OPT_FILTER) : NULL);
+    }
+    
+    memmove(buffer, lineEnd + 1, leftover);
+    return leftover;
 }
 
 /****************************************************************
- * Compare int and int pointer to see if that have the same data
+ * Count a message from a client and queue it for every connection
  * 
- * Preconditions: userData is a valid int *
+ * Preconditions: connections is the connections list, connection is the
+ *  sender. traceId is from Trace_Sample when the message was read, or 0.
  *
  * Postcondition:
- *  returns 1 if data == *userData
- *  otherwise, returns 0
+ *  message handed to the fan-out writers, errors written to stderr
  ****************************************************************/
-int fdRemoveCompare(int data, void * userData)
+void broadcastMessage(linked_list_t connections, connection_t * connection,
+                      char * message, int messageLength, uint32_t traceId)
 {
-    int valueToRemove = *(int *)userData;
+    uint64_t matchStart = 0;
+    uint64_t submitStart = 0;
+    int threshold = __atomic_load_n(&compressThreshold, __ATOMIC_RELAXED);
+    char * compressed;
+    int compressedLength;
+    filter_hits_t hits;
+    bool matched;
+    int used;
+    int run;
+    
+    connection->bytesRead += messageLength;
+    ++(connection->messagesRead);
+    __atomic_add_fetch(&ingestMessages, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ingestBytes, messageLength, __ATOMIC_RELAXED);
+    
+    // A no-op unless capturing
+    Capture_Message(connection->id, message, messageLength);
     
-    if (valueToRemove == data)
+    if (traceId)
     {
-        return 1;
+        matchStart = Trace_Now();
+        Trace_Event(TRACE_MESSAGE_BEGIN, traceId, matchStart, matchStart,
+                    connection->id);
     }
-    else
+    // Match against every subscriber's filter once, here, rather than once
+    // per recipient in the writers. A read can hold many lines, so they are
+    // matched one by one, and each run of lines with the same keywords goes
+    // out as a message of its own.
+    for (used = 0; used < messageLength; used += run)
     {
-        return 0;
+        run = Match_Filter_Run(message + used, messageLength - used, &hits,
+                               &matched);
+        if (traceId && 0 == used)
+        {
+            submitStart = Trace_Now();
+            Trace_Event(TRACE_MATCH, traceId, matchStart, submitStart, run);
+        }
+        
+        // Compressed here, once, rather than by the writers for each
+        // recipient. Only this sender waits for it; small messages never do.
+        compressed = NULL;
+        compressedLength = 0;
+        if (threshold > 0 && run >= threshold &&
+            __atomic_load_n(&deflateConnections, __ATOMIC_RELAXED) > 0)
+        {
+            compressedLength = Compress_Frame(message + used, run,
+                __atomic_load_n(&compressLevel, __ATOMIC_RELAXED), &compressed);
+        }
+        
+        // The writer threads do the actual writes, each to its own shard, so
+        // a slow recipient only holds up the others in its shard, and any
+        // sender with a full window of messages waiting on it. Only the
+        // first run carries the trace.
+        if (0 != Fanout_Submit(connection, message + used, run, compressed,
+                               compressedLength, matched ? &hits : NULL,
+                               used ? 0 : traceId))
+        {
+            fprintf(stderr, "Couldn't queue a message from connection %lu.\n",
+                    (unsigned long)connection->id);
+        }
+        free(compressed);
+    }
+    // Chat that came in by datagram was already relayed to the subscribers
+    if (!(connection->flags & CONNECTION_UDP))
+    {
+        Udp_Broadcast(message, messageLength);
+    }
+    if (traceId)
+    {
+        Trace_Event(TRACE_SUBMIT, traceId, submitStart, Trace_Now(),
+                    messageLength);
     }
+    
+    // If this client is over its limits, stop reading from it for a
+    // while. TCP flow control then slows the sender down.
+    Rate_Limit_Read(&(connection->rate), messageLength);
 }
 
 /****************************************************************
- * Uses getopt style arguments to get the port number, as a cstring
- * don't need to free returned pointer as it points to argv
+ * Broadcast chat that arrived by datagram to the stream clients. Called by
+ * the datagram thread once per batch of datagrams, so the whole batch is one
+ * read and one message.
  * 
- * Preconditions: argc is the count of elements in argv, and argv pointers are
- *  valid
+ * Preconditions: udpSender is set up
  *
  * Postcondition:
- *  returns a pointer to the argv string that is the port number
+ *  chat queued for every connection
  ****************************************************************/
-char * getPortString(int argc, char ** argv)
+void receiveDatagrams(char * chat, int length)
 {
-    char * portString = NULL;
-    int arg;
-    while (-1 != (arg = getopt(argc, argv, "p:")))
+    __atomic_add_fetch(&ingestReads, 1, __ATOMIC_RELAXED);
+    broadcastMessage(NULL, udpSender, chat, length, Trace_Sample());
+}
+
+/****************************************************************
+ * Remove control lines (see protocol.h) from a client's input, so only chat
+ * gets broadcast. Lines may be split across reads.
+ * 
+ * Preconditions: buffer holds length bytes just read from connection
+ *
+ * Postcondition:
+ *  control lines removed from buffer, returns the number of bytes left
+ ****************************************************************/
+int stripControlLines(connection_t * connection, char * buffer, int length)
+{
+    int from;
+    int to = 0;
+    
+    for (from = 0; from < length; ++from)
     {
-        if ('p' == arg)
+        if (connection->inControlLine)
+        {
+            // Nothing the client sends us mid-stream (PONG) needs acting on
+            // beyond counting as activity
+            if ('\n' == buffer[from])
+            {
+                connection->inControlLine = false;
+            }
+        }
+        else if (PROTO_CONTROL == buffer[from])
+        {
+            connection->inControlLine = true;
+        }
+        else
         {
-            portString = optarg;
+            buffer[to++] = buffer[from];
         }
     }
-    if (NULL == portString)
+    return to;
+}
+
+/****************************************************************
+ * Handle bytes read from a client: note the activity and broadcast any chat
+ * 
+ * Preconditions: buffer holds length bytes just read from connection.
+ *  traceId is from Trace_Sample for this read, or 0.
+ *
+ * Postcondition:
+ *  chat in buffer written to every connection. buffer may be modified.
+ ****************************************************************/
+void handleClientInput(linked_list_t connections, connection_t * connection,
+                       char * buffer, int length, uint32_t traceId)
+{
+    Heartbeat_Activity(connection);
+    length = stripControlLines(connection, buffer, length);
+    if (length > 0)
     {
-        fprintf(stderr, "No port number or service name set. Please specify it"
-        " with -p <port_number>.\n");
-        exit(4);
+        broadcastMessage(connections, connection, buffer, length, traceId);
     }
-    return portString;
 }
 
-typedef struct
+/****************************************************************
+ * Read everything a client has sent so far, to broadcast as one message: a
+ * blocking read, then while the buffer keeps filling up, a bigger buffer and
+ * non-blocking reads until the socket is empty or the biggest buffer is
+ * full. A read that doesn't fill the buffer took all there was, so a quiet
+ * client still costs one read per message.
+ * 
+ * Preconditions: *buffer is from readBuffers[connection->readSizeClass]
+ *
+ * Postcondition:
+ *  *buffer may have been swapped for a bigger one, with readSizeClass moved
+ *  to match. returns the bytes now at the start of *buffer, 0 if the client
+ *  hung up, or -1 with errno set as by read().
+ ****************************************************************/
+int readPass(connection_t * connection, char ** buffer)
 {
-    char * messageBuf;
-    int messageBufUsed;
-} write_message_data;
+    int sizeClass = connection->readSizeClass;
+    int size = READ_BUFFER_SIZE(sizeClass);
+    int reads = 1;
+    int used;
+    int got;
+    char * bigger;
+    
+    if (0 >= (used = Transport_Read(connection->fd, *buffer, size)))
+    {
+        return used;
+    }
+    while (used == size && sizeClass + 1 < READ_SIZE_CLASSES &&
+           NULL != (bigger = Acquire_Buffer(readBuffers[sizeClass + 1])))
+    {
+        memcpy(bigger, *buffer, used);
+        Release_Buffer(readBuffers[sizeClass], *buffer);
+        *buffer = bigger;
+        size = READ_BUFFER_SIZE(++sizeClass);
+        connection->readSizeClass = sizeClass;
+        connection->smallPasses = 0;
+        // Nothing left, or an error, which the next blocking read will see
+        if (0 >= (got = Transport_Recv(connection->fd, *buffer + used,
+                                       size - used, MSG_DONTWAIT)))
+        {
+            break;
+        }
+        used += got;
+        ++reads;
+    }
+    connection->reads += reads;
+    __atomic_add_fetch(&ingestReads, reads, __ATOMIC_RELAXED);
+    return used;
+}
 
 /****************************************************************
- * Write a message to a file descriptor
+ * Move a connection to the next smaller read buffer once enough passes in a
+ * row would have fit in it
  * 
- * Preconditions: outFd is a valid file descriptor that is open for writing
+ * Preconditions: *buffer is NULL or from readBuffers[connection->
+ *  readSizeClass]. used is what the last pass read.
  *
  * Postcondition:
- *  message written to outFd, or error written to stderr
+ *  if it shrank, *buffer went back to its pool and is NULL
  ****************************************************************/
-void writeMessage(int outFd, void * userData)
+void fitReadBuffer(connection_t * connection, char ** buffer, int used)
 {
-    int messageBufUsed = ((write_message_data *)userData)->messageBufUsed;
-    char* messageBuf = ((write_message_data *)userData)->messageBuf;
-    int messageBufWritten = 0;
-    int writtenThisRound = 0;
-    while (messageBufWritten < messageBufUsed && 0 < (writtenThisRound =
-        write(outFd, messageBuf, messageBufUsed-messageBufWritten))
-    )
+    int sizeClass = connection->readSizeClass;
+    
+    if (0 == sizeClass || used >= READ_BUFFER_SIZE(sizeClass - 1))
     {
-        messageBufWritten += writtenThisRound;
+        connection->smallPasses = 0;
+        return;
     }
-    if (writtenThisRound < 0)
+    if (++(connection->smallPasses) < READ_SHRINK_PASSES)
     {
-        fprintf(stderr, "Error writing to fd %d.\n", outFd);
+        return;
+    }
+    if (*buffer)
+    {
+        Release_Buffer(readBuffers[sizeClass], *buffer);
+        *buffer = NULL;
     }
+    connection->readSizeClass = sizeClass - 1;
+    connection->smallPasses = 0;
 }
 
 /****************************************************************
@@ -190,8 +1367,8 @@ void writeMessage(int outFd, void * userData)
  * 
  * Preconditions: void * arg is a valid thread_data_t pointer
  * Postcondition:
- *  arg->clientFd closed.
- *  input from clientFd written to all fd in arg->connections
+ *  arg->connection closed and freed.
+ *  input from the connection written to all of arg->connections
  *  error messages written to stderr
  ****************************************************************/
 void * ThreadServeConnection(void * arg)
@@ -200,34 +1377,123 @@ void * ThreadServeConnection(void * arg)
     thread_data_t * threadData = (thread_data_t *)arg;
     
     // Client we read from
-    int clientSocket = threadData->clientFd;
+    connection_t * connection = threadData->connection;
+    int clientSocket = connection->fd;
     
     // All clients list, which we will broadcast message to.
     linked_list_t connections = threadData->connections;
     
-    // Add our connection to the list of connections to send messages
-    Insert_At_Beginning(connections, clientSocket);
-    
-    // Our buffer for copying
-    char copyBuffer[BUFFSIZE];
+    // Our buffer for copying, taken from the pool once there's input. In
+    // lean mode it goes back after each read, otherwise it's kept.
+    char * copyBuffer = NULL;
     int copyBufferUsed = 0;
+    struct pollfd waitFor[2];
+    int ready = 0;
+    uint32_t traceId;
+    uint64_t readStart = 0;
+    bool firstRead = true;
+    
+    // Without a place in the fan-out it would never be sent chat. Nothing
+    // else knows about it yet, so dropping our reference closes it.
+    if (0 != Fanout_Join(connection))
+    {
+        fprintf(stderr, "Couldn't add fd %d to the fan-out, closing that"
+        " connection.\n", clientSocket);
+        Release_Connection(connection);
+        free(threadData);
+        return NULL;
+    }
+    Capture_Connect(connection->id, connection->flags);
+    
+    // Add our connection to the list of connections to send messages. A
+    // HELLO, if it sends one, upgrades it later.
+    Insert_Link_At_Beginning(connections, &(connection->link));
+    Heartbeat_Add(connection);
     
     // while there is still stuff to read from the client and the server isn't
     // trying to shut down try to read buffersize and set buffer used based on
     // result
-    while (!serverShutdown &&
-        (0 < (copyBufferUsed = read(clientSocket, copyBuffer, BUFFSIZE))))
+    // Wait for input or shutdown, whichever comes first
+    waitFor[0].fd = clientSocket;
+    waitFor[0].events = POLLIN;
+    waitFor[1].fd = Get_Shutdown_Fd();
+    waitFor[1].events = POLLIN;
+    while (true)
     {
-        write_message_data writeInfo;
-        writeInfo.messageBuf = copyBuffer;
-        writeInfo.messageBufUsed = copyBufferUsed;
-        // Attempt to write that buffer to each connection:
-        if (0 != Traverse(connections, writeMessage, &writeInfo))
+        // Only wake up for idleness while there's a big buffer to give back
+        while (-1 == (ready = poll(waitFor, 2, (connection->readSizeClass > 0) ?
+                                   READ_IDLE_MS : -1)) && EINTR == errno)
+        {
+        }
+        if (Shutdown_Requested())
+        {
+            break;
+        }
+        if (0 == ready)
+        {
+            // Gone quiet: start small again when it next says something
+            if (copyBuffer)
+            {
+                Release_Buffer(readBuffers[connection->readSizeClass],
+                               copyBuffer);
+                copyBuffer = NULL;
+            }
+            connection->readSizeClass = 0;
+            connection->smallPasses = 0;
+            continue;
+        }
+        // Hold no buffer while the client is idle, which in lean mode is
+        // most of the time
+        if (NULL == copyBuffer && NULL == (copyBuffer = Acquire_Buffer(
+            readBuffers[connection->readSizeClass])))
+        {
+            break;
+        }
+        // Costs one load per read while tracing is off
+        traceId = Trace_Sample();
+        if (traceId)
+        {
+            readStart = Trace_Now();
+        }
+        copyBufferUsed = readPass(connection, &copyBuffer);
+        if (copyBufferUsed < 0 &&
+            (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno))
+        {
+            // Nothing there after all; wait again, watching for shutdown
+            copyBufferUsed = 0;
+            continue;
+        }
+        if (copyBufferUsed <= 0)
+        {
+            break;
+        }
+        if (traceId)
+        {
+            Trace_Event(TRACE_READ, traceId, readStart, Trace_Now(),
+                        copyBufferUsed);
+        }
+        if (firstRead && PROTO_CONTROL == copyBuffer[0] &&
+            0 > (copyBufferUsed = negotiateHello(connection, copyBuffer,
+                copyBufferUsed, READ_BUFFER_SIZE(connection->readSizeClass))))
+        {
+            // Hung up partway through its HELLO, or missed the WELCOME
+            copyBufferUsed = 0;
+            break;
+        }
+        firstRead = false;
+        handleClientInput(connections, connection, copyBuffer, copyBufferUsed,
+                          traceId);
+        fitReadBuffer(connection, &copyBuffer, copyBufferUsed);
+        if (leanMode && copyBuffer)
         {
-            fprintf(stderr, "Error while trying to traverse connections list to"
-            " write message from thread %ld", pthread_self());
+            Release_Buffer(readBuffers[connection->readSizeClass], copyBuffer);
+            copyBuffer = NULL;
         }
     }
+    if (copyBuffer)
+    {
+        Release_Buffer(readBuffers[connection->readSizeClass], copyBuffer);
+    }
     if (copyBufferUsed < 0)
     {
         printf("%d\n", errno);
@@ -235,27 +1501,158 @@ void * ThreadServeConnection(void * arg)
         "thread %ld, closing that connection.\n", clientSocket, pthread_self());
     }
     
-    // Remove the fd from the list
-    if (1 != DeleteItemsFilter(connections, fdRemoveCompare,
-        &(threadData->clientFd)))
+    // Remove the connection from the list
+    Heartbeat_Remove(connection);
+    if (connection->flags & CONNECTION_DEFLATE)
     {
-        fprintf(stderr, "Warning, thread %ld did not remove 1 item from"
-        " connections list when it tried to remove fd %d.\n", pthread_self(),
-        threadData->clientFd);
+        __atomic_sub_fetch(&deflateConnections, 1, __ATOMIC_RELAXED);
+    }
+    Fanout_Leave(connection);
+    Capture_Disconnect(connection->id);
+    if (0 != Remove_Link(connections, &(connection->link)))
+    {
+        fprintf(stderr, "Warning, thread %ld could not find its connection in"
+        " the connections list when it tried to remove fd %d.\n",
+        pthread_self(), clientSocket);
     }
     
-    // Close the fd
-    close(threadData->clientFd);
-    
+    // Drop our reference. The fd is closed once no snapshot or writer still
+    // holds it.
+    Release_Connection(connection);
     free(threadData);
     return NULL;
 }
 
-int main(int argc, char ** argv)
+/****************************************************************
+ * Set up the state for a newly accepted connection and start a thread to
+ * serve it
+ * 
+ * Preconditions: acceptfd is a connected socket, threads points to the list of
+ *  threads main() will join
+ *
+ * Postcondition:
+ *  a thread serving acceptfd is running and on *threads, or acceptfd is
+ *  closed if that couldn't be done
+ ****************************************************************/
+void startConnectionThread(int acceptfd, uint32_t flags,
+                           linked_list_t connections,
+                           thread_list_node ** threads)
+{
+    thread_data_t * threadData =
+        (thread_data_t *)malloc(sizeof(thread_data_t));
+    thread_list_node * thisThread =
+        (thread_list_node *)malloc(sizeof(thread_list_node));
+    connection_t * connection = Init_Connection(acceptfd);
+    pthread_attr_t attributes;
+    if (NULL != threadData && NULL != thisThread && NULL != connection)
+    {
+        connection->flags = flags;
+        thisThread->next = *threads;
+        threadData->connection = connection;
+        thisThread->clientFd = acceptfd;
+        threadData->connections = connections;
+        pthread_attr_init(&attributes);
+        if (leanMode)
+        {
+            // The default is megabytes. Untouched stack isn't resident, but
+            // the address space and guard pages add up at 100k threads.
+            pthread_attr_setstacksize(&attributes, LEAN_STACK_SIZE);
+        }
+        pthread_create(&(thisThread->threadId), &attributes,
+                       ThreadServeConnection, threadData);
+        pthread_attr_destroy(&attributes);
+        // Now we have a valid thread, add it to the list of ones we'll
+        // wait for
+        *threads = thisThread;
+    }
+    else
+    {
+        // At least one allocation failed; free(NULL) is a no-op so
+        // just release all of them and drop the connection
+        free(threadData);
+        free(thisThread);
+        if (connection)
+        {
+            Release_Connection(connection);
+        }
+        else
+        {
+            Transport_Close(acceptfd);
+        }
+    }
+}
+
+/****************************************************************
+ * Open a listening Unix domain socket at path, replacing any stale socket
+ * file left there by an earlier run
+ * 
+ * Preconditions: (none)
+ *
+ * Postcondition:
+ *  returns the listening socket, or -1 with an error written to stderr
+ ****************************************************************/
+int openUnixListener(const char * path)
+{
+    struct sockaddr_un address;
+    int fd;
+    
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Unix socket path %s is too long.\n", path);
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    
+    if (-1 == (fd = socket(AF_UNIX, SOCK_STREAM, 0)))
+    {
+        perror("Trouble getting a Unix domain socket");
+        return -1;
+    }
+    unlink(path);
+    if (-1 == bind(fd, (struct sockaddr *)&address, sizeof(address)) ||
+        -1 == listen(fd, SOMAXCONN))
+    {
+        perror("Trouble listening on the Unix domain socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/****************************************************************
+ * Run the server until it is told to shut down. Split from main so the
+ * simulator (simulate.c) can run the server in its own process after
+ * installing its transport.
+ * 
+ * Preconditions: argc/argv as for main. Transport chosen with Set_Transport
+ *  if not the kernel's.
+ *
+ * Postcondition:
+ *  returns 0 once shut down; exits on startup errors
+ ****************************************************************/
+int runServer(int argc, char ** argv)
 {
     printf("Server starting, version %s\n", GIT_VERSION);
     serverShutdown = false;
-    char * portString = getPortString(argc, argv);
+    server_options options;
+    parseOptions(argc, argv, &options);
+    char * portString = options.port;
+    
+    // Take SIGINT and SIGTERM through a signalfd in the accept loop instead
+    // of a handler. Blocked before any threads start, so they all inherit it.
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+    int signalFd = signalfd(-1, &stopSignals, SFD_CLOEXEC);
+    if (-1 == signalFd || 0 != Init_Shutdown_Event())
+    {
+        perror("Trouble setting up for shutdown");
+        exit(2);
+    }
     
     linked_list_t connections = Init_List();
     if (NULL == connections)
@@ -264,148 +1661,226 @@ int main(int argc, char ** argv)
         exit(3);
     }
     
-    thread_list_node * threads = NULL;
-    
-    // Gives getaddrinfo hints about the critera for the addresses it returns
-    struct addrinfo hints;
-    // Points to list of results from getaddrinfo
-    struct addrinfo *serverinfo;
-    
-    // Erase the struct
-    memset(&hints, 0, sizeof(hints));
+    // Keep connections alive while a broadcast snapshot refers to them
+    Set_Snapshot_Refcounting(connections, Retain_Connection_Link,
+                             Release_Connection_Link);
     
-    // Then set what we actually want:
-    hints.ai_family = AF_INET6;
-    // We want to do TCP
-    hints.ai_socktype = SOCK_STREAM;
-    // We want to listen (we are the server)
-    hints.ai_flags = AI_PASSIVE;
+    thread_list_node * threads = NULL;
     
-    int status = 0;
-    if (0 != (status = getaddrinfo(NULL, portString, &hints, &serverinfo)))
+    leanMode = options.lean;
+    compressThreshold = options.compressThreshold;
+    compressLevel = options.compressLevel;
+    if (leanMode)
     {
-        // There was a problem, print it out
-        fprintf(stderr, "Trouble with getaddrinfo, error was %s.\n",
-                gai_strerror(status));
+        // Each thread that mallocs can otherwise get an arena of its own,
+        // and with a thread per connection that's a lot of arenas
+        mallopt(M_ARENA_MAX, 1);
     }
-    
-    struct addrinfo * current = serverinfo;
-    // Traverse results list until one of them works to open
-    sockfd = socket(current->ai_family, current->ai_socktype,
-                    current->ai_protocol);
-    while (-1 == sockfd && NULL != current->ai_next)
+    for (int sizeClass = 0; sizeClass < READ_SIZE_CLASSES; ++sizeClass)
     {
-        current = current->ai_next;
-        sockfd = socket(current->ai_family, current->ai_socktype,
-                        current->ai_protocol);
+        // The biggest sizes come one per slab, and only a few are kept
+        // once connections shrink back out of them
+        readBuffers[sizeClass] = Init_Buffer_Pool(READ_BUFFER_SIZE(sizeClass),
+            MAX(1, BUFFERS_PER_SLAB >> (2 * sizeClass)), READ_FREE_LARGE);
+        if (NULL == readBuffers[sizeClass])
+        {
+            fprintf(stderr, "Trouble creating the read buffer pools.\n");
+            exit(3);
+        }
     }
-    if (-1 == sockfd)
+    
+    if (-1 == (sockfd = Transport_Listen(portString)))
     {
-        fprintf(stderr, "We tried valliantly, but we were unable to open the"
-        " socket with what getaddrinfo gave us.\n");
-        freeaddrinfo(serverinfo);
         exit(8);
     }
     
-    // Ok, say we want a socket that abstracts away whether we are doing IPv6 or
-    // IPv4 by just having it handle IPv4 mapped addresses for us
-    int no = 0;
-    if (0 > setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&no, sizeof(no)))
+    if (options.unixPath && -1 == (unixfd = openUnixListener(options.unixPath)))
+    {
+        exit(64);
+    }
+    
+    Set_Heartbeat_Timeouts(options.idleTimeout * 1000,
+                           options.pingInterval * 1000);
+    if (0 != Start_Heartbeat(sendPing))
     {
-        fprintf(stderr,"Trouble setting socket option to also listen on IPv4 in"
-        " addition to IPv6. Falling back to IPv6 only.\n");
+        fprintf(stderr, "Couldn't start the heartbeat thread. Idle connections"
+        " won't be dropped.\n");
     }
     
-    int yes = 1;
-    if (0 > 
-        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (void *)&yes, sizeof(yes)))
+    if (0 != Start_Fanout(options.writers, options.sequence, writeMessage))
     {
-        fprintf(stderr, "Couldn't set option to re-use addresses. The server "
-        "will still try to start, but if the address & port has been in use"
-        " recently (think last minute range), binding may fail.");
+        fprintf(stderr, "Couldn't start the fan-out writer threads.\n");
+        exit(128);
     }
     
-    // Ok, so now we have a socket. Lets try to bind to it
-    if (-1 == bind(sockfd, current->ai_addr, current->ai_addrlen))
+    if (options.capturePath && 0 != Start_Capture(options.capturePath))
     {
-        // Couldn't bind
-        fprintf(stderr, "We couldn't bind to the socket. (Or something like tha"
-        "t. What is the correct terminology?)\n");
-        exit(16);
+        fprintf(stderr, "Couldn't start capturing to %s.\n",
+                options.capturePath);
+        exit(128);
     }
     
-    // Also cleans up the memory pointed to by current
-    freeaddrinfo(serverinfo);
-    serverinfo = NULL;
+    if (options.udpPort)
+    {
+        // Its rate limits apply to all datagram clients together
+        if (NULL == (udpSender = Init_Connection(-1)))
+        {
+            fprintf(stderr, "Trouble setting up for datagrams.\n");
+            exit(3);
+        }
+        udpSender->flags = CONNECTION_UDP;
+        Capture_Connect(udpSender->id, udpSender->flags);
+        if (0 != Start_Udp(options.udpPort, receiveDatagrams))
+        {
+            exit(8);
+        }
+    }
     
-    if (-1 == listen(sockfd, 10))
+    if (options.adminPort)
     {
-        // Couldn't listen
-        fprintf(stderr, "Call to listen failed.\n");
-        exit(32);
+        Register_Admin_Command("stats", "", adminStats, connections);
+        Register_Admin_Command("heartbeat", "[idle_seconds ping_seconds]",
+                               adminHeartbeat, NULL);
+        Register_Admin_Command("limits", "", adminLimits, NULL);
+        Register_Admin_Command("limit", "<conn|global> <bytes|messages>"
+                               " <per_second> [burst]", adminLimit, NULL);
+        Register_Admin_Command("weight", "<connection_id> <weight>",
+                               adminWeight, connections);
+        Register_Admin_Command("compress", "[threshold_bytes level]",
+                               adminCompress, NULL);
+        Register_Admin_Command("trace", "[one_in_n]", adminTrace, NULL);
+        Register_Admin_Command("trace_dump", "<file>", adminTraceDump, NULL);
+        if (0 != Start_Admin(options.adminPort))
+        {
+            fprintf(stderr, "Couldn't open the admin port. Continuing without"
+            " it.\n");
+        }
     }
     
-    // Set a signal handler so the server can be stopped with Ctrl-C
-    signal(SIGINT, handleSIGINT);
+    // Writes to clients that already hung up should fail, not kill us
+    signal(SIGPIPE, SIG_IGN);
     // Now we are set up to take connections. Start a thread for each.
+    baselineRss = currentRss();
+    
+    struct pollfd listeners[3];
+    int listenerCount = 1;
+    listeners[0].fd = sockfd;
+    listeners[0].events = POLLIN;
+    if (-1 != unixfd)
+    {
+        listeners[1].fd = unixfd;
+        listeners[1].events = POLLIN;
+        listenerCount = 2;
+    }
+    // After the listeners, the signalfd
+    listeners[listenerCount].fd = signalFd;
+    listeners[listenerCount].events = POLLIN;
     
     while (!serverShutdown)
     {
-    int acceptfd = -1; 
-        if (-1 == (acceptfd = accept(sockfd, NULL, NULL)))
+        if (-1 == poll(listeners, listenerCount + 1, -1))
         {
-            if (EINVAL == errno)
-            {
-                printf("Sever interrupted while waiting to accept a connection."
-                " Shutting down.\n");
-            }
-            else
+            if (EINTR != errno)
             {
-                perror("Trouble accept()ing a connection");
+                perror("Trouble waiting for connections");
+                serverShutdown = true;
             }
-            // Things the man page says we should check for and try again after
-            if (!(EAGAIN == errno || ENETDOWN == errno || EPROTO == errno || \
-                ENOPROTOOPT == errno || EHOSTDOWN == errno || ENONET == errno \
-                || EHOSTUNREACH == errno || EOPNOTSUPP == errno || ENETUNREACH))
+            continue;
+        }
+        
+        if (listeners[listenerCount].revents)
+        {
+            struct signalfd_siginfo signalInfo;
+            if (sizeof(signalInfo) ==
+                read(signalFd, &signalInfo, sizeof(signalInfo)))
             {
-                // Something the man page didn't list went wrong, let's give up
-                serverShutdown = true;
+                printf("Server got signal %d. Shutting down.\n",
+                       (int)signalInfo.ssi_signo);
             }
+            serverShutdown = true;
+            continue;
         }
-        else
+        
+        int index;
+        for (index = 0; index < listenerCount && !serverShutdown; ++index)
         {
-            thread_data_t * threadData =
-                (thread_data_t *)malloc(sizeof(thread_data_t));
-            thread_list_node * thisThread =
-                (thread_list_node *)malloc(sizeof(thread_list_node));
-            if (NULL != threadData && NULL != thisThread)
+            if (0 == listeners[index].revents)
             {
-                thisThread->next = threads;
-                threadData->clientFd = acceptfd;
-                thisThread->clientFd = acceptfd;
-                threadData->connections = connections;
-                pthread_create(&(thisThread->threadId), NULL,
-                               ThreadServeConnection, threadData);
-                // Now we have a valid thread, add it to the list of ones we'll
-                // wait for
-                threads = thisThread;
+                continue;
             }
-            else if (threadData)
+            
+            int acceptfd = -1; 
+            if (-1 == (acceptfd = Transport_Accept(listeners[index].fd)))
             {
-                free(threadData);
+                if (EINVAL == errno)
+                {
+                    printf("Sever interrupted while waiting to accept a "
+                    "connection. Shutting down.\n");
+                }
+                else
+                {
+                    perror("Trouble accept()ing a connection");
+                }
+                // Things the man page says we should check for and try again
+                // after
+                if (!(EAGAIN == errno || ENETDOWN == errno || EPROTO == errno ||
+                    ENOPROTOOPT == errno || EHOSTDOWN == errno || ENONET == errno
+                    || EHOSTUNREACH == errno || EOPNOTSUPP == errno || ENETUNREACH))
+                {
+                    // Something the man page didn't list went wrong, let's give
+                    // up
+                    serverShutdown = true;
+                }
             }
             else
             {
-               // One of them was NULL, and it wasn't threadData, so it must be
-               //thisThread
-                free(thisThread);
+                // Only the Unix domain socket is guaranteed to be this host
+                startConnectionThread(acceptfd,
+                                      (1 == index) ? CONNECTION_LOCAL : 0,
+                                      connections, &threads);
             }
         }
     }
     
-    Traverse(connections, shutConnection, NULL);
-    
     // Now in shutdown mode
+    struct timespec shutdownStart;
+    struct timespec shutdownEnd;
+    clock_gettime(CLOCK_MONOTONIC, &shutdownStart);
+    
+    // Keep every connection open until its goodbye is out or the deadline
+    // passes, even once its thread has gone
+    list_snapshot_t * remaining = Acquire_Snapshot(connections);
+    
+    // Goes out through the writer threads' control lanes, so every shard's
+    // goodbyes are written in parallel, ahead of any chat still queued.
+    // Queued before the shutdown event fires, so it's ahead of every
+    // connection's leave.
+    static const char goodbye[] = "Chat server says goodbye.\n";
+    Fanout_Control(goodbye, sizeof(goodbye) - 1);
+    Udp_Broadcast(goodbye, sizeof(goodbye) - 1);
+    // Wakes every reader, the heartbeat thread and throttled readers at once
+    Request_Shutdown();
+    Stop_Admin();
+    
+    int forced = 0;
+    // Clamped so a huge -d can't overflow the int
+    double deadlineMs = MIN(MAX(options.shutdownDeadline * 1000, 0), INT_MAX);
+    if (0 != Fanout_Drain((int)lround(deadlineMs)))
+    {
+        // Shutting the stragglers down makes writes blocked on them fail, so
+        // the writers can finish
+        if (remaining)
+        {
+            Traverse_Snapshot(remaining, shutConnection, &forced);
+        }
+        printf("Shutdown deadline of %gs passed. Forced %d connections"
+               " closed.\n", options.shutdownDeadline, forced);
+    }
+    if (remaining)
+    {
+        Release_Snapshot(remaining);
+    }
+    
     // Clean up thread data
     while (threads)
     {
@@ -418,7 +1893,41 @@ int main(int argc, char ** argv)
         }
         free(thisthread);
     }
+    // The datagram thread stopped taking chat on shutdown; this waits for it
+    Stop_Udp();
+    // Every connection has left by now, so this only drains the log
+    Stop_Fanout();
+    if (udpSender)
+    {
+        Capture_Disconnect(udpSender->id);
+        // Nothing in the log refers to it any more
+        Release_Connection(udpSender);
+    }
+    Stop_Heartbeat();
+    // No connection threads are left to capture anything
+    Stop_Capture();
     
-    free(connections);
+    clock_gettime(CLOCK_MONOTONIC, &shutdownEnd);
+    printf("Shutdown took %ld ms.\n",
+           (long)((shutdownEnd.tv_sec - shutdownStart.tv_sec) * 1000 +
+                  (shutdownEnd.tv_nsec - shutdownStart.tv_nsec) / 1000000));
+    
+    if (-1 != unixfd)
+    {
+        close(unixfd);
+        unlink(options.unixPath);
+    }
+    Delete_List(connections);
+    for (int sizeClass = 0; sizeClass < READ_SIZE_CLASSES; ++sizeClass)
+    {
+        Delete_Buffer_Pool(readBuffers[sizeClass]);
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+#ifndef SERVER_NO_MAIN
+int main(int argc, char ** argv)
+{
+    return runServer(argc, argv);
+}
+#endif
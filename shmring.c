@@ -0,0 +1,421 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      shmring.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Shared memory SPSC byte ring with eventfd wakeups.
+ * 
+ *  -- See shmring.h for function header blocks
+ *
+ ************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+#define SHM_RING_MAGIC 0x43485452
+// Data starts on the page after the header
+#define SHM_RING_HEADER_SPACE 4096
+// How long to sleep between checks that the peer is still there
+#define SHM_RING_WAIT_MS 1000
+#define SHM_RING_FD_COUNT 3
+
+//********************************************
+// Bump an eventfd so whoever sleeps on it wakes up
+static void Signal_Event(int eventFd)
+{
+    uint64_t one = 1;
+    // Can only fail if the counter would overflow, in which case it is
+    // already signalled
+    if (sizeof(one) != write(eventFd, &one, sizeof(one)))
+    {
+        return;
+    }
+}
+
+//********************************************
+// Reset an eventfd after waking up on it
+static void Drain_Event(int eventFd)
+{
+    uint64_t count;
+    if (sizeof(count) != read(eventFd, &count, sizeof(count)))
+    {
+        // EAGAIN: nothing was pending
+        return;
+    }
+}
+
+//********************************************
+// Map the memory behind memFd and fill in a handle for it
+static shm_ring_t * Map_Ring(int memFd, int dataEventFd, int spaceEventFd,
+                             size_t capacity)
+{
+    shm_ring_t * ring = (shm_ring_t *)malloc(sizeof(shm_ring_t));
+    if (NULL == ring)
+    {
+        return NULL;
+    }
+    
+    ring->mappedSize = SHM_RING_HEADER_SPACE + capacity;
+    void * memory = mmap(NULL, ring->mappedSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, memFd, 0);
+    if (MAP_FAILED == memory)
+    {
+        free(ring);
+        return NULL;
+    }
+    
+    ring->header = (shm_ring_header_t *)memory;
+    ring->data = (char *)memory + SHM_RING_HEADER_SPACE;
+    ring->memFd = memFd;
+    ring->dataEventFd = dataEventFd;
+    ring->spaceEventFd = spaceEventFd;
+    return ring;
+}
+
+//********************************************
+shm_ring_t * Create_Shm_Ring(size_t capacity)
+{
+    int memFd = -1;
+    int dataEventFd = -1;
+    int spaceEventFd = -1;
+    shm_ring_t * ring = NULL;
+    
+    // Index math relies on a power of two
+    if (0 == capacity || 0 != (capacity & (capacity - 1)))
+    {
+        return NULL;
+    }
+    
+    memFd = memfd_create("chat-ring", MFD_CLOEXEC);
+    dataEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    spaceEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (-1 != memFd && -1 != dataEventFd && -1 != spaceEventFd &&
+        0 == ftruncate(memFd, SHM_RING_HEADER_SPACE + capacity))
+    {
+        ring = Map_Ring(memFd, dataEventFd, spaceEventFd, capacity);
+    }
+    if (NULL == ring)
+    {
+        if (-1 != memFd)
+        {
+            close(memFd);
+        }
+        if (-1 != dataEventFd)
+        {
+            close(dataEventFd);
+        }
+        if (-1 != spaceEventFd)
+        {
+            close(spaceEventFd);
+        }
+        return NULL;
+    }
+    
+    // ftruncate zero filled it, so head, tail and the flags start at 0
+    ring->header->magic = SHM_RING_MAGIC;
+    ring->header->capacity = capacity;
+    return ring;
+}
+
+//********************************************
+shm_ring_t * Attach_Shm_Ring(int memFd, int dataEventFd, int spaceEventFd)
+{
+    shm_ring_header_t header;
+    shm_ring_t * ring = NULL;
+    
+    // Read the capacity before mapping the whole thing
+    if (sizeof(header) == pread(memFd, &header, sizeof(header), 0) &&
+        SHM_RING_MAGIC == header.magic && 0 != header.capacity &&
+        0 == (header.capacity & (header.capacity - 1)))
+    {
+        ring = Map_Ring(memFd, dataEventFd, spaceEventFd, header.capacity);
+    }
+    if (NULL == ring)
+    {
+        close(memFd);
+        close(dataEventFd);
+        close(spaceEventFd);
+    }
+    return ring;
+}
+
+//********************************************
+void Delete_Shm_Ring(shm_ring_t * ring)
+{
+    munmap(ring->header, ring->mappedSize);
+    close(ring->memFd);
+    close(ring->dataEventFd);
+    close(ring->spaceEventFd);
+    free(ring);
+}
+
+//********************************************
+// Sleep until the consumer frees space or peerFd hangs up
+// Returns 0 to try again, SHM_RING_PEER_GONE if the peer is gone
+static int Wait_For_Space(shm_ring_t * ring, uint64_t head, int peerFd)
+{
+    shm_ring_header_t * header = ring->header;
+    struct pollfd fds[2];
+    int result = 0;
+    
+    // Announce we are about to sleep, then check again, so a consumer that
+    // freed space in between is guaranteed to see the flag and signal us
+    __atomic_store_n(&(header->producerWaiting), 1, __ATOMIC_SEQ_CST);
+    if (head - __atomic_load_n(&(header->tail), __ATOMIC_SEQ_CST) <
+        header->capacity)
+    {
+        __atomic_store_n(&(header->producerWaiting), 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    
+    fds[0].fd = ring->spaceEventFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = peerFd;
+    fds[1].events = POLLRDHUP;
+    if (-1 == poll(fds, 2, SHM_RING_WAIT_MS) && EINTR != errno)
+    {
+        result = SHM_RING_PEER_GONE;
+    }
+    else if (fds[1].revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL))
+    {
+        result = SHM_RING_PEER_GONE;
+    }
+    Drain_Event(ring->spaceEventFd);
+    __atomic_store_n(&(header->producerWaiting), 0, __ATOMIC_RELAXED);
+    return result;
+}
+
+//********************************************
+int Shm_Ring_Write(shm_ring_t * ring, const char * buf, size_t length,
+                   int peerFd)
+{
+    shm_ring_header_t * header = ring->header;
+    uint64_t capacity = header->capacity;
+    // Only we write head, so our own copy is always current
+    uint64_t head = header->head;
+    
+    while (length > 0)
+    {
+        uint64_t tail = __atomic_load_n(&(header->tail), __ATOMIC_ACQUIRE);
+        uint64_t space = capacity - (head - tail);
+        if (0 == space)
+        {
+            if (SHM_RING_PEER_GONE == Wait_For_Space(ring, head, peerFd))
+            {
+                return SHM_RING_PEER_GONE;
+            }
+            continue;
+        }
+        
+        size_t count = (length < space) ? length : space;
+        size_t offset = head & (capacity - 1);
+        size_t firstPart = capacity - offset;
+        if (firstPart > count)
+        {
+            firstPart = count;
+        }
+        memcpy(ring->data + offset, buf, firstPart);
+        memcpy(ring->data, buf + firstPart, count - firstPart);
+        
+        head += count;
+        buf += count;
+        length -= count;
+        
+        // Publish, then check whether the consumer went to sleep. Both sides
+        // use seq_cst for this pair so one of them always sees the other.
+        __atomic_store_n(&(header->head), head, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&(header->consumerWaiting), __ATOMIC_SEQ_CST))
+        {
+            Signal_Event(ring->dataEventFd);
+        }
+    }
+    return 0;
+}
+
+//********************************************
+int Shm_Ring_Try_Write(shm_ring_t * ring, const char * buf, size_t length)
+{
+    shm_ring_header_t * header = ring->header;
+    
+    if (header->capacity - (header->head -
+        __atomic_load_n(&(header->tail), __ATOMIC_ACQUIRE)) < length)
+    {
+        return -1;
+    }
+    // Fits, so this never waits and never looks at the peer fd
+    return Shm_Ring_Write(ring, buf, length, -1);
+}
+
+//********************************************
+size_t Shm_Ring_Read(shm_ring_t * ring, char * buf, size_t length)
+{
+    shm_ring_header_t * header = ring->header;
+    uint64_t capacity = header->capacity;
+    uint64_t tail = header->tail;
+    uint64_t head = __atomic_load_n(&(header->head), __ATOMIC_ACQUIRE);
+    size_t count = head - tail;
+    
+    if (count > length)
+    {
+        count = length;
+    }
+    if (0 == count)
+    {
+        return 0;
+    }
+    
+    size_t offset = tail & (capacity - 1);
+    size_t firstPart = capacity - offset;
+    if (firstPart > count)
+    {
+        firstPart = count;
+    }
+    memcpy(buf, ring->data + offset, firstPart);
+    memcpy(buf + firstPart, ring->data, count - firstPart);
+    
+    __atomic_store_n(&(header->tail), tail + count, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(header->producerWaiting), __ATOMIC_SEQ_CST))
+    {
+        Signal_Event(ring->spaceEventFd);
+    }
+    return count;
+}
+
+//********************************************
+int Shm_Ring_Wait(shm_ring_t * ring, int otherFd)
+{
+    shm_ring_header_t * header = ring->header;
+    struct pollfd fds[2];
+    int result;
+    
+    __atomic_store_n(&(header->consumerWaiting), 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(header->head), __ATOMIC_SEQ_CST) != header->tail)
+    {
+        __atomic_store_n(&(header->consumerWaiting), 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+    
+    fds[0].fd = ring->dataEventFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = otherFd;
+    fds[1].events = POLLIN;
+    if (-1 == poll(fds, (-1 == otherFd) ? 1 : 2, -1))
+    {
+        result = (EINTR == errno) ? 1 : -1;
+    }
+    else
+    {
+        result = (-1 != otherFd && 0 != fds[1].revents) ? 0 : 1;
+    }
+    Drain_Event(ring->dataEventFd);
+    __atomic_store_n(&(header->consumerWaiting), 0, __ATOMIC_RELAXED);
+    return result;
+}
+
+//********************************************
+int Shm_Ring_Arm(shm_ring_t * ring)
+{
+    shm_ring_header_t * header = ring->header;
+    
+    Drain_Event(ring->dataEventFd);
+    // Same handshake as Shm_Ring_Wait, but the sleeping is up to the caller
+    __atomic_store_n(&(header->consumerWaiting), 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(header->head), __ATOMIC_SEQ_CST) != header->tail)
+    {
+        __atomic_store_n(&(header->consumerWaiting), 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+//********************************************
+int Send_Shm_Ring_Fds(int socketFd, shm_ring_t * ring, const char * message,
+                      size_t length)
+{
+    struct msghdr header;
+    struct iovec iov;
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int) * SHM_RING_FD_COUNT)];
+        struct cmsghdr align;
+    } control;
+    struct cmsghdr * cmsg;
+    int fds[SHM_RING_FD_COUNT];
+    
+    fds[0] = ring->memFd;
+    fds[1] = ring->dataEventFd;
+    fds[2] = ring->spaceEventFd;
+    
+    memset(&header, 0, sizeof(header));
+    iov.iov_base = (void *)message;
+    iov.iov_len = length;
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buffer;
+    header.msg_controllen = sizeof(control.buffer);
+    
+    cmsg = CMSG_FIRSTHDR(&header);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    
+    if ((ssize_t)length != sendmsg(socketFd, &header, MSG_NOSIGNAL))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+//********************************************
+ssize_t Receive_Shm_Ring_Fds(int socketFd, char * buf, size_t length,
+                             shm_ring_t ** ring)
+{
+    struct msghdr header;
+    struct iovec iov;
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int) * SHM_RING_FD_COUNT)];
+        struct cmsghdr align;
+    } control;
+    struct cmsghdr * cmsg;
+    int fds[SHM_RING_FD_COUNT];
+    ssize_t result;
+    
+    memset(&header, 0, sizeof(header));
+    iov.iov_base = buf;
+    iov.iov_len = length;
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buffer;
+    header.msg_controllen = sizeof(control.buffer);
+    
+    result = recvmsg(socketFd, &header, MSG_CMSG_CLOEXEC);
+    if (result < 0)
+    {
+        return result;
+    }
+    
+    for (cmsg = CMSG_FIRSTHDR(&header); NULL != cmsg;
+         cmsg = CMSG_NXTHDR(&header, cmsg))
+    {
+        if (SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type &&
+            CMSG_LEN(sizeof(fds)) == cmsg->cmsg_len)
+        {
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+            *ring = Attach_Shm_Ring(fds[0], fds[1], fds[2]);
+        }
+    }
+    return result;
+}
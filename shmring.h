@@ -0,0 +1,136 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      shmring.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Single producer, single consumer byte ring in shared memory, for
+ *    delivering broadcasts to a client on the same host without a socket
+ *    syscall per message. The ring lives in a memfd and each side sleeps on an
+ *    eventfd only when it has to wait, so a busy stream needs no syscalls.
+ *
+ *    The server creates the ring and passes the three fds (memory, "data
+ *    available" eventfd, "space available" eventfd) to the client over the
+ *    client's Unix domain socket.
+ *
+ ************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Capacity the server uses for new rings. Must be a power of two.
+#define SHM_RING_DEFAULT_SIZE (256 * 1024)
+
+// Error returns
+#define SHM_RING_PEER_GONE -1
+
+// Shared header at the start of the memory. Producer and consumer fields are
+// on separate cache lines so the two sides don't bounce a line between them.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t capacity;
+    // Total bytes ever written. Written by the producer only.
+    uint64_t head __attribute__((aligned(64)));
+    // Set by the producer while it sleeps waiting for space
+    uint32_t producerWaiting;
+    // Total bytes ever read. Written by the consumer only.
+    uint64_t tail __attribute__((aligned(64)));
+    // Set by the consumer while it sleeps waiting for data
+    uint32_t consumerWaiting;
+} shm_ring_header_t;
+
+// One side's handle on a ring
+typedef struct
+{
+    shm_ring_header_t * header;
+    char * data;
+    size_t mappedSize;
+    int memFd;
+    // Signalled by the producer when data is added
+    int dataEventFd;
+    // Signalled by the consumer when space is freed
+    int spaceEventFd;
+} shm_ring_t;
+
+// Create a new ring (producer side)
+// Return the ring, or NULL on failure
+// Params:
+//    capacity: bytes of data the ring can hold, a power of two
+shm_ring_t * Create_Shm_Ring(size_t capacity);
+
+// Map a ring created by another process (consumer side). Takes ownership of
+// the fds, even on failure.
+// Return the ring, or NULL on failure
+// Params:
+//    memFd, dataEventFd, spaceEventFd: fds received from the producer
+shm_ring_t * Attach_Shm_Ring(int memFd, int dataEventFd, int spaceEventFd);
+
+// Unmap the ring and close its fds
+// Params:
+//    ring: ring to free
+void Delete_Shm_Ring(shm_ring_t * ring);
+
+// Write all of buf to the ring, sleeping while it is full (producer side)
+// Return 0 on success, SHM_RING_PEER_GONE if peerFd hung up while waiting
+// Params:
+//    ring: ring to write to
+//    buf, length: bytes to write
+//    peerFd: socket to the consumer, watched for hangup while waiting
+int Shm_Ring_Write(shm_ring_t * ring, const char * buf, size_t length,
+                   int peerFd);
+
+// Write all of buf to the ring if there is room for it, without waiting
+// (producer side)
+// Return 0 if written, -1 if there wasn't enough room
+// Params:
+//    ring: ring to write to
+//    buf, length: bytes to write
+int Shm_Ring_Try_Write(shm_ring_t * ring, const char * buf, size_t length);
+
+// Read up to length bytes from the ring without blocking (consumer side)
+// Return the number of bytes read, 0 if the ring is empty
+// Params:
+//    ring: ring to read from
+//    buf, length: where to put the bytes
+size_t Shm_Ring_Read(shm_ring_t * ring, char * buf, size_t length);
+
+// Sleep until the ring has data or otherFd is readable (consumer side)
+// Return 1 if the ring has data, 0 if otherFd is readable (or both), -1 on
+// error
+// Params:
+//    ring: ring to wait on
+//    otherFd: another fd to wake up for, or -1
+int Shm_Ring_Wait(shm_ring_t * ring, int otherFd);
+
+// Get ready to sleep on the ring's dataEventFd in the caller's own poll or
+// epoll set, instead of in Shm_Ring_Wait (consumer side). Call it again
+// after each wakeup, once Shm_Ring_Read has emptied the ring.
+// Return 1 if the ring already has data, so don't sleep; 0 if the producer
+// will signal dataEventFd when it adds some
+// Params:
+//    ring: ring to wait on
+int Shm_Ring_Arm(shm_ring_t * ring);
+
+// Send a ring's fds over a Unix domain socket along with a message
+// Return 0 on success, -1 on failure
+// Params:
+//    socketFd: connected AF_UNIX socket
+//    ring: ring whose fds to send
+//    message, length: bytes to send with them (at least one)
+int Send_Shm_Ring_Fds(int socketFd, shm_ring_t * ring, const char * message,
+                      size_t length);
+
+// Receive data from a Unix domain socket, picking up ring fds if they were
+// sent with it. Reads at most length bytes, like recv().
+// Return bytes read (0 on hangup, -1 on error). ring is set to the attached
+// ring if fds came with the data, left alone otherwise.
+// Params:
+//    socketFd: connected AF_UNIX socket
+//    buf, length: where to put the data
+//    ring: where to store an attached ring
+ssize_t Receive_Shm_Ring_Fds(int socketFd, char * buf, size_t length,
+                             shm_ring_t ** ring);
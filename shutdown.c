@@ -0,0 +1,76 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      shutdown.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Shutdown event built on an eventfd that is written once and never
+ *    read, so it stays readable.
+ * 
+ *  -- See shutdown.h for function header blocks
+ *
+ ************************************************************/
+#define _GNU_SOURCE
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shutdown.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+static int shutdownFd = -1;
+static bool shutdownRequested = false;
+
+//********************************************
+int Init_Shutdown_Event(void)
+{
+    if (-1 == shutdownFd)
+    {
+        shutdownFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    }
+    return (-1 == shutdownFd) ? 1 : 0;
+}
+
+//********************************************
+void Request_Shutdown(void)
+{
+    uint64_t one = 1;
+
+    __atomic_store_n(&shutdownRequested, true, __ATOMIC_SEQ_CST);
+    if (-1 != shutdownFd &&
+        sizeof(one) != write(shutdownFd, &one, sizeof(one)))
+    {
+        // Only fails if the counter would overflow, when it's readable anyway
+    }
+}
+
+//********************************************
+bool Shutdown_Requested(void)
+{
+    return __atomic_load_n(&shutdownRequested, __ATOMIC_SEQ_CST);
+}
+
+//********************************************
+int Get_Shutdown_Fd(void)
+{
+    return shutdownFd;
+}
+
+//********************************************
+bool Shutdown_Sleep(uint64_t ns)
+{
+    struct pollfd waitFor;
+    struct timespec delay;
+
+    waitFor.fd = shutdownFd;
+    waitFor.events = POLLIN;
+    delay.tv_sec = ns / NS_PER_SEC;
+    delay.tv_nsec = ns % NS_PER_SEC;
+    // ppoll rather than poll for a timeout finer than a millisecond
+    ppoll(&waitFor, 1, &delay, NULL);
+    return Shutdown_Requested();
+}
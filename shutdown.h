@@ -0,0 +1,38 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      shutdown.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Process wide shutdown event. Once requested, the event's fd stays
+ *    readable for good, so any thread that includes it in a poll() wakes
+ *    immediately and every later poll returns at once. Threads that sleep
+ *    use Shutdown_Sleep instead of nanosleep for the same effect.
+ *
+ ************************************************************/
+#include <stdbool.h>
+#include <stdint.h>
+
+// Create the event. Call before starting threads that wait on it.
+// Return zero on success
+int Init_Shutdown_Event(void);
+
+// Fire the event, waking every thread waiting on it. Safe to call more than
+// once, and from a signal handler.
+void Request_Shutdown(void);
+
+// Return true once Request_Shutdown has been called
+bool Shutdown_Requested(void);
+
+// Return an fd that polls readable (POLLIN) once shutdown is requested, or
+// -1 before Init_Shutdown_Event, which poll() ignores
+int Get_Shutdown_Fd(void);
+
+// Sleep for a while, or less if shutdown is requested first
+// Return true if woken by shutdown
+// Params:
+//    ns: how long to sleep
+bool Shutdown_Sleep(uint64_t ns);
@@ -0,0 +1,657 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      simnet.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Simulated sockets. Each connection is a pair of byte rings, one per
+ *    direction, under a lock. The server's fd for a connection is a real
+ *    eventfd that is kept readable exactly when a read wouldn't block, so
+ *    the server can poll it with everything else. Calls block just as they
+ *    would on a blocking socket, on the connection's condition variable.
+ *
+ *    Connections are kept until the process exits, since a run is a short
+ *    test process and keeping them means nothing can touch freed memory.
+ *
+ *  -- See simnet.h for function header blocks
+ *
+ ************************************************************/
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "simnet.h"
+
+// Server fds are looked up in a table indexed by fd
+#define SIM_MAX_FDS 65536
+
+typedef struct
+{
+    char * data;
+    int head;
+    int count;
+} sim_ring_t;
+
+struct sim_socket_s
+{
+    pthread_mutex_t lock;
+    // Broadcast whenever anything below changes
+    pthread_cond_t changed;
+    // Server's end, an eventfd
+    int fd;
+    int capacity;
+    sim_ring_t toServer;
+    sim_ring_t toClient;
+    bool clientClosed;
+    bool serverClosed;
+    bool serverShutRead;
+    bool serverShutWrite;
+    bool reset;
+    // The eventfd's counter is non-zero
+    bool signalled;
+    // Fault decisions for the server's reads and for its writes. Kept apart
+    // so each follows its own thread's calls.
+    uint64_t readRandom;
+    uint64_t writeRandom;
+    struct sim_socket_s * nextPending;
+    struct sim_socket_s * nextSocket;
+};
+
+static sim_faults_t faults;
+static uint64_t connectCount = 0;
+
+// Guards everything about the listener and the list of all sockets
+static pthread_mutex_t listenLock = PTHREAD_MUTEX_INITIALIZER;
+static int listenFd = -1;
+static bool listenSignalled = false;
+static sim_socket_t * pendingHead = NULL;
+static sim_socket_t * pendingTail = NULL;
+static sim_socket_t * allSockets = NULL;
+
+static sim_socket_t * byFd[SIM_MAX_FDS];
+
+static int acceptedCount = 0;
+static int closedCount = 0;
+static uint64_t interruptCount = 0;
+static uint64_t shortReadCount = 0;
+static uint64_t partialWriteCount = 0;
+static uint64_t resetCount = 0;
+
+//********************************************
+// Next number from a xorshift64* stream
+static uint64_t Next_Random(uint64_t * state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+//********************************************
+// Start a stream from a seed and a stream number. Never zero, which would
+// stick xorshift at zero.
+static uint64_t Seed_Random(uint64_t seed, uint64_t stream)
+{
+    uint64_t state = seed * 0x9E3779B97F4A7C15ULL + stream + 1;
+    state ^= state >> 31;
+    state *= 0xBF58476D1CE4E5B9ULL;
+    state ^= state >> 29;
+    return state ? state : 1;
+}
+
+//********************************************
+static bool Chance(uint64_t * state, int percent)
+{
+    return (int)(Next_Random(state) % 100) < percent;
+}
+
+//********************************************
+// Make the eventfd's readability match a flag
+static void Set_Signalled(int fd, bool * signalled, bool readable)
+{
+    uint64_t value = 1;
+
+    if (readable && !*signalled)
+    {
+        if (sizeof(value) == write(fd, &value, sizeof(value)))
+        {
+            *signalled = true;
+        }
+    }
+    else if (!readable && *signalled)
+    {
+        if (sizeof(value) == read(fd, &value, sizeof(value)))
+        {
+            *signalled = false;
+        }
+    }
+}
+
+//********************************************
+// Called with the socket's lock held after any change
+static void Update_Socket(sim_socket_t * socket)
+{
+    if (-1 != socket->fd && !socket->serverClosed)
+    {
+        Set_Signalled(socket->fd, &(socket->signalled),
+                      socket->toServer.count > 0 || socket->clientClosed ||
+                      socket->reset || socket->serverShutRead);
+    }
+    pthread_cond_broadcast(&(socket->changed));
+}
+
+//********************************************
+static void Ring_Put(sim_ring_t * ring, int capacity, const char * buffer,
+                     int length)
+{
+    int tail;
+    int index;
+
+    for (index = 0; index < length; ++index)
+    {
+        tail = (ring->head + ring->count) % capacity;
+        ring->data[tail] = buffer[index];
+        ++(ring->count);
+    }
+}
+
+//********************************************
+static void Ring_Take(sim_ring_t * ring, int capacity, char * buffer,
+                      int length)
+{
+    int index;
+
+    for (index = 0; index < length; ++index)
+    {
+        buffer[index] = ring->data[ring->head];
+        ring->head = (ring->head + 1) % capacity;
+        --(ring->count);
+    }
+}
+
+//********************************************
+static sim_socket_t * Find_Socket(int fd)
+{
+    if (fd < 0 || fd >= SIM_MAX_FDS)
+    {
+        return NULL;
+    }
+    return __atomic_load_n(&(byFd[fd]), __ATOMIC_ACQUIRE);
+}
+
+//********************************************
+// Fail a server call with EINTR or EAGAIN if the stream says so. Called
+// with the socket's lock held.
+static bool Inject_Interrupt(uint64_t * random)
+{
+    if (!Chance(random, faults.interruptPercent))
+    {
+        return false;
+    }
+    errno = (Next_Random(random) & 1) ? EINTR : EAGAIN;
+    __atomic_add_fetch(&interruptCount, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+//********************************************
+static int Sim_Listen(const char * port)
+{
+    (void)port;
+    pthread_mutex_lock(&listenLock);
+    if (-1 == listenFd)
+    {
+        listenFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    // Clients may already be waiting
+    if (-1 != listenFd)
+    {
+        Set_Signalled(listenFd, &listenSignalled, NULL != pendingHead);
+    }
+    pthread_mutex_unlock(&listenLock);
+    return listenFd;
+}
+
+//********************************************
+static int Sim_Accept(int fd)
+{
+    sim_socket_t * socket;
+
+    pthread_mutex_lock(&listenLock);
+    if (fd != listenFd || NULL == (socket = pendingHead))
+    {
+        pthread_mutex_unlock(&listenLock);
+        errno = (fd != listenFd) ? EBADF : EAGAIN;
+        return -1;
+    }
+    pendingHead = socket->nextPending;
+    if (NULL == pendingHead)
+    {
+        pendingTail = NULL;
+    }
+    Set_Signalled(listenFd, &listenSignalled, NULL != pendingHead);
+    ++acceptedCount;
+    pthread_mutex_unlock(&listenLock);
+
+    pthread_mutex_lock(&(socket->lock));
+    socket->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (socket->fd < 0 || socket->fd >= SIM_MAX_FDS)
+    {
+        // Looks like a reset to the client
+        if (socket->fd >= 0)
+        {
+            close(socket->fd);
+        }
+        socket->fd = -1;
+        socket->reset = true;
+        Update_Socket(socket);
+        pthread_mutex_unlock(&(socket->lock));
+        errno = EMFILE;
+        return -1;
+    }
+    __atomic_store_n(&(byFd[socket->fd]), socket, __ATOMIC_RELEASE);
+    Update_Socket(socket);
+    pthread_mutex_unlock(&(socket->lock));
+    return socket->fd;
+}
+
+//********************************************
+// Only MSG_DONTWAIT is supported in flags
+static ssize_t Sim_Recv(int fd, void * buffer, size_t length, int flags)
+{
+    sim_socket_t * socket = Find_Socket(fd);
+    int count;
+
+    if (NULL == socket)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&(socket->lock));
+    if (Chance(&(socket->readRandom), faults.yieldPercent))
+    {
+        pthread_mutex_unlock(&(socket->lock));
+        sched_yield();
+        pthread_mutex_lock(&(socket->lock));
+    }
+    if (Inject_Interrupt(&(socket->readRandom)))
+    {
+        pthread_mutex_unlock(&(socket->lock));
+        return -1;
+    }
+    if (!socket->reset && !socket->clientClosed &&
+        (int)(Next_Random(&(socket->readRandom)) % 1000) <
+        faults.resetPerThousand)
+    {
+        socket->reset = true;
+        __atomic_add_fetch(&resetCount, 1, __ATOMIC_RELAXED);
+        Update_Socket(socket);
+    }
+    while (0 == socket->toServer.count && !socket->clientClosed &&
+           !socket->reset && !socket->serverShutRead)
+    {
+        if (flags & MSG_DONTWAIT)
+        {
+            pthread_mutex_unlock(&(socket->lock));
+            errno = EAGAIN;
+            return -1;
+        }
+        pthread_cond_wait(&(socket->changed), &(socket->lock));
+    }
+    if (socket->reset)
+    {
+        pthread_mutex_unlock(&(socket->lock));
+        errno = ECONNRESET;
+        return -1;
+    }
+    count = socket->toServer.count < (int)length ?
+            socket->toServer.count : (int)length;
+    if (socket->serverShutRead)
+    {
+        count = 0;
+    }
+    if (count > 1 && Chance(&(socket->readRandom), faults.shortReadPercent))
+    {
+        count = 1 + Next_Random(&(socket->readRandom)) % (count - 1);
+        __atomic_add_fetch(&shortReadCount, 1, __ATOMIC_RELAXED);
+    }
+    Ring_Take(&(socket->toServer), socket->capacity, buffer, count);
+    Update_Socket(socket);
+    pthread_mutex_unlock(&(socket->lock));
+    return count;
+}
+
+//********************************************
+static ssize_t Sim_Read(int fd, void * buffer, size_t length)
+{
+    return Sim_Recv(fd, buffer, length, 0);
+}
+
+//********************************************
+// Write as much as fits now. Called with the socket's lock held. Return
+// what was written, or -1 with errno set.
+static int Server_Write_Locked(sim_socket_t * socket, const void * buffer,
+                               int length, bool wait)
+{
+    int count;
+
+    while (socket->toClient.count == socket->capacity && wait &&
+           !socket->clientClosed && !socket->reset &&
+           !socket->serverShutWrite)
+    {
+        pthread_cond_wait(&(socket->changed), &(socket->lock));
+    }
+    if (socket->clientClosed || socket->reset || socket->serverShutWrite)
+    {
+        errno = socket->reset ? ECONNRESET : EPIPE;
+        return -1;
+    }
+    count = socket->capacity - socket->toClient.count;
+    if (0 == count)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (count > length)
+    {
+        count = length;
+    }
+    Ring_Put(&(socket->toClient), socket->capacity, buffer, count);
+    Update_Socket(socket);
+    return count;
+}
+
+//********************************************
+static ssize_t Sim_Write(int fd, const void * buffer, size_t length)
+{
+    sim_socket_t * socket = Find_Socket(fd);
+    int count;
+
+    if (NULL == socket)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&(socket->lock));
+    if (Chance(&(socket->writeRandom), faults.yieldPercent))
+    {
+        pthread_mutex_unlock(&(socket->lock));
+        sched_yield();
+        pthread_mutex_lock(&(socket->lock));
+    }
+    if (Inject_Interrupt(&(socket->writeRandom)))
+    {
+        pthread_mutex_unlock(&(socket->lock));
+        return -1;
+    }
+    if (length > 1 &&
+        Chance(&(socket->writeRandom), faults.partialWritePercent))
+    {
+        length = 1 + Next_Random(&(socket->writeRandom)) % (length - 1);
+        __atomic_add_fetch(&partialWriteCount, 1, __ATOMIC_RELAXED);
+    }
+    count = Server_Write_Locked(socket, buffer, (int)length, true);
+    pthread_mutex_unlock(&(socket->lock));
+    return count;
+}
+
+//********************************************
+// Only the heartbeat's pings use send, always with MSG_DONTWAIT
+static ssize_t Sim_Send(int fd, const void * buffer, size_t length, int flags)
+{
+    sim_socket_t * socket = Find_Socket(fd);
+    int count;
+
+    if (NULL == socket)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&(socket->lock));
+    count = Server_Write_Locked(socket, buffer, (int)length,
+                                0 == (flags & MSG_DONTWAIT));
+    pthread_mutex_unlock(&(socket->lock));
+    return count;
+}
+
+//********************************************
+static int Sim_Shutdown(int fd, int how)
+{
+    sim_socket_t * socket = Find_Socket(fd);
+
+    if (NULL == socket)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&(socket->lock));
+    if (SHUT_RD == how || SHUT_RDWR == how)
+    {
+        socket->serverShutRead = true;
+    }
+    if (SHUT_WR == how || SHUT_RDWR == how)
+    {
+        socket->serverShutWrite = true;
+    }
+    Update_Socket(socket);
+    pthread_mutex_unlock(&(socket->lock));
+    return 0;
+}
+
+//********************************************
+static int Sim_Close(int fd)
+{
+    sim_socket_t * socket = Find_Socket(fd);
+
+    if (NULL == socket)
+    {
+        // Not one of ours, such as a real fd the server also closes
+        return close(fd);
+    }
+    // Out of the table first, so the fd number is free for reuse once the
+    // eventfd is closed
+    __atomic_store_n(&(byFd[fd]), NULL, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&(socket->lock));
+    socket->serverClosed = true;
+    socket->serverShutRead = true;
+    socket->serverShutWrite = true;
+    close(socket->fd);
+    socket->fd = -1;
+    Update_Socket(socket);
+    pthread_mutex_unlock(&(socket->lock));
+    __atomic_add_fetch(&closedCount, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static const transport_t simTransport =
+{
+    Sim_Listen,
+    Sim_Accept,
+    Sim_Read,
+    Sim_Recv,
+    Sim_Write,
+    Sim_Send,
+    Sim_Shutdown,
+    Sim_Close
+};
+
+//********************************************
+void Sim_Init(const sim_faults_t * settings)
+{
+    faults = *settings;
+    if (faults.minBuffer < 1)
+    {
+        faults.minBuffer = 1;
+    }
+    if (faults.maxBuffer < faults.minBuffer)
+    {
+        faults.maxBuffer = faults.minBuffer;
+    }
+}
+
+//********************************************
+const transport_t * Get_Sim_Transport(void)
+{
+    return &simTransport;
+}
+
+//********************************************
+sim_socket_t * Sim_Connect(void)
+{
+    sim_socket_t * socket = calloc(1, sizeof(sim_socket_t));
+    uint64_t number;
+
+    if (NULL == socket)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&listenLock);
+    number = connectCount++;
+    pthread_mutex_unlock(&listenLock);
+
+    socket->readRandom = Seed_Random(faults.seed, 2 * number);
+    socket->writeRandom = Seed_Random(faults.seed, 2 * number + 1);
+    socket->capacity = faults.minBuffer + Next_Random(&(socket->writeRandom)) %
+                       (faults.maxBuffer - faults.minBuffer + 1);
+    socket->toServer.data = malloc(socket->capacity);
+    socket->toClient.data = malloc(socket->capacity);
+    if (NULL == socket->toServer.data || NULL == socket->toClient.data)
+    {
+        free(socket->toServer.data);
+        free(socket->toClient.data);
+        free(socket);
+        return NULL;
+    }
+    socket->fd = -1;
+    pthread_mutex_init(&(socket->lock), NULL);
+    pthread_cond_init(&(socket->changed), NULL);
+
+    pthread_mutex_lock(&listenLock);
+    socket->nextSocket = allSockets;
+    allSockets = socket;
+    if (pendingTail)
+    {
+        pendingTail->nextPending = socket;
+    }
+    else
+    {
+        pendingHead = socket;
+    }
+    pendingTail = socket;
+    if (-1 != listenFd)
+    {
+        Set_Signalled(listenFd, &listenSignalled, true);
+    }
+    pthread_mutex_unlock(&listenLock);
+    return socket;
+}
+
+//********************************************
+int Sim_Client_Write(sim_socket_t * client, const char * buffer, int length)
+{
+    int count;
+
+    pthread_mutex_lock(&(client->lock));
+    while (length > 0)
+    {
+        while (client->toServer.count == client->capacity &&
+               !client->serverShutRead && !client->reset)
+        {
+            pthread_cond_wait(&(client->changed), &(client->lock));
+        }
+        if (client->serverShutRead || client->reset)
+        {
+            pthread_mutex_unlock(&(client->lock));
+            return -1;
+        }
+        count = client->capacity - client->toServer.count;
+        if (count > length)
+        {
+            count = length;
+        }
+        Ring_Put(&(client->toServer), client->capacity, buffer, count);
+        buffer += count;
+        length -= count;
+        Update_Socket(client);
+    }
+    pthread_mutex_unlock(&(client->lock));
+    return 0;
+}
+
+//********************************************
+int Sim_Client_Read(sim_socket_t * client, char * buffer, int length)
+{
+    int count;
+
+    pthread_mutex_lock(&(client->lock));
+    while (0 == client->toClient.count && !client->serverShutWrite &&
+           !client->reset && !client->clientClosed)
+    {
+        pthread_cond_wait(&(client->changed), &(client->lock));
+    }
+    if (client->reset)
+    {
+        pthread_mutex_unlock(&(client->lock));
+        return -1;
+    }
+    count = client->clientClosed ? 0 : client->toClient.count;
+    if (count > length)
+    {
+        count = length;
+    }
+    Ring_Take(&(client->toClient), client->capacity, buffer, count);
+    Update_Socket(client);
+    pthread_mutex_unlock(&(client->lock));
+    return count;
+}
+
+//********************************************
+void Sim_Client_Close(sim_socket_t * client)
+{
+    pthread_mutex_lock(&(client->lock));
+    client->clientClosed = true;
+    Update_Socket(client);
+    pthread_mutex_unlock(&(client->lock));
+}
+
+//********************************************
+void Sim_Wait_For_Reads(void)
+{
+    sim_socket_t * socket;
+
+    pthread_mutex_lock(&listenLock);
+    socket = allSockets;
+    pthread_mutex_unlock(&listenLock);
+    // Sockets are only ever added at the head, so this walk is safe
+    for (; NULL != socket; socket = socket->nextSocket)
+    {
+        pthread_mutex_lock(&(socket->lock));
+        while (socket->toServer.count > 0 && !socket->serverShutRead &&
+               !socket->reset)
+        {
+            pthread_cond_wait(&(socket->changed), &(socket->lock));
+        }
+        pthread_mutex_unlock(&(socket->lock));
+    }
+}
+
+//********************************************
+void Get_Sim_Stats(sim_stats_t * stats)
+{
+    pthread_mutex_lock(&listenLock);
+    stats->accepted = acceptedCount;
+    pthread_mutex_unlock(&listenLock);
+    stats->closed = __atomic_load_n(&closedCount, __ATOMIC_RELAXED);
+    stats->interrupts = __atomic_load_n(&interruptCount, __ATOMIC_RELAXED);
+    stats->shortReads = __atomic_load_n(&shortReadCount, __ATOMIC_RELAXED);
+    stats->partialWrites =
+        __atomic_load_n(&partialWriteCount, __ATOMIC_RELAXED);
+    stats->resets = __atomic_load_n(&resetCount, __ATOMIC_RELAXED);
+}
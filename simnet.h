@@ -0,0 +1,101 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      simnet.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    In-memory network for running the server under test. Installed with
+ *    Set_Transport, it stands in for the kernel's sockets. The test plays
+ *    the clients through the Sim_Client_ calls.
+ *
+ *    Faults are injected on the server's side of each connection: reads and
+ *    writes that fail with EINTR or EAGAIN, short reads, partial writes and
+ *    resets. Each connection also gets its own receive buffer size, so some
+ *    clients are slow to drain. Every decision comes from a random stream
+ *    seeded from the run's seed and the connection's number, so a seed
+ *    replays the same faults on the same connections. The operating system
+ *    still schedules the threads, so a seed makes a failure likely to
+ *    recur rather than certain; the same streams also decide where to yield
+ *    the CPU, to shake out different interleavings per seed.
+ *
+ ************************************************************/
+#include <stdint.h>
+
+#include "transport.h"
+
+typedef struct
+{
+    uint32_t seed;
+    // Percent of server reads and writes that fail with EINTR or EAGAIN
+    int interruptPercent;
+    // Percent of server reads that return less than was available
+    int shortReadPercent;
+    // Percent of server writes that take less than was offered
+    int partialWritePercent;
+    // Server reads, per thousand, that find the connection reset
+    int resetPerThousand;
+    // Percent of server calls that yield the CPU first
+    int yieldPercent;
+    // Range of buffer sizes in each direction of a connection
+    int minBuffer;
+    int maxBuffer;
+} sim_faults_t;
+
+// One simulated connection
+typedef struct sim_socket_s sim_socket_t;
+
+// Set up the network. Call before Set_Transport.
+// Params:
+//    faults: what to inject, copied
+void Sim_Init(const sim_faults_t * faults);
+
+// Get the functions to pass to Set_Transport
+const transport_t * Get_Sim_Transport(void);
+
+// Connect a client. The server accepts it on the fd from its listen call.
+// Return the client's end, or NULL if out of memory
+sim_socket_t * Sim_Connect(void);
+
+// Write all of a buffer from the client, waiting for room
+// Return 0 on success, -1 if the server closed or reset the connection
+// Params:
+//    client: from Sim_Connect
+//    buffer, length: what to write
+int Sim_Client_Write(sim_socket_t * client, const char * buffer, int length);
+
+// Read what the server sent, waiting for something to arrive
+// Return bytes read, 0 once the server has closed its end and everything
+// has been read, -1 if the connection was reset
+// Params:
+//    client: from Sim_Connect
+//    buffer, length: where to put it
+int Sim_Client_Read(sim_socket_t * client, char * buffer, int length);
+
+// Hang up. Anything already written still reaches the server first. The
+// client must not use the connection afterwards, and any client read in
+// progress returns 0.
+// Params:
+//    client: from Sim_Connect
+void Sim_Client_Close(sim_socket_t * client);
+
+// Wait until the server has read everything clients wrote
+void Sim_Wait_For_Reads(void);
+
+typedef struct
+{
+    int accepted;
+    // Connections the server has closed its end of
+    int closed;
+    uint64_t interrupts;
+    uint64_t shortReads;
+    uint64_t partialWrites;
+    uint64_t resets;
+} sim_stats_t;
+
+// Get counts of what happened
+// Params:
+//    stats: where to store them
+void Get_Sim_Stats(sim_stats_t * stats);
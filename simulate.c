@@ -0,0 +1,766 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      simulate.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Runs the real server over the simulated network in simnet.c, many
+ *    times, each time with a different seed. A scenario runs in a child
+ *    process of its own, so a crash or hang only fails that seed.
+ *
+ *    Each scenario picks from its seed how many clients there are, how much
+ *    each sends, in what size pieces, which clients hang up part way
+ *    through, which read slowly, and what faults the network injects. Every
+ *    client says HELLO, waits until all of them have been welcomed, then
+ *    they all send at once. Once everything sent has been read, the
+ *    scenario shuts the server down with SIGTERM, the same as an operator
+ *    would.
+ *
+ *    Each client sends bytes only it uses, so receivers can tell senders'
+ *    chat apart however the server splits and interleaves it. The checks:
+ *     - what a client received from each sender is a contiguous piece of
+ *       what that sender sent: nothing lost, repeated or reordered
+ *     - the server only hangs up on a client that hung up or was reset,
+ *       until it says goodbye
+ *     - a client that stayed until the goodbye got everything its senders
+ *       sent from the time it joined on
+ *     - the server closed every connection it accepted
+ *     - the scenario finished in time
+ *
+ *    The operating system still schedules the threads, so a seed replays
+ *    the same scenario and faults but not exactly the same interleaving.
+ *    Rerunning a failing seed with -n 1 -v usually brings the failure back.
+ *
+ * Input:
+ *    -s first seed, -n scenarios to run, -c most clients in a scenario (up
+ *    to 64), -m most bytes each client sends, -w writer threads for the
+ *    server, -D to run the server without its fan-out sequencer, -F most
+ *    percent of server calls to fault, -R most resets per thousand reads, -t
+ *    seconds before a scenario counts as hung, -j scenarios to run at once,
+ *    -v to show the server's output and each scenario's numbers.
+ *
+ * Output:
+ *    Failing seeds, and a summary with scenarios run per second. Exits 1 if
+ *    any scenario failed.
+ ************************************************************/
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "simnet.h"
+#include "transport.h"
+
+// Each client's chat uses two byte values of its own from 0x80 up, so 64
+// clients use them all
+#define SIM_MAX_CLIENTS 64
+#define SIM_FIRST_BYTE 0x80
+#define SIM_CHUNK 512
+#define SIM_READ_SIZE 1024
+// Room for the WELCOME line and the goodbye
+#define SIM_TEXT_SIZE 1024
+#define SIM_GOODBYE "goodbye."
+#define NS_PER_SEC 1000000000ULL
+
+// From server.c
+int runServer(int argc, char ** argv);
+
+typedef struct
+{
+    uint32_t seed;
+    int scenarios;
+    int maxClients;
+    int maxBytes;
+    int writers;
+    bool direct;
+    int faultPercent;
+    int resetPerThousand;
+    int timeout;
+    int jobs;
+    bool verbose;
+} simulate_options;
+
+typedef struct
+{
+    int index;
+    sim_socket_t * socket;
+    // Everything this client will send if it isn't cut off
+    char * stream;
+    int streamLength;
+    // Hang up after sending this much, or -1 not to
+    int closeAt;
+    // Bytes handed to the network, counting all of a piece that was cut off
+    int sent;
+    // Microseconds to pause between reads, 0 for a fast reader
+    int readPauseUs;
+    uint64_t chunkRandom;
+    // Received chat, by sender
+    char * received[SIM_MAX_CLIENTS];
+    int receivedLength[SIM_MAX_CLIENTS];
+    // Everything else received: control lines and the goodbye
+    char text[SIM_TEXT_SIZE];
+    int textLength;
+    // Chat bytes that no client could have sent
+    int stray;
+    // Everything read so far, for the driver to watch
+    uint64_t totalReceived;
+    bool welcomed;
+    // The network reset the connection
+    bool reset;
+    // A write failed, from a reset or the server hanging up
+    bool cutOff;
+    bool closed;
+    pthread_t reader;
+    pthread_t sender;
+} sim_client_t;
+
+static simulate_options options;
+static sim_client_t clients[SIM_MAX_CLIENTS];
+static int clientCount = 0;
+static FILE * report = NULL;
+
+// Counts clients that have their WELCOME, or won't get one
+static pthread_mutex_t welcomeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t welcomeCond = PTHREAD_COND_INITIALIZER;
+static int welcomeCount = 0;
+
+/****************************************************************
+ * Next number from a xorshift64* stream
+ *
+ * Preconditions: state is not zero
+ *
+ * Postcondition:
+ *  state advanced, returns the next number
+ ****************************************************************/
+uint64_t nextRandom(uint64_t * state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+/****************************************************************
+ * Start a random stream from a seed and a stream number
+ *
+ * Preconditions: (none)
+ *
+ * Postcondition:
+ *  returns a non-zero state for nextRandom
+ ****************************************************************/
+uint64_t seedRandom(uint64_t seed, uint64_t stream)
+{
+    uint64_t state = (seed + 1) * 0xD1B54A32D192ED03ULL + stream;
+    state ^= state >> 31;
+    state *= 0x94D049BB133111EBULL;
+    state ^= state >> 29;
+    return state ? state : 1;
+}
+
+/****************************************************************
+ * Pick a number in a range
+ *
+ * Preconditions: low <= high
+ *
+ * Postcondition:
+ *  returns a number from low to high inclusive
+ ****************************************************************/
+int randomBetween(uint64_t * state, int low, int high)
+{
+    return low + (int)(nextRandom(state) % (uint64_t)(high - low + 1));
+}
+
+/****************************************************************
+ * Read the command line
+ *
+ * Preconditions: argc/argv from main
+ *
+ * Postcondition:
+ *  options filled in; exits if any are out of range
+ ****************************************************************/
+void parseSimulateOptions(int argc, char ** argv)
+{
+    int arg;
+
+    options.seed = 1;
+    options.scenarios = 100;
+    options.maxClients = 8;
+    options.maxBytes = 4096;
+    options.writers = 2;
+    options.direct = false;
+    options.faultPercent = 10;
+    options.resetPerThousand = 2;
+    options.timeout = 10;
+    options.jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    options.verbose = false;
+    while (-1 != (arg = getopt(argc, argv, "s:n:c:m:w:DF:R:t:j:v")))
+    {
+        if ('s' == arg)
+        {
+            options.seed = strtoul(optarg, NULL, 0);
+        }
+        else if ('n' == arg)
+        {
+            options.scenarios = atoi(optarg);
+        }
+        else if ('c' == arg)
+        {
+            options.maxClients = atoi(optarg);
+        }
+        else if ('m' == arg)
+        {
+            options.maxBytes = atoi(optarg);
+        }
+        else if ('w' == arg)
+        {
+            options.writers = atoi(optarg);
+        }
+        else if ('D' == arg)
+        {
+            options.direct = true;
+        }
+        else if ('F' == arg)
+        {
+            options.faultPercent = atoi(optarg);
+        }
+        else if ('R' == arg)
+        {
+            options.resetPerThousand = atoi(optarg);
+        }
+        else if ('t' == arg)
+        {
+            options.timeout = atoi(optarg);
+        }
+        else if ('j' == arg)
+        {
+            options.jobs = atoi(optarg);
+        }
+        else if ('v' == arg)
+        {
+            options.verbose = true;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-s seed] [-n scenarios] [-c clients]"
+                    " [-m bytes] [-w writers] [-D] [-F fault_percent]"
+                    " [-R resets_per_thousand] [-t timeout] [-j jobs] [-v]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if (options.maxClients < 2 || options.maxClients > SIM_MAX_CLIENTS ||
+        options.maxBytes < 1 || options.scenarios < 1 || options.jobs < 1 ||
+        options.timeout < 1 || options.faultPercent < 0 ||
+        options.faultPercent > 100 || options.resetPerThousand < 0)
+    {
+        fprintf(stderr, "Need 2 to %d clients, at least 1 byte, scenario, job"
+                " and second, and fault rates in range.\n", SIM_MAX_CLIENTS);
+        exit(1);
+    }
+    if (1 == options.scenarios)
+    {
+        options.jobs = 1;
+    }
+}
+
+/****************************************************************
+ * Note that a client has its WELCOME, or never will
+ *
+ * Preconditions: client not counted yet
+ *
+ * Postcondition:
+ *  client counted, the driver woken
+ ****************************************************************/
+void countWelcome(sim_client_t * client)
+{
+    pthread_mutex_lock(&welcomeLock);
+    client->welcomed = true;
+    ++welcomeCount;
+    pthread_cond_broadcast(&welcomeCond);
+    pthread_mutex_unlock(&welcomeLock);
+}
+
+/****************************************************************
+ * Read everything the server sends a client, sorting chat by sender
+ *
+ * Preconditions: arg is a connected sim_client_t
+ *
+ * Postcondition:
+ *  returns NULL once the server hangs up, the connection is reset or the
+ *  client hangs up itself
+ ****************************************************************/
+void * clientReader(void * arg)
+{
+    sim_client_t * client = (sim_client_t *)arg;
+    char buffer[SIM_READ_SIZE];
+    int got;
+    int index;
+    int sender;
+
+    while (0 < (got = Sim_Client_Read(client->socket, buffer,
+                                      sizeof(buffer))))
+    {
+        for (index = 0; index < got; ++index)
+        {
+            unsigned char byte = (unsigned char)buffer[index];
+            if (byte < SIM_FIRST_BYTE)
+            {
+                if (client->textLength < SIM_TEXT_SIZE - 1)
+                {
+                    client->text[client->textLength++] = (char)byte;
+                }
+                if ('\n' == byte && !client->welcomed)
+                {
+                    countWelcome(client);
+                }
+                continue;
+            }
+            sender = (byte - SIM_FIRST_BYTE) / 2;
+            // More than the sender had to send can't be right either
+            if (sender >= clientCount || client->receivedLength[sender] >=
+                clients[sender].streamLength)
+            {
+                ++(client->stray);
+                continue;
+            }
+            client->received[sender][client->receivedLength[sender]++] =
+                (char)byte;
+        }
+        __atomic_add_fetch(&(client->totalReceived), got, __ATOMIC_RELAXED);
+        if (client->readPauseUs)
+        {
+            usleep(client->readPauseUs);
+        }
+    }
+    client->text[client->textLength] = '\0';
+    if (got < 0)
+    {
+        client->reset = true;
+    }
+    if (!client->welcomed)
+    {
+        countWelcome(client);
+    }
+    return NULL;
+}
+
+/****************************************************************
+ * Send a client's stream in random pieces, hanging up part way if the
+ * scenario says to
+ *
+ * Preconditions: arg is a welcomed sim_client_t
+ *
+ * Postcondition:
+ *  returns NULL once done
+ ****************************************************************/
+void * clientSender(void * arg)
+{
+    sim_client_t * client = (sim_client_t *)arg;
+    int end = (client->closeAt >= 0) ? client->closeAt : client->streamLength;
+    int chunk;
+
+    while (client->sent < end)
+    {
+        chunk = randomBetween(&(client->chunkRandom), 1, SIM_CHUNK);
+        if (chunk > end - client->sent)
+        {
+            chunk = end - client->sent;
+        }
+        if (0 != Sim_Client_Write(client->socket,
+                                  client->stream + client->sent, chunk))
+        {
+            // Some of it may have got through
+            client->sent += chunk;
+            client->cutOff = true;
+            return NULL;
+        }
+        client->sent += chunk;
+    }
+    if (client->closeAt >= 0)
+    {
+        client->closed = true;
+        Sim_Client_Close(client->socket);
+    }
+    return NULL;
+}
+
+/****************************************************************
+ * Play the clients' side of a scenario, then shut the server down
+ *
+ * Preconditions: clients set up, the server starting in another thread
+ *
+ * Postcondition:
+ *  every client thread joined, SIGTERM sent to the process
+ ****************************************************************/
+void * driveScenario(void * arg)
+{
+    static const char hello[] = PROTO_HELLO "\n";
+    struct timespec pause = {0, 1000000};
+    uint64_t total = 0;
+    uint64_t lastTotal;
+    int index;
+
+    (void)arg;
+    for (index = 0; index < clientCount; ++index)
+    {
+        if (0 != Sim_Client_Write(clients[index].socket, hello,
+                                  sizeof(hello) - 1))
+        {
+            clients[index].cutOff = true;
+        }
+        pthread_create(&(clients[index].reader), NULL, clientReader,
+                       &(clients[index]));
+    }
+    // Everyone joins before anyone talks
+    pthread_mutex_lock(&welcomeLock);
+    while (welcomeCount < clientCount)
+    {
+        pthread_cond_wait(&welcomeCond, &welcomeLock);
+    }
+    pthread_mutex_unlock(&welcomeLock);
+    // The WELCOME goes out just before the connection joins the fan-out
+    nanosleep(&pause, NULL);
+
+    for (index = 0; index < clientCount; ++index)
+    {
+        pthread_create(&(clients[index].sender), NULL, clientSender,
+                       &(clients[index]));
+    }
+    for (index = 0; index < clientCount; ++index)
+    {
+        pthread_join(clients[index].sender, NULL);
+    }
+    // Let the server pass on everything it has read before it says goodbye:
+    // a message read but still queued when the goodbye goes out may be cut
+    // off, which is fine for a real shutdown but not for the checks
+    Sim_Wait_For_Reads();
+    pause.tv_nsec = 20000000;
+    do
+    {
+        lastTotal = total;
+        nanosleep(&pause, NULL);
+        total = 0;
+        for (index = 0; index < clientCount; ++index)
+        {
+            total += __atomic_load_n(&(clients[index].totalReceived),
+                                     __ATOMIC_RELAXED);
+        }
+    } while (total != lastTotal);
+    kill(getpid(), SIGTERM);
+    for (index = 0; index < clientCount; ++index)
+    {
+        pthread_join(clients[index].reader, NULL);
+    }
+    return NULL;
+}
+
+/****************************************************************
+ * Set up a scenario's clients and faults from its seed
+ *
+ * Preconditions: seed chosen
+ *
+ * Postcondition:
+ *  clients and faults filled in; exits if out of memory
+ ****************************************************************/
+void planScenario(uint32_t seed, sim_faults_t * faults)
+{
+    uint64_t random = seedRandom(seed, 0);
+    uint64_t streamRandom;
+    int index;
+    int byte;
+    int sender;
+
+    faults->seed = seed;
+    faults->interruptPercent = randomBetween(&random, 0, options.faultPercent);
+    faults->shortReadPercent = randomBetween(&random, 0,
+                                             3 * options.faultPercent);
+    faults->partialWritePercent = randomBetween(&random, 0,
+                                                3 * options.faultPercent);
+    faults->resetPerThousand = randomBetween(&random, 0,
+                                             options.resetPerThousand);
+    faults->yieldPercent = randomBetween(&random, 0, options.faultPercent);
+    faults->minBuffer = randomBetween(&random, 1, 64);
+    faults->maxBuffer = randomBetween(&random, faults->minBuffer, 4096);
+
+    clientCount = randomBetween(&random, 2, options.maxClients);
+    for (index = 0; index < clientCount; ++index)
+    {
+        sim_client_t * client = &(clients[index]);
+        client->index = index;
+        client->streamLength = randomBetween(&random, 0, options.maxBytes);
+        client->closeAt = (0 == randomBetween(&random, 0, 9)) ?
+            randomBetween(&random, 0, client->streamLength) : -1;
+        client->readPauseUs = (0 == randomBetween(&random, 0, 3)) ?
+            randomBetween(&random, 10, 1000) : 0;
+        client->chunkRandom = seedRandom(seed, 2 * index + 1);
+        streamRandom = seedRandom(seed, 2 * index + 2);
+        client->stream = malloc(client->streamLength + 1);
+        if (NULL == client->stream)
+        {
+            exit(3);
+        }
+        for (byte = 0; byte < client->streamLength; ++byte)
+        {
+            client->stream[byte] = (char)(SIM_FIRST_BYTE + 2 * index +
+                                          (nextRandom(&streamRandom) & 1));
+        }
+    }
+    // Every client can receive all of every sender's stream
+    for (index = 0; index < clientCount; ++index)
+    {
+        for (sender = 0; sender < clientCount; ++sender)
+        {
+            clients[index].received[sender] =
+                malloc(clients[sender].streamLength + 1);
+            if (NULL == clients[index].received[sender])
+            {
+                exit(3);
+            }
+        }
+    }
+}
+
+/****************************************************************
+ * Check what every client received
+ *
+ * Preconditions: scenario over, every client thread joined
+ *
+ * Postcondition:
+ *  problems written to report, returns how many
+ ****************************************************************/
+int checkScenario(uint32_t seed)
+{
+    int problems = 0;
+    int index;
+    int sender;
+    sim_stats_t stats;
+
+    for (index = 0; index < clientCount; ++index)
+    {
+        sim_client_t * client = &(clients[index]);
+        bool stayed = !client->reset && !client->closed &&
+                      NULL != strstr(client->text, SIM_GOODBYE);
+        if (!client->reset && !client->closed && !stayed)
+        {
+            fprintf(report, "seed %u: server hung up on client %d before"
+                    " saying goodbye\n", seed, index);
+            ++problems;
+        }
+        if (client->stray)
+        {
+            fprintf(report, "seed %u: client %d got %d bytes nobody sent\n",
+                    seed, index, client->stray);
+            ++problems;
+        }
+        for (sender = 0; sender < clientCount; ++sender)
+        {
+            sim_client_t * from = &(clients[sender]);
+            int length = client->receivedLength[sender];
+            if (0 == length)
+            {
+                continue;
+            }
+            if (length > from->sent ||
+                NULL == memmem(from->stream, from->sent,
+                               client->received[sender], length))
+            {
+                fprintf(report, "seed %u: client %d got %d bytes from %d"
+                        " that aren't a piece of the %d it sent\n", seed,
+                        index, length, sender, from->sent);
+                ++problems;
+            }
+            else if (stayed && !from->reset && !from->cutOff &&
+                     0 != memcmp(from->stream + from->sent - length,
+                                 client->received[sender], length))
+            {
+                fprintf(report, "seed %u: client %d stayed to the end but"
+                        " missed the last of what %d sent\n", seed, index,
+                        sender);
+                ++problems;
+            }
+        }
+    }
+    Get_Sim_Stats(&stats);
+    if (stats.accepted != stats.closed)
+    {
+        fprintf(report, "seed %u: server accepted %d connections but closed"
+                " %d\n", seed, stats.accepted, stats.closed);
+        ++problems;
+    }
+    if (options.verbose)
+    {
+        fprintf(report, "seed %u: %d clients, %d accepted, %lu interrupts,"
+                " %lu short reads, %lu partial writes, %lu resets\n", seed,
+                clientCount, stats.accepted, (unsigned long)stats.interrupts,
+                (unsigned long)stats.shortReads,
+                (unsigned long)stats.partialWrites,
+                (unsigned long)stats.resets);
+    }
+    return problems;
+}
+
+/****************************************************************
+ * Run one scenario. Called in a child process of its own.
+ *
+ * Preconditions: no other threads in this process
+ *
+ * Postcondition:
+ *  exits 0 if every check passed, 1 otherwise
+ ****************************************************************/
+void runScenario(uint32_t seed)
+{
+    char writers[16];
+    // Room at the end for -D
+    char * serverArgs[] = {"server", "-p", "sim", "-w", writers, "-d", "2",
+                           NULL, NULL};
+    int serverArgCount = sizeof(serverArgs) / sizeof(serverArgs[0]) - 2;
+    sigset_t stopSignals;
+    sim_faults_t faults;
+    pthread_t driver;
+    int reportFd = dup(STDERR_FILENO);
+
+    alarm(options.timeout);
+    report = fdopen(reportFd, "w");
+    if (NULL == report)
+    {
+        exit(3);
+    }
+    setvbuf(report, NULL, _IOLBF, 0);
+    if (!options.verbose && (NULL == freopen("/dev/null", "w", stdout) ||
+                             NULL == freopen("/dev/null", "w", stderr)))
+    {
+        exit(3);
+    }
+    // The server takes these through a signalfd, which only works if every
+    // thread has them blocked, the driver's included
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+
+    planScenario(seed, &faults);
+    Sim_Init(&faults);
+    Set_Transport(Get_Sim_Transport());
+    for (int index = 0; index < clientCount; ++index)
+    {
+        if (NULL == (clients[index].socket = Sim_Connect()))
+        {
+            exit(3);
+        }
+    }
+    snprintf(writers, sizeof(writers), "%d", options.writers);
+    if (options.direct)
+    {
+        serverArgs[serverArgCount++] = "-D";
+    }
+    pthread_create(&driver, NULL, driveScenario, NULL);
+    optind = 1;
+    runServer(serverArgCount, serverArgs);
+    pthread_join(driver, NULL);
+    exit(checkScenario(seed) ? 1 : 0);
+}
+
+int main(int argc, char ** argv)
+{
+    struct timespec start;
+    struct timespec end;
+    pid_t * running;
+    uint32_t * runningSeed;
+    int next = 0;
+    int done = 0;
+    int failed = 0;
+    int status;
+    int slot;
+    pid_t pid;
+    double seconds;
+
+    parseSimulateOptions(argc, argv);
+    running = calloc(options.jobs, sizeof(pid_t));
+    runningSeed = calloc(options.jobs, sizeof(uint32_t));
+    if (NULL == running || NULL == runningSeed)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return 3;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (done < options.scenarios)
+    {
+        // Keep every job slot busy
+        for (slot = 0; slot < options.jobs && next < options.scenarios;
+             ++slot)
+        {
+            if (0 != running[slot])
+            {
+                continue;
+            }
+            runningSeed[slot] = options.seed + next++;
+            fflush(NULL);
+            pid = fork();
+            if (0 == pid)
+            {
+                runScenario(runningSeed[slot]);
+            }
+            if (-1 == pid)
+            {
+                perror("Couldn't start a scenario");
+                return 3;
+            }
+            running[slot] = pid;
+        }
+        if (-1 == (pid = wait(&status)))
+        {
+            perror("Trouble waiting for a scenario");
+            return 3;
+        }
+        for (slot = 0; slot < options.jobs && running[slot] != pid; ++slot)
+        {
+        }
+        if (slot == options.jobs)
+        {
+            continue;
+        }
+        running[slot] = 0;
+        ++done;
+        if (WIFEXITED(status) && 0 == WEXITSTATUS(status))
+        {
+            continue;
+        }
+        ++failed;
+        if (WIFSIGNALED(status) && SIGALRM == WTERMSIG(status))
+        {
+            printf("seed %u: hung for %d s\n", runningSeed[slot],
+                   options.timeout);
+        }
+        else if (WIFSIGNALED(status))
+        {
+            printf("seed %u: died with signal %d\n", runningSeed[slot],
+                   WTERMSIG(status));
+        }
+        else
+        {
+            printf("seed %u: failed, exit status %d\n", runningSeed[slot],
+                   WEXITSTATUS(status));
+        }
+        printf("  rerun with: %s -s %u -n 1 -v\n", argv[0], runningSeed[slot]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) +
+              (end.tv_nsec - start.tv_nsec) / (double)NS_PER_SEC;
+    printf("%d scenarios from seed %u, %d failed, in %.2f s (%.1f per"
+           " second)\n", done, options.seed, failed, seconds,
+           seconds > 0 ? done / seconds : 0.0);
+    free(running);
+    free(runningSeed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,175 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      timerwheel.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Hierarchical timer wheel. Level 0 has one slot per tick; each slot of
+ *    level n covers a whole turn of level n-1. When a lower level wraps
+ *    around, the matching slot of the level above is emptied and its timers
+ *    are re-added, which drops them to a lower level.
+ * 
+ *  -- See timerwheel.h for function header blocks
+ *
+ ************************************************************/
+#include <stddef.h>
+
+#include "timerwheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+//********************************************
+// Index of the slot at level that covers tick
+static int Slot_Index(uint64_t tick, int level)
+{
+    return (tick >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK;
+}
+
+//********************************************
+// Put a timer at the end of a slot's list
+static void Append_To_Slot(wheel_timer_t * slot, wheel_timer_t * timer)
+{
+    timer->prev = slot->prev;
+    timer->next = slot;
+    slot->prev->next = timer;
+    slot->prev = timer;
+}
+
+//********************************************
+void Init_Timer_Wheel(timer_wheel_t * wheel, uint64_t now)
+{
+    int level;
+    int index;
+    
+    wheel->now = now;
+    for (level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+    {
+        for (index = 0; index < TIMER_WHEEL_SLOTS; ++index)
+        {
+            wheel->slots[level][index].next = &(wheel->slots[level][index]);
+            wheel->slots[level][index].prev = &(wheel->slots[level][index]);
+        }
+    }
+}
+
+//********************************************
+void Init_Wheel_Timer(wheel_timer_t * timer)
+{
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+}
+
+//********************************************
+void Timer_Wheel_Add(timer_wheel_t * wheel, wheel_timer_t * timer,
+                     uint64_t expires)
+{
+    uint64_t delta;
+    int level = 0;
+    
+    if (expires <= wheel->now)
+    {
+        expires = wheel->now + 1;
+    }
+    delta = expires - wheel->now;
+    if (delta > TIMER_WHEEL_MAX_TICKS)
+    {
+        expires = wheel->now + TIMER_WHEEL_MAX_TICKS;
+        delta = TIMER_WHEEL_MAX_TICKS;
+    }
+    timer->expires = expires;
+    
+    // Lowest level whose full turn still reaches the expiry
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+        delta >= (1ULL << ((level + 1) * TIMER_WHEEL_SLOT_BITS)))
+    {
+        ++level;
+    }
+    
+    Append_To_Slot(&(wheel->slots[level][Slot_Index(expires, level)]), timer);
+}
+
+//********************************************
+void Timer_Wheel_Remove(wheel_timer_t * timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+//********************************************
+bool Timer_Pending(const wheel_timer_t * timer)
+{
+    return NULL != timer->next;
+}
+
+//********************************************
+// Re-add every timer in the current slot of level so they move down.
+// Returns the slot index, so the caller knows whether this level wrapped too.
+static int Cascade(timer_wheel_t * wheel, int level)
+{
+    int index = Slot_Index(wheel->now, level);
+    wheel_timer_t * slot = &(wheel->slots[level][index]);
+    wheel_timer_t pending;
+    wheel_timer_t * timer;
+    
+    if (slot->next == slot)
+    {
+        return index;
+    }
+    
+    // Move the whole chain onto a local sentinel first, since re-adding can
+    // put timers back into this same slot
+    pending.next = slot->next;
+    pending.prev = slot->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    slot->next = slot;
+    slot->prev = slot;
+    
+    while (pending.next != &pending)
+    {
+        timer = pending.next;
+        Timer_Wheel_Remove(timer);
+        Timer_Wheel_Add(wheel, timer, timer->expires);
+    }
+    return index;
+}
+
+//********************************************
+void Timer_Wheel_Advance(timer_wheel_t * wheel, uint64_t now,
+                         void (*expired)(wheel_timer_t * timer,
+                                         void * userData),
+                         void * userData)
+{
+    wheel_timer_t * slot;
+    wheel_timer_t * timer;
+    int level;
+    
+    while (wheel->now < now)
+    {
+        ++(wheel->now);
+        
+        if (0 == Slot_Index(wheel->now, 0))
+        {
+            for (level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+            {
+                if (0 != Cascade(wheel, level))
+                {
+                    break;
+                }
+            }
+        }
+        
+        slot = &(wheel->slots[0][Slot_Index(wheel->now, 0)]);
+        while (slot->next != slot)
+        {
+            timer = slot->next;
+            Timer_Wheel_Remove(timer);
+            expired(timer, userData);
+        }
+    }
+}
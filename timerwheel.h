@@ -0,0 +1,84 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      timerwheel.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    Hierarchical timer wheel. Adding and removing a timer is O(1), and
+ *    advancing the clock costs O(1) per tick plus O(1) per timer that
+ *    expires or moves down a level, no matter how many timers are pending.
+ *    Times are in ticks; the caller decides how long a tick is.
+ *
+ *    Not thread safe: the caller serializes access to a wheel.
+ *
+ ************************************************************/
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_LEVELS 4
+// Timers further out than this many ticks are clamped to it
+#define TIMER_WHEEL_MAX_TICKS \
+    ((1ULL << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+// Embed in the object being timed
+typedef struct wheel_timer_s
+{
+    struct wheel_timer_s * next;
+    struct wheel_timer_s * prev;
+    // Tick this timer expires on
+    uint64_t expires;
+} wheel_timer_t;
+
+typedef struct
+{
+    // Tick the wheel has been advanced to
+    uint64_t now;
+    // Each slot is a circular list with the slot itself as the sentinel
+    wheel_timer_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel_t;
+
+// Initialize a wheel
+// Params:
+//    wheel: wheel to initialize
+//    now: the current tick
+void Init_Timer_Wheel(timer_wheel_t * wheel, uint64_t now);
+
+// Initialize a timer so Timer_Pending can be called on it before it is added
+// Params:
+//    timer: timer to initialize
+void Init_Wheel_Timer(wheel_timer_t * timer);
+
+// Add a timer. Timers already due fire on the next tick.
+// Params:
+//    wheel: wheel to add to
+//    timer: a timer that is not pending
+//    expires: tick to fire on
+void Timer_Wheel_Add(timer_wheel_t * wheel, wheel_timer_t * timer,
+                     uint64_t expires);
+
+// Remove a pending timer without firing it
+// Params:
+//    timer: a pending timer
+void Timer_Wheel_Remove(wheel_timer_t * timer);
+
+// Return true if the timer is in a wheel
+// Params:
+//    timer: an initialized timer
+bool Timer_Pending(const wheel_timer_t * timer);
+
+// Advance the wheel to a tick, removing each timer that comes due and
+// calling expired on it. expired may add the timer back.
+// Params:
+//    wheel: wheel to advance
+//    now: tick to advance to
+//    expired: called for each expired timer
+//    userData: passed to expired
+void Timer_Wheel_Advance(timer_wheel_t * wheel, uint64_t now,
+                         void (*expired)(wheel_timer_t * timer,
+                                         void * userData),
+                         void * userData);
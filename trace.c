@@ -0,0 +1,373 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      trace.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Per-thread trace buffers and the Chrome trace writer.
+ *
+ *    Each buffer is a ring with a single writer, its thread, which fills
+ *    the next slot and then publishes it by advancing head. A dump copies
+ *    the slots it can see, then rereads head: any slot the writer may have
+ *    started overwriting in the meantime is thrown away, as with a seqlock.
+ *
+ *    Buffers wrap at their own rates, so a dump only includes messages whose
+ *    first event is still there.
+ *
+ *    A thread gets its buffer the first time it records an event, so with
+ *    tracing off no buffers exist. When a thread exits its buffer is
+ *    retired, keeping its events for dumps, and handed to the next new
+ *    thread that needs one, so connection threads coming and going don't
+ *    grow the registry. Only TRACE_MAX_RETIRED are kept that way; past
+ *    that an exiting thread's buffer is freed, so a burst of connections
+ *    doesn't leave its buffers behind for good. The registry lock is only
+ *    taken then and by dumps.
+ *
+ *  -- See trace.h for function header blocks
+ *
+ ************************************************************/
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+typedef struct
+{
+    uint64_t startNs;
+    uint32_t durationNs;
+    uint32_t traceId;
+    uint64_t arg;
+    int32_t tid;
+    int32_t kind;
+} trace_event_t;
+
+typedef struct trace_buffer_s
+{
+    // Every buffer ever made, for dumps
+    struct trace_buffer_s * next;
+    bool retired;
+    int capacity;
+    // Events ever recorded; the newest capacity of them are in events
+    uint64_t head;
+    trace_event_t events[];
+} trace_buffer_t;
+
+static const char * kindNames[TRACE_KINDS] =
+{
+    "read", "message", "match", "submit", "queue", "shard", "write_lock",
+    "write", "message"
+};
+
+static uint32_t sampleOneIn = 0;
+static uint64_t sampleCounter = 0;
+static uint32_t lastTraceId = 0;
+
+// Guards the buffer list, retired flags and count
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer_t * allBuffers = NULL;
+static int retiredCount = 0;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+// Only used for its destructor, which retires the thread's buffer
+static pthread_key_t bufferKey;
+
+static __thread trace_buffer_t * threadBuffer = NULL;
+static __thread int threadCapacity = TRACE_THREAD_EVENTS;
+static __thread int32_t threadId = 0;
+
+//********************************************
+static void Retire_Buffer(void * buffer)
+{
+    trace_buffer_t ** link;
+
+    pthread_mutex_lock(&registryLock);
+    if (retiredCount < TRACE_MAX_RETIRED)
+    {
+        ((trace_buffer_t *)buffer)->retired = true;
+        ++retiredCount;
+        buffer = NULL;
+    }
+    else
+    {
+        // Enough kept: unlink it, and its events go with it
+        for (link = &allBuffers; *link != buffer; link = &((*link)->next))
+        {
+        }
+        *link = ((trace_buffer_t *)buffer)->next;
+    }
+    pthread_mutex_unlock(&registryLock);
+    free(buffer);
+}
+
+//********************************************
+static void Make_Key(void)
+{
+    pthread_key_create(&bufferKey, Retire_Buffer);
+}
+
+//********************************************
+// Find or make this thread's buffer. Return NULL if out of memory.
+static trace_buffer_t * Get_Thread_Buffer(void)
+{
+    trace_buffer_t * buffer;
+
+    pthread_once(&keyOnce, Make_Key);
+    pthread_mutex_lock(&registryLock);
+    for (buffer = allBuffers; NULL != buffer; buffer = buffer->next)
+    {
+        if (buffer->retired && buffer->capacity >= threadCapacity)
+        {
+            buffer->retired = false;
+            --retiredCount;
+            break;
+        }
+    }
+    if (NULL == buffer &&
+        NULL != (buffer = malloc(sizeof(trace_buffer_t) +
+                                 sizeof(trace_event_t) * threadCapacity)))
+    {
+        buffer->retired = false;
+        buffer->capacity = threadCapacity;
+        buffer->head = 0;
+        buffer->next = allBuffers;
+        allBuffers = buffer;
+    }
+    pthread_mutex_unlock(&registryLock);
+    if (NULL != buffer)
+    {
+        pthread_setspecific(bufferKey, buffer);
+        threadId = (int32_t)syscall(SYS_gettid);
+    }
+    threadBuffer = buffer;
+    return buffer;
+}
+
+//********************************************
+void Set_Trace_Sampling(uint32_t oneIn)
+{
+    __atomic_store_n(&sampleOneIn, oneIn, __ATOMIC_RELAXED);
+}
+
+//********************************************
+uint32_t Get_Trace_Sampling(void)
+{
+    return __atomic_load_n(&sampleOneIn, __ATOMIC_RELAXED);
+}
+
+//********************************************
+uint32_t Trace_Sample(void)
+{
+    uint32_t oneIn = __atomic_load_n(&sampleOneIn, __ATOMIC_RELAXED);
+    uint32_t traceId;
+
+    if (0 == oneIn ||
+        0 != __atomic_add_fetch(&sampleCounter, 1, __ATOMIC_RELAXED) % oneIn)
+    {
+        return 0;
+    }
+    // Zero means untraced, so skip it when the ids wrap
+    while (0 == (traceId = __atomic_add_fetch(&lastTraceId, 1,
+                                              __ATOMIC_RELAXED)))
+    {
+    }
+    return traceId;
+}
+
+//********************************************
+uint64_t Trace_Now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+//********************************************
+void Trace_Event(int kind, uint32_t traceId, uint64_t startNs, uint64_t endNs,
+                 uint64_t arg)
+{
+    trace_buffer_t * buffer = threadBuffer;
+    trace_event_t * event;
+    uint64_t head;
+
+    if (0 == traceId ||
+        (NULL == buffer && NULL == (buffer = Get_Thread_Buffer())))
+    {
+        return;
+    }
+    head = buffer->head;
+    event = &(buffer->events[head % buffer->capacity]);
+    event->startNs = startNs;
+    event->durationNs = (endNs - startNs > UINT32_MAX) ? UINT32_MAX :
+                        (uint32_t)(endNs - startNs);
+    event->traceId = traceId;
+    event->arg = arg;
+    event->tid = threadId;
+    event->kind = kind;
+    __atomic_store_n(&(buffer->head), head + 1, __ATOMIC_RELEASE);
+}
+
+//********************************************
+void Trace_Reserve_Thread(int events)
+{
+    if (events > threadCapacity)
+    {
+        threadCapacity = events;
+    }
+}
+
+//********************************************
+// Write one event. Return true if it was written.
+static bool Write_Event(FILE * out, const trace_event_t * event, int pid,
+                        bool first)
+{
+    const char * separator = first ? "" : ",\n";
+
+    if (event->kind < 0 || event->kind >= TRACE_KINDS)
+    {
+        return false;
+    }
+    if (TRACE_MESSAGE_BEGIN == event->kind || TRACE_MESSAGE_END == event->kind)
+    {
+        // Async pair, matched by id, so it can start and end on different
+        // threads
+        fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"chat\",\"ph\":\"%s\","
+                "\"id\":%u,\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"arg\":%lu}}", separator, kindNames[event->kind],
+                (TRACE_MESSAGE_BEGIN == event->kind) ? "b" : "e",
+                event->traceId, event->startNs / 1000.0, pid, event->tid,
+                (unsigned long)event->arg);
+    }
+    else
+    {
+        fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"chat\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"message\":%u,\"arg\":%lu}}", separator,
+                kindNames[event->kind], event->startNs / 1000.0,
+                event->durationNs / 1000.0, pid, event->tid, event->traceId,
+                (unsigned long)event->arg);
+    }
+    return true;
+}
+
+//********************************************
+static int Compare_Ids(const void * left, const void * right)
+{
+    uint32_t leftId = *(const uint32_t *)left;
+    uint32_t rightId = *(const uint32_t *)right;
+    return (leftId > rightId) - (leftId < rightId);
+}
+
+//********************************************
+// Copy the events a buffer still holds onto the end of *events. Return
+// false if out of memory.
+static bool Collect_Buffer(trace_buffer_t * buffer, trace_event_t ** events,
+                           int * count, int * capacity)
+{
+    uint64_t headBefore;
+    uint64_t headAfter;
+    uint64_t first;
+    uint64_t index;
+    int start = *count;
+
+    if (*count + buffer->capacity > *capacity)
+    {
+        int newCapacity = *count + buffer->capacity + *capacity;
+        trace_event_t * grown =
+            realloc(*events, sizeof(trace_event_t) * newCapacity);
+        if (NULL == grown)
+        {
+            return false;
+        }
+        *events = grown;
+        *capacity = newCapacity;
+    }
+    headBefore = __atomic_load_n(&(buffer->head), __ATOMIC_ACQUIRE);
+    first = (headBefore > (uint64_t)buffer->capacity) ?
+            headBefore - buffer->capacity : 0;
+    for (index = first; index < headBefore; ++index)
+    {
+        (*events)[start + (index - first)] =
+            buffer->events[index % buffer->capacity];
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    headAfter = __atomic_load_n(&(buffer->head), __ATOMIC_RELAXED);
+    // The writer may be part way through the slot for event headAfter, and
+    // has reused the slots of everything older than that
+    if (headAfter + 1 > first + buffer->capacity)
+    {
+        uint64_t overwritten = headAfter + 1 - buffer->capacity - first;
+        if (overwritten >= headBefore - first)
+        {
+            return true;
+        }
+        memmove(*events + start, *events + start + overwritten,
+                sizeof(trace_event_t) * (headBefore - first - overwritten));
+        first += overwritten;
+    }
+    *count += (int)(headBefore - first);
+    return true;
+}
+
+//********************************************
+int Write_Trace(FILE * out)
+{
+    trace_buffer_t * buffer;
+    trace_event_t * events = NULL;
+    uint32_t * begun = NULL;
+    int count = 0;
+    int capacity = 0;
+    int begunCount = 0;
+    int index;
+    int pid = (int)getpid();
+    int written = 0;
+
+    // Held so no buffer is handed to a new thread mid-copy; recording
+    // carries on regardless
+    pthread_mutex_lock(&registryLock);
+    for (buffer = allBuffers; NULL != buffer; buffer = buffer->next)
+    {
+        if (!Collect_Buffer(buffer, &events, &count, &capacity))
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registryLock);
+
+    // Buffers wrap at different rates, so a busy reader may have lost the
+    // start of a message a writer still has spans for. Only keep messages
+    // whose begin event survived, so each one is either whole or left out.
+    if (count > 0 && NULL != (begun = malloc(sizeof(uint32_t) * count)))
+    {
+        for (index = 0; index < count; ++index)
+        {
+            if (TRACE_MESSAGE_BEGIN == events[index].kind)
+            {
+                begun[begunCount++] = events[index].traceId;
+            }
+        }
+        qsort(begun, begunCount, sizeof(uint32_t), Compare_Ids);
+    }
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (index = 0; index < count && NULL != begun; ++index)
+    {
+        if (NULL != bsearch(&(events[index].traceId), begun, begunCount,
+                            sizeof(uint32_t), Compare_Ids) &&
+            Write_Event(out, &(events[index]), pid, 0 == written))
+        {
+            ++written;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    free(begun);
+    free(events);
+    return written;
+}
@@ -0,0 +1,92 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      trace.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Sampled per-message tracing. One message in every N is given a trace
+ *    id when it is read; each stage it goes through on its way to the
+ *    recipients then records a timed event under that id. Events go into a
+ *    buffer owned by the recording thread, so recording takes no locks.
+ *    Write_Trace dumps every thread's buffer as Chrome trace JSON, which
+ *    chrome://tracing and Perfetto open directly.
+ *
+ *    With sampling off, Trace_Sample is one relaxed load and every other
+ *    call site is skipped because the trace id is zero.
+ *
+ ************************************************************/
+#include <stdint.h>
+#include <stdio.h>
+
+// Events a thread keeps unless it asks for more with Trace_Reserve_Thread.
+// Older events are overwritten. Sized for a connection's reader, which
+// records a handful of events per sampled message, as there is one per
+// connection.
+#define TRACE_THREAD_EVENTS 256
+// Buffers of exited threads kept for dumps and for new threads to reuse.
+// Past this, a buffer is freed when its thread exits.
+#define TRACE_MAX_RETIRED 64
+
+// Kinds of events. Spans have a start and end; the message begin and end
+// events mark the same instant for both and tie the spans for one message
+// together.
+// read() that got the message. arg: bytes read
+#define TRACE_READ 0
+// Message handed to the fan-out. arg: sender's connection id
+#define TRACE_MESSAGE_BEGIN 1
+// Matching against the subscribers' filters. arg: message length
+#define TRACE_MATCH 2
+// Fanout_Submit, including any wait for the sender's earlier messages.
+// arg: message length
+#define TRACE_SUBMIT 3
+// Waiting in the log for a writer to reach it. arg: shard
+#define TRACE_QUEUE 4
+// One writer delivering to its shard. arg: shard
+#define TRACE_SHARD 5
+// Waiting for a recipient's write lock. arg: recipient's connection id
+#define TRACE_WRITE_LOCK 6
+// Writing to a recipient. arg: recipient's connection id
+#define TRACE_WRITE 7
+// Every shard is done with the message. arg: unused
+#define TRACE_MESSAGE_END 8
+#define TRACE_KINDS 9
+
+// Set how often to trace
+// Params:
+//    oneIn: trace one message in this many, 0 for off
+void Set_Trace_Sampling(uint32_t oneIn);
+
+// Get how often messages are traced, 0 for off
+uint32_t Get_Trace_Sampling(void);
+
+// Decide whether to trace the next message
+// Return a new trace id, or 0 not to trace it
+uint32_t Trace_Sample(void);
+
+// Get the clock trace events use, in ns
+uint64_t Trace_Now(void);
+
+// Record an event in this thread's buffer. Does nothing if traceId is 0.
+// Params:
+//    kind: one of the TRACE_ kinds
+//    traceId: from Trace_Sample
+//    startNs, endNs: from Trace_Now. The same for begin and end events.
+//    arg: meaning depends on kind
+void Trace_Event(int kind, uint32_t traceId, uint64_t startNs, uint64_t endNs,
+                 uint64_t arg);
+
+// Ask for a bigger buffer for this thread, for threads that record an event
+// per recipient. Call before the thread records anything.
+// Params:
+//    events: events to keep
+void Trace_Reserve_Thread(int events);
+
+// Write every thread's events as Chrome trace JSON. Safe while threads are
+// recording; events overwritten during the dump are left out.
+// Return the number of events written
+// Params:
+//    out: where to write
+int Write_Trace(FILE * out);
@@ -0,0 +1,188 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      transport.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Kernel transport and the dispatch to whichever transport is in use.
+ *    The TCP listener setup moved here from server.c's main.
+ *
+ *  -- See transport.h for function header blocks
+ *
+ ************************************************************/
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "transport.h"
+
+//********************************************
+static int Kernel_Listen(const char * port)
+{
+    // Gives getaddrinfo hints about the critera for the addresses it returns
+    struct addrinfo hints;
+    // Points to list of results from getaddrinfo
+    struct addrinfo *serverinfo;
+    int sockfd;
+
+    // Erase the struct
+    memset(&hints, 0, sizeof(hints));
+
+    // Then set what we actually want:
+    hints.ai_family = AF_INET6;
+    // We want to do TCP
+    hints.ai_socktype = SOCK_STREAM;
+    // We want to listen (we are the server)
+    hints.ai_flags = AI_PASSIVE;
+
+    int status = 0;
+    if (0 != (status = getaddrinfo(NULL, port, &hints, &serverinfo)))
+    {
+        // There was a problem, print it out
+        fprintf(stderr, "Trouble with getaddrinfo, error was %s.\n",
+                gai_strerror(status));
+        return -1;
+    }
+
+    struct addrinfo * current = serverinfo;
+    // Traverse results list until one of them works to open
+    sockfd = socket(current->ai_family, current->ai_socktype,
+                    current->ai_protocol);
+    while (-1 == sockfd && NULL != current->ai_next)
+    {
+        current = current->ai_next;
+        sockfd = socket(current->ai_family, current->ai_socktype,
+                        current->ai_protocol);
+    }
+    if (-1 == sockfd)
+    {
+        fprintf(stderr, "We tried valliantly, but we were unable to open the"
+        " socket with what getaddrinfo gave us.\n");
+        freeaddrinfo(serverinfo);
+        return -1;
+    }
+
+    // Ok, say we want a socket that abstracts away whether we are doing IPv6
+    // or IPv4 by just having it handle IPv4 mapped addresses for us
+    int no = 0;
+    if (0 > setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&no,
+                       sizeof(no)))
+    {
+        fprintf(stderr,"Trouble setting socket option to also listen on IPv4 in"
+        " addition to IPv6. Falling back to IPv6 only.\n");
+    }
+
+    int yes = 1;
+    if (0 >
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (void *)&yes, sizeof(yes)))
+    {
+        fprintf(stderr, "Couldn't set option to re-use addresses. The server "
+        "will still try to start, but if the address & port has been in use"
+        " recently (think last minute range), binding may fail.");
+    }
+
+    // Ok, so now we have a socket. Lets try to bind to it
+    if (-1 == bind(sockfd, current->ai_addr, current->ai_addrlen))
+    {
+        // Couldn't bind
+        fprintf(stderr, "We couldn't bind to the socket. (Or something like tha"
+        "t. What is the correct terminology?)\n");
+        freeaddrinfo(serverinfo);
+        close(sockfd);
+        return -1;
+    }
+
+    // Also cleans up the memory pointed to by current
+    freeaddrinfo(serverinfo);
+
+    // Room for a burst of clients connecting at once, as when a lot of them
+    // reconnect after a restart
+    if (-1 == listen(sockfd, SOMAXCONN))
+    {
+        // Couldn't listen
+        fprintf(stderr, "Call to listen failed.\n");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+//********************************************
+static int Kernel_Accept(int listenFd)
+{
+    return accept(listenFd, NULL, NULL);
+}
+
+static const transport_t kernelTransport =
+{
+    Kernel_Listen,
+    Kernel_Accept,
+    read,
+    recv,
+    write,
+    send,
+    shutdown,
+    close
+};
+
+// Written before any threads use it, then only read
+static const transport_t * currentTransport = &kernelTransport;
+
+//********************************************
+void Set_Transport(const transport_t * transport)
+{
+    currentTransport = transport ? transport : &kernelTransport;
+}
+
+//********************************************
+int Transport_Listen(const char * port)
+{
+    return currentTransport->listen(port);
+}
+
+//********************************************
+int Transport_Accept(int listenFd)
+{
+    return currentTransport->accept(listenFd);
+}
+
+//********************************************
+ssize_t Transport_Read(int fd, void * buffer, size_t length)
+{
+    return currentTransport->read(fd, buffer, length);
+}
+
+//********************************************
+ssize_t Transport_Recv(int fd, void * buffer, size_t length, int flags)
+{
+    return currentTransport->recv(fd, buffer, length, flags);
+}
+
+//********************************************
+ssize_t Transport_Write(int fd, const void * buffer, size_t length)
+{
+    return currentTransport->write(fd, buffer, length);
+}
+
+//********************************************
+ssize_t Transport_Send(int fd, const void * buffer, size_t length, int flags)
+{
+    return currentTransport->send(fd, buffer, length, flags);
+}
+
+//********************************************
+int Transport_Shutdown(int fd, int how)
+{
+    return currentTransport->shutdown(fd, how);
+}
+
+//********************************************
+int Transport_Close(int fd)
+{
+    return currentTransport->close(fd);
+}
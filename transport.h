@@ -0,0 +1,56 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      transport.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ * 
+ * Overview:
+ *    The socket calls the server makes on client connections, behind a
+ *    table of functions. Normally they go straight to the kernel; the
+ *    simulator (see simnet.h) swaps in an in-memory network so stalls and
+ *    races can be reproduced without real sockets.
+ *
+ *    Every fd a transport hands out must work with poll(), since the server
+ *    polls them alongside its own eventfds.
+ *
+ ************************************************************/
+#include <sys/types.h>
+
+typedef struct
+{
+    // Return a listening fd for port, or -1 with an error written to stderr
+    int (*listen)(const char * port);
+    // The rest behave like the system calls of the same name
+    int (*accept)(int listenFd);
+    ssize_t (*read)(int fd, void * buffer, size_t length);
+    ssize_t (*recv)(int fd, void * buffer, size_t length, int flags);
+    ssize_t (*write)(int fd, const void * buffer, size_t length);
+    ssize_t (*send)(int fd, const void * buffer, size_t length, int flags);
+    int (*shutdown)(int fd, int how);
+    int (*close)(int fd);
+} transport_t;
+
+// Route the Transport_ calls through different functions. Call before
+// anything is listening.
+// Params:
+//    transport: the functions, or NULL for the kernel's
+void Set_Transport(const transport_t * transport);
+
+// Open a TCP listener on every address (IPv6 with IPv4 mapped)
+// Return the listening socket, or -1 with an error written to stderr
+// Params:
+//    port: port number or service name
+int Transport_Listen(const char * port);
+
+// As accept(listenFd, NULL, NULL)
+int Transport_Accept(int listenFd);
+
+// As read(), recv(), write(), send(), shutdown() and close()
+ssize_t Transport_Read(int fd, void * buffer, size_t length);
+ssize_t Transport_Recv(int fd, void * buffer, size_t length, int flags);
+ssize_t Transport_Write(int fd, const void * buffer, size_t length);
+ssize_t Transport_Send(int fd, const void * buffer, size_t length, int flags);
+int Transport_Shutdown(int fd, int how);
+int Transport_Close(int fd);
@@ -0,0 +1,758 @@
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      udp.c
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Datagram thread, subscriber table and batched sends.
+ *
+ *    Subscribers are a plain array searched by address, as are the addresses
+ *    sent a cookie (see protocol.h) that haven't sent it back. Those only
+ *    hold a random cookie, and forged requests just push the oldest out.
+ *    Only the datagram thread changes either table or sends, so each
+ *    subscriber's datagrams go out in sequence order; the lock around them
+ *    is for the statistics and for shutting down. Sends don't wait for room.
+ *
+ *    Udp_Broadcast runs on the stream readers, so it only copies the chat
+ *    onto a lock-free queue (see mpscq.h) for the datagram thread and wakes
+ *    it. Readers never wait on datagram sends. The eventfd is only written
+ *    by the reader that finds it unsignalled.
+ *
+ *    A relayed datagram goes out of the buffer it came in on, with the
+ *    server's sequence number written over the sender's. A broadcast is
+ *    sent as a header and a slice of the queued chat, so chat is never
+ *    copied per subscriber either way.
+ *
+ *  -- See udp.h for function header blocks
+ *
+ ************************************************************/
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/param.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpscq.h"
+#include "shutdown.h"
+#include "udp.h"
+
+#define UDP_DATAGRAM (PROTO_UDP_HEADER + PROTO_UDP_MAX_PAYLOAD)
+// How often the datagram thread looks for subscribers to drop, in ms
+#define UDP_EXPIRE_CHECK_MS 1000
+// Socket buffer asked for in each direction. The kernel may cap it.
+#define UDP_SOCKET_BUFFER (1024 * 1024)
+
+typedef struct
+{
+    struct sockaddr_in6 address;
+    uint64_t lastHeardMs;
+    // Sequence number expected next from this subscriber
+    uint32_t nextSequence;
+} udp_subscriber_t;
+
+// An address that has been sent a cookie and not sent it back yet
+typedef struct
+{
+    struct sockaddr_in6 address;
+    uint64_t cookie;
+    uint64_t sentMs;
+} udp_pending_t;
+
+// Chat from the stream readers waiting for the datagram thread
+typedef struct
+{
+    mpsc_link_t link;
+    int length;
+    char data[];
+} udp_outbound_t;
+
+// Datagrams waiting to go out in one sendmmsg call
+typedef struct
+{
+    struct mmsghdr messages[UDP_BATCH];
+    int count;
+} udp_batch_t;
+
+static int udpFd = -1;
+static bool udpRunning = false;
+static pthread_t udpThread;
+static udp_receive_t receiveFunction = NULL;
+
+// Chat for the datagram thread to send, how many are queued, and the
+// eventfd that wakes the thread for them with whether it's signalled
+static mpsc_queue_t outbound;
+static int outboundCount = 0;
+static int outboundFd = -1;
+static int outboundSignalled = 0;
+
+// Held by the datagram thread while it uses everything below, so the
+// statistics can be read and the socket closed from other threads
+static pthread_mutex_t udpLock = PTHREAD_MUTEX_INITIALIZER;
+static udp_subscriber_t subscribers[UDP_MAX_SUBSCRIBERS];
+// Also read without the lock, to skip broadcasts nobody would get
+static int subscriberCount = 0;
+static uint32_t nextSequence = 0;
+static udp_pending_t pending[UDP_MAX_PENDING];
+static int pendingCount = 0;
+static udp_stats_t stats;
+// Kept apart from stats: counted by the readers without the lock
+static uint64_t queueDropped = 0;
+
+//********************************************
+static uint64_t Now_Ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//********************************************
+// Open the datagram socket, taking IPv4 as well as IPv6 as the TCP listener
+// does. Return it, or -1 with an error written to stderr.
+static int Open_Socket(const char * port)
+{
+    struct addrinfo hints;
+    struct addrinfo * serverinfo;
+    int status;
+    int fd;
+    int no = 0;
+    int size = UDP_SOCKET_BUFFER;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET6;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (0 != (status = getaddrinfo(NULL, port, &hints, &serverinfo)))
+    {
+        fprintf(stderr, "Trouble with getaddrinfo for the datagram port, error"
+                " was %s.\n", gai_strerror(status));
+        return -1;
+    }
+    if (-1 == (fd = socket(serverinfo->ai_family, serverinfo->ai_socktype,
+                           serverinfo->ai_protocol)))
+    {
+        perror("Trouble getting a datagram socket");
+        freeaddrinfo(serverinfo);
+        return -1;
+    }
+    if (0 > setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no)))
+    {
+        fprintf(stderr, "Trouble setting the datagram socket to also take"
+                " IPv4. Falling back to IPv6 only.\n");
+    }
+    // Best effort: bursts that outrun the thread are dropped either way
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    if (-1 == bind(fd, serverinfo->ai_addr, serverinfo->ai_addrlen))
+    {
+        perror("Trouble binding the datagram socket");
+        freeaddrinfo(serverinfo);
+        close(fd);
+        return -1;
+    }
+    freeaddrinfo(serverinfo);
+    return fd;
+}
+
+//********************************************
+// Send everything in a batch and empty it. Caller holds udpLock.
+static void Send_Batch(udp_batch_t * batch)
+{
+    int sent = 0;
+    int result;
+
+    while (sent < batch->count)
+    {
+        result = sendmmsg(udpFd, batch->messages + sent, batch->count - sent,
+                          MSG_DONTWAIT);
+        if (result > 0)
+        {
+            ++stats.sendCalls;
+            stats.datagramsOut += result;
+            sent += result;
+        }
+        else if (EAGAIN == errno || EWOULDBLOCK == errno)
+        {
+            // Out of room; the rest would only fail the same way
+            stats.sendDropped += batch->count - sent;
+            break;
+        }
+        else if (EINTR != errno)
+        {
+            // Something wrong with this one address. Skip it.
+            ++stats.sendDropped;
+            ++sent;
+        }
+    }
+    batch->count = 0;
+}
+
+//********************************************
+// Add a datagram to a batch, sending the batch if that fills it. to and iov
+// must stay put until the batch is sent. Caller holds udpLock.
+static void Queue_Datagram(udp_batch_t * batch, struct sockaddr_in6 * to,
+                           struct iovec * iov, int iovCount)
+{
+    struct msghdr * header = &(batch->messages[batch->count++].msg_hdr);
+
+    memset(header, 0, sizeof(*header));
+    header->msg_name = to;
+    header->msg_namelen = sizeof(*to);
+    header->msg_iov = iov;
+    header->msg_iovlen = iovCount;
+    if (UDP_BATCH == batch->count)
+    {
+        Send_Batch(batch);
+    }
+}
+
+//********************************************
+// Check whether two addresses are the same
+static bool Same_Address(const struct sockaddr_in6 * one,
+                         const struct sockaddr_in6 * other)
+{
+    return one->sin6_port == other->sin6_port &&
+           0 == memcmp(&(one->sin6_addr), &(other->sin6_addr),
+                       sizeof(one->sin6_addr));
+}
+
+//********************************************
+// Find the subscriber for an address. Return NULL if it isn't subscribed.
+// Caller holds udpLock.
+static udp_subscriber_t * Find_Subscriber(const struct sockaddr_in6 * address,
+                                          uint64_t nowMs)
+{
+    int index;
+
+    for (index = 0; index < subscriberCount; ++index)
+    {
+        if (Same_Address(&(subscribers[index].address), address))
+        {
+            subscribers[index].lastHeardMs = nowMs;
+            return &(subscribers[index]);
+        }
+    }
+    return NULL;
+}
+
+//********************************************
+// Subscribe an address. Return NULL if the table is full. Caller holds
+// udpLock.
+static udp_subscriber_t * Add_Subscriber(const struct sockaddr_in6 * address,
+                                         uint32_t sequence, uint64_t nowMs)
+{
+    udp_subscriber_t * subscriber;
+
+    if (UDP_MAX_SUBSCRIBERS == subscriberCount)
+    {
+        return NULL;
+    }
+    subscriber = &(subscribers[subscriberCount]);
+    subscriber->address = *address;
+    subscriber->lastHeardMs = nowMs;
+    // Whatever it sent before this is none of our business
+    subscriber->nextSequence = sequence;
+    __atomic_store_n(&subscriberCount, subscriberCount + 1, __ATOMIC_RELAXED);
+    return subscriber;
+}
+
+//********************************************
+// Find the cookie sent to an address, making one if there isn't one still
+// good. Return NULL if no cookie could be made. Caller holds udpLock.
+static udp_pending_t * Get_Pending(const struct sockaddr_in6 * address,
+                                   bool make, uint64_t nowMs)
+{
+    udp_pending_t * entry = NULL;
+    int index;
+
+    for (index = 0; index < pendingCount; ++index)
+    {
+        if (Same_Address(&(pending[index].address), address))
+        {
+            entry = &(pending[index]);
+            break;
+        }
+    }
+    if (entry && nowMs - entry->sentMs >= UDP_COOKIE_TIMEOUT_MS)
+    {
+        // Stale: forget it, and make a new one if asked
+        *entry = pending[--pendingCount];
+        entry = NULL;
+    }
+    if (entry || !make)
+    {
+        return entry;
+    }
+    if (UDP_MAX_PENDING == pendingCount)
+    {
+        // Forged requests can fill the table, so the oldest goes. Its owner
+        // asks again.
+        entry = &(pending[0]);
+        for (index = 1; index < pendingCount; ++index)
+        {
+            if (pending[index].sentMs < entry->sentMs)
+            {
+                entry = &(pending[index]);
+            }
+        }
+    }
+    else
+    {
+        entry = &(pending[pendingCount++]);
+    }
+    entry->address = *address;
+    entry->sentMs = nowMs;
+    if (sizeof(entry->cookie) !=
+        getrandom(&(entry->cookie), sizeof(entry->cookie), 0) ||
+        0 == entry->cookie)
+    {
+        *entry = pending[--pendingCount];
+        return NULL;
+    }
+    return entry;
+}
+
+//********************************************
+// Deal with a datagram from an address that isn't subscribed. A request for
+// a cookie gets one, and the cookie sent back subscribes the address and is
+// sent once more to say so. Anything else is dropped. The answer is written
+// over the datagram and sent back out of its buffer, so it's never bigger
+// than what came in; reply is the iovec to send it with. Caller holds
+// udpLock.
+static void Check_Cookie(udp_batch_t * batch, struct iovec * reply,
+                         struct sockaddr_in6 * address, char * datagram,
+                         int payloadLength, uint64_t nowMs)
+{
+    static const char noCookie[PROTO_UDP_COOKIE_DIGITS] =
+        "0000000000000000";
+    char * line = datagram + PROTO_UDP_HEADER;
+    char * digits = line + strlen(PROTO_UDP_COOKIE);
+    char expected[PROTO_UDP_COOKIE_DIGITS + 1];
+    udp_pending_t * entry;
+    uint32_t sequence;
+
+    if (payloadLength !=
+        (int)strlen(PROTO_UDP_COOKIE) + PROTO_UDP_COOKIE_DIGITS ||
+        0 != memcmp(line, PROTO_UDP_COOKIE, strlen(PROTO_UDP_COOKIE)))
+    {
+        ++stats.notSubscribed;
+        return;
+    }
+    memcpy(&sequence, datagram, PROTO_UDP_HEADER);
+    sequence = ntohl(sequence);
+    if (0 == memcmp(digits, noCookie, PROTO_UDP_COOKIE_DIGITS))
+    {
+        if (NULL == (entry = Get_Pending(address, true, nowMs)))
+        {
+            return;
+        }
+        snprintf(expected, sizeof(expected), "%0*llx",
+                 PROTO_UDP_COOKIE_DIGITS, (unsigned long long)entry->cookie);
+        memcpy(digits, expected, PROTO_UDP_COOKIE_DIGITS);
+        ++stats.cookiesSent;
+    }
+    else
+    {
+        if (NULL == (entry = Get_Pending(address, false, nowMs)))
+        {
+            ++stats.notSubscribed;
+            return;
+        }
+        snprintf(expected, sizeof(expected), "%0*llx",
+                 PROTO_UDP_COOKIE_DIGITS, (unsigned long long)entry->cookie);
+        if (0 != memcmp(digits, expected, PROTO_UDP_COOKIE_DIGITS) ||
+            NULL == Add_Subscriber(address, sequence + 1, nowMs))
+        {
+            ++stats.notSubscribed;
+            return;
+        }
+        *entry = pending[--pendingCount];
+    }
+    memset(datagram, 0, PROTO_UDP_HEADER);
+    reply->iov_base = datagram;
+    reply->iov_len = PROTO_UDP_HEADER + payloadLength;
+    Queue_Datagram(batch, address, reply, 1);
+}
+
+//********************************************
+// Caller holds udpLock
+static void Remove_Subscriber(udp_subscriber_t * subscriber)
+{
+    *subscriber = subscribers[subscriberCount - 1];
+    __atomic_store_n(&subscriberCount, subscriberCount - 1, __ATOMIC_RELAXED);
+}
+
+//********************************************
+// Count what a subscriber's sequence number says was lost or reordered.
+// Caller holds udpLock.
+static void Check_Sequence(udp_subscriber_t * subscriber, uint32_t sequence)
+{
+    // Wraps along with the sequence numbers
+    int32_t ahead = (int32_t)(sequence - subscriber->nextSequence);
+
+    if (ahead < 0)
+    {
+        ++stats.lateIn;
+        return;
+    }
+    stats.lostIn += ahead;
+    subscriber->nextSequence = sequence + 1;
+}
+
+//********************************************
+// Take in one batch of datagrams: note who sent them, relay the chat to
+// every subscriber and copy it into chat. Return the bytes of chat.
+static int Take_Batch(struct mmsghdr * messages, int received,
+                      struct sockaddr_in6 * addresses, char * chat)
+{
+    struct iovec relays[UDP_BATCH];
+    struct iovec replies[UDP_BATCH];
+    udp_batch_t batch;
+    udp_subscriber_t * subscriber;
+    uint64_t nowMs = Now_Ms();
+    uint32_t sequence;
+    char * datagram;
+    char * control;
+    int relayCount = 0;
+    int chatLength = 0;
+    int payloadLength;
+    int index;
+    int relay;
+
+    batch.count = 0;
+    pthread_mutex_lock(&udpLock);
+    ++stats.receiveCalls;
+    stats.datagramsIn += received;
+    for (index = 0; index < received; ++index)
+    {
+        datagram = messages[index].msg_hdr.msg_iov->iov_base;
+        payloadLength = (int)messages[index].msg_len - PROTO_UDP_HEADER;
+        if (payloadLength < 0 ||
+            (messages[index].msg_hdr.msg_flags & MSG_TRUNC) ||
+            AF_INET6 != addresses[index].sin6_family)
+        {
+            continue;
+        }
+        if (NULL == (subscriber = Find_Subscriber(&(addresses[index]),
+                                                  nowMs)))
+        {
+            Check_Cookie(&batch, &(replies[index]), &(addresses[index]),
+                         datagram, payloadLength, nowMs);
+            continue;
+        }
+        memcpy(&sequence, datagram, PROTO_UDP_HEADER);
+        sequence = ntohl(sequence);
+        Check_Sequence(subscriber, sequence);
+        if (0 == payloadLength)
+        {
+            // Keepalive
+            continue;
+        }
+        if (PROTO_CONTROL == datagram[PROTO_UDP_HEADER])
+        {
+            if (payloadLength == (int)strlen(PROTO_UDP_BYE) &&
+                0 == memcmp(datagram + PROTO_UDP_HEADER, PROTO_UDP_BYE,
+                            payloadLength))
+            {
+                Remove_Subscriber(subscriber);
+            }
+            else if (0 == memcmp(datagram + PROTO_UDP_HEADER,
+                                 PROTO_UDP_COOKIE, MIN(payloadLength,
+                                 (int)strlen(PROTO_UDP_COOKIE))))
+            {
+                // Our answer to its cookie was lost. Say so again.
+                memset(datagram, 0, PROTO_UDP_HEADER);
+                replies[index].iov_base = datagram;
+                replies[index].iov_len = messages[index].msg_len;
+                Queue_Datagram(&batch, &(addresses[index]), &(replies[index]),
+                               1);
+            }
+            continue;
+        }
+        // Stream clients would take it for the start of a control line
+        while (NULL != (control = memchr(datagram + PROTO_UDP_HEADER,
+                                         PROTO_CONTROL, payloadLength)))
+        {
+            *control = '?';
+        }
+        memcpy(chat + chatLength, datagram + PROTO_UDP_HEADER, payloadLength);
+        chatLength += payloadLength;
+
+        sequence = htonl(nextSequence++);
+        memcpy(datagram, &sequence, PROTO_UDP_HEADER);
+        relays[relayCount].iov_base = datagram;
+        relays[relayCount++].iov_len = messages[index].msg_len;
+    }
+    for (index = 0; index < subscriberCount && relayCount > 0; ++index)
+    {
+        for (relay = 0; relay < relayCount; ++relay)
+        {
+            Queue_Datagram(&batch, &(subscribers[index].address),
+                           &(relays[relay]), 1);
+        }
+    }
+    Send_Batch(&batch);
+    pthread_mutex_unlock(&udpLock);
+    return chatLength;
+}
+
+//********************************************
+// Drop subscribers that have gone quiet
+static void Expire_Subscribers(uint64_t nowMs)
+{
+    int index = 0;
+
+    pthread_mutex_lock(&udpLock);
+    while (index < subscriberCount)
+    {
+        if (nowMs - subscribers[index].lastHeardMs >= UDP_SUBSCRIBER_TIMEOUT_MS)
+        {
+            // Moves the last one here, so look at this slot again
+            Remove_Subscriber(&(subscribers[index]));
+        }
+        else
+        {
+            ++index;
+        }
+    }
+    pthread_mutex_unlock(&udpLock);
+}
+
+//********************************************
+// Send chat to every subscriber. Caller holds udpLock.
+static void Send_Broadcast(const char * message, int length)
+{
+    uint32_t headers[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH][2];
+    udp_batch_t batch;
+    int offset;
+    int chunks;
+    int chunk;
+    int index;
+
+    batch.count = 0;
+    // Up to UDP_BATCH datagrams' worth of the message at a time, each sent
+    // to every subscriber
+    for (offset = 0; offset < length; offset += chunks * PROTO_UDP_MAX_PAYLOAD)
+    {
+        for (chunks = 0; chunks < UDP_BATCH &&
+             offset + chunks * PROTO_UDP_MAX_PAYLOAD < length; ++chunks)
+        {
+            chunk = offset + chunks * PROTO_UDP_MAX_PAYLOAD;
+            headers[chunks] = htonl(nextSequence++);
+            iovs[chunks][0].iov_base = &(headers[chunks]);
+            iovs[chunks][0].iov_len = PROTO_UDP_HEADER;
+            iovs[chunks][1].iov_base = (void *)(message + chunk);
+            iovs[chunks][1].iov_len = MIN(PROTO_UDP_MAX_PAYLOAD,
+                                          length - chunk);
+        }
+        for (index = 0; index < subscriberCount; ++index)
+        {
+            for (chunk = 0; chunk < chunks; ++chunk)
+            {
+                Queue_Datagram(&batch, &(subscribers[index].address),
+                               iovs[chunk], 2);
+            }
+        }
+        // The headers and iovs get reused for the next chunks
+        Send_Batch(&batch);
+    }
+}
+
+//********************************************
+// Send everything the stream readers have queued. Only the datagram thread
+// calls this, or Stop_Udp once the thread is gone.
+static void Send_Outbound(void)
+{
+    uint64_t count;
+    mpsc_link_t * link;
+    udp_outbound_t * chat;
+
+    // Cleared first, so a reader queueing after this signals again
+    __atomic_store_n(&outboundSignalled, 0, __ATOMIC_SEQ_CST);
+    if (sizeof(count) != read(outboundFd, &count, sizeof(count)))
+    {
+        // Nothing signalled, or woken by something else
+    }
+    pthread_mutex_lock(&udpLock);
+    while (NULL != (link = Mpsc_Pop(&outbound)))
+    {
+        chat = MPSC_ENTRY(link, udp_outbound_t, link);
+        __atomic_sub_fetch(&outboundCount, 1, __ATOMIC_RELAXED);
+        Send_Broadcast(chat->data, chat->length);
+        free(chat);
+    }
+    pthread_mutex_unlock(&udpLock);
+}
+
+//********************************************
+static void * Udp_Thread(void * arg)
+{
+    // Only this thread uses them, and they're too big for a thread's stack
+    static char datagrams[UDP_BATCH][UDP_DATAGRAM];
+    static char chat[UDP_BATCH * PROTO_UDP_MAX_PAYLOAD];
+    struct mmsghdr messages[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    struct sockaddr_in6 addresses[UDP_BATCH];
+    struct pollfd waitFor[3];
+    uint64_t nextExpiryMs = Now_Ms() + UDP_EXPIRE_CHECK_MS;
+    uint64_t nowMs;
+    int received;
+    int chatLength;
+    int index;
+
+    memset(messages, 0, sizeof(messages));
+    for (index = 0; index < UDP_BATCH; ++index)
+    {
+        iovs[index].iov_base = datagrams[index];
+        iovs[index].iov_len = UDP_DATAGRAM;
+        messages[index].msg_hdr.msg_iov = &(iovs[index]);
+        messages[index].msg_hdr.msg_iovlen = 1;
+        messages[index].msg_hdr.msg_name = &(addresses[index]);
+    }
+    waitFor[0].fd = udpFd;
+    waitFor[0].events = POLLIN;
+    waitFor[1].fd = Get_Shutdown_Fd();
+    waitFor[1].events = POLLIN;
+    waitFor[2].fd = outboundFd;
+    waitFor[2].events = POLLIN;
+
+    while (!Shutdown_Requested())
+    {
+        if (-1 == poll(waitFor, 3, UDP_EXPIRE_CHECK_MS) && EINTR != errno)
+        {
+            perror("Trouble waiting for datagrams");
+            break;
+        }
+        nowMs = Now_Ms();
+        if (nowMs >= nextExpiryMs)
+        {
+            Expire_Subscribers(nowMs);
+            nextExpiryMs = nowMs + UDP_EXPIRE_CHECK_MS;
+        }
+        if (waitFor[2].revents & POLLIN)
+        {
+            Send_Outbound();
+        }
+        if (0 == (waitFor[0].revents & POLLIN))
+        {
+            continue;
+        }
+        for (index = 0; index < UDP_BATCH; ++index)
+        {
+            // Both are in/out, so they need resetting for each call
+            messages[index].msg_hdr.msg_namelen = sizeof(addresses[index]);
+            messages[index].msg_hdr.msg_flags = 0;
+        }
+        received = recvmmsg(udpFd, messages, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (received <= 0)
+        {
+            continue;
+        }
+        chatLength = Take_Batch(messages, received, addresses, chat);
+        if (chatLength > 0)
+        {
+            receiveFunction(chat, chatLength);
+        }
+    }
+    return NULL;
+}
+
+//********************************************
+int Start_Udp(const char * port, udp_receive_t receive)
+{
+    if (-1 == (udpFd = Open_Socket(port)))
+    {
+        return 1;
+    }
+    receiveFunction = receive;
+    Init_Mpsc_Queue(&outbound);
+    if (-1 == (outboundFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) ||
+        0 != pthread_create(&udpThread, NULL, Udp_Thread, NULL))
+    {
+        if (-1 != outboundFd)
+        {
+            close(outboundFd);
+            outboundFd = -1;
+        }
+        close(udpFd);
+        udpFd = -1;
+        return 1;
+    }
+    __atomic_store_n(&udpRunning, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+//********************************************
+void Stop_Udp(void)
+{
+    if (!udpRunning)
+    {
+        return;
+    }
+    pthread_join(udpThread, NULL);
+    __atomic_store_n(&udpRunning, false, __ATOMIC_RELEASE);
+    // Chat queued after the thread's last look, such as the goodbye. Every
+    // reader is done by now.
+    Send_Outbound();
+    pthread_mutex_lock(&udpLock);
+    close(udpFd);
+    udpFd = -1;
+    close(outboundFd);
+    outboundFd = -1;
+    pthread_mutex_unlock(&udpLock);
+}
+
+//********************************************
+void Udp_Broadcast(const char * message, int length)
+{
+    udp_outbound_t * chat;
+    uint64_t one = 1;
+
+    if (!__atomic_load_n(&udpRunning, __ATOMIC_ACQUIRE) ||
+        0 == __atomic_load_n(&subscriberCount, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    // The datagram thread has fallen behind: lose this like any datagram
+    if (__atomic_add_fetch(&outboundCount, 1, __ATOMIC_RELAXED) >
+        UDP_MAX_QUEUED ||
+        NULL == (chat = malloc(sizeof(udp_outbound_t) + length)))
+    {
+        __atomic_sub_fetch(&outboundCount, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&queueDropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    chat->length = length;
+    memcpy(chat->data, message, length);
+    Mpsc_Push(&outbound, &(chat->link));
+    if (0 == __atomic_exchange_n(&outboundSignalled, 1, __ATOMIC_SEQ_CST) &&
+        sizeof(one) != write(outboundFd, &one, sizeof(one)))
+    {
+        // Counter is saturated, so it is already signalled
+    }
+}
+
+//********************************************
+void Get_Udp_Stats(udp_stats_t * out)
+{
+    pthread_mutex_lock(&udpLock);
+    *out = stats;
+    out->subscribers = subscriberCount;
+    out->queueDropped = __atomic_load_n(&queueDropped, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&udpLock);
+}
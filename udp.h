@@ -0,0 +1,94 @@
+#pragma once
+/*************************************************************
+ * Author:        Erik Andersen
+ * Filename:      udp.h
+ * Date Created:  2026-10-18
+ * Modifications:
+ **************************************************************
+ *
+ * Overview:
+ *    Datagram listener for clients that would rather lose a message than
+ *    wait for one, such as telemetry bots. See protocol.h for the wire
+ *    format.
+ *
+ *    One thread takes datagrams in with recvmmsg, up to UDP_BATCH per
+ *    call. It relays each batch to every subscriber with sendmmsg, then hands
+ *    the batch's chat to the server as one message for its stream clients.
+ *    Chat from stream clients reaches subscribers through Udp_Broadcast,
+ *    which queues it for the same thread to send, again one sendmmsg call
+ *    for up to UDP_BATCH datagrams. Sends never wait: a datagram the socket
+ *    has no room for is dropped and counted.
+ *
+ *    An address is only subscribed once it sends back a cookie the thread
+ *    sent it, so a forged source address can't make the server send chat to
+ *    someone who never asked for it.
+ *
+ ************************************************************/
+#include <stdint.h>
+
+#include "protocol.h"
+
+// Most datagrams taken in or sent per syscall
+#define UDP_BATCH 64
+// Most addresses subscribed at once
+#define UDP_MAX_SUBSCRIBERS 1024
+// Most broadcasts queued for the datagram thread. Later ones are dropped.
+#define UDP_MAX_QUEUED 1024
+// Most addresses waiting to send their cookie back. The oldest is forgotten
+// to make room.
+#define UDP_MAX_PENDING 256
+// How long a cookie can take to come back, in ms
+#define UDP_COOKIE_TIMEOUT_MS 5000
+// A subscriber that sends nothing for this long is dropped, in ms
+#define UDP_SUBSCRIBER_TIMEOUT_MS (3 * PROTO_UDP_KEEPALIVE_MS)
+
+// Called on the datagram thread with the chat from one batch of datagrams
+typedef void (*udp_receive_t)(char * chat, int length);
+
+// Open the datagram socket and start the datagram thread
+// Return zero on success
+// Params:
+//    port: port number or service name
+//    receive: function to pass incoming chat to
+int Start_Udp(const char * port, udp_receive_t receive);
+
+// Stop the datagram thread, once shutdown has been requested (see
+// shutdown.h), and close the socket
+void Stop_Udp(void);
+
+// Send chat to every subscriber, split into datagrams of at most
+// PROTO_UDP_MAX_PAYLOAD bytes. Copies the chat for the datagram thread to
+// send, so the caller never waits on the network or on that thread. Does
+// nothing unless started.
+// Params:
+//    message, length: the chat
+void Udp_Broadcast(const char * message, int length);
+
+// Statistics for the admin interface
+typedef struct
+{
+    int subscribers;
+    uint64_t datagramsIn;
+    // recvmmsg calls that returned something
+    uint64_t receiveCalls;
+    // Gaps in subscribers' sequence numbers, and datagrams that came in
+    // behind a later one
+    uint64_t lostIn;
+    uint64_t lateIn;
+    uint64_t datagramsOut;
+    uint64_t sendCalls;
+    // Cookies sent, and datagrams dropped from addresses that weren't
+    // subscribed and didn't send a good cookie
+    uint64_t cookiesSent;
+    uint64_t notSubscribed;
+    // Datagrams the socket had no room for
+    uint64_t sendDropped;
+    // Broadcasts dropped because the datagram thread was UDP_MAX_QUEUED
+    // behind
+    uint64_t queueDropped;
+} udp_stats_t;
+
+// Get datagram statistics
+// Params:
+//    stats: where to store them
+void Get_Udp_Stats(udp_stats_t * stats);